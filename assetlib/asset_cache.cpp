@@ -0,0 +1,50 @@
+#include "asset_cache.h"
+
+#include <xxhash.h>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <cstring>
+
+std::string assets::derived_data_path(const char* cacheDirectory, const char* sourcePath, const char* extension) {
+    std::ifstream infile(sourcePath, std::ios::binary | std::ios::ate);
+
+    if (!infile.is_open()) return "";
+
+    size_t fileSize = (size_t)infile.tellg();
+    std::vector<char> contents(fileSize);
+
+    infile.seekg(0);
+    infile.read(contents.data(), fileSize);
+
+    //the baker version seeds the hash, so a new baker never picks up old entries
+    uint64_t hash = XXH64(contents.data(), contents.size(), BAKER_VERSION);
+
+    std::stringstream name;
+    name << std::filesystem::path(sourcePath).stem().string() << "_"
+        << std::hex << std::setw(16) << std::setfill('0') << hash << extension;
+
+    return (std::filesystem::path(cacheDirectory) / name.str()).string();
+}
+
+bool assets::load_derived_data(const std::string& path, const char type[4], AssetFile& outputFile) {
+    if (path.empty() || !std::filesystem::exists(path)) return false;
+
+    if (!load_binaryfile(path.c_str(), outputFile)) return false;
+
+    return memcmp(outputFile.type, type, 4) == 0;
+}
+
+bool assets::save_derived_data(const std::string& path, const AssetFile& file) {
+    std::error_code error;
+    std::filesystem::path target(path);
+    std::filesystem::create_directories(target.parent_path(), error);
+
+    //written next to the entry and renamed, so an interrupted bake never leaves a truncated file behind
+    std::string tempPath = path + ".tmp";
+    if (!save_binaryfile(tempPath.c_str(), file)) return false;
+
+    std::filesystem::rename(tempPath, target, error);
+    return !error;
+}
@@ -0,0 +1,16 @@
+#pragma once
+#include "asset_loader.h"
+
+namespace assets {
+    //bump whenever a baked format or the baking itself changes, every cached entry then misses once
+    constexpr uint32_t BAKER_VERSION = 3;
+
+    //path of the baked form of sourcePath inside the cache directory, named after the hash of the
+    //source contents and the baker version. Returns an empty string when the source can't be read
+    std::string derived_data_path(const char* cacheDirectory, const char* sourcePath, const char* extension);
+
+    //loads a cached entry, fails when it doesn't exist yet or has a different asset type
+    bool load_derived_data(const std::string& path, const char type[4], AssetFile& outputFile);
+
+    bool save_derived_data(const std::string& path, const AssetFile& file);
+}
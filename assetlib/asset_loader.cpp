@@ -2,9 +2,10 @@
 
 #include <iostream>
 #include <fstream>
+#include <cstring>
 
 assets::CompressionMode assets::parse_compression(const char* f) {
-    if (strcmp(f, "LZ4")) return assets::CompressionMode::LZ4;
+    if (strcmp(f, "LZ4") == 0) return assets::CompressionMode::LZ4;
     else return assets::CompressionMode::None;
 }
 
@@ -12,6 +13,8 @@ bool assets::save_binaryfile(const char* path, const assets::AssetFile& file) {
     std::ofstream outfile;
     outfile.open(path, std::ios::binary | std::ios::out);
 
+    if (!outfile.is_open()) return false;
+
     outfile.write(file.type, 4);
 
     uint32_t version = file.version;
@@ -28,7 +31,7 @@ bool assets::save_binaryfile(const char* path, const assets::AssetFile& file) {
 
     outfile.close();
 
-    return true;
+    return !outfile.fail();
 }
 
 bool assets::load_binaryfile(const char* path, assets::AssetFile& outputFile) {
@@ -54,5 +57,27 @@ bool assets::load_binaryfile(const char* path, assets::AssetFile& outputFile) {
     outputFile.binaryBlob.resize(bloblen);
     infile.read(outputFile.binaryBlob.data(), bloblen);
 
-    return true;
+    //a truncated file would leave the tail of the blob zeroed
+    return !infile.fail();
+}
+
+bool assets::load_binaryfile_range(const char* path, uint64_t offset, uint64_t size, char* destination) {
+    std::ifstream infile;
+    infile.open(path, std::ios::binary);
+
+    if (!infile.is_open()) return false;
+
+    //type and version, then the json and blob lengths
+    uint32_t header[4];
+    infile.read((char*)header, sizeof(header));
+    if (infile.fail()) return false;
+
+    uint32_t jsonlen = header[2];
+    uint32_t bloblen = header[3];
+    if (offset + size > bloblen) return false;
+
+    infile.seekg(sizeof(header) + jsonlen + offset);
+    infile.read(destination, size);
+
+    return !infile.fail();
 }
\ No newline at end of file
@@ -19,5 +19,8 @@ namespace assets {
     bool save_binaryfile(const char* path, const AssetFile& file);
     bool load_binaryfile(const char* path, AssetFile& outputFile);
 
+    //reads size bytes at offset inside the binary blob of the file, without loading the json or the rest of the blob
+    bool load_binaryfile_range(const char* path, uint64_t offset, uint64_t size, char* destination);
+
     assets::CompressionMode parse_compression(const char* f);
 }
\ No newline at end of file
@@ -0,0 +1,197 @@
+#include "model_asset.h"
+#include <json.hpp>
+#include <lz4.h>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <climits>
+#include <iostream>
+
+//the meshes have to cover the unpacked blob exactly, each from its own range of the packed one
+static bool valid_model_info(const assets::ModelInfo& info, size_t blobSize) {
+    uint64_t unpackedSize = 0;
+    for (const assets::MeshInfo& mesh : info.meshes) {
+        uint64_t meshSize = (uint64_t)mesh.vertexCount * sizeof(assets::Vertex_f32_PNCV) + (uint64_t)mesh.indexCount * sizeof(uint32_t);
+        if (mesh.dataSize != meshSize) return false;
+
+        if (mesh.compressedOffset > blobSize || mesh.compressedSize > blobSize - mesh.compressedOffset) return false;
+
+        for (uint32_t texture : mesh.textures) {
+            if (texture >= info.textures.size()) return false;
+        }
+        unpackedSize += mesh.dataSize;
+    }
+
+    return unpackedSize == info.blobSize;
+}
+
+bool assets::read_model_info(AssetFile* file, ModelInfo& info) {
+    info = ModelInfo{};
+
+    //a corrupt cache entry has to read as a miss, not throw while loading
+    try {
+        nlohmann::json metadata = nlohmann::json::parse(file->json);
+
+        for (auto& meshJson : metadata["meshes"]) {
+            MeshInfo mesh;
+            mesh.vertexCount = meshJson["vertex_count"];
+            mesh.indexCount = meshJson["index_count"];
+            mesh.dataSize = meshJson["data_size"];
+            mesh.compressedOffset = meshJson["compressed_offset"];
+            mesh.compressedSize = meshJson["compressed_size"];
+
+            std::vector<float> bounds = meshJson["bounds"];
+            if (bounds.size() != 7) return false;
+            mesh.bounds.origin[0] = bounds[0];
+            mesh.bounds.origin[1] = bounds[1];
+            mesh.bounds.origin[2] = bounds[2];
+            mesh.bounds.radius = bounds[3];
+            mesh.bounds.extents[0] = bounds[4];
+            mesh.bounds.extents[1] = bounds[5];
+            mesh.bounds.extents[2] = bounds[6];
+
+            mesh.textures = meshJson["textures"].get<std::vector<uint32_t>>();
+            info.meshes.push_back(mesh);
+        }
+
+        for (auto& textureJson : metadata["textures"]) {
+            ModelTexture texture;
+            texture.path = textureJson["path"];
+            texture.type = textureJson["type"];
+            info.textures.push_back(texture);
+        }
+
+        std::string compressionString = metadata["compression"];
+        info.compressionMode = parse_compression(compressionString.c_str());
+
+        info.blobSize = metadata["buffer_size"];
+        info.originalFile = metadata["original_file"];
+    } catch (const nlohmann::json::exception& e) {
+        std::cout << "Failed to read model header: " << e.what() << std::endl;
+        return false;
+    }
+
+    if (!valid_model_info(info, file->binaryBlob.size())) {
+        std::cout << "Model header doesn't match its data: " << info.originalFile << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool assets::unpack_model(ModelInfo* info, const char* sourcebuffer, size_t sourceSize, char* destination) {
+    for (uint32_t mesh = 0; mesh < info->meshes.size(); mesh++) {
+        const MeshInfo& meshInfo = info->meshes[mesh];
+        if (meshInfo.compressedOffset > sourceSize || meshInfo.compressedSize > sourceSize - meshInfo.compressedOffset) return false;
+
+        if (!unpack_model_mesh(info, mesh, sourcebuffer + meshInfo.compressedOffset, destination)) return false;
+        destination += meshInfo.dataSize;
+    }
+    return true;
+}
+
+bool assets::unpack_model_mesh(const ModelInfo* info, uint32_t mesh, const char* compressedMesh, char* destination) {
+    if (mesh >= info->meshes.size()) return false;
+
+    const MeshInfo& meshInfo = info->meshes[mesh];
+    if (meshInfo.compressedSize > INT_MAX || meshInfo.dataSize > INT_MAX) return false;
+
+    if (info->compressionMode == CompressionMode::LZ4) {
+        int unpacked = LZ4_decompress_safe(compressedMesh, destination, (int)meshInfo.compressedSize, (int)meshInfo.dataSize);
+        return unpacked >= 0 && (uint64_t)unpacked == meshInfo.dataSize;
+    }
+
+    if (meshInfo.compressedSize != meshInfo.dataSize) return false;
+    memcpy(destination, compressedMesh, meshInfo.compressedSize);
+    return true;
+}
+
+assets::AssetFile assets::pack_model(ModelInfo* info, const char* meshData) {
+    nlohmann::json metadata;
+
+    AssetFile file;
+    file.type[0] = 'M';
+    file.type[1] = 'O';
+    file.type[2] = 'D';
+    file.type[3] = 'L';
+    file.version = 2;
+
+    const char* source = meshData;
+    for (MeshInfo& mesh : info->meshes) {
+        mesh.dataSize = mesh.vertexCount * sizeof(Vertex_f32_PNCV) + mesh.indexCount * sizeof(uint32_t);
+
+        int compressStaging = LZ4_compressBound(mesh.dataSize);
+
+        mesh.compressedOffset = file.binaryBlob.size();
+        file.binaryBlob.resize(mesh.compressedOffset + compressStaging);
+
+        int compressedSize = LZ4_compress_default(source, file.binaryBlob.data() + mesh.compressedOffset,
+            mesh.dataSize, compressStaging);
+
+        mesh.compressedSize = compressedSize;
+        file.binaryBlob.resize(mesh.compressedOffset + compressedSize);
+        source += mesh.dataSize;
+
+        nlohmann::json meshJson;
+        meshJson["vertex_count"] = mesh.vertexCount;
+        meshJson["index_count"] = mesh.indexCount;
+        meshJson["data_size"] = mesh.dataSize;
+        meshJson["compressed_offset"] = mesh.compressedOffset;
+        meshJson["compressed_size"] = mesh.compressedSize;
+        meshJson["bounds"] = std::vector<float>{
+            mesh.bounds.origin[0], mesh.bounds.origin[1], mesh.bounds.origin[2], mesh.bounds.radius,
+            mesh.bounds.extents[0], mesh.bounds.extents[1], mesh.bounds.extents[2]
+        };
+        meshJson["textures"] = mesh.textures;
+        metadata["meshes"].push_back(meshJson);
+    }
+
+    metadata["textures"] = nlohmann::json::array();
+    for (ModelTexture& texture : info->textures) {
+        nlohmann::json textureJson;
+        textureJson["path"] = texture.path;
+        textureJson["type"] = texture.type;
+        metadata["textures"].push_back(textureJson);
+    }
+
+    metadata["buffer_size"] = info->blobSize;
+    metadata["original_file"] = info->originalFile;
+    metadata["compression"] = "LZ4";
+
+    file.json = metadata.dump();
+
+    return file;
+}
+
+assets::MeshBounds assets::calculate_bounds(const Vertex_f32_PNCV* vertices, size_t count) {
+    MeshBounds bounds = {};
+    if (count == 0) return bounds;
+
+    float min[3] = { vertices[0].position[0], vertices[0].position[1], vertices[0].position[2] };
+    float max[3] = { min[0], min[1], min[2] };
+
+    for (size_t i = 1; i < count; i++) {
+        for (int axis = 0; axis < 3; axis++) {
+            min[axis] = std::min(min[axis], vertices[i].position[axis]);
+            max[axis] = std::max(max[axis], vertices[i].position[axis]);
+        }
+    }
+
+    for (int axis = 0; axis < 3; axis++) {
+        bounds.origin[axis] = (max[axis] + min[axis]) / 2.f;
+        bounds.extents[axis] = (max[axis] - min[axis]) / 2.f;
+    }
+
+    //exact radius around the box center rather than the looser half diagonal
+    float radiusSquared = 0.f;
+    for (size_t i = 0; i < count; i++) {
+        float distanceSquared = 0.f;
+        for (int axis = 0; axis < 3; axis++) {
+            float offset = vertices[i].position[axis] - bounds.origin[axis];
+            distanceSquared += offset * offset;
+        }
+        radiusSquared = std::max(radiusSquared, distanceSquared);
+    }
+    bounds.radius = std::sqrt(radiusSquared);
+
+    return bounds;
+}
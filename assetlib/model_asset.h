@@ -0,0 +1,59 @@
+#pragma once
+#include "asset_loader.h"
+
+namespace assets {
+    struct Vertex_f32_PNCV {
+        float position[3];
+        float normal[3];
+        float color[3];
+        float uv[2];
+    };
+
+    struct MeshBounds {
+        float origin[3];
+        float radius;
+        float extents[3];
+    };
+
+    //every mesh is compressed on its own, so a single mesh can be read back without the rest
+    struct MeshInfo {
+        uint32_t vertexCount;
+        uint32_t indexCount;
+        //the vertices followed by the 32 bit indices, once unpacked
+        uint64_t dataSize;
+        uint64_t compressedOffset;
+        uint64_t compressedSize;
+        MeshBounds bounds;
+        //indices into ModelInfo::textures
+        std::vector<uint32_t> textures;
+    };
+
+    struct ModelTexture {
+        std::string path;
+        std::string type;
+    };
+
+    //unpacked, the meshes of the model follow each other in one blob
+    struct ModelInfo {
+        std::vector<MeshInfo> meshes;
+        std::vector<ModelTexture> textures;
+        uint64_t blobSize;
+        CompressionMode compressionMode;
+        std::string originalFile;
+    };
+
+    //false when the header doesn't parse or its meshes don't match the blob
+    bool read_model_info(AssetFile* file, ModelInfo& info);
+
+    //unpacks every mesh, one after another.
+    //Returns false when a mesh lies outside the source or doesn't unpack to its size
+    bool unpack_model(ModelInfo* info, const char* sourcebuffer, size_t sourceSize, char* destination);
+
+    //compressedMesh points at the compressedSize bytes of the mesh alone, as read from its range of the blob
+    bool unpack_model_mesh(const ModelInfo* info, uint32_t mesh, const char* compressedMesh, char* destination);
+
+    //meshData holds the meshes described by info->meshes one after another, their sizes and offsets are filled in
+    AssetFile pack_model(ModelInfo* info, const char* meshData);
+
+    MeshBounds calculate_bounds(const Vertex_f32_PNCV* vertices, size_t count);
+}
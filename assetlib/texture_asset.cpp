@@ -1,37 +1,108 @@
 #include "texture_asset.h"
 #include <json.hpp>
 #include <lz4.h>
+#include <cstring>
+#include <climits>
+#include <algorithm>
+#include <iostream>
 
 assets::TextureFormat parse_format(const char* f) {
     if (strcmp(f, "RGBA8") == 0) return assets::TextureFormat::RGBA8;
     else return assets::TextureFormat::Unknown;
 }
 
+//every level has to have the halved extent of the one before it and lie inside the blob
+static bool valid_texture_info(const assets::TextureInfo& info, size_t blobSize) {
+    if (info.mips.empty() || info.mips.size() > 32) return false;
+
+    uint64_t chainSize = 0;
+    for (uint32_t level = 0; level < info.mips.size(); level++) {
+        const assets::MipInfo& mip = info.mips[level];
+
+        uint32_t width = std::max(info.pixelSize[0] >> level, 1u);
+        uint32_t height = std::max(info.pixelSize[1] >> level, 1u);
+        if (mip.width != width || mip.height != height) return false;
+        if (mip.dataSize != (uint64_t)width * height * 4) return false;
+
+        if (mip.compressedOffset > blobSize || mip.compressedSize > blobSize - mip.compressedOffset) return false;
+        chainSize += mip.dataSize;
+    }
+
+    return chainSize == info.textureSize;
+}
+
 assets::TextureInfo assets::read_texture_info(AssetFile* file) {
     TextureInfo info;
-    
-    nlohmann::json metadata = nlohmann::json::parse(file->json);
-
-    std::string formatString = metadata["format"];
-    info.textureFormat = parse_format(formatString.c_str());
 
-    std::string compressionString = metadata["compression"];
-    info.compressionMode = parse_compression(compressionString.c_str());
+    //a corrupt cache entry has to read as a miss, not throw on the worker loading it
+    try {
+        nlohmann::json metadata = nlohmann::json::parse(file->json);
+
+        std::string formatString = metadata["format"];
+        info.textureFormat = parse_format(formatString.c_str());
+
+        std::string compressionString = metadata["compression"];
+        info.compressionMode = parse_compression(compressionString.c_str());
+
+        info.pixelSize[0] = metadata["width"];
+        info.pixelSize[1] = metadata["height"];
+        info.textureSize = metadata["buffer_size"];
+        info.originalFile = metadata["original_file"];
+
+        if (metadata.contains("mips")) {
+            for (auto& mipJson : metadata["mips"]) {
+                MipInfo mip;
+                mip.width = mipJson["width"];
+                mip.height = mipJson["height"];
+                mip.dataSize = mipJson["data_size"];
+                mip.compressedOffset = mipJson["compressed_offset"];
+                mip.compressedSize = mipJson["compressed_size"];
+                info.mips.push_back(mip);
+            }
+        } else {
+            //files from before the chains were baked hold one level in the whole blob
+            info.mips.push_back({ info.pixelSize[0], info.pixelSize[1], info.textureSize, 0, file->binaryBlob.size() });
+        }
+    } catch (const nlohmann::json::exception& e) {
+        std::cout << "Failed to read texture header: " << e.what() << std::endl;
+        info = TextureInfo{};
+        info.textureFormat = TextureFormat::Unknown;
+        return info;
+    }
 
-    info.pixelSize[0] = metadata["width"];
-    info.pixelSize[1] = metadata["height"];
-    info.textureSize = metadata["buffer_size"];
-    info.originalFile = metadata["original_file"];
+    if (!valid_texture_info(info, file->binaryBlob.size())) {
+        std::cout << "Texture header doesn't match its data: " << info.originalFile << std::endl;
+        info.textureFormat = TextureFormat::Unknown;
+    }
 
     return info;
 }
 
-void assets::unpack_texture(TextureInfo* info, const char* sourcebuffer, size_t sourceSize, char* destination) {
+bool assets::unpack_texture(TextureInfo* info, const char* sourcebuffer, size_t sourceSize, char* destination) {
+    for (uint32_t mip = 0; mip < info->mips.size(); mip++) {
+        if (!unpack_texture_mip(info, sourcebuffer, sourceSize, mip, destination)) return false;
+        destination += info->mips[mip].dataSize;
+    }
+    return true;
+}
+
+bool assets::unpack_texture_mip(TextureInfo* info, const char* sourcebuffer, size_t sourceSize, uint32_t mip, char* destination) {
+    if (mip >= info->mips.size()) return false;
+
+    MipInfo& level = info->mips[mip];
+    if (level.compressedOffset > sourceSize || level.compressedSize > sourceSize - level.compressedOffset) return false;
+    if (level.compressedSize > INT_MAX || level.dataSize > INT_MAX) return false;
+
+    const char* source = sourcebuffer + level.compressedOffset;
+
     if (info->compressionMode == CompressionMode::LZ4) {
-        LZ4_decompress_safe(sourcebuffer, destination, sourceSize, info->textureSize);
-    } else {
-        memcpy(destination, sourcebuffer, sourceSize);
+        int unpacked = LZ4_decompress_safe(source, destination, (int)level.compressedSize, (int)level.dataSize);
+        return unpacked >= 0 && (uint64_t)unpacked == level.dataSize;
     }
+
+    if (level.compressedSize != level.dataSize) return false;
+    memcpy(destination, source, level.compressedSize);
+    return true;
 }
 
 assets::AssetFile assets::pack_texture(assets::TextureInfo* info, void* pixelData) {
@@ -49,16 +120,34 @@ assets::AssetFile assets::pack_texture(assets::TextureInfo* info, void* pixelDat
 	file.type[3] = 'I';
 	file.version = 1;
 
-    // Find max data needed for compression
-    int compressStaging = LZ4_compressBound(info->textureSize);
-
-    file.binaryBlob.resize(compressStaging);
-
-    //Like memcpy but compresses the data and returns a compressed size
-    int compressedSize = LZ4_compress_default((const char*)pixelData, file.binaryBlob.data(), 
-        info->textureSize, compressStaging);
+    if (info->mips.empty()) {
+        info->mips.push_back({ info->pixelSize[0], info->pixelSize[1], info->textureSize, 0, 0 });
+    }
 
-    file.binaryBlob.resize(compressedSize);
+    const char* source = (const char*)pixelData;
+    for (MipInfo& mip : info->mips) {
+        // Find max data needed for compression
+        int compressStaging = LZ4_compressBound(mip.dataSize);
+
+        mip.compressedOffset = file.binaryBlob.size();
+        file.binaryBlob.resize(mip.compressedOffset + compressStaging);
+
+        //Like memcpy but compresses the data and returns a compressed size
+        int compressedSize = LZ4_compress_default(source, file.binaryBlob.data() + mip.compressedOffset,
+            mip.dataSize, compressStaging);
+
+        mip.compressedSize = compressedSize;
+        file.binaryBlob.resize(mip.compressedOffset + compressedSize);
+        source += mip.dataSize;
+
+        nlohmann::json mipJson;
+        mipJson["width"] = mip.width;
+        mipJson["height"] = mip.height;
+        mipJson["data_size"] = mip.dataSize;
+        mipJson["compressed_offset"] = mip.compressedOffset;
+        mipJson["compressed_size"] = mip.compressedSize;
+        metadata["mips"].push_back(mipJson);
+    }
 
     metadata["compression"] = "LZ4";
 
@@ -7,17 +7,35 @@ namespace assets {
         RGBA8
     };
 
+    //every level is compressed on its own, so single levels can be unpacked without the rest
+    struct MipInfo {
+        uint32_t width;
+        uint32_t height;
+        uint64_t dataSize;
+        uint64_t compressedOffset;
+        uint64_t compressedSize;
+    };
+
     struct TextureInfo {
+        //size of the whole chain once unpacked
         uint64_t textureSize;
         TextureFormat textureFormat;
         CompressionMode compressionMode;
         uint32_t pixelSize[3];
         std::string originalFile;
+        std::vector<MipInfo> mips;
     };
 
+    //headers that don't parse or don't match the blob come back with an Unknown format
     TextureInfo read_texture_info(AssetFile* file);
 
-    void unpack_texture(TextureInfo* info, const char* sourcebuffer, size_t sourceSize, char* destination);
+    //unpacks the whole chain, levels one after another.
+    //Returns false when a level lies outside the source or doesn't unpack to its size
+    bool unpack_texture(TextureInfo* info, const char* sourcebuffer, size_t sourceSize, char* destination);
+
+    bool unpack_texture_mip(TextureInfo* info, const char* sourcebuffer, size_t sourceSize, uint32_t mip, char* destination);
 
+    //pixelData holds the levels described by info->mips one after another,
+    //an empty mips list packs a single level of pixelSize
     AssetFile pack_texture(TextureInfo* info, void* pixelData);
 }
\ No newline at end of file
@@ -0,0 +1,16 @@
+#version 450
+
+layout (location = 0) in vec3 position;
+
+layout(set = 0, binding = 0) uniform CameraBuffer{
+	mat4 view;
+	mat4 proj;
+	mat4 viewproj;
+} cameraData;
+
+//the main pass tests for equal depth, so both shaders must produce the exact same positions
+invariant gl_Position;
+
+void main() {
+	gl_Position = cameraData.viewproj * vec4(position, 1.0f);
+}
@@ -0,0 +1,8 @@
+#version 450
+
+layout (location = 0) out vec4 outColor;
+
+//drawn while the real pipeline of a material is still compiling, so it has to stay trivial
+void main() {
+    outColor = vec4(0.5, 0.5, 0.5, 1.0);
+}
\ No newline at end of file
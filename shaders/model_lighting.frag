@@ -1,14 +1,160 @@
 #version 450
+#extension GL_EXT_nonuniform_qualifier : require
+
+//permutation bits, the disabled branches get folded away when the pipeline is built
+layout (constant_id = 0) const bool USE_DIFFUSE = true;
+layout (constant_id = 1) const bool USE_SPECULAR = true;
+layout (constant_id = 2) const bool USE_FOG = false;
+layout (constant_id = 3) const bool USE_ALPHA_TEST = false;
+layout (constant_id = 4) const bool USE_LIGHTING = true;
 
 layout (location = 0) out vec4 outColor;
 layout (location = 0) in vec2 fragUV;
+layout (location = 1) flat in uint materialIndex;
+layout (location = 2) in vec3 viewPosition;
+layout (location = 3) in vec3 viewNormal;
+layout (location = 4) flat in vec3 sunDirection;
+
+struct Light {
+    vec4 positionRange;
+    //w is 1 for spot lights
+    vec4 color;
+    //w is the cosine of the spot half angle
+    vec4 directionCone;
+};
+
+struct Material {
+    uint diffuse;
+    uint specular;
+    uint padding0;
+    uint padding1;
+};
+
+layout (set = 0, binding = 1) uniform SceneData {
+    vec4 fogColor;
+    //x is where the fog starts, y where it fully covers
+    vec4 fogDistances;
+    vec4 ambientColor;
+    vec4 sunlightDirection;
+    //w is the intensity
+    vec4 sunlightColor;
+    //x and y turn a pixel into a cluster tile, z and w the log of the view depth into a slice
+    vec4 clusterScale;
+} sceneData;
+
+//in view space, written for the frame before the pass starts
+layout (std430, set = 0, binding = 2) readonly buffer LightBuffer {
+    Light lights[];
+} lightBuffer;
+
+//offset and count of the lights touching each cluster inside the index list
+layout (std430, set = 0, binding = 3) readonly buffer ClusterBuffer {
+    uvec2 clusters[];
+} clusterBuffer;
+
+layout (std430, set = 0, binding = 4) readonly buffer IndexBuffer {
+    uint indices[];
+} indexBuffer;
 
 layout (set = 1, binding = 0) uniform sampler samp;
-layout (set = 1, binding = 1) uniform texture2D textures[2];
+layout (set = 1, binding = 1) uniform texture2D textures[];
+
+layout (std430, set = 1, binding = 2) readonly buffer MaterialBuffer {
+    Material materials[];
+} materialBuffer;
+
+const uint NO_TEXTURE = 0xFFFFFFFF;
+const float ALPHA_CUTOFF = 0.5;
+
+//matches vk_clustered_lighting.h
+const uint CLUSTER_X = 16;
+const uint CLUSTER_Y = 9;
+const uint CLUSTER_Z = 24;
+
+const float SPECULAR_POWER = 32.0;
+//share of the spot cone that fades out towards its edge
+const float SPOT_SOFTNESS = 0.2;
+
+vec3 shade(vec3 lightDirection, vec3 radiance, vec3 normal, vec3 viewDirection, vec3 albedo, float specular) {
+    float diffuse = max(dot(normal, lightDirection), 0.0);
+    vec3 halfway = normalize(lightDirection + viewDirection);
+    float highlight = diffuse > 0.0 ? pow(max(dot(normal, halfway), 0.0), SPECULAR_POWER) * specular : 0.0;
+    return radiance * (albedo * diffuse + highlight);
+}
+
+uint cluster_index() {
+    //w of the clip position is the view depth
+    float depth = 1.0 / gl_FragCoord.w;
+    uvec2 tile = min(uvec2(gl_FragCoord.xy * sceneData.clusterScale.xy), uvec2(CLUSTER_X - 1, CLUSTER_Y - 1));
+    uint slice = uint(clamp(log(depth) * sceneData.clusterScale.z + sceneData.clusterScale.w, 0.0, float(CLUSTER_Z - 1)));
+    return tile.x + CLUSTER_X * (tile.y + CLUSTER_Y * slice);
+}
+
+//the sun and ambient reach everything, the other lights only come from the cluster of the fragment
+vec3 light_fragment(vec3 albedo, float specular) {
+    vec3 normal = normalize(viewNormal);
+    vec3 viewDirection = normalize(-viewPosition);
+
+    vec3 color = sceneData.ambientColor.rgb * albedo;
+    color += shade(normalize(-sunDirection), sceneData.sunlightColor.rgb * sceneData.sunlightColor.w,
+        normal, viewDirection, albedo, specular);
+
+    uvec2 range = clusterBuffer.clusters[cluster_index()];
+    for (uint i = 0; i < range.y; i++) {
+        Light light = lightBuffer.lights[indexBuffer.indices[range.x + i]];
+
+        vec3 toLight = light.positionRange.xyz - viewPosition;
+        float lightDistance = length(toLight);
+        if (lightDistance >= light.positionRange.w) continue;
+
+        vec3 lightDirection = toLight / lightDistance;
+
+        //inverse square falloff, windowed so it reaches zero at the range the light was binned with
+        float window = clamp(1.0 - pow(lightDistance / light.positionRange.w, 4.0), 0.0, 1.0);
+        float attenuation = window * window / (lightDistance * lightDistance + 1.0);
+
+        if (light.color.w > 0.0) {
+            float cosOuter = light.directionCone.w;
+            attenuation *= smoothstep(cosOuter, mix(cosOuter, 1.0, SPOT_SOFTNESS), dot(-lightDirection, light.directionCone.xyz));
+        }
+
+        color += shade(lightDirection, light.color.rgb * attenuation, normal, viewDirection, albedo, specular);
+    }
+    return color;
+}
 
 void main() {
-    vec4 color = texture(sampler2D(textures[0], samp), fragUV);
-    color += texture(sampler2D(textures[1], samp), fragUV);
+    Material material = materialBuffer.materials[materialIndex];
+
+    //merged draws mix materials inside a subgroup, so the index is non uniform
+    vec4 color = vec4(0.0);
+    if (USE_DIFFUSE && material.diffuse != NO_TEXTURE) {
+        color += texture(sampler2D(textures[nonuniformEXT(material.diffuse)], samp), fragUV);
+    }
+
+    if (USE_ALPHA_TEST && color.a < ALPHA_CUTOFF) {
+        discard;
+    }
+
+    vec4 specular = vec4(0.0);
+    if (USE_SPECULAR && material.specular != NO_TEXTURE) {
+        specular = texture(sampler2D(textures[nonuniformEXT(material.specular)], samp), fragUV);
+    }
+
+    if (USE_LIGHTING) {
+        //without a diffuse texture the surface is lit as plain white
+        vec3 albedo = USE_DIFFUSE && material.diffuse != NO_TEXTURE ? color.rgb : vec3(1.0);
+        color.rgb = light_fragment(albedo, specular.r);
+    } else {
+        color += specular;
+    }
+
+    if (USE_FOG) {
+        //w of the clip position is the view depth
+        float depth = 1.0 / gl_FragCoord.w;
+        float fog = clamp((depth - sceneData.fogDistances.x) / max(sceneData.fogDistances.y - sceneData.fogDistances.x, 0.001), 0.0, 1.0);
+        color.rgb = mix(color.rgb, sceneData.fogColor.rgb, fog);
+    }
     
     outColor = color;
 }
\ No newline at end of file
@@ -6,6 +6,11 @@ layout (location = 2) in vec3 color;
 layout (location = 3) in vec2 vTexCoord;
 
 layout (location = 0) out vec2 texUV;
+layout (location = 1) flat out uint materialIndex;
+//lighting happens in view space, where the light clusters are
+layout (location = 2) out vec3 viewPosition;
+layout (location = 3) out vec3 viewNormal;
+layout (location = 4) flat out vec3 sunDirection;
 
 layout(set = 0, binding = 0) uniform CameraBuffer{
 	mat4 view;
@@ -13,7 +18,26 @@ layout(set = 0, binding = 0) uniform CameraBuffer{
 	mat4 viewproj;
 } cameraData;
 
+layout(set = 0, binding = 1) uniform SceneData {
+	vec4 fogColor;
+	vec4 fogDistances;
+	vec4 ambientColor;
+	vec4 sunlightDirection;
+	vec4 sunlightColor;
+	vec4 clusterScale;
+} sceneData;
+
+//matches depth_only.vert, the main pass tests for equal depth after the prepass
+invariant gl_Position;
+
 void main() {
 	gl_Position = cameraData.viewproj * vec4(position, 1.0f);
 	texUV = vTexCoord;
+	//draws carry their material in the first instance
+	materialIndex = gl_InstanceIndex;
+
+	//the model is drawn without a transform, so its positions are already in world space
+	viewPosition = (cameraData.view * vec4(position, 1.0f)).xyz;
+	viewNormal = mat3(cameraData.view) * normal;
+	sunDirection = mat3(cameraData.view) * sceneData.sunlightDirection.xyz;
 }
\ No newline at end of file
@@ -31,7 +31,8 @@ layout( push_constant ) uniform constants
 void main()
 {
 	//output the position of each vertex
-	mat4 modelMatrix = objectBuffer.objects[gl_BaseInstance].model;
+	//instanced draws start at the first object of their batch, gl_InstanceIndex already includes that base
+	mat4 modelMatrix = objectBuffer.objects[gl_InstanceIndex].model;
 	mat4 transformMatrix = cameraData.viewproj * modelMatrix;
 	gl_Position = transformMatrix * vec4(vPosition, 1.0f);
 	outColor = vColor;
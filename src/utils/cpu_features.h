@@ -0,0 +1,17 @@
+#pragma once
+
+//x64 builds carry AVX2 paths next to their fallbacks and pick one at runtime.
+//Only the functions marked CPU_AVX2_FUNCTION are compiled for AVX2, so the rest
+//of the executable still runs on any x64 cpu
+#if defined(VULKAN_GUIDE_AVX2) && (defined(__x86_64__) || defined(_M_X64))
+#define CPU_AVX2
+#if defined(_MSC_VER) && !defined(__clang__)
+//msvc emits the intrinsics without any flags
+#define CPU_AVX2_FUNCTION
+#else
+#define CPU_AVX2_FUNCTION __attribute__((target("avx2")))
+#endif
+#endif
+
+//false when the cpu or the operating system can't run AVX2, checked once
+bool cpu_supports_avx2();
@@ -0,0 +1,107 @@
+#include "thread_pool.h"
+
+#include <atomic>
+#include <algorithm>
+#include <memory>
+
+void ThreadPool::init(unsigned int threadCount) {
+    if (threadCount == 0) {
+        unsigned int hardwareThreads = std::thread::hardware_concurrency();
+        threadCount = hardwareThreads > 1 ? hardwareThreads - 1 : 1;
+    }
+
+    m_stop = false;
+    for (unsigned int i = 0; i < threadCount; i++) {
+        m_workers.emplace_back([this]() { worker_loop(); });
+    }
+}
+
+void ThreadPool::cleanup() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_condition.notify_all();
+
+    for (std::thread& worker : m_workers) {
+        if (worker.joinable()) worker.join();
+    }
+    m_workers.clear();
+}
+
+std::future<void> ThreadPool::submit(std::function<void()>&& job) {
+    auto task = std::make_shared<std::packaged_task<void()>>(std::move(job));
+    std::future<void> result = task->get_future();
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_jobs.push_back([task]() { (*task)(); });
+    }
+    m_condition.notify_one();
+
+    return result;
+}
+
+void ThreadPool::parallel_for(size_t count, size_t minChunk, const std::function<void(size_t begin, size_t end)>& body) {
+    if (count == 0) return;
+
+    size_t chunkSize = std::max<size_t>(minChunk, 1);
+    size_t chunkCount = (count + chunkSize - 1) / chunkSize;
+
+    if (chunkCount == 1 || m_workers.empty()) {
+        body(0, count);
+        return;
+    }
+
+    //chunks are claimed through a shared counter, so fast threads simply take more of them
+    struct Shared {
+        std::atomic<size_t> nextChunk{ 0 };
+        std::atomic<size_t> doneChunks{ 0 };
+        std::mutex mutex;
+        std::condition_variable done;
+    };
+    auto shared = std::make_shared<Shared>();
+
+    auto run_chunks = [shared, chunkCount, chunkSize, count, &body]() {
+        size_t chunk;
+        while ((chunk = shared->nextChunk.fetch_add(1)) < chunkCount) {
+            size_t begin = chunk * chunkSize;
+            size_t end = std::min(begin + chunkSize, count);
+            body(begin, end);
+
+            if (shared->doneChunks.fetch_add(1) + 1 == chunkCount) {
+                std::lock_guard<std::mutex> lock(shared->mutex);
+                shared->done.notify_all();
+            }
+        }
+    };
+
+    size_t helpers = std::min<size_t>(m_workers.size(), chunkCount - 1);
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (size_t i = 0; i < helpers; i++) {
+            m_jobs.push_back(run_chunks);
+        }
+    }
+    m_condition.notify_all();
+
+    run_chunks();
+
+    std::unique_lock<std::mutex> lock(shared->mutex);
+    shared->done.wait(lock, [&]() { return shared->doneChunks.load() == chunkCount; });
+}
+
+void ThreadPool::worker_loop() {
+    while (true) {
+        std::function<void()> job;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_condition.wait(lock, [this]() { return m_stop || !m_jobs.empty(); });
+            if (m_stop && m_jobs.empty()) return;
+
+            job = std::move(m_jobs.front());
+            m_jobs.pop_front();
+        }
+        job();
+    }
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <functional>
+#include <future>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+class ThreadPool {
+    public:
+        //threadCount of 0 uses one worker per hardware thread, minus the main one
+        void init(unsigned int threadCount = 0);
+        void cleanup();
+
+        std::future<void> submit(std::function<void()>&& job);
+
+        //splits [0, count) in chunks of at least minChunk and runs them on the workers,
+        //the calling thread takes chunks too and returns once every chunk is done
+        void parallel_for(size_t count, size_t minChunk, const std::function<void(size_t begin, size_t end)>& body);
+
+        unsigned int thread_count() const { return (unsigned int)m_workers.size(); }
+
+    private:
+        void worker_loop();
+
+        std::vector<std::thread> m_workers;
+        std::deque<std::function<void()>> m_jobs;
+        std::mutex m_mutex;
+        std::condition_variable m_condition;
+        bool m_stop = false;
+};
@@ -0,0 +1,390 @@
+#include "vk_clustered_lighting.h"
+#include "vk_engine.h"
+#include "vk_initializers.h"
+#include "utils/thread_pool.h"
+#include "utils/cpu_features.h"
+
+#include <algorithm>
+#include <cmath>
+
+#if defined(CPU_AVX2)
+#include <immintrin.h>
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+//clusters per invocation group of cluster_lights.comp
+constexpr uint32_t CLUSTER_GROUP_SIZE = 64;
+static_assert(CLUSTER_COUNT % CLUSTER_GROUP_SIZE == 0, "the dispatch covers whole groups");
+
+//padding lanes sit far behind the camera, no cluster is ever close enough to them
+constexpr float LIGHT_PADDING_DEPTH = -1e30f;
+
+constexpr VkDeviceSize CLUSTER_RANGES_SIZE = CLUSTER_COUNT * 2 * sizeof(uint32_t);
+constexpr VkDeviceSize CLUSTER_INDICES_SIZE = CLUSTER_INDEX_CAPACITY * sizeof(uint32_t);
+
+//appends the lights whose range reaches the froxel box
+static void bin_tile_scalar(const float* lightXs, const float* lightYs, const float* lightDepths,
+	const float* lightRanges, size_t count, const glm::vec2& boundsMin, const glm::vec2& boundsMax,
+	float depthNear, float depthFar, std::vector<uint32_t>& indices)
+{
+	for (size_t i = 0; i < count; i++) {
+		float dx = std::max(std::max(boundsMin.x - lightXs[i], lightXs[i] - boundsMax.x), 0.f);
+		float dy = std::max(std::max(boundsMin.y - lightYs[i], lightYs[i] - boundsMax.y), 0.f);
+		float dz = std::max(std::max(depthNear - lightDepths[i], lightDepths[i] - depthFar), 0.f);
+		if (dx * dx + dy * dy + dz * dz <= lightRanges[i] * lightRanges[i]) indices.push_back((uint32_t)i);
+	}
+}
+
+#if defined(CPU_AVX2)
+static uint32_t lowest_bit(uint32_t bits) {
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward(&index, bits);
+	return (uint32_t)index;
+#else
+	return (uint32_t)__builtin_ctz(bits);
+#endif
+}
+
+//the same test 8 lights at a time, the light arrays are padded to a multiple of 8
+static CPU_AVX2_FUNCTION void bin_tile_avx2(const float* lightXs, const float* lightYs, const float* lightDepths,
+	const float* lightRanges, size_t count, const glm::vec2& boundsMin, const glm::vec2& boundsMax,
+	float depthNear, float depthFar, std::vector<uint32_t>& indices)
+{
+	__m256 minX = _mm256_set1_ps(boundsMin.x);
+	__m256 maxX = _mm256_set1_ps(boundsMax.x);
+	__m256 minY = _mm256_set1_ps(boundsMin.y);
+	__m256 maxY = _mm256_set1_ps(boundsMax.y);
+	__m256 minDepth = _mm256_set1_ps(depthNear);
+	__m256 maxDepth = _mm256_set1_ps(depthFar);
+	__m256 zero = _mm256_setzero_ps();
+
+	for (size_t i = 0; i < count; i += 8) {
+		__m256 lightX = _mm256_loadu_ps(lightXs + i);
+		__m256 lightY = _mm256_loadu_ps(lightYs + i);
+		__m256 lightDepth = _mm256_loadu_ps(lightDepths + i);
+		__m256 range = _mm256_loadu_ps(lightRanges + i);
+
+		__m256 dx = _mm256_max_ps(_mm256_max_ps(_mm256_sub_ps(minX, lightX), _mm256_sub_ps(lightX, maxX)), zero);
+		__m256 dy = _mm256_max_ps(_mm256_max_ps(_mm256_sub_ps(minY, lightY), _mm256_sub_ps(lightY, maxY)), zero);
+		__m256 dz = _mm256_max_ps(_mm256_max_ps(_mm256_sub_ps(minDepth, lightDepth), _mm256_sub_ps(lightDepth, maxDepth)), zero);
+
+		__m256 distance = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)), _mm256_mul_ps(dz, dz));
+		uint32_t mask = (uint32_t)_mm256_movemask_ps(_mm256_cmp_ps(distance, _mm256_mul_ps(range, range), _CMP_LE_OQ));
+		while (mask) {
+			indices.push_back((uint32_t)i + lowest_bit(mask));
+			mask &= mask - 1;
+		}
+	}
+}
+#endif
+
+void ClusteredLighting::init(VulkanEngine* engine, uint32_t framesInFlight) {
+	m_engine = engine;
+
+	init_pipeline();
+
+	//the lights and the lists change every frame, so every frame in flight has its own
+	m_frames.resize(framesInFlight);
+	for (FrameBuffers& frame : m_frames) {
+		frame.lights = m_engine->create_buffer(MAX_LIGHTS * sizeof(GPULight),
+			VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU);
+		vmaMapMemory(m_engine->m_allocator, frame.lights.m_allocation, (void**)&frame.mappedLights);
+
+		frame.clusters = m_engine->create_buffer(CLUSTER_RANGES_SIZE,
+			VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_ONLY);
+		frame.indices = m_engine->create_buffer(CLUSTER_INDICES_SIZE,
+			VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_ONLY);
+		frame.counter = m_engine->create_buffer(sizeof(uint32_t),
+			VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_ONLY);
+
+		frame.staging = m_engine->create_buffer(CLUSTER_RANGES_SIZE + CLUSTER_INDICES_SIZE,
+			VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU);
+		vmaMapMemory(m_engine->m_allocator, frame.staging.m_allocation, (void**)&frame.mappedStaging);
+
+		VkDescriptorSetAllocateInfo allocInfo = {};
+		allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+		allocInfo.pNext = nullptr;
+		allocInfo.descriptorPool = m_engine->m_descriptorPool;
+		allocInfo.descriptorSetCount = 1;
+		allocInfo.pSetLayouts = &m_setLayout;
+
+		VK_CHECK(vkAllocateDescriptorSets(m_engine->m_device, &allocInfo, &frame.descriptor));
+
+		VkDescriptorBufferInfo lightInfo = { frame.lights.m_buffer, 0, VK_WHOLE_SIZE };
+		VkDescriptorBufferInfo clusterInfo = { frame.clusters.m_buffer, 0, VK_WHOLE_SIZE };
+		VkDescriptorBufferInfo indexInfo = { frame.indices.m_buffer, 0, VK_WHOLE_SIZE };
+		VkDescriptorBufferInfo counterInfo = { frame.counter.m_buffer, 0, VK_WHOLE_SIZE };
+
+		VkWriteDescriptorSet writes[] = {
+			vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, frame.descriptor, &lightInfo, 0),
+			vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, frame.descriptor, &clusterInfo, 1),
+			vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, frame.descriptor, &indexInfo, 2),
+			vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, frame.descriptor, &counterInfo, 3)
+		};
+		vkUpdateDescriptorSets(m_engine->m_device, 4, writes, 0, nullptr);
+	}
+
+	m_sliceIndices.resize(CLUSTER_Z);
+	m_sliceCounts.resize(CLUSTER_Z);
+}
+
+void ClusteredLighting::cleanup() {
+	VmaAllocator allocator = m_engine->m_allocator;
+
+	for (FrameBuffers& frame : m_frames) {
+		vmaUnmapMemory(allocator, frame.lights.m_allocation);
+		vmaUnmapMemory(allocator, frame.staging.m_allocation);
+
+		vmaDestroyBuffer(allocator, frame.lights.m_buffer, frame.lights.m_allocation);
+		vmaDestroyBuffer(allocator, frame.clusters.m_buffer, frame.clusters.m_allocation);
+		vmaDestroyBuffer(allocator, frame.indices.m_buffer, frame.indices.m_allocation);
+		vmaDestroyBuffer(allocator, frame.counter.m_buffer, frame.counter.m_allocation);
+		vmaDestroyBuffer(allocator, frame.staging.m_buffer, frame.staging.m_allocation);
+	}
+	m_frames.clear();
+
+	vkDestroyPipeline(m_engine->m_device, m_pipeline, nullptr);
+	vkDestroyPipelineLayout(m_engine->m_device, m_pipelineLayout, nullptr);
+	vkDestroyDescriptorSetLayout(m_engine->m_device, m_setLayout, nullptr);
+}
+
+void ClusteredLighting::init_pipeline() {
+	VkDescriptorSetLayoutBinding bindings[] = {
+		vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 0),
+		vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 1),
+		vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 2),
+		vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 3)
+	};
+
+	VkDescriptorSetLayoutCreateInfo setLayoutInfo = vkinit::descriptorset_layout_create_info(bindings, 4);
+	VK_CHECK(vkCreateDescriptorSetLayout(m_engine->m_device, &setLayoutInfo, nullptr, &m_setLayout));
+
+	VkPushConstantRange pushConstant;
+	pushConstant.offset = 0;
+	pushConstant.size = sizeof(ClusterConstants);
+	pushConstant.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+
+	VkPipelineLayoutCreateInfo layoutInfo = vkinit::pipeline_layout_create_info();
+	layoutInfo.setLayoutCount = 1;
+	layoutInfo.pSetLayouts = &m_setLayout;
+	layoutInfo.pushConstantRangeCount = 1;
+	layoutInfo.pPushConstantRanges = &pushConstant;
+
+	VK_CHECK(vkCreatePipelineLayout(m_engine->m_device, &layoutInfo, nullptr, &m_pipelineLayout));
+
+	//without the compute pipeline the lights are binned on the cpu
+	m_pipeline = build_pipeline();
+}
+
+VkPipeline ClusteredLighting::build_pipeline() const {
+	VkShaderModule clusterShader;
+	if (!m_engine->load_shader_module("../../shaders/cluster_lights.comp.spv", &clusterShader)) {
+		std::cout << "Error when building the light clustering compute shader" << std::endl;
+		return VK_NULL_HANDLE;
+	}
+
+	VkComputePipelineCreateInfo pipelineInfo = {};
+	pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+	pipelineInfo.pNext = nullptr;
+	pipelineInfo.stage = vkinit::pipeline_shader_stage_create_info(VK_SHADER_STAGE_COMPUTE_BIT, clusterShader);
+	pipelineInfo.layout = m_pipelineLayout;
+
+	//a reloaded shader may not link, the previous pipeline then keeps running
+	VkPipeline pipeline;
+	if (vkCreateComputePipelines(m_engine->m_device, m_engine->m_pipelineCache.handle(), 1, &pipelineInfo, nullptr, &pipeline) != VK_SUCCESS) {
+		std::cout << "failed to create compute pipeline\n";
+		pipeline = VK_NULL_HANDLE;
+	}
+
+	vkDestroyShaderModule(m_engine->m_device, clusterShader, nullptr);
+
+	return pipeline;
+}
+
+VkPipeline ClusteredLighting::swap_pipeline(VkPipeline pipeline) {
+	VkPipeline previous = m_pipeline;
+	m_pipeline = pipeline;
+	return previous;
+}
+
+void ClusteredLighting::write_descriptors(uint32_t frameIndex, VkDescriptorSet set, uint32_t firstBinding) {
+	FrameBuffers& frame = m_frames[frameIndex];
+
+	VkDescriptorBufferInfo lightInfo = { frame.lights.m_buffer, 0, VK_WHOLE_SIZE };
+	VkDescriptorBufferInfo clusterInfo = { frame.clusters.m_buffer, 0, VK_WHOLE_SIZE };
+	VkDescriptorBufferInfo indexInfo = { frame.indices.m_buffer, 0, VK_WHOLE_SIZE };
+
+	VkWriteDescriptorSet writes[] = {
+		vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, set, &lightInfo, firstBinding),
+		vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, set, &clusterInfo, firstBinding + 1),
+		vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, set, &indexInfo, firstBinding + 2)
+	};
+	vkUpdateDescriptorSets(m_engine->m_device, 3, writes, 0, nullptr);
+}
+
+glm::vec4 ClusteredLighting::cluster_scale(VkExtent2D extent, float nearPlane, float farPlane) {
+	//slice = log(depth / near) / log(far / near) * slices
+	float sliceScale = CLUSTER_Z / std::log(farPlane / nearPlane);
+	return glm::vec4((float)CLUSTER_X / extent.width, (float)CLUSTER_Y / extent.height,
+		sliceScale, -std::log(nearPlane) * sliceScale);
+}
+
+void ClusteredLighting::record_update(VkCommandBuffer cmd, uint32_t frameIndex, const std::vector<Light>& lights, uint32_t lightCount,
+	const glm::mat4& view, const glm::mat4& projection, float nearPlane, float farPlane,
+	bool gpuBinning, ThreadPool& pool)
+{
+	FrameBuffers& frame = m_frames[frameIndex];
+	bool cpuBinning = !gpuBinning || m_pipeline == VK_NULL_HANDLE;
+
+	m_lightCount = std::min({ lightCount, (uint32_t)lights.size(), MAX_LIGHTS });
+
+	size_t padded = (m_lightCount + 7) / 8 * 8;
+	if (cpuBinning) {
+		m_lightX.assign(padded, 0.f);
+		m_lightY.assign(padded, 0.f);
+		m_lightDepth.assign(padded, LIGHT_PADDING_DEPTH);
+		m_lightRange.assign(padded, 0.f);
+	}
+
+	//the frame fence signaled, so the mapping is free to be written
+	glm::mat3 rotation = glm::mat3(view);
+	for (uint32_t i = 0; i < m_lightCount; i++) {
+		const Light& light = lights[i];
+		glm::vec3 position = glm::vec3(view * glm::vec4(light.position, 1.f));
+
+		GPULight& gpuLight = frame.mappedLights[i];
+		gpuLight.positionRange = glm::vec4(position, light.range);
+		gpuLight.color = glm::vec4(light.color * light.intensity, light.type == LightType::Spot ? 1.f : 0.f);
+		gpuLight.directionCone = glm::vec4(glm::normalize(rotation * light.direction), std::cos(light.outerAngle));
+
+		//spot lights are binned by the whole sphere of their range
+		if (cpuBinning) {
+			m_lightX[i] = position.x;
+			m_lightY[i] = position.y;
+			m_lightDepth[i] = -position.z;
+			m_lightRange[i] = light.range;
+		}
+	}
+
+	ClusterConstants constants;
+	constants.projection = glm::vec4(projection[0][0], projection[1][1], nearPlane, farPlane);
+	constants.lightCount = m_lightCount;
+	constants.indexCapacity = CLUSTER_INDEX_CAPACITY;
+
+	if (!cpuBinning) {
+		vkCmdFillBuffer(cmd, frame.counter.m_buffer, 0, sizeof(uint32_t), 0);
+
+		VkBufferMemoryBarrier counterReset = vkinit::buffer_barrier(frame.counter.m_buffer,
+			VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT);
+
+		vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,
+			0, nullptr, 1, &counterReset, 0, nullptr);
+
+		vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, m_pipeline);
+		vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, m_pipelineLayout, 0, 1, &frame.descriptor, 0, nullptr);
+		vkCmdPushConstants(cmd, m_pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(ClusterConstants), &constants);
+
+		vkCmdDispatch(cmd, CLUSTER_COUNT / CLUSTER_GROUP_SIZE, 1, 1);
+
+		VkBufferMemoryBarrier listBarriers[] = {
+			vkinit::buffer_barrier(frame.clusters.m_buffer, VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT),
+			vkinit::buffer_barrier(frame.indices.m_buffer, VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT)
+		};
+
+		vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0,
+			0, nullptr, 2, listBarriers, 0, nullptr);
+		return;
+	}
+
+	uint32_t* clusters = (uint32_t*)frame.mappedStaging;
+	uint32_t* indices = (uint32_t*)(frame.mappedStaging + CLUSTER_RANGES_SIZE);
+	uint32_t indexCount = bin_lights(constants, pool, clusters, indices);
+
+	//only the used part of the index list goes over
+	VkBufferCopy clusterCopy = { 0, 0, CLUSTER_RANGES_SIZE };
+	vkCmdCopyBuffer(cmd, frame.staging.m_buffer, frame.clusters.m_buffer, 1, &clusterCopy);
+	if (indexCount > 0) {
+		VkBufferCopy indexCopy = { CLUSTER_RANGES_SIZE, 0, indexCount * sizeof(uint32_t) };
+		vkCmdCopyBuffer(cmd, frame.staging.m_buffer, frame.indices.m_buffer, 1, &indexCopy);
+	}
+
+	VkBufferMemoryBarrier listBarriers[] = {
+		vkinit::buffer_barrier(frame.clusters.m_buffer, VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT),
+		vkinit::buffer_barrier(frame.indices.m_buffer, VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT)
+	};
+
+	vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0,
+		0, nullptr, 2, listBarriers, 0, nullptr);
+}
+
+uint32_t ClusteredLighting::bin_lights(const ClusterConstants& constants, ThreadPool& pool, uint32_t* clusters, uint32_t* indices) {
+	pool.parallel_for(CLUSTER_Z, 1, [&](size_t begin, size_t end) {
+		for (size_t slice = begin; slice < end; slice++) {
+			bin_slice(constants, (uint32_t)slice);
+		}
+	});
+
+	//the ranges are packed in cluster order, clusters past the capacity keep what still fits
+	uint32_t offset = 0;
+	m_droppedIndices = 0;
+	for (uint32_t slice = 0; slice < CLUSTER_Z; slice++) {
+		const std::vector<uint32_t>& sliceIndices = m_sliceIndices[slice];
+		const std::vector<uint32_t>& sliceCounts = m_sliceCounts[slice];
+
+		uint32_t first = 0;
+		for (uint32_t tile = 0; tile < CLUSTER_X * CLUSTER_Y; tile++) {
+			uint32_t count = sliceCounts[tile];
+			uint32_t kept = std::min(count, CLUSTER_INDEX_CAPACITY - offset);
+			std::copy(sliceIndices.begin() + first, sliceIndices.begin() + first + kept, indices + offset);
+
+			uint32_t cluster = slice * CLUSTER_X * CLUSTER_Y + tile;
+			clusters[cluster * 2] = offset;
+			clusters[cluster * 2 + 1] = kept;
+
+			offset += kept;
+			first += count;
+			m_droppedIndices += count - kept;
+		}
+	}
+	return offset;
+}
+
+void ClusteredLighting::bin_slice(const ClusterConstants& constants, uint32_t slice) {
+	std::vector<uint32_t>& sliceIndices = m_sliceIndices[slice];
+	std::vector<uint32_t>& sliceCounts = m_sliceCounts[slice];
+	sliceIndices.clear();
+	sliceCounts.assign(CLUSTER_X * CLUSTER_Y, 0);
+
+	float nearPlane = constants.projection.z;
+	float farPlane = constants.projection.w;
+	float depthNear = nearPlane * std::pow(farPlane / nearPlane, (float)slice / CLUSTER_Z);
+	float depthFar = nearPlane * std::pow(farPlane / nearPlane, (float)(slice + 1) / CLUSTER_Z);
+
+	auto bin_tile = bin_tile_scalar;
+#if defined(CPU_AVX2)
+	if (cpu_supports_avx2()) bin_tile = bin_tile_avx2;
+#endif
+
+	for (uint32_t y = 0; y < CLUSTER_Y; y++) {
+		for (uint32_t x = 0; x < CLUSTER_X; x++) {
+			//view x and y grow with the depth, so the corners at both ends of the slice bound the froxel
+			glm::vec2 ndcMin = glm::vec2(x, y) / glm::vec2(CLUSTER_X, CLUSTER_Y) * 2.f - 1.f;
+			glm::vec2 ndcMax = glm::vec2(x + 1, y + 1) / glm::vec2(CLUSTER_X, CLUSTER_Y) * 2.f - 1.f;
+			glm::vec2 scale = 1.f / glm::vec2(constants.projection);
+
+			glm::vec2 corners[] = { ndcMin * scale * depthNear, ndcMax * scale * depthNear,
+				ndcMin * scale * depthFar, ndcMax * scale * depthFar };
+			glm::vec2 boundsMin = glm::min(glm::min(corners[0], corners[1]), glm::min(corners[2], corners[3]));
+			glm::vec2 boundsMax = glm::max(glm::max(corners[0], corners[1]), glm::max(corners[2], corners[3]));
+
+			size_t before = sliceIndices.size();
+			bin_tile(m_lightX.data(), m_lightY.data(), m_lightDepth.data(), m_lightRange.data(), m_lightX.size(),
+				boundsMin, boundsMax, depthNear, depthFar, sliceIndices);
+			sliceCounts[y * CLUSTER_X + x] = (uint32_t)(sliceIndices.size() - before);
+		}
+	}
+}
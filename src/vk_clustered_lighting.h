@@ -0,0 +1,128 @@
+#pragma once
+
+#include "vk_types.h"
+
+#include <glm/glm.hpp>
+
+#include <vector>
+
+class VulkanEngine;
+class ThreadPool;
+
+//froxels the view frustum is split into: tiles on the screen, and slices growing exponentially with the view depth.
+//Matches the constants of cluster_lights.comp and model_lighting.frag
+constexpr uint32_t CLUSTER_X = 16;
+constexpr uint32_t CLUSTER_Y = 9;
+constexpr uint32_t CLUSTER_Z = 24;
+constexpr uint32_t CLUSTER_COUNT = CLUSTER_X * CLUSTER_Y * CLUSTER_Z;
+
+constexpr uint32_t MAX_LIGHTS = 1024;
+
+//the light index list has room for this many lights per cluster on average, clusters past the end get fewer
+constexpr uint32_t CLUSTER_AVERAGE_LIGHTS = 32;
+constexpr uint32_t CLUSTER_INDEX_CAPACITY = CLUSTER_COUNT * CLUSTER_AVERAGE_LIGHTS;
+
+enum class LightType : uint32_t {
+	Point,
+	Spot
+};
+
+//in world space, as the scene keeps them
+struct Light {
+	LightType type{ LightType::Point };
+	glm::vec3 position{ 0.f };
+	//where spot lights point to
+	glm::vec3 direction{ 0.f, -1.f, 0.f };
+	glm::vec3 color{ 1.f };
+	float intensity{ 1.f };
+	//distance at which the light fades out completely
+	float range{ 1.f };
+	//half angle of the spot cone, in radians
+	float outerAngle{ 0.5f };
+};
+
+//matches Light in model_lighting.frag and cluster_lights.comp, in view space
+struct GPULight {
+	glm::vec4 positionRange;
+	//color times intensity, w is 1 for spot lights
+	glm::vec4 color;
+	//xyz the spot direction, w the cosine of its half angle
+	glm::vec4 directionCone;
+};
+
+//matches the push constants of cluster_lights.comp
+struct ClusterConstants {
+	//x and y scale of the projection, near and far plane
+	glm::vec4 projection;
+	uint32_t lightCount;
+	uint32_t indexCapacity;
+};
+
+//assigns every light to the froxels its range touches, so a fragment only loops over the lights of its own cluster.
+//Shading then scales with the lights per cluster instead of the lights in the scene.
+//The lists are built every frame by a compute pass, or binned on the worker threads and copied up
+class ClusteredLighting {
+public:
+	void init(VulkanEngine* engine, uint32_t framesInFlight);
+	void cleanup();
+
+	//points the light, cluster and index bindings of a scene set at the buffers of the frame
+	void write_descriptors(uint32_t frameIndex, VkDescriptorSet set, uint32_t firstBinding);
+
+	//outside of the render pass: moves the first lightCount lights to view space and builds the cluster
+	//lists of the frame. Lights past MAX_LIGHTS are left out
+	void record_update(VkCommandBuffer cmd, uint32_t frameIndex, const std::vector<Light>& lights, uint32_t lightCount,
+		const glm::mat4& view, const glm::mat4& projection, float nearPlane, float farPlane,
+		bool gpuBinning, ThreadPool& pool);
+
+	//x and y turn a pixel into a cluster tile, z and w turn the log of the view depth into a slice
+	static glm::vec4 cluster_scale(VkExtent2D extent, float nearPlane, float farPlane);
+
+	//compiles the compute shader again, safe from a worker. VK_NULL_HANDLE when it failed
+	VkPipeline build_pipeline() const;
+	//puts a rebuilt pipeline in place and returns the previous one, frames in flight may still use it
+	VkPipeline swap_pipeline(VkPipeline pipeline);
+
+	uint32_t light_count() const { return m_lightCount; }
+	//light indices the cpu binning had no room for last time it ran
+	uint32_t dropped_indices() const { return m_droppedIndices; }
+
+private:
+	struct FrameBuffers {
+		//written through the mapping every frame
+		AllocatedBuffer lights;
+		GPULight* mappedLights;
+		//offset and count of every cluster, then the indices of the lights they touch
+		AllocatedBuffer clusters;
+		AllocatedBuffer indices;
+		AllocatedBuffer counter;
+		//the cpu binning writes here, the lists are copied over to the gpu buffers
+		AllocatedBuffer staging;
+		char* mappedStaging;
+		VkDescriptorSet descriptor;
+	};
+
+	void init_pipeline();
+	//writes the cluster ranges and light indices to the staging mapping, returns the indices written
+	uint32_t bin_lights(const ClusterConstants& constants, ThreadPool& pool, uint32_t* clusters, uint32_t* indices);
+	void bin_slice(const ClusterConstants& constants, uint32_t slice);
+
+	VulkanEngine* m_engine{ nullptr };
+	std::vector<FrameBuffers> m_frames;
+
+	//view space bounds of the lights as structure of arrays, padded to a multiple of 8 lights that touch nothing
+	std::vector<float> m_lightX;
+	std::vector<float> m_lightY;
+	std::vector<float> m_lightDepth;
+	std::vector<float> m_lightRange;
+	//one list per slice, so the slices are binned in parallel
+	std::vector<std::vector<uint32_t>> m_sliceIndices;
+	std::vector<std::vector<uint32_t>> m_sliceCounts;
+
+	uint32_t m_lightCount{ 0 };
+	uint32_t m_droppedIndices{ 0 };
+
+	VkDescriptorSetLayout m_setLayout{ VK_NULL_HANDLE };
+	VkPipelineLayout m_pipelineLayout{ VK_NULL_HANDLE };
+	VkPipeline m_pipeline{ VK_NULL_HANDLE };
+};
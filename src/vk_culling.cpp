@@ -0,0 +1,193 @@
+#include "vk_culling.h"
+#include "utils/thread_pool.h"
+#include "utils/cpu_features.h"
+
+#include <algorithm>
+
+#if defined(CPU_AVX2)
+#include <immintrin.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define CULLING_SSE
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+//spheres per job, small sets are culled on the calling thread
+constexpr size_t CULLING_CHUNK_SIZE = 1024;
+
+//padding lanes fail every plane test
+constexpr float CULLING_PADDING_RADIUS = -1e30f;
+
+static uint32_t lowest_bit(uint32_t bits) {
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward(&index, bits);
+	return (uint32_t)index;
+#else
+	return (uint32_t)__builtin_ctz(bits);
+#endif
+}
+
+vkutil::Frustum vkutil::extract_frustum(const glm::mat4& viewproj) {
+	//rows of the matrix, glm stores it by columns
+	glm::vec4 row[4];
+	for (int i = 0; i < 4; i++) {
+		row[i] = glm::vec4(viewproj[0][i], viewproj[1][i], viewproj[2][i], viewproj[3][i]);
+	}
+
+	Frustum frustum;
+	frustum.planes[0] = row[3] + row[0];
+	frustum.planes[1] = row[3] - row[0];
+	frustum.planes[2] = row[3] + row[1];
+	frustum.planes[3] = row[3] - row[1];
+	//the -1 to 1 depth near plane, a bit behind the 0 to 1 one, which only keeps some extra objects
+	frustum.planes[4] = row[3] + row[2];
+	frustum.planes[5] = row[3] - row[2];
+
+	for (glm::vec4& plane : frustum.planes) {
+		plane /= glm::length(glm::vec3(plane));
+	}
+	return frustum;
+}
+
+void vkutil::CullingBounds::clear() {
+	resize(0);
+}
+
+void vkutil::CullingBounds::resize(size_t count) {
+	m_count = count;
+
+	size_t padded = (count + WIDTH - 1) / WIDTH * WIDTH;
+	m_x.assign(padded, 0.f);
+	m_y.assign(padded, 0.f);
+	m_z.assign(padded, 0.f);
+	m_radius.assign(padded, CULLING_PADDING_RADIUS);
+}
+
+void vkutil::CullingBounds::set(size_t index, const glm::vec3& center, float radius) {
+	m_x[index] = center.x;
+	m_y[index] = center.y;
+	m_z[index] = center.z;
+	m_radius[index] = radius;
+}
+
+#if defined(CPU_AVX2)
+//whole groups of 8 stay inside the padded arrays, the padding lanes never pass
+static CPU_AVX2_FUNCTION void cull_spheres_avx2(const vkutil::Frustum& frustum, const vkutil::CullingBounds& bounds,
+	size_t begin, size_t end, std::vector<uint32_t>& visible)
+{
+	const float* xs = bounds.x();
+	const float* ys = bounds.y();
+	const float* zs = bounds.z();
+	const float* radii = bounds.radius();
+
+	for (size_t i = begin; i < end; i += 8) {
+		__m256 x = _mm256_loadu_ps(xs + i);
+		__m256 y = _mm256_loadu_ps(ys + i);
+		__m256 z = _mm256_loadu_ps(zs + i);
+		__m256 negativeRadius = _mm256_sub_ps(_mm256_setzero_ps(), _mm256_loadu_ps(radii + i));
+
+		__m256 inside = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+		for (const glm::vec4& plane : frustum.planes) {
+			__m256 distance = _mm256_add_ps(
+				_mm256_add_ps(_mm256_mul_ps(x, _mm256_set1_ps(plane.x)), _mm256_mul_ps(y, _mm256_set1_ps(plane.y))),
+				_mm256_add_ps(_mm256_mul_ps(z, _mm256_set1_ps(plane.z)), _mm256_set1_ps(plane.w)));
+			inside = _mm256_and_ps(inside, _mm256_cmp_ps(distance, negativeRadius, _CMP_GE_OQ));
+		}
+
+		uint32_t mask = (uint32_t)_mm256_movemask_ps(inside);
+		while (mask) {
+			visible.push_back((uint32_t)i + lowest_bit(mask));
+			mask &= mask - 1;
+		}
+	}
+}
+#endif
+
+void vkutil::cull_spheres(const Frustum& frustum, const CullingBounds& bounds, size_t begin, size_t end,
+	std::vector<uint32_t>& visible)
+{
+#if defined(CPU_AVX2)
+	if (cpu_supports_avx2()) {
+		cull_spheres_avx2(frustum, bounds, begin, end, visible);
+		return;
+	}
+#endif
+
+	const float* xs = bounds.x();
+	const float* ys = bounds.y();
+	const float* zs = bounds.z();
+	const float* radii = bounds.radius();
+
+	size_t i = begin;
+
+#if defined(CULLING_SSE)
+	for (; i < end; i += 4) {
+		__m128 x = _mm_loadu_ps(xs + i);
+		__m128 y = _mm_loadu_ps(ys + i);
+		__m128 z = _mm_loadu_ps(zs + i);
+		__m128 negativeRadius = _mm_sub_ps(_mm_setzero_ps(), _mm_loadu_ps(radii + i));
+
+		__m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+		for (const glm::vec4& plane : frustum.planes) {
+			__m128 distance = _mm_add_ps(
+				_mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(plane.x)), _mm_mul_ps(y, _mm_set1_ps(plane.y))),
+				_mm_add_ps(_mm_mul_ps(z, _mm_set1_ps(plane.z)), _mm_set1_ps(plane.w)));
+			inside = _mm_and_ps(inside, _mm_cmpge_ps(distance, negativeRadius));
+		}
+
+		uint32_t mask = (uint32_t)_mm_movemask_ps(inside);
+		while (mask) {
+			visible.push_back((uint32_t)i + lowest_bit(mask));
+			mask &= mask - 1;
+		}
+	}
+#else
+	for (; i < end; i++) {
+		bool inside = true;
+		for (const glm::vec4& plane : frustum.planes) {
+			if (plane.x * xs[i] + plane.y * ys[i] + plane.z * zs[i] + plane.w < -radii[i]) {
+				inside = false;
+				break;
+			}
+		}
+		if (inside) visible.push_back((uint32_t)i);
+	}
+#endif
+}
+
+void FrustumCuller::cull(const vkutil::Frustum& frustum, const vkutil::CullingBounds& bounds, ThreadPool& pool,
+	std::vector<uint32_t>& visible)
+{
+	visible.clear();
+	if (bounds.size() == 0) return;
+
+	size_t chunkCount = (bounds.size() + CULLING_CHUNK_SIZE - 1) / CULLING_CHUNK_SIZE;
+	if (chunkCount == 1) {
+		vkutil::cull_spheres(frustum, bounds, 0, bounds.size(), visible);
+		return;
+	}
+
+	if (m_chunkVisible.size() < chunkCount) m_chunkVisible.resize(chunkCount);
+
+	pool.parallel_for(chunkCount, 1, [&](size_t begin, size_t end) {
+		for (size_t chunk = begin; chunk < end; chunk++) {
+			std::vector<uint32_t>& chunkVisible = m_chunkVisible[chunk];
+			chunkVisible.clear();
+
+			size_t first = chunk * CULLING_CHUNK_SIZE;
+			size_t last = std::min(first + CULLING_CHUNK_SIZE, bounds.size());
+			vkutil::cull_spheres(frustum, bounds, first, last, chunkVisible);
+		}
+	});
+
+	//chunks are in index order, so concatenating them keeps the list sorted
+	for (size_t chunk = 0; chunk < chunkCount; chunk++) {
+		visible.insert(visible.end(), m_chunkVisible[chunk].begin(), m_chunkVisible[chunk].end());
+	}
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include <vector>
+#include <cstdint>
+
+class ThreadPool;
+
+namespace vkutil {
+	//planes point inwards, a point is inside when dot(plane.xyz, p) + plane.w >= 0 for all of them
+	struct Frustum {
+		glm::vec4 planes[6];
+	};
+
+	Frustum extract_frustum(const glm::mat4& viewproj);
+
+	//bounding spheres as structure of arrays, so the tests load 8 of each component at once.
+	//The arrays are padded to a multiple of 8 with spheres that never pass
+	class CullingBounds {
+	public:
+		static constexpr size_t WIDTH = 8;
+
+		void clear();
+		void resize(size_t count);
+		void set(size_t index, const glm::vec3& center, float radius);
+
+		size_t size() const { return m_count; }
+
+		const float* x() const { return m_x.data(); }
+		const float* y() const { return m_y.data(); }
+		const float* z() const { return m_z.data(); }
+		const float* radius() const { return m_radius.data(); }
+
+	private:
+		std::vector<float> m_x;
+		std::vector<float> m_y;
+		std::vector<float> m_z;
+		std::vector<float> m_radius;
+		size_t m_count{ 0 };
+	};
+
+	//appends the indices of the spheres in [begin, end) that touch the frustum, begin must be a multiple of 8
+	void cull_spheres(const Frustum& frustum, const CullingBounds& bounds, size_t begin, size_t end,
+		std::vector<uint32_t>& visible);
+}
+
+//splits the culling of a set of bounds over the thread pool and gathers a compact list of the visible ones
+class FrustumCuller {
+public:
+	//visible is overwritten with the indices in increasing order
+	void cull(const vkutil::Frustum& frustum, const vkutil::CullingBounds& bounds, ThreadPool& pool,
+		std::vector<uint32_t>& visible);
+
+private:
+	//one list per chunk, kept between frames so they don't reallocate
+	std::vector<std::vector<uint32_t>> m_chunkVisible;
+};
@@ -0,0 +1,188 @@
+#include "vk_defragmenter.h"
+
+#include <algorithm>
+#include <unordered_map>
+
+void Defragmenter::init(VmaAllocator allocator, uint32_t framesInFlight) {
+	m_allocator = allocator;
+	m_framesInFlight = framesInFlight;
+	m_nextCheckFrame = DEFRAGMENT_CHECK_INTERVAL;
+
+	const VkPhysicalDeviceMemoryProperties* memoryProperties;
+	vmaGetMemoryProperties(m_allocator, &memoryProperties);
+
+	m_deviceTypeMask = 0;
+	for (uint32_t type = 0; type < memoryProperties->memoryTypeCount; type++) {
+		if (memoryProperties->memoryTypes[type].propertyFlags & VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT) {
+			m_deviceTypeMask |= 1u << type;
+		}
+	}
+}
+
+void Defragmenter::cleanup() {
+	//the device is idle here, so whatever pass is running can end right away
+	if (m_context != VK_NULL_HANDLE) {
+		release_moved();
+		vmaEndDefragmentationPass(m_allocator, m_context);
+		end_run();
+	}
+}
+
+void Defragmenter::add_source(std::function<void(std::vector<MovableAllocation>&)>&& collect) {
+	m_sources.push_back(std::move(collect));
+}
+
+void Defragmenter::update(VkCommandBuffer cmd, uint64_t frameNumber) {
+	if (m_context == VK_NULL_HANDLE) {
+		if (frameNumber < m_nextCheckFrame) return;
+		m_nextCheckFrame = frameNumber + DEFRAGMENT_CHECK_INTERVAL;
+
+		measure();
+		if (m_stats.fragmentation < DEFRAGMENT_THRESHOLD || m_stats.unusedBytes < DEFRAGMENT_MIN_UNUSED_BYTES) return;
+
+		if (!begin_run()) return;
+
+		m_passFrame = frameNumber;
+		if (!begin_pass(cmd)) end_run();
+		return;
+	}
+
+	//the fence of the frame that recorded the copies signaled, and every later frame uses the new resources
+	if (frameNumber < m_passFrame + m_framesInFlight) return;
+
+	release_moved();
+
+	//frees the old places, VK_NOT_READY means the plan has moves left
+	VkResult result = vmaEndDefragmentationPass(m_allocator, m_context);
+
+	m_passFrame = frameNumber;
+	if (result != VK_NOT_READY || m_passes >= DEFRAGMENT_MAX_PASSES || !begin_pass(cmd)) {
+		end_run();
+	}
+}
+
+void Defragmenter::measure() {
+	VmaStats vmaStats;
+	vmaCalculateStats(m_allocator, &vmaStats);
+
+	VkDeviceSize unusedBytes = 0;
+	VkDeviceSize largestRange = 0;
+	uint32_t unusedRanges = 0;
+	for (uint32_t type = 0; type < VK_MAX_MEMORY_TYPES; type++) {
+		if (!(m_deviceTypeMask & (1u << type))) continue;
+
+		const VmaStatInfo& info = vmaStats.memoryType[type];
+		if (info.unusedRangeCount == 0) continue;
+
+		unusedBytes += info.unusedBytes;
+		unusedRanges += info.unusedRangeCount;
+		largestRange = std::max(largestRange, info.unusedRangeSizeMax);
+	}
+
+	m_stats.unusedBytes = unusedBytes;
+	m_stats.unusedRanges = unusedRanges;
+	m_stats.fragmentation = unusedBytes > 0 ? 1.f - (float)largestRange / (float)unusedBytes : 0.f;
+}
+
+bool Defragmenter::begin_run() {
+	for (auto& collect : m_sources) {
+		collect(m_movables);
+	}
+
+	if (m_movables.empty()) return false;
+
+	m_allocations.clear();
+	for (MovableAllocation& movable : m_movables) {
+		m_allocations.push_back(movable.allocation);
+	}
+	m_states.assign(m_movables.size(), MoveState::Pinned);
+
+	VmaDefragmentationInfo2 defragInfo = {};
+	defragInfo.flags = VMA_DEFRAGMENTATION_FLAG_INCREMENTAL;
+	defragInfo.allocationCount = (uint32_t)m_allocations.size();
+	defragInfo.pAllocations = m_allocations.data();
+	defragInfo.maxCpuBytesToMove = DEFRAGMENT_BYTES_PER_PASS;
+	defragInfo.maxCpuAllocationsToMove = DEFRAGMENT_MOVES_PER_PASS;
+	defragInfo.maxGpuBytesToMove = DEFRAGMENT_BYTES_PER_PASS;
+	defragInfo.maxGpuAllocationsToMove = DEFRAGMENT_MOVES_PER_PASS;
+
+	m_runStats = {};
+	m_passes = 0;
+
+	VkResult result = vmaDefragmentationBegin(m_allocator, &defragInfo, &m_runStats, &m_context);
+	if (result != VK_NOT_READY) {
+		//nothing worth moving
+		vmaDefragmentationEnd(m_allocator, m_context);
+		m_context = VK_NULL_HANDLE;
+
+		for (MovableAllocation& movable : m_movables) {
+			movable.release(false);
+		}
+		m_movables.clear();
+		return false;
+	}
+
+	m_stats.runs++;
+	return true;
+}
+
+bool Defragmenter::begin_pass(VkCommandBuffer cmd) {
+	m_moves.resize(m_allocations.size());
+
+	VmaDefragmentationPassInfo passInfo = {};
+	passInfo.moveCount = (uint32_t)m_moves.size();
+	passInfo.pMoves = m_moves.data();
+	vmaBeginDefragmentationPass(m_allocator, m_context, &passInfo);
+	m_passes++;
+
+	if (passInfo.moveCount == 0) {
+		vmaEndDefragmentationPass(m_allocator, m_context);
+		return false;
+	}
+
+	std::unordered_map<VmaAllocation, size_t> indices;
+	for (size_t i = 0; i < m_allocations.size(); i++) {
+		indices[m_allocations[i]] = i;
+	}
+
+	for (uint32_t i = 0; i < passInfo.moveCount; i++) {
+		VmaDefragmentationPassMoveInfo& move = m_moves[i];
+		size_t index = indices[move.allocation];
+
+		m_movables[index].move(cmd, move.memory, move.offset);
+		m_states[index] = MoveState::Moved;
+	}
+
+	return true;
+}
+
+void Defragmenter::release_moved() {
+	for (size_t i = 0; i < m_movables.size(); i++) {
+		if (m_states[i] != MoveState::Moved) continue;
+
+		m_movables[i].release(true);
+		m_states[i] = MoveState::Released;
+	}
+}
+
+void Defragmenter::end_run() {
+	vmaDefragmentationEnd(m_allocator, m_context);
+	m_context = VK_NULL_HANDLE;
+
+	release_moved();
+	for (size_t i = 0; i < m_movables.size(); i++) {
+		if (m_states[i] == MoveState::Pinned) m_movables[i].release(false);
+	}
+	m_movables.clear();
+	m_states.clear();
+
+	m_stats.allocationsMoved += m_runStats.allocationsMoved;
+	m_stats.bytesMoved += m_runStats.bytesMoved;
+	m_stats.bytesFreed += m_runStats.bytesFreed;
+	m_stats.blocksFreed += m_runStats.deviceMemoryBlocksFreed;
+
+	std::cout << "Defragmentation moved " << m_runStats.allocationsMoved << " allocations ("
+		<< m_runStats.bytesMoved / 1024 << " KB) and freed " << m_runStats.deviceMemoryBlocksFreed << " memory blocks" << std::endl;
+
+	measure();
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include "vk_types.h"
+
+#include <vector>
+#include <functional>
+
+//frames between two fragmentation checks
+constexpr uint64_t DEFRAGMENT_CHECK_INTERVAL = 600;
+
+//runs start once this share of the free memory is outside of the largest free range
+constexpr float DEFRAGMENT_THRESHOLD = 0.5f;
+constexpr VkDeviceSize DEFRAGMENT_MIN_UNUSED_BYTES = 16 * 1024 * 1024;
+
+//limits of a single pass, so no frame copies more than this
+constexpr uint32_t DEFRAGMENT_MOVES_PER_PASS = 16;
+constexpr VkDeviceSize DEFRAGMENT_BYTES_PER_PASS = 32 * 1024 * 1024;
+constexpr uint32_t DEFRAGMENT_MAX_PASSES = 8;
+
+//a resource whose memory the defragmenter may move
+struct MovableAllocation {
+	VmaAllocation allocation;
+	//creates the resource again bound to its new place, records the copy of its contents
+	//and swaps the new one in wherever the old one was used
+	std::function<void(VkCommandBuffer cmd, VkDeviceMemory memory, VkDeviceSize offset)> move;
+	//called once per allocation at the end, after no frame in flight can use the old resource anymore
+	std::function<void(bool moved)> release;
+};
+
+struct DefragmentationStats {
+	//share of the free device local memory outside of its largest free range, when last measured
+	float fragmentation{ 0.f };
+	VkDeviceSize unusedBytes{ 0 };
+	uint32_t unusedRanges{ 0 };
+
+	uint64_t runs{ 0 };
+	uint64_t allocationsMoved{ 0 };
+	VkDeviceSize bytesMoved{ 0 };
+	VkDeviceSize bytesFreed{ 0 };
+	uint64_t blocksFreed{ 0 };
+};
+
+//periodically checks how scattered the free device memory is and compacts it with VMA's
+//incremental defragmentation. Every pass moves a few allocations with copies recorded in
+//the frame command buffer, the old resources are released once the frames using them finished
+class Defragmenter {
+public:
+	void init(VmaAllocator allocator, uint32_t framesInFlight);
+	void cleanup();
+
+	//gathers the allocations that may move during the next run, the sources keep them alive until released
+	void add_source(std::function<void(std::vector<MovableAllocation>&)>&& collect);
+
+	//called at the start of every frame command buffer, outside of any render pass
+	void update(VkCommandBuffer cmd, uint64_t frameNumber);
+
+	const DefragmentationStats& stats() const { return m_stats; }
+
+private:
+	void measure();
+	bool begin_run();
+	bool begin_pass(VkCommandBuffer cmd);
+	void release_moved();
+	void end_run();
+
+	enum class MoveState : uint8_t {
+		Pinned,
+		//copied to its new place, the old resource waits for the frames using it
+		Moved,
+		Released
+	};
+
+	VmaAllocator m_allocator{ VK_NULL_HANDLE };
+	uint32_t m_framesInFlight{ 0 };
+	uint32_t m_deviceTypeMask{ 0 };
+
+	std::vector<std::function<void(std::vector<MovableAllocation>&)>> m_sources;
+
+	VmaDefragmentationContext m_context{ VK_NULL_HANDLE };
+	//written by VMA for the whole lifetime of the context
+	VmaDefragmentationStats m_runStats{};
+
+	std::vector<MovableAllocation> m_movables;
+	std::vector<VmaAllocation> m_allocations;
+	std::vector<MoveState> m_states;
+	std::vector<VmaDefragmentationPassMoveInfo> m_moves;
+
+	uint32_t m_passes{ 0 };
+	uint64_t m_passFrame{ 0 };
+	uint64_t m_nextCheckFrame{ 0 };
+
+	DefragmentationStats m_stats;
+};
@@ -0,0 +1,205 @@
+#include "vk_depth_pyramid.h"
+#include "vk_engine.h"
+#include "vk_initializers.h"
+
+#include <algorithm>
+
+static uint32_t previous_power_of_two(uint32_t value) {
+	uint32_t result = 1;
+	while (result * 2 <= value) result *= 2;
+	return result;
+}
+
+void DepthPyramid::init(VulkanEngine* engine, VkImageView depthView, VkExtent2D depthExtent) {
+	m_engine = engine;
+	m_depthExtent = depthExtent;
+
+	m_extent.width = previous_power_of_two(depthExtent.width);
+	m_extent.height = previous_power_of_two(depthExtent.height);
+
+	m_levelCount = 1;
+	while ((std::max(m_extent.width, m_extent.height) >> m_levelCount) > 0) m_levelCount++;
+
+	VkExtent3D imageExtent = { m_extent.width, m_extent.height, 1 };
+	VkImageCreateInfo imageInfo = vkinit::image_create_info(VK_FORMAT_R32_SFLOAT,
+		VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_STORAGE_BIT, imageExtent, m_levelCount);
+
+	VmaAllocationCreateInfo allocInfo = {};
+	allocInfo.usage = VMA_MEMORY_USAGE_GPU_ONLY;
+
+	VK_CHECK(vmaCreateImage(m_engine->m_allocator, &imageInfo, &allocInfo, &m_image.m_image, &m_image.m_allocation, nullptr));
+
+	VkImageViewCreateInfo viewInfo = vkinit::imageview_create_info(VK_FORMAT_R32_SFLOAT, m_image.m_image,
+		VK_IMAGE_ASPECT_COLOR_BIT, m_levelCount);
+	VK_CHECK(vkCreateImageView(m_engine->m_device, &viewInfo, nullptr, &m_view));
+
+	m_levelViews.resize(m_levelCount);
+	for (uint32_t level = 0; level < m_levelCount; level++) {
+		VkImageViewCreateInfo levelInfo = vkinit::imageview_create_info(VK_FORMAT_R32_SFLOAT, m_image.m_image,
+			VK_IMAGE_ASPECT_COLOR_BIT);
+		levelInfo.subresourceRange.baseMipLevel = level;
+		VK_CHECK(vkCreateImageView(m_engine->m_device, &levelInfo, nullptr, &m_levelViews[level]));
+	}
+
+	//texels are fetched one by one, the filter never comes into play
+	VkSamplerCreateInfo samplerInfo = vkinit::sampler_create_info(VK_FILTER_NEAREST, VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE);
+	samplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+	VK_CHECK(vkCreateSampler(m_engine->m_device, &samplerInfo, nullptr, &m_sampler));
+
+	//the pyramid stays in the general layout, where it can be both written and sampled
+	m_engine->immediate_submit([&](VkCommandBuffer cmd) {
+		VkImageMemoryBarrier toGeneral = vkinit::image_barrier(m_image.m_image, VK_IMAGE_LAYOUT_UNDEFINED,
+			VK_IMAGE_LAYOUT_GENERAL, 0, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT, VK_IMAGE_ASPECT_COLOR_BIT);
+
+		vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,
+			0, nullptr, 0, nullptr, 1, &toGeneral);
+	});
+
+	init_pipeline();
+
+	m_levelSets.resize(m_levelCount);
+	for (uint32_t level = 0; level < m_levelCount; level++) {
+		VkDescriptorSetAllocateInfo setInfo = {};
+		setInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+		setInfo.pNext = nullptr;
+		setInfo.descriptorPool = m_engine->m_descriptorPool;
+		setInfo.descriptorSetCount = 1;
+		setInfo.pSetLayouts = &m_setLayout;
+
+		VK_CHECK(vkAllocateDescriptorSets(m_engine->m_device, &setInfo, &m_levelSets[level]));
+
+		//the first level reads the depth image itself, while it is in the read only layout
+		VkDescriptorImageInfo sourceInfo = {};
+		sourceInfo.sampler = m_sampler;
+		sourceInfo.imageView = level == 0 ? depthView : m_levelViews[level - 1];
+		sourceInfo.imageLayout = level == 0 ? VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL : VK_IMAGE_LAYOUT_GENERAL;
+
+		VkDescriptorImageInfo targetInfo = {};
+		targetInfo.imageView = m_levelViews[level];
+		targetInfo.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+
+		VkWriteDescriptorSet writes[] = {
+			vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, m_levelSets[level], &sourceInfo, 0),
+			vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, m_levelSets[level], &targetInfo, 1)
+		};
+		vkUpdateDescriptorSets(m_engine->m_device, 2, writes, 0, nullptr);
+	}
+}
+
+void DepthPyramid::cleanup() {
+	VkDevice device = m_engine->m_device;
+
+	vkDestroyPipeline(device, m_pipeline, nullptr);
+	vkDestroyPipelineLayout(device, m_pipelineLayout, nullptr);
+	vkDestroyDescriptorSetLayout(device, m_setLayout, nullptr);
+
+	vkDestroySampler(device, m_sampler, nullptr);
+	for (VkImageView levelView : m_levelViews) {
+		vkDestroyImageView(device, levelView, nullptr);
+	}
+	m_levelViews.clear();
+	vkDestroyImageView(device, m_view, nullptr);
+	vmaDestroyImage(m_engine->m_allocator, m_image.m_image, m_image.m_allocation);
+}
+
+void DepthPyramid::init_pipeline() {
+	VkDescriptorSetLayoutBinding bindings[] = {
+		vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_COMPUTE_BIT, 0),
+		vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_SHADER_STAGE_COMPUTE_BIT, 1)
+	};
+
+	VkDescriptorSetLayoutCreateInfo setLayoutInfo = vkinit::descriptorset_layout_create_info(bindings, 2);
+	VK_CHECK(vkCreateDescriptorSetLayout(m_engine->m_device, &setLayoutInfo, nullptr, &m_setLayout));
+
+	VkPushConstantRange pushConstant;
+	pushConstant.offset = 0;
+	pushConstant.size = sizeof(DepthPyramidConstants);
+	pushConstant.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+
+	VkPipelineLayoutCreateInfo layoutInfo = vkinit::pipeline_layout_create_info();
+	layoutInfo.setLayoutCount = 1;
+	layoutInfo.pSetLayouts = &m_setLayout;
+	layoutInfo.pushConstantRangeCount = 1;
+	layoutInfo.pPushConstantRanges = &pushConstant;
+
+	VK_CHECK(vkCreatePipelineLayout(m_engine->m_device, &layoutInfo, nullptr, &m_pipelineLayout));
+
+	m_pipeline = build_pipeline();
+}
+
+VkPipeline DepthPyramid::build_pipeline() const {
+	VkShaderModule pyramidShader;
+	if (!m_engine->load_shader_module("../../shaders/depth_pyramid.comp.spv", &pyramidShader)) {
+		std::cout << "Error when building the depth pyramid compute shader" << std::endl;
+		return VK_NULL_HANDLE;
+	}
+
+	VkComputePipelineCreateInfo pipelineInfo = {};
+	pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+	pipelineInfo.pNext = nullptr;
+	pipelineInfo.stage = vkinit::pipeline_shader_stage_create_info(VK_SHADER_STAGE_COMPUTE_BIT, pyramidShader);
+	pipelineInfo.layout = m_pipelineLayout;
+
+	//a reloaded shader may not link, the previous pipeline then keeps running
+	VkPipeline pipeline;
+	if (vkCreateComputePipelines(m_engine->m_device, m_engine->m_pipelineCache.handle(), 1, &pipelineInfo, nullptr, &pipeline) != VK_SUCCESS) {
+		std::cout << "failed to create compute pipeline\n";
+		pipeline = VK_NULL_HANDLE;
+	}
+
+	vkDestroyShaderModule(m_engine->m_device, pyramidShader, nullptr);
+
+	return pipeline;
+}
+
+VkPipeline DepthPyramid::swap_pipeline(VkPipeline pipeline) {
+	VkPipeline previous = m_pipeline;
+	m_pipeline = pipeline;
+	return previous;
+}
+
+void DepthPyramid::record_build(VkCommandBuffer cmd, VkImage depthImage) {
+	if (m_pipeline == VK_NULL_HANDLE) return;
+
+	//the culling of the last frame may still read the levels about to be written
+	VkImageMemoryBarrier depthRead = vkinit::image_barrier(depthImage, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+		VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL, VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+		VK_ACCESS_SHADER_READ_BIT, VK_IMAGE_ASPECT_DEPTH_BIT);
+
+	vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+		VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, nullptr, 0, nullptr, 1, &depthRead);
+
+	vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, m_pipeline);
+
+	VkExtent2D source = m_depthExtent;
+	for (uint32_t level = 0; level < m_levelCount; level++) {
+		VkExtent2D target = { std::max(m_extent.width >> level, 1u), std::max(m_extent.height >> level, 1u) };
+
+		DepthPyramidConstants constants;
+		constants.sourceSize = glm::uvec2(source.width, source.height);
+		constants.targetSize = glm::uvec2(target.width, target.height);
+
+		vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, m_pipelineLayout, 0, 1, &m_levelSets[level], 0, nullptr);
+		vkCmdPushConstants(cmd, m_pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(DepthPyramidConstants), &constants);
+		vkCmdDispatch(cmd, (target.width + 7) / 8, (target.height + 7) / 8, 1);
+
+		//the next level reads this one, and the culling reads them all
+		VkImageMemoryBarrier levelWritten = vkinit::image_barrier(m_image.m_image, VK_IMAGE_LAYOUT_GENERAL,
+			VK_IMAGE_LAYOUT_GENERAL, VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT, VK_IMAGE_ASPECT_COLOR_BIT);
+		levelWritten.subresourceRange.baseMipLevel = level;
+		levelWritten.subresourceRange.levelCount = 1;
+
+		vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,
+			0, nullptr, 0, nullptr, 1, &levelWritten);
+
+		source = target;
+	}
+
+	VkImageMemoryBarrier depthWrite = vkinit::image_barrier(depthImage, VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL,
+		VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL, VK_ACCESS_SHADER_READ_BIT,
+		VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT, VK_IMAGE_ASPECT_DEPTH_BIT);
+
+	vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+		VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT, 0,
+		0, nullptr, 0, nullptr, 1, &depthWrite);
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include "vk_types.h"
+
+#include <glm/glm.hpp>
+
+#include <vector>
+
+class VulkanEngine;
+
+struct DepthPyramidConstants {
+	glm::uvec2 sourceSize;
+	glm::uvec2 targetSize;
+};
+
+//mip chain of the depth image where every texel holds the farthest depth of the area it covers.
+//Level 0 is the depth size rounded down to powers of two, so every further level halves it exactly.
+//Bounds whose nearest depth lies behind the texels they cover are hidden by what was drawn
+class DepthPyramid {
+public:
+	void init(VulkanEngine* engine, VkImageView depthView, VkExtent2D depthExtent);
+	void cleanup();
+
+	//outside of a render pass, once a pass wrote the depth image. The depth image is expected in
+	//the depth attachment layout and is left in it, ready for the passes that keep drawing into it
+	void record_build(VkCommandBuffer cmd, VkImage depthImage);
+
+	//every level, in the general layout
+	VkImageView view() const { return m_view; }
+	VkSampler sampler() const { return m_sampler; }
+	VkExtent2D extent() const { return m_extent; }
+	uint32_t level_count() const { return m_levelCount; }
+
+	//compiles the compute shader again, safe from a worker. VK_NULL_HANDLE when it failed
+	VkPipeline build_pipeline() const;
+	//puts a rebuilt pipeline in place and returns the previous one, frames in flight may still use it
+	VkPipeline swap_pipeline(VkPipeline pipeline);
+
+private:
+	void init_pipeline();
+
+	VulkanEngine* m_engine{ nullptr };
+	VkExtent2D m_depthExtent{};
+	VkExtent2D m_extent{};
+	uint32_t m_levelCount{ 0 };
+
+	AllocatedImage m_image{};
+	VkImageView m_view{ VK_NULL_HANDLE };
+	//one view and one set per level, each reads the level before it and writes its own
+	std::vector<VkImageView> m_levelViews;
+	std::vector<VkDescriptorSet> m_levelSets;
+	VkSampler m_sampler{ VK_NULL_HANDLE };
+
+	VkDescriptorSetLayout m_setLayout{ VK_NULL_HANDLE };
+	VkPipelineLayout m_pipelineLayout{ VK_NULL_HANDLE };
+	VkPipeline m_pipeline{ VK_NULL_HANDLE };
+};
@@ -14,22 +14,18 @@
 #include <iostream>
 #include <fstream>
 #include <cmath>
+#include <algorithm>
+#include <cstring>
+#include <cfloat>
+#include <random>
 #include <glm/gtx/transform.hpp>
 #include "vk_pipeline.h"
 #include "vk_textures.h"
+#include <xxhash.h>
 #include <imgui.h>
 #include <imgui_impl_sdl.h>
 #include <imgui_impl_vulkan.h>
 
-#define VK_CHECK(x) \
-	do { \
-		VkResult err = x; \
-		if (err) { \
-			std::cout << "Detected Vulkan error: " << err << std::endl; \
-			abort(); \
-		} \
-	} while(0) \
-
 void VulkanEngine::init()
 {
 	// We initialize SDL and create a window with it. 
@@ -48,7 +44,21 @@ void VulkanEngine::init()
 
 	m_camera = Camera();
 
-	init_vulkan();
+	m_sceneParameters.fogColor = { 0.5f, 0.5f, 0.55f, 1.f };
+	m_sceneParameters.fogDistances = { 10.f, 60.f, 0.f, 0.f };
+	m_sceneParameters.ambientColor = { 0.05f, 0.05f, 0.06f, 1.f };
+	m_sceneParameters.sunlightDirection = glm::vec4(glm::normalize(glm::vec3(-0.3f, -1.f, -0.4f)), 0.f);
+	m_sceneParameters.sunlightColor = { 1.f, 0.95f, 0.85f, 0.3f };
+
+	//no device with the bindless features leaves the engine uninitialized, run and cleanup skip it
+	if (!init_vulkan()) {
+		SDL_DestroyWindow(_window);
+		return;
+	}
+
+	m_threadPool.init();
+
+	m_pipelineCache.init(m_device, m_gpuProperties, PIPELINE_CACHE_PATH, FRAME_OVERLAP);
 
 	init_swapchain();
 
@@ -61,14 +71,32 @@ void VulkanEngine::init()
 
 	init_descriptors();
 
+	//the scene sets read the light lists, so they point at them before anything is drawn
+	m_lighting.init(this, FRAME_OVERLAP);
+	for (int i = 0; i < FRAME_OVERLAP; i++) {
+		m_lighting.write_descriptors(i, m_frames[i].m_globalDescriptor, 2);
+	}
+
 	init_pipelines();
 
 	init_imgui();
 
+	m_textureStreamer.init(this, TEXTURE_STREAMING_BUDGET);
+
+	//streamed textures come and go the most, so theirs are the allocations that get compacted
+	m_defragmenter.add_source([this](std::vector<MovableAllocation>& movables) {
+		m_textureStreamer.collect_movable(movables);
+	});
+
+	m_depthPyramid.init(this, m_depthImageView, _windowExtent);
+	m_gpuCuller.init(this, GPU_CULL_MAX_OBJECTS, FRAME_OVERLAP, m_drawIndirectCount, m_multiDrawIndirect, m_depthPyramid);
+
 	load_images();
 
 	load_model();
 
+	init_lights();
+
 	//everything went fine
 	_isInitialized = true;
 }
@@ -80,6 +108,20 @@ void VulkanEngine::cleanup()
 			vkWaitForFences(m_device, 1, &frame.m_renderFence, true, 1000000);
 		}
 
+		//workers may still hand uploads to the transfer queue, so they stop first
+		m_threadPool.cleanup();
+		m_shaderReloader.cleanup();
+		//reloads that finished compiling are put in place, so their owners destroy them
+		update_pipeline_reloads();
+		m_transfer.cleanup();
+		m_defragmenter.cleanup();
+		m_textureStreamer.cleanup();
+		m_gpuCuller.cleanup();
+		m_depthPyramid.cleanup();
+		m_lighting.cleanup();
+		m_pipelineCompiler.cleanup();
+		m_pipelineCache.cleanup();
+
 		m_deletionQueue.flush();
 
 		vkDestroySurfaceKHR(m_instance, m_surface, nullptr);
@@ -91,12 +133,12 @@ void VulkanEngine::cleanup()
 	}
 }
 
-void VulkanEngine::init_vulkan() {
+bool VulkanEngine::init_vulkan() {
 	vkb::InstanceBuilder builder;
 
 	auto inst_ret = builder.set_app_name("Vulkan App")
 		.request_validation_layers(true)
-		.require_api_version(1, 1, 0)
+		.require_api_version(1, 2, 0)
 		.use_default_debug_messenger()
 		.build();
 
@@ -107,20 +149,78 @@ void VulkanEngine::init_vulkan() {
 
 	SDL_Vulkan_CreateSurface(_window, m_instance, &m_surface);
 
+	//the model textures live in a single partially bound array. the selector can't check 1.2 features,
+	//but the extension guarantees all of the ones that array needs, so devices without them are skipped
 	vkb::PhysicalDeviceSelector selector{ vkb_inst };
-	vkb::PhysicalDevice physicalDevice = selector
-		.set_minimum_version(1, 1)
+	auto physicalDeviceRet = selector
+		.set_minimum_version(1, 2)
 		.set_surface(m_surface)
-		.select()
-		.value();
+		.add_required_extension(VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME)
+		.add_desired_extension(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME)
+		.select();
+	if (!physicalDeviceRet.has_value()) {
+		std::cout << "No device supports the descriptor indexing needed for the bindless textures: "
+			<< physicalDeviceRet.error().message() << std::endl;
+		vkDestroySurfaceKHR(m_instance, m_surface, nullptr);
+		vkb::destroy_debug_utils_messenger(m_instance, m_debug_messenger);
+		vkDestroyInstance(m_instance, nullptr);
+		return false;
+	}
+	vkb::PhysicalDevice physicalDevice = physicalDeviceRet.value();
+
+	//indirect draws fall back to one call per command, or to a fixed count, where these are missing
+	VkPhysicalDeviceVulkan12Features supported12 = {};
+	supported12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+	supported12.pNext = nullptr;
+
+	VkPhysicalDeviceFeatures2 supported = {};
+	supported.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+	supported.pNext = &supported12;
+	vkGetPhysicalDeviceFeatures2(physicalDevice.physical_device, &supported);
+
+	m_drawIndirectCount = supported12.drawIndirectCount == VK_TRUE;
+
+	VkPhysicalDeviceVulkan12Properties properties12 = {};
+	properties12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_PROPERTIES;
+	properties12.pNext = nullptr;
+
+	VkPhysicalDeviceProperties2 properties = {};
+	properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+	properties.pNext = &properties12;
+	vkGetPhysicalDeviceProperties2(physicalDevice.physical_device, &properties);
+
+	m_bindlessTextureCount = std::min({ MAX_BINDLESS_TEXTURES,
+		properties12.maxDescriptorSetUpdateAfterBindSampledImages,
+		properties12.maxPerStageDescriptorUpdateAfterBindSampledImages });
+	m_multiDrawIndirect = supported.features.multiDrawIndirect == VK_TRUE;
+	physicalDevice.features.multiDrawIndirect = supported.features.multiDrawIndirect;
+
+	//the overdraw statistics come from a query kept active around the secondaries of the main pass
+	m_pipelineStatistics = supported.features.pipelineStatisticsQuery && supported.features.inheritedQueries;
+	physicalDevice.features.pipelineStatisticsQuery = supported.features.pipelineStatisticsQuery;
+	physicalDevice.features.inheritedQueries = supported.features.inheritedQueries;
 
 	vkb::DeviceBuilder deviceBuilder{ physicalDevice };
 
-	VkPhysicalDeviceShaderDrawParametersFeatures shader_draw_parameters_features = {};
-	shader_draw_parameters_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SHADER_DRAW_PARAMETERS_FEATURES;
-	shader_draw_parameters_features.pNext = nullptr;
-	shader_draw_parameters_features.shaderDrawParameters = VK_TRUE;
-	vkb::Device vkbDevice = deviceBuilder.add_pNext(&shader_draw_parameters_features).build().value();
+	VkPhysicalDeviceVulkan11Features vulkan11_features = {};
+	vulkan11_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_1_FEATURES;
+	vulkan11_features.pNext = nullptr;
+	vulkan11_features.shaderDrawParameters = VK_TRUE;
+
+	VkPhysicalDeviceVulkan12Features vulkan12_features = {};
+	vulkan12_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+	vulkan12_features.pNext = nullptr;
+	vulkan12_features.timelineSemaphore = VK_TRUE;
+	vulkan12_features.drawIndirectCount = supported12.drawIndirectCount;
+	vulkan12_features.descriptorIndexing = VK_TRUE;
+	vulkan12_features.runtimeDescriptorArray = VK_TRUE;
+	vulkan12_features.descriptorBindingPartiallyBound = VK_TRUE;
+	vulkan12_features.descriptorBindingSampledImageUpdateAfterBind = VK_TRUE;
+	vulkan12_features.shaderSampledImageArrayNonUniformIndexing = VK_TRUE;
+
+	vkb::Device vkbDevice = deviceBuilder.add_pNext(&vulkan11_features)
+		.add_pNext(&vulkan12_features)
+		.build().value();
 
 	m_device = vkbDevice.device;
 	m_chosenGPU = physicalDevice.physical_device;
@@ -128,15 +228,64 @@ void VulkanEngine::init_vulkan() {
 	m_graphicsQueue = vkbDevice.get_queue(vkb::QueueType::graphics).value();
 	m_graphicsQueueFamily = vkbDevice.get_queue_index(vkb::QueueType::graphics).value();
 
+	//prefer a transfer-only family, then any non graphics one. Single queue devices
+	//such as lavapipe upload through the graphics queue instead
+	auto dedicatedTransferQueue = vkbDevice.get_dedicated_queue(vkb::QueueType::transfer);
+	auto separateTransferQueue = vkbDevice.get_queue(vkb::QueueType::transfer);
+
+	if (dedicatedTransferQueue.has_value()) {
+		m_transferQueue = dedicatedTransferQueue.value();
+		m_transferQueueFamily = vkbDevice.get_dedicated_queue_index(vkb::QueueType::transfer).value();
+	} else if (separateTransferQueue.has_value()) {
+		m_transferQueue = separateTransferQueue.value();
+		m_transferQueueFamily = vkbDevice.get_queue_index(vkb::QueueType::transfer).value();
+	} else {
+		m_transferQueue = m_graphicsQueue;
+		m_transferQueueFamily = m_graphicsQueueFamily;
+	}
+
 	VmaAllocatorCreateInfo allocatorInfo{};
 	allocatorInfo.physicalDevice = m_chosenGPU;
 	allocatorInfo.device = m_device;
 	allocatorInfo.instance = m_instance;
+	allocatorInfo.vulkanApiVersion = VK_API_VERSION_1_2;
+
+	//without the budget extension VMA estimates the budget from the heap sizes and its own allocations
+	if (supports_device_extension(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME)) {
+		allocatorInfo.flags |= VMA_ALLOCATOR_CREATE_EXT_MEMORY_BUDGET_BIT;
+	} else {
+		std::cout << "VK_EXT_memory_budget is not supported, the VRAM budget is estimated" << std::endl;
+	}
 	vmaCreateAllocator(&allocatorInfo, &m_allocator);
 
+	m_residency.init(m_allocator, FRAME_OVERLAP, RESIDENCY_PRESSURE_THRESHOLD);
+	m_defragmenter.init(m_allocator, FRAME_OVERLAP);
+
+	m_geometry.init(m_allocator, GEOMETRY_ARENA_VERTICES, GEOMETRY_ARENA_INDICES);
+	m_deletionQueue.push_function([=]() {
+		m_geometry.cleanup();
+	});
+
 	m_gpuProperties = vkbDevice.physical_device.properties;
+	if (!m_drawIndirectCount) {
+		std::cout << "drawIndirectCount is not supported, culled draws are skipped with empty commands" << std::endl;
+	}
 	std::cout << "The GPU has a minimum buffer alignment of " <<
 		m_gpuProperties.limits.minUniformBufferOffsetAlignment << std::endl;
+	return true;
+}
+
+bool VulkanEngine::supports_device_extension(const char* name) {
+	uint32_t count = 0;
+	vkEnumerateDeviceExtensionProperties(m_chosenGPU, nullptr, &count, nullptr);
+
+	std::vector<VkExtensionProperties> extensions(count);
+	vkEnumerateDeviceExtensionProperties(m_chosenGPU, nullptr, &count, extensions.data());
+
+	for (VkExtensionProperties& extension : extensions) {
+		if (strcmp(extension.extensionName, name) == 0) return true;
+	}
+	return false;
 }
 
 void VulkanEngine::init_imgui() {
@@ -175,6 +324,7 @@ void VulkanEngine::init_imgui() {
 	init_info.Device = m_device;
 	init_info.Queue = m_graphicsQueue;
 	init_info.DescriptorPool = imguiPool;
+	init_info.PipelineCache = m_pipelineCache.handle();
 	init_info.MinImageCount = 3;
 	init_info.ImageCount = 3;
 	init_info.MSAASamples = VK_SAMPLE_COUNT_1_BIT;
@@ -230,7 +380,9 @@ void VulkanEngine::init_swapchain() {
 
 	m_depthFormat = VK_FORMAT_D32_SFLOAT;
 
-	VkImageCreateInfo dimg_info = vkinit::image_create_info(m_depthFormat, VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT, depthImageExtent);
+	//sampled by the depth pyramid build
+	VkImageCreateInfo dimg_info = vkinit::image_create_info(m_depthFormat,
+		VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, depthImageExtent);
 
 	VmaAllocationCreateInfo dimg_allocinfo = {};
 	dimg_allocinfo.usage = VMA_MEMORY_USAGE_GPU_ONLY;
@@ -261,7 +413,23 @@ void VulkanEngine::init_commands() {
 
 		VK_CHECK(vkAllocateCommandBuffers(m_device, &cmdAllocInfo, &m_frames[i].m_mainCommandBuffer));
 
+		//one slot for every worker plus the main thread, which takes chunks as well
+		m_frames[i].secondaryCommands.init(m_device, m_graphicsQueueFamily, m_threadPool.thread_count() + 1);
+
+		if (m_pipelineStatistics) {
+			VkQueryPoolCreateInfo queryInfo = {};
+			queryInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+			queryInfo.pNext = nullptr;
+			queryInfo.queryType = VK_QUERY_TYPE_PIPELINE_STATISTICS;
+			queryInfo.queryCount = 1;
+			queryInfo.pipelineStatistics = VK_QUERY_PIPELINE_STATISTIC_FRAGMENT_SHADER_INVOCATIONS_BIT;
+
+			VK_CHECK(vkCreateQueryPool(m_device, &queryInfo, nullptr, &m_frames[i].statisticsQuery));
+		}
+
 		m_deletionQueue.push_function([=]() {
+			if (m_frames[i].statisticsQuery != VK_NULL_HANDLE) vkDestroyQueryPool(m_device, m_frames[i].statisticsQuery, nullptr);
+			m_frames[i].secondaryCommands.cleanup();
 			vkDestroyCommandPool(m_device, m_frames[i].m_commandPool, nullptr);
 			});
 	}
@@ -275,6 +443,10 @@ void VulkanEngine::init_commands() {
 
 	VkCommandBufferAllocateInfo cmdAllocInfo = vkinit::command_buffer_allocate_info(m_uploadContext.commandPool, 1);
 	VK_CHECK(vkAllocateCommandBuffers(m_device, &cmdAllocInfo, &m_uploadContext.commandBuffer));
+
+	bool sharesGraphicsQueue = m_transferQueue == m_graphicsQueue;
+	m_transfer.init(m_device, m_transferQueue, m_transferQueueFamily, m_graphicsQueueFamily,
+		sharesGraphicsQueue ? &m_graphicsQueueMutex : nullptr);
 }
 
 void VulkanEngine::immediate_submit(std::function<void(VkCommandBuffer cmd)>&& function) {
@@ -289,7 +461,10 @@ void VulkanEngine::immediate_submit(std::function<void(VkCommandBuffer cmd)>&& f
 
 	VkSubmitInfo submit = vkinit::submit_info(&cmd);
 
-	VK_CHECK(vkQueueSubmit(m_graphicsQueue, 1, &submit, m_uploadContext.uploadFence));
+	{
+		std::lock_guard<std::mutex> queueLock(m_graphicsQueueMutex);
+		VK_CHECK(vkQueueSubmit(m_graphicsQueue, 1, &submit, m_uploadContext.uploadFence));
+	}
 
 	vkWaitForFences(m_device, 1, &m_uploadContext.uploadFence, true, 9999999999);
 	vkResetFences(m_device, 1, &m_uploadContext.uploadFence);
@@ -350,9 +525,10 @@ void VulkanEngine::init_default_renderpass() {
 	depth_dependency.srcSubpass = VK_SUBPASS_EXTERNAL;
 	depth_dependency.dstSubpass = 0;
 	depth_dependency.srcStageMask = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
-	depth_dependency.srcAccessMask = 0;
+	//covers the depth written by the prepass, the main passes must share it to stay compatible
+	depth_dependency.srcAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
 	depth_dependency.dstStageMask = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
-	depth_dependency.dstAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+	depth_dependency.dstAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
 
 	VkSubpassDependency dependencies[2] = { dependency, depth_dependency };
 
@@ -370,8 +546,47 @@ void VulkanEngine::init_default_renderpass() {
 
 	VK_CHECK(vkCreateRenderPass(m_device, &render_pass_info, nullptr, &m_renderPass));
 
+	//after the prepass the main pass keeps the depth it wrote, only load ops and layouts differ
+	attachments[1].loadOp = VK_ATTACHMENT_LOAD_OP_LOAD;
+	attachments[1].stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+	attachments[1].initialLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+
+	VK_CHECK(vkCreateRenderPass(m_device, &render_pass_info, nullptr, &m_depthLoadRenderPass));
+
+	VkAttachmentReference prepass_depth_ref{};
+	prepass_depth_ref.attachment = 0;
+	prepass_depth_ref.layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+
+	VkSubpassDescription prepass_subpass{};
+	prepass_subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+	prepass_subpass.colorAttachmentCount = 0;
+	prepass_subpass.pDepthStencilAttachment = &prepass_depth_ref;
+
+	VkRenderPassCreateInfo prepass_info{};
+	prepass_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+
+	prepass_info.attachmentCount = 1;
+	prepass_info.pAttachments = &depth_attachment;
+	prepass_info.subpassCount = 1;
+	prepass_info.pSubpasses = &prepass_subpass;
+	prepass_info.dependencyCount = 1;
+	prepass_info.pDependencies = &depth_dependency;
+
+	VK_CHECK(vkCreateRenderPass(m_device, &prepass_info, nullptr, &m_depthPrepassRenderPass));
+
+	VkAttachmentDescription prepass_load_attachment = depth_attachment;
+	prepass_load_attachment.loadOp = VK_ATTACHMENT_LOAD_OP_LOAD;
+	prepass_load_attachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+	prepass_load_attachment.initialLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+	prepass_info.pAttachments = &prepass_load_attachment;
+
+	VK_CHECK(vkCreateRenderPass(m_device, &prepass_info, nullptr, &m_depthPrepassLoadRenderPass));
+
 	m_deletionQueue.push_function([=]() {
 		vkDestroyRenderPass(m_device, m_renderPass, nullptr);
+		vkDestroyRenderPass(m_device, m_depthLoadRenderPass, nullptr);
+		vkDestroyRenderPass(m_device, m_depthPrepassRenderPass, nullptr);
+		vkDestroyRenderPass(m_device, m_depthPrepassLoadRenderPass, nullptr);
 		});
 }
 
@@ -404,6 +619,17 @@ void VulkanEngine::init_framebuffers() {
 			vkDestroyImageView(m_device, m_swapchainImageViews[i], nullptr);
 		});
 	}
+
+	//the prepass only touches the depth image, which every swapchain image shares
+	fb_info.renderPass = m_depthPrepassRenderPass;
+	fb_info.attachmentCount = 1;
+	fb_info.pAttachments = &m_depthImageView;
+
+	VK_CHECK(vkCreateFramebuffer(m_device, &fb_info, nullptr, &m_depthFramebuffer));
+
+	m_deletionQueue.push_function([=]() {
+		vkDestroyFramebuffer(m_device, m_depthFramebuffer, nullptr);
+	});
 }
 
 void VulkanEngine::init_sync_structures() {
@@ -439,40 +665,97 @@ void VulkanEngine::init_descriptors() {
 	std::vector<VkDescriptorPoolSize> sizes = {
 		{ VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 10},
 		{ VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, 10},
-		{ VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 10},
-		{ VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 10}
+		{ VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 48},
+		{ VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC, 10},
+		{ VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 32},
+		{ VK_DESCRIPTOR_TYPE_SAMPLER, 10},
+		{ VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE, 10},
+		{ VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 16}
 	};
 
 	VkDescriptorPoolCreateInfo pool_info = {};
 	pool_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
 	pool_info.flags = 0;
-	pool_info.maxSets = 10;
+	//the depth pyramid takes one set per level
+	pool_info.maxSets = 64;
 	pool_info.poolSizeCount = (uint32_t)sizes.size();
 	pool_info.pPoolSizes = sizes.data();
 
 	vkCreateDescriptorPool(m_device, &pool_info, nullptr, &m_descriptorPool);
 
+	std::vector<VkDescriptorPoolSize> bindlessSizes = {
+		{ VK_DESCRIPTOR_TYPE_SAMPLER, FRAME_OVERLAP },
+		{ VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE, FRAME_OVERLAP * m_bindlessTextureCount },
+		{ VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, FRAME_OVERLAP }
+	};
+
+	VkDescriptorPoolCreateInfo bindless_pool_info = {};
+	bindless_pool_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+	bindless_pool_info.flags = VK_DESCRIPTOR_POOL_CREATE_UPDATE_AFTER_BIND_BIT;
+	bindless_pool_info.maxSets = FRAME_OVERLAP;
+	bindless_pool_info.poolSizeCount = (uint32_t)bindlessSizes.size();
+	bindless_pool_info.pPoolSizes = bindlessSizes.data();
+
+	vkCreateDescriptorPool(m_device, &bindless_pool_info, nullptr, &m_bindlessPool);
+
 	VkDescriptorSetLayoutBinding cameraBind = vkinit::descriptorset_layout_binding(
-		VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+		VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
+		VK_SHADER_STAGE_VERTEX_BIT, 0);
+	VkDescriptorSetLayoutBinding sceneBind = vkinit::descriptorset_layout_binding(
+		VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
+		VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT, 1);
+	//lights, cluster ranges and light indices of the clustered lighting
+	VkDescriptorSetLayoutBinding lightBinds[3];
+	for (uint32_t i = 0; i < 3; i++) {
+		lightBinds[i] = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+			VK_SHADER_STAGE_FRAGMENT_BIT, 2 + i);
+	}
+	VkDescriptorSetLayoutBinding objectBind = vkinit::descriptorset_layout_binding(
+		VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC,
 		VK_SHADER_STAGE_VERTEX_BIT, 0);
 	VkDescriptorSetLayoutBinding textureBind = vkinit::descriptorset_layout_binding(
 		VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE,
-		VK_SHADER_STAGE_FRAGMENT_BIT, 1, 2);
+		VK_SHADER_STAGE_FRAGMENT_BIT, 1, m_bindlessTextureCount);
 	VkDescriptorSetLayoutBinding samplerBind = vkinit::descriptorset_layout_binding(
 		VK_DESCRIPTOR_TYPE_SAMPLER,
 		VK_SHADER_STAGE_FRAGMENT_BIT, 0);
+	VkDescriptorSetLayoutBinding materialBind = vkinit::descriptorset_layout_binding(
+		VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+		VK_SHADER_STAGE_FRAGMENT_BIT, 2);
+
+	VkDescriptorSetLayoutBinding modelFragBindings[] = { textureBind, samplerBind, materialBind };
 
-	VkDescriptorSetLayoutBinding modelFragBindings[] = { textureBind, samplerBind};
+	//slots of textures that aren't resident stay empty, views get written while earlier frames are recorded
+	VkDescriptorBindingFlags modelBindingFlags[] = {
+		VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT | VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT, 0, 0
+	};
 
-	VkDescriptorSetLayoutCreateInfo modelLayoutInfo = vkinit::descriptorset_layout_create_info(modelFragBindings, 2);
+	VkDescriptorSetLayoutBindingFlagsCreateInfo modelFlagsInfo = {};
+	modelFlagsInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO;
+	modelFlagsInfo.pNext = nullptr;
+	modelFlagsInfo.bindingCount = 3;
+	modelFlagsInfo.pBindingFlags = modelBindingFlags;
+
+	VkDescriptorSetLayoutCreateInfo modelLayoutInfo = vkinit::descriptorset_layout_create_info(modelFragBindings, 3);
+	modelLayoutInfo.pNext = &modelFlagsInfo;
+	modelLayoutInfo.flags = VK_DESCRIPTOR_SET_LAYOUT_CREATE_UPDATE_AFTER_BIND_POOL_BIT;
 	vkCreateDescriptorSetLayout(m_device, &modelLayoutInfo, nullptr, &m_textureSetLayout);
 
-	VkDescriptorSetLayoutCreateInfo modelVertexLayoutInfo = vkinit::descriptorset_layout_create_info(&cameraBind, 1);
-	vkCreateDescriptorSetLayout(m_device, &modelVertexLayoutInfo, nullptr, &m_sceneSetLayout);
+	VkDescriptorSetLayoutBinding sceneBindings[] = { cameraBind, sceneBind, lightBinds[0], lightBinds[1], lightBinds[2] };
+
+	VkDescriptorSetLayoutCreateInfo sceneLayoutInfo = vkinit::descriptorset_layout_create_info(sceneBindings, 5);
+	vkCreateDescriptorSetLayout(m_device, &sceneLayoutInfo, nullptr, &m_sceneSetLayout);
+
+	VkDescriptorSetLayoutCreateInfo objectLayoutInfo = vkinit::descriptorset_layout_create_info(&objectBind, 1);
+	vkCreateDescriptorSetLayout(m_device, &objectLayoutInfo, nullptr, &m_objectSetLayout);
+
+	//every dynamic slice is aligned to satisfy both uniform and storage offsets
+	VkDeviceSize frameAlignment = std::max(m_gpuProperties.limits.minUniformBufferOffsetAlignment,
+		m_gpuProperties.limits.minStorageBufferOffsetAlignment);
 
 	for (int i = 0; i < FRAME_OVERLAP; i++) {
-		m_frames[i].cameraBuffer = create_buffer(sizeof(GPUCameraData), 
-			VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU);
+		m_frames[i].dynamicData.init(m_allocator, FRAME_ALLOCATOR_SIZE, frameAlignment,
+			VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT);
 
 		VkDescriptorSetAllocateInfo allocInfo = {};
 		allocInfo.pNext = nullptr;
@@ -483,41 +766,183 @@ void VulkanEngine::init_descriptors() {
 
 		vkAllocateDescriptorSets(m_device, &allocInfo, &m_frames[i].m_globalDescriptor);
 
+		allocInfo.pSetLayouts = &m_objectSetLayout;
+		vkAllocateDescriptorSets(m_device, &allocInfo, &m_frames[i].objectDescriptor);
+
+		//the descriptors point at offset 0, the real slice is picked by the dynamic offsets
 		VkDescriptorBufferInfo cameraInfo;
-		cameraInfo.buffer = m_frames[i].cameraBuffer.m_buffer;
+		cameraInfo.buffer = m_frames[i].dynamicData.buffer();
 		cameraInfo.offset = 0;
 		cameraInfo.range = sizeof(GPUCameraData);
 
-		VkWriteDescriptorSet cameraWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
-			m_frames[i].m_globalDescriptor, &cameraInfo, 0);
-
-		vkUpdateDescriptorSets(m_device, 1, &cameraWrite, 0, nullptr);
+		VkDescriptorBufferInfo sceneInfo;
+		sceneInfo.buffer = m_frames[i].dynamicData.buffer();
+		sceneInfo.offset = 0;
+		sceneInfo.range = sizeof(GPUSceneData);
+
+		VkDescriptorBufferInfo objectInfo;
+		objectInfo.buffer = m_frames[i].dynamicData.buffer();
+		objectInfo.offset = 0;
+		objectInfo.range = VK_WHOLE_SIZE;
+
+		VkWriteDescriptorSet writes[] = {
+			vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
+				m_frames[i].m_globalDescriptor, &cameraInfo, 0),
+			vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
+				m_frames[i].m_globalDescriptor, &sceneInfo, 1),
+			vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC,
+				m_frames[i].objectDescriptor, &objectInfo, 0)
+		};
+
+		vkUpdateDescriptorSets(m_device, 3, writes, 0, nullptr);
 	}
 
 	m_deletionQueue.push_function([&]() {
 		vkDestroyDescriptorSetLayout(m_device, m_sceneSetLayout, nullptr);
+		vkDestroyDescriptorSetLayout(m_device, m_objectSetLayout, nullptr);
 		vkDestroyDescriptorSetLayout(m_device, m_textureSetLayout, nullptr);
 
 		vkDestroyDescriptorPool(m_device, m_descriptorPool, nullptr);
+		vkDestroyDescriptorPool(m_device, m_bindlessPool, nullptr);
 
 		for (int i = 0; i < FRAME_OVERLAP; i++) {
-			vmaDestroyBuffer(m_allocator, m_frames[i].cameraBuffer.m_buffer, m_frames[i].cameraBuffer.m_allocation);
+			m_frames[i].dynamicData.cleanup();
 		}
 	});
 }
 
 void VulkanEngine::init_pipelines() {
+	VkPipelineLayoutCreateInfo pipeline_layout_info = vkinit::pipeline_layout_create_info();
+
+	VkDescriptorSetLayout setLayouts[] = { m_sceneSetLayout, m_textureSetLayout };
+	pipeline_layout_info.setLayoutCount = 2;
+	pipeline_layout_info.pSetLayouts = setLayouts;
+
+	VK_CHECK(vkCreatePipelineLayout(m_device, &pipeline_layout_info, nullptr, &m_pipelineLayout));
+
+	m_pipelineCompiler.init(m_device, &m_threadPool);
+
+	//the fallback is a flat color, cheap enough to compile before the first frame
+	m_fallbackPipeline = build_model_pipeline("../../shaders/model_lighting.vert.spv", "../../shaders/fallback.frag.spv");
+
+	m_modelPermutations.init({ "diffuse", "specular", "fog", "alpha_test", "lighting" });
+	m_modelPrepassPermutations.init(m_modelPermutations.features());
+	m_modelFeatures = m_modelPermutations.feature_bit("diffuse") | m_modelPermutations.feature_bit("specular")
+		| m_modelPermutations.feature_bit("lighting");
+	m_modelPipeline = request_model_pipeline(m_modelFeatures);
+
+	//every shader the engine loads is watched, the triangle and *_lit sources in the directory are not used
+	m_shaderReloader.init(SHADER_DIRECTORY, GLSL_VALIDATOR_PATH, &m_threadPool);
+
+	//dropping the permutations makes draw_model request them again, the current one draws until the new one compiled
+	auto reload_model = [this]() {
+		for (PipelineHandle handle : m_modelPermutations.invalidate()) m_stalePipelines.push_back(handle);
+		for (PipelineHandle handle : m_modelPrepassPermutations.invalidate()) m_stalePipelines.push_back(handle);
+	};
+	m_shaderReloader.watch("model_lighting.vert", reload_model);
+	m_shaderReloader.watch("model_lighting.frag", reload_model);
+
+	//the previous fallback keeps drawing until the new one compiled
+	auto reload_fallback = [this]() {
+		reload_pipeline([this]() {
+			return build_model_pipeline("../../shaders/model_lighting.vert.spv", "../../shaders/fallback.frag.spv");
+		}, [this](VkPipeline fallback) {
+			m_pipelineCache.release(m_fallbackPipeline);
+			m_fallbackPipeline = fallback;
+		});
+	};
+	m_shaderReloader.watch("model_lighting.vert", reload_fallback);
+	m_shaderReloader.watch("fallback.frag", reload_fallback);
+
+	//depth only, so it builds as fast as the fallback
+	m_depthPipeline = build_depth_pipeline();
+	m_shaderReloader.watch("depth_only.vert", [this]() {
+		reload_pipeline([this]() { return build_depth_pipeline(); }, [this](VkPipeline depth) {
+			m_pipelineCache.release(m_depthPipeline);
+			m_depthPipeline = depth;
+		});
+	});
+
+	//the compute pipelines belong to their passes, the cache only delays destroying the replaced ones
+	m_shaderReloader.watch("cluster_lights.comp", [this]() {
+		reload_pipeline([this]() { return m_lighting.build_pipeline(); },
+			[this](VkPipeline pipeline) { m_pipelineCache.retire(m_lighting.swap_pipeline(pipeline)); });
+	});
+	m_shaderReloader.watch("indirect_cull.comp", [this]() {
+		reload_pipeline([this]() { return m_gpuCuller.build_pipeline(); },
+			[this](VkPipeline pipeline) { m_pipelineCache.retire(m_gpuCuller.swap_pipeline(pipeline)); });
+	});
+	m_shaderReloader.watch("depth_pyramid.comp", [this]() {
+		reload_pipeline([this]() { return m_depthPyramid.build_pipeline(); },
+			[this](VkPipeline pipeline) { m_pipelineCache.retire(m_depthPyramid.swap_pipeline(pipeline)); });
+	});
+
+	//the pipelines themselves belong to the pipeline cache
+	m_deletionQueue.push_function([=]() {
+		vkDestroyPipelineLayout(m_device, m_pipelineLayout, nullptr);
+	});
+}
+
+void VulkanEngine::reload_pipeline(std::function<VkPipeline()>&& build, std::function<void(VkPipeline)>&& swap) {
+	PipelineReload reload;
+	reload.handle = m_pipelineCompiler.submit(std::move(build));
+	reload.swap = std::move(swap);
+	m_pipelineReloads.push_back(std::move(reload));
+}
+
+void VulkanEngine::update_pipeline_reloads() {
+	//reloads swap in the order they were started, so an older compile never replaces a newer one
+	size_t swapped = 0;
+	for (; swapped < m_pipelineReloads.size(); swapped++) {
+		PipelineReload& reload = m_pipelineReloads[swapped];
+
+		VkPipeline pipeline = m_pipelineCompiler.get(reload.handle);
+		if (pipeline != VK_NULL_HANDLE) {
+			reload.swap(pipeline);
+		} else if (!m_pipelineCompiler.failed(reload.handle)) {
+			break;
+		}
+	}
+	m_pipelineReloads.erase(m_pipelineReloads.begin(), m_pipelineReloads.begin() + swapped);
+
+	//the permutation draw_model still falls back to stays until its replacement took over
+	auto released = std::remove_if(m_stalePipelines.begin(), m_stalePipelines.end(), [this](PipelineHandle handle) {
+		if (handle == m_modelPipeline || handle == m_modelPrepassPipeline) return false;
+
+		VkPipeline pipeline = m_pipelineCompiler.get(handle);
+		if (pipeline != VK_NULL_HANDLE) m_pipelineCache.release(pipeline);
+		return pipeline != VK_NULL_HANDLE || m_pipelineCompiler.failed(handle);
+	});
+	m_stalePipelines.erase(released, m_stalePipelines.end());
+}
+
+PipelineHandle VulkanEngine::request_model_pipeline(uint32_t features, bool afterPrepass) {
+	ShaderPermutations& permutations = afterPrepass ? m_modelPrepassPermutations : m_modelPermutations;
+
+	return permutations.get(features, [this, &permutations, afterPrepass](uint32_t permutation) {
+		SpecializationConstants constants = permutations.specialization(permutation);
+
+		return m_pipelineCompiler.submit([this, constants, afterPrepass]() {
+			return build_model_pipeline("../../shaders/model_lighting.vert.spv",
+				"../../shaders/model_lighting.frag.spv", constants, afterPrepass);
+		});
+	});
+}
+
+VkPipeline VulkanEngine::build_model_pipeline(const char* vertexPath, const char* fragmentPath,
+	SpecializationConstants fragmentConstants, bool afterPrepass)
+{
+	uint64_t vertexHash, fragmentHash;
 	VkShaderModule modelFragShader;
-	if (!load_shader_module("../../shaders/model_lighting.frag.spv", &modelFragShader)) {
-		std::cout << "Error when building the model lighting frag shader" << std::endl;
-	} else {
-		std::cout << "Model Lighting frag shader successfully loaded" << std::endl;
+	if (!load_shader_module(fragmentPath, &modelFragShader, &fragmentHash)) {
+		std::cout << "Error when building the " << fragmentPath << " shader" << std::endl;
+		return VK_NULL_HANDLE;
 	}
 	VkShaderModule modelVertexShader;
-	if (!load_shader_module("../../shaders/model_lighting.vert.spv", &modelVertexShader)) {
-		std::cout << "Error when building the model lighting vertex shader" << std::endl;
-	} else {
-		std::cout << "Model Lighting vertex shader successfully loaded" << std::endl;
+	if (!load_shader_module(vertexPath, &modelVertexShader, &vertexHash)) {
+		std::cout << "Error when building the " << vertexPath << " shader" << std::endl;
+		vkDestroyShaderModule(m_device, modelFragShader, nullptr);
+		return VK_NULL_HANDLE;
 	}
 
 	PipelineBuilder pipelineBuilder;
@@ -527,51 +952,77 @@ void VulkanEngine::init_pipelines() {
 	pipelineBuilder.m_shaderStages.push_back(
 		vkinit::pipeline_shader_stage_create_info(VK_SHADER_STAGE_FRAGMENT_BIT, modelFragShader)
 	);
+	pipelineBuilder.m_shaderStages.back().pSpecializationInfo = fragmentConstants.info();
+	pipelineBuilder.m_shaderHashes = { vertexHash, fragmentHash };
 
-	VkPipelineLayoutCreateInfo pipeline_layout_info = vkinit::pipeline_layout_create_info();
+	pipelineBuilder.m_pipelineLayout = m_pipelineLayout;
+	pipelineBuilder.m_vertexInputInfo = vkinit::vertex_input_state_create_info();
+	pipelineBuilder.m_inputAssembly = vkinit::input_assembly_create_info(VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST);
 
-	VkDescriptorSetLayout setLayouts[] = { m_sceneSetLayout, m_textureSetLayout };
-	pipeline_layout_info.setLayoutCount = 2;
-	pipeline_layout_info.pSetLayouts = setLayouts;
+	pipelineBuilder.m_rasterizer = vkinit::rasterization_state_create_info(VK_POLYGON_MODE_FILL);
+	pipelineBuilder.m_multisampling = vkinit::multisampling_state_create_info();
+	pipelineBuilder.m_colorBlendAttachment = vkinit::color_blend_attachment_state();
 
-	VK_CHECK(vkCreatePipelineLayout(m_device, &pipeline_layout_info, nullptr, &m_pipelineLayout));
+	//the prepass already holds the closest depth, so only the fragments matching it get shaded
+	if (afterPrepass) {
+		pipelineBuilder.m_depthStencil = vkinit::depth_stencil_create_info(true, false, VK_COMPARE_OP_EQUAL);
+	} else {
+		pipelineBuilder.m_depthStencil = vkinit::depth_stencil_create_info(true, true, VK_COMPARE_OP_LESS_OR_EQUAL);
+	}
+
+	VertexInputDescription vertexDescription = Vertex::get_vertex_description();
+	pipelineBuilder.m_vertexInputInfo.pVertexAttributeDescriptions = vertexDescription.attributes.data();
+	pipelineBuilder.m_vertexInputInfo.vertexAttributeDescriptionCount = vertexDescription.attributes.size();
+
+	pipelineBuilder.m_vertexInputInfo.pVertexBindingDescriptions = vertexDescription.bindings.data();
+	pipelineBuilder.m_vertexInputInfo.vertexBindingDescriptionCount = vertexDescription.bindings.size();
+
+	//materials built from the same shaders and state get the same pipeline back
+	VkPipeline pipeline = m_pipelineCache.get_pipeline(pipelineBuilder, m_renderPass);
+
+	vkDestroyShaderModule(m_device, modelVertexShader, nullptr);
+	vkDestroyShaderModule(m_device, modelFragShader, nullptr);
+
+	return pipeline;
+}
+
+VkPipeline VulkanEngine::build_depth_pipeline() {
+	uint64_t vertexHash;
+	VkShaderModule depthVertexShader;
+	if (!load_shader_module("../../shaders/depth_only.vert.spv", &depthVertexShader, &vertexHash)) {
+		std::cout << "Error when building the depth prepass shader" << std::endl;
+		return VK_NULL_HANDLE;
+	}
+
+	PipelineBuilder pipelineBuilder;
+	pipelineBuilder.m_shaderStages.push_back(
+		vkinit::pipeline_shader_stage_create_info(VK_SHADER_STAGE_VERTEX_BIT, depthVertexShader)
+	);
+	pipelineBuilder.m_shaderHashes = { vertexHash };
 
 	pipelineBuilder.m_pipelineLayout = m_pipelineLayout;
 	pipelineBuilder.m_vertexInputInfo = vkinit::vertex_input_state_create_info();
 	pipelineBuilder.m_inputAssembly = vkinit::input_assembly_create_info(VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST);
 
-	pipelineBuilder.m_viewport.x = 0.0f;
-	pipelineBuilder.m_viewport.y = 0.0f;
-	pipelineBuilder.m_viewport.width = (float)_windowExtent.width;
-	pipelineBuilder.m_viewport.height = (float)_windowExtent.height;
-	pipelineBuilder.m_viewport.minDepth = 0.0f;
-	pipelineBuilder.m_viewport.maxDepth = 1.0f;
-
-	pipelineBuilder.m_scissor.offset = { 0, 0 };
-	pipelineBuilder.m_scissor.extent = _windowExtent;
-
 	pipelineBuilder.m_rasterizer = vkinit::rasterization_state_create_info(VK_POLYGON_MODE_FILL);
 	pipelineBuilder.m_multisampling = vkinit::multisampling_state_create_info();
 	pipelineBuilder.m_colorBlendAttachment = vkinit::color_blend_attachment_state();
+	pipelineBuilder.m_colorAttachmentCount = 0;
 
 	pipelineBuilder.m_depthStencil = vkinit::depth_stencil_create_info(true, true, VK_COMPARE_OP_LESS_OR_EQUAL);
 
-	VertexInputDescription vertexDescription = Vertex::get_vertex_description();
+	VertexInputDescription vertexDescription = Vertex::get_position_description();
 	pipelineBuilder.m_vertexInputInfo.pVertexAttributeDescriptions = vertexDescription.attributes.data();
 	pipelineBuilder.m_vertexInputInfo.vertexAttributeDescriptionCount = vertexDescription.attributes.size();
 
 	pipelineBuilder.m_vertexInputInfo.pVertexBindingDescriptions = vertexDescription.bindings.data();
 	pipelineBuilder.m_vertexInputInfo.vertexBindingDescriptionCount = vertexDescription.bindings.size();
 
-	m_pipeline = pipelineBuilder.build_pipeline(m_device, m_renderPass);
+	VkPipeline pipeline = m_pipelineCache.get_pipeline(pipelineBuilder, m_depthPrepassRenderPass);
 
-	vkDestroyShaderModule(m_device, modelVertexShader, nullptr);
-	vkDestroyShaderModule(m_device, modelFragShader, nullptr);
+	vkDestroyShaderModule(m_device, depthVertexShader, nullptr);
 
-	m_deletionQueue.push_function([=]() {
-		vkDestroyPipeline(m_device, m_pipeline, nullptr);
-		vkDestroyPipelineLayout(m_device, m_pipelineLayout, nullptr);
-	});
+	return pipeline;
 }
 
 void VulkanEngine::init_scene() {
@@ -624,97 +1075,455 @@ void VulkanEngine::init_scene() {
 	vkUpdateDescriptorSets(m_device, 1, &texture1, 0, nullptr);
 }
 
-void VulkanEngine::draw_model(VkCommandBuffer cmd) {
-	glm::mat4 projection = glm::perspective(glm::radians(70.f), 1700.f / 900.f, 0.1f, 200.0f);
-	projection[1][1] *= -1;
+void VulkanEngine::cull_model() {
+	m_culler.cull(m_frustum, m_modelBounds, m_threadPool, m_visible);
 
-	GPUCameraData camData;
-	camData.proj = projection;
-	camData.view = m_camera.getViewMatrix();
-	camData.viewproj = projection * camData.view;
+	//the compute pass tests occlusion on its own, this only saves the cpu path from recording hidden draws
+	if (!m_gpuCulling && m_cpuOcclusionCulling) {
+		//an occluder that can't be drawn yet must not hide what is behind it
+		for (size_t id = 0; id < m_occluderMeshes.size(); id++) {
+			const Mesh& mesh = m_importedModel.m_meshes[m_occluderMeshes[id]];
+			m_occlusionRasterizer.set_enabled((uint32_t)id, mesh.m_resident && mesh_textures_resident(mesh));
+		}
 
-	void* data;
-	vmaMapMemory(m_allocator, get_current_frame().cameraBuffer.m_allocation, &data);
-	memcpy(data, &camData, sizeof(GPUCameraData));
-	vmaUnmapMemory(m_allocator, get_current_frame().cameraBuffer.m_allocation);
+		m_occlusionRasterizer.render(m_viewproj, m_threadPool);
+		m_occlusionRasterizer.cull(m_modelBounds, m_threadPool, m_visible);
+	}
 
-	vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipeline);
+	//culled meshes request no texture levels either, so the streamer can let them go.
+	//The feedback stays on this thread, the resident meshes are compacted into the draw list
+	size_t drawCount = 0;
+	for (uint32_t index : m_visible) {
+		Mesh& mesh = m_importedModel.m_meshes[index];
 
-	vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipelineLayout,
-		1, 1, &m_textureDescriptorSet, 0, nullptr);
-	vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipelineLayout,
-		0, 1, &get_current_frame().m_globalDescriptor, 0, nullptr);
+		//evicted meshes start uploading again here and show up once they are back
+		m_residency.touch(mesh.m_residencyId);
+		if (!mesh.m_resident) continue;
 
-	for (Mesh& mesh : m_importedModel.m_meshes) {
-		VkDeviceSize offset = 0;
-		vkCmdBindVertexBuffers(cmd, 0, 1, &mesh.m_vertexBuffer.m_buffer, &offset);
-		vkCmdBindIndexBuffer(cmd, mesh.m_indicesBuffer.m_buffer, 0, VK_INDEX_TYPE_UINT32);
+		//the array is partially bound, so meshes wait until the mip tails of their own textures arrived
+		bool texturesResident = mesh_textures_resident(mesh);
 
-		vkCmdDrawIndexed(cmd, mesh.m_indices.size(), 1, 0, 0, 0);
+		//the model is drawn without a transform, so its bounds are already in world space
+		float size = screen_size(mesh.m_boundsOrigin, mesh.m_boundsRadius);
+		for (Texture& texture : mesh.m_textures) {
+			m_residency.touch(texture.residencyId);
+			m_textureStreamer.request(texture.streamId, size);
+		}
+
+		if (texturesResident) m_visible[drawCount++] = index;
+	}
+	m_visible.resize(drawCount);
+
+	//the geometry and the textures are bound once, so the pipeline is the only state that changes between draws.
+	//Meshes of the classes the prepass takes go first, the main pass tests them for equal depth.
+	//Inside each pipeline the meshes go near to far, so early depth testing rejects more of what follows
+	bool prepass = depth_prepass_active();
+	m_prepassCount = 0;
+	m_renderQueue.clear();
+	for (uint32_t index : m_visible) {
+		const Mesh& mesh = m_importedModel.m_meshes[index];
+		bool prepassMesh = prepass && m_prepassClasses[(size_t)mesh.m_class];
+		if (prepassMesh) m_prepassCount++;
+
+		float depth = glm::distance(m_camera.position, mesh.m_boundsOrigin);
+		m_renderQueue.push(RenderQueue::opaque_key(prepassMesh ? 0 : 1, 0, 0, depth), index);
+	}
+
+	m_renderQueue.sort(m_threadPool);
+
+	const std::vector<RenderItem>& items = m_renderQueue.items();
+	for (size_t i = 0; i < items.size(); i++) {
+		m_visible[i] = items[i].index;
+	}
+
+	//the visible meshes become indirect commands, every chunk the workers record is then a single call.
+	//Without multi draw indirect each command would still be its own call, so the draws stay direct
+	FrameData& frame = get_current_frame();
+	VkDrawIndexedIndirectCommand* commands = nullptr;
+	if (!m_gpuCulling && m_multiDrawIndirect && !m_visible.empty()) {
+		commands = frame.dynamicData.allocate<VkDrawIndexedIndirectCommand>(frame.modelDrawOffset, m_visible.size());
+	}
+	frame.modelDrawsWritten = commands != nullptr;
+
+	if (commands) {
+		for (size_t i = 0; i < m_visible.size(); i++) {
+			//the mesh index doubles as the material index
+			const Mesh& mesh = m_importedModel.m_meshes[m_visible[i]];
+			commands[i].indexCount = mesh.m_indexCount;
+			commands[i].instanceCount = 1;
+			commands[i].firstIndex = mesh.m_firstIndex;
+			commands[i].vertexOffset = (int32_t)mesh.m_vertexOffset;
+			commands[i].firstInstance = m_visible[i];
+		}
 	}
 }
 
-void VulkanEngine::draw_objects(VkCommandBuffer cmd, RenderObject* first, int count) {
-	glm::vec3 camPos = { 0.f,-6.f,-10.f };
+bool VulkanEngine::model_textures_resident() {
+	//the compute pass only knows about mesh residency, so its draws wait for every mip tail
+	for (Texture& texture : m_importedModel.m_textures_loaded) {
+		if (!m_textureStreamer.is_resident(texture.streamId)) return false;
+	}
+	return true;
+}
+
+bool VulkanEngine::mesh_textures_resident(const Mesh& mesh) {
+	for (const Texture& texture : mesh.m_textures) {
+		if (!m_textureStreamer.is_resident(texture.streamId)) return false;
+	}
+	return true;
+}
+
+bool VulkanEngine::depth_prepass_active() {
+	//the depth only shader doesn't discard, alpha tested meshes would hide what shows through them
+	bool alphaTest = (m_modelFeatures & m_modelPermutations.feature_bit("alpha_test")) != 0;
+	return m_depthPrepass && m_depthPipeline != VK_NULL_HANDLE && !alphaTest;
+}
+
+void VulkanEngine::draw_depth_prepass(CullPhase phase) {
+	FrameData& frame = get_current_frame();
+	uint32_t globalOffsets[] = { frame.cameraOffset, frame.sceneOffset };
+
+	auto bind_depth = [&](VkCommandBuffer cmd) {
+		vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, m_depthPipeline);
+		set_viewport(cmd);
+
+		vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipelineLayout,
+			0, 1, &frame.m_globalDescriptor, 2, globalOffsets);
+
+		//the compact position stream is all the prepass reads
+		m_geometry.bind_positions(cmd);
+	};
+
+	//the indirect commands cover every object, so the classes only apply to the cpu path
+	if (m_gpuCulling) {
+		if (!model_textures_resident()) return;
+
+		frame.secondaryCommands.record(m_threadPool, 1, 1, [&](VkCommandBuffer cmd, size_t, size_t) {
+			bind_depth(cmd);
+			m_gpuCuller.record_draws(cmd, _frameNumber % FRAME_OVERLAP, phase);
+		});
+		return;
+	}
+
+	//occlusion culling only runs on the gpu, the cpu list is drawn whole in the early phase
+	if (phase == CullPhase::Late) return;
+
+	frame.secondaryCommands.record(m_threadPool, m_prepassCount, SECONDARY_RECORD_CHUNK,
+		[&](VkCommandBuffer cmd, size_t begin, size_t end) {
+		bind_depth(cmd);
+		draw_visible_meshes(cmd, begin, end);
+	});
+}
+
+void VulkanEngine::draw_model() {
+	FrameData& frame = get_current_frame();
+	uint32_t globalOffsets[] = { frame.cameraOffset, frame.sceneOffset };
+
+	if (frame.textureGeneration != m_textureStreamer.generation()) write_texture_descriptors(frame);
+
+	//switching features requests the permutation, the previous one draws until it compiled
+	PipelineHandle wantedPipeline = request_model_pipeline(m_modelFeatures);
+	VkPipeline pipeline = m_pipelineCompiler.get(wantedPipeline);
+	if (pipeline != VK_NULL_HANDLE) {
+		m_modelPipeline = wantedPipeline;
+	} else {
+		pipeline = m_pipelineCompiler.get(m_modelPipeline);
+	}
+	if (pipeline == VK_NULL_HANDLE) pipeline = m_fallbackPipeline;
+
+	//depth written again with the same value still passes, so the regular pipeline stands in while the equal one compiles
+	bool prepass = depth_prepass_active();
+	VkPipeline prepassPipeline = pipeline;
+	if (prepass) {
+		PipelineHandle wantedPrepassPipeline = request_model_pipeline(m_modelFeatures, true);
+		VkPipeline ready = m_pipelineCompiler.get(wantedPrepassPipeline);
+		if (ready != VK_NULL_HANDLE) {
+			m_modelPrepassPipeline = wantedPrepassPipeline;
+		} else {
+			ready = m_pipelineCompiler.get(m_modelPrepassPipeline);
+		}
+		if (ready != VK_NULL_HANDLE) prepassPipeline = ready;
+	}
+
+	//secondaries inherit nothing but the render pass, so every chunk binds the state again
+	auto bind_model = [&](VkCommandBuffer cmd, VkPipeline boundPipeline) {
+		vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, boundPipeline);
+		set_viewport(cmd);
+
+		vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipelineLayout,
+			1, 1, &frame.textureDescriptor, 0, nullptr);
+		vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipelineLayout,
+			0, 1, &frame.m_globalDescriptor, 2, globalOffsets);
 
-	glm::mat4 view = glm::translate(glm::mat4(1.f), camPos);
-	//camera projection
-	glm::mat4 projection = glm::perspective(glm::radians(70.f), 1700.f / 900.f, 0.1f, 200.0f);
+		//every mesh lives in the arena, so the geometry is bound once
+		m_geometry.bind(cmd);
+	};
+
+	if (m_gpuCulling) {
+		if (!model_textures_resident()) return;
+
+		frame.secondaryCommands.record(m_threadPool, 1, 1, [&](VkCommandBuffer cmd, size_t, size_t) {
+			bind_model(cmd, prepass ? prepassPipeline : pipeline);
+			m_gpuCuller.record_draws(cmd, _frameNumber % FRAME_OVERLAP, CullPhase::Early);
+			m_gpuCuller.record_draws(cmd, _frameNumber % FRAME_OVERLAP, CullPhase::Late);
+		});
+		return;
+	}
+
+	frame.secondaryCommands.record(m_threadPool, m_prepassCount, SECONDARY_RECORD_CHUNK,
+		[&](VkCommandBuffer cmd, size_t begin, size_t end) {
+		bind_model(cmd, prepassPipeline);
+		draw_visible_meshes(cmd, begin, end);
+	});
+
+	frame.secondaryCommands.record(m_threadPool, m_visible.size() - m_prepassCount, SECONDARY_RECORD_CHUNK,
+		[&](VkCommandBuffer cmd, size_t begin, size_t end) {
+		bind_model(cmd, pipeline);
+		draw_visible_meshes(cmd, m_prepassCount + begin, m_prepassCount + end);
+	});
+}
+
+void VulkanEngine::draw_visible_meshes(VkCommandBuffer cmd, size_t begin, size_t end) {
+	if (begin >= end) return;
+
+	FrameData& frame = get_current_frame();
+	if (frame.modelDrawsWritten) {
+		VkDeviceSize offset = frame.modelDrawOffset + begin * sizeof(VkDrawIndexedIndirectCommand);
+		vkCmdDrawIndexedIndirect(cmd, frame.dynamicData.buffer(), offset, (uint32_t)(end - begin),
+			sizeof(VkDrawIndexedIndirectCommand));
+		return;
+	}
+
+	for (size_t i = begin; i < end; i++) {
+		//the mesh index doubles as the material index
+		const Mesh& mesh = m_importedModel.m_meshes[m_visible[i]];
+		vkCmdDrawIndexed(cmd, mesh.m_indexCount, 1, mesh.m_firstIndex, mesh.m_vertexOffset, m_visible[i]);
+	}
+}
+
+void VulkanEngine::set_viewport(VkCommandBuffer cmd) {
+	VkViewport viewport;
+	viewport.x = 0.0f;
+	viewport.y = 0.0f;
+	viewport.width = (float)_windowExtent.width;
+	viewport.height = (float)_windowExtent.height;
+	viewport.minDepth = 0.0f;
+	viewport.maxDepth = 1.0f;
+
+	VkRect2D scissor;
+	scissor.offset = { 0, 0 };
+	scissor.extent = _windowExtent;
+
+	vkCmdSetViewport(cmd, 0, 1, &viewport);
+	vkCmdSetScissor(cmd, 0, 1, &scissor);
+}
+
+void VulkanEngine::write_texture_descriptors(FrameData& frame) {
+	std::vector<VkDescriptorImageInfo> textureImageInfo;
+	std::vector<VkWriteDescriptorSet> textureWrites;
+	textureImageInfo.reserve(m_importedModel.m_textures_loaded.size());
+
+	//only resident textures get a view, the draws skip meshes sampling the others
+	for (Texture& texture : m_importedModel.m_textures_loaded) {
+		VkImageView view = m_textureStreamer.view(texture.streamId);
+		if (view == VK_NULL_HANDLE || texture.bindlessIndex == ~0u) continue;
+
+		VkDescriptorImageInfo imageInfo = {};
+		imageInfo.sampler = nullptr;
+		imageInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+		imageInfo.imageView = view;
+		textureImageInfo.push_back(imageInfo);
+
+		VkWriteDescriptorSet textureWrite = vkinit::write_descriptor_image(
+			VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE,
+			frame.textureDescriptor,
+			&textureImageInfo.back(),
+			1
+		);
+		textureWrite.dstArrayElement = texture.bindlessIndex;
+		textureWrites.push_back(textureWrite);
+	}
+
+	vkUpdateDescriptorSets(m_device, (uint32_t)textureWrites.size(), textureWrites.data(), 0, nullptr);
+
+	frame.textureGeneration = m_textureStreamer.generation();
+}
+
+float VulkanEngine::screen_size(const glm::vec3& center, float radius) {
+	float distance = glm::length(center - m_camera.position);
+	float screenHeight = (float)_windowExtent.height;
+
+	//from inside the bounds the object covers the whole screen
+	if (distance <= radius) return screenHeight;
+
+	//projected diameter with the same 70 degree vertical fov as the camera projection
+	return std::min(radius / (distance * std::tan(glm::radians(70.f) / 2.f)), 1.f) * screenHeight;
+}
+
+void VulkanEngine::update_frame_data() {
+	FrameData& frame = get_current_frame();
+
+	glm::mat4 projection = glm::perspective(glm::radians(70.f), 1700.f / 900.f, CAMERA_NEAR, CAMERA_FAR);
 	projection[1][1] *= -1;
 
-	GPUCameraData camData;
-	camData.proj = projection;
-	camData.view = m_camera.getViewMatrix();
-	camData.viewproj = projection * camData.view;
+	glm::mat4 view = m_camera.getViewMatrix();
+	glm::mat4 viewproj = projection * view;
 
-	void* data;
-	vmaMapMemory(m_allocator, get_current_frame().cameraBuffer.m_allocation, &data);
-	memcpy(data, &camData, sizeof(GPUCameraData));
-	vmaUnmapMemory(m_allocator, get_current_frame().cameraBuffer.m_allocation);
+	GPUCameraData* camData = frame.dynamicData.allocate<GPUCameraData>(frame.cameraOffset);
+	camData->proj = projection;
+	camData->view = view;
+	camData->viewproj = viewproj;
 
-	float framed = _frameNumber / 120.f;
-	m_sceneParameters.ambientColor = { sin(framed), 0, cos(framed), 1 };
+	m_viewproj = viewproj;
+	m_view = view;
+	m_projection = projection;
+	m_frustum = vkutil::extract_frustum(viewproj);
 
-	char* sceneData;
-	vmaMapMemory(m_allocator, m_sceneParameterBuffer.m_allocation, (void**)&sceneData);
+	m_sceneParameters.clusterScale = ClusteredLighting::cluster_scale(_windowExtent, CAMERA_NEAR, CAMERA_FAR);
 
-	int frameIndex = _frameNumber % FRAME_OVERLAP;
-	sceneData += pad_uniform_buffer_size(sizeof(GPUSceneData)) * frameIndex;
-	memcpy(sceneData, &m_sceneParameters, sizeof(GPUSceneData));
+	GPUSceneData* sceneData = frame.dynamicData.allocate<GPUSceneData>(frame.sceneOffset);
+	*sceneData = m_sceneParameters;
+}
 
-	vmaUnmapMemory(m_allocator, m_sceneParameterBuffer.m_allocation);
+void VulkanEngine::init_lights() {
+	//the lights are scattered through the box around the model, its bounds are already in world space
+	glm::vec3 boundsMin{ FLT_MAX };
+	glm::vec3 boundsMax{ -FLT_MAX };
+	for (Mesh& mesh : m_importedModel.m_meshes) {
+		boundsMin = glm::min(boundsMin, mesh.m_boundsOrigin - mesh.m_boundsRadius);
+		boundsMax = glm::max(boundsMax, mesh.m_boundsOrigin + mesh.m_boundsRadius);
+	}
+	if (m_importedModel.m_meshes.empty()) {
+		boundsMin = glm::vec3(-1.f);
+		boundsMax = glm::vec3(1.f);
+	}
 
-	void* objectData;
-	vmaMapMemory(m_allocator, get_current_frame().objectBuffer.m_allocation, &objectData);
-	
-	GPUObjectData* objectSSBO = (GPUObjectData*)objectData;
+	m_lightCenter = (boundsMin + boundsMax) * 0.5f;
+	glm::vec3 extent = (boundsMax - boundsMin) * 0.75f;
+	float size = glm::length(boundsMax - boundsMin);
+
+	//a fixed seed, so every run shows the same lights
+	std::mt19937 random(1337);
+	std::uniform_real_distribution<float> unit(0.f, 1.f);
+
+	m_lights.resize(MAX_LIGHTS);
+	for (size_t i = 0; i < m_lights.size(); i++) {
+		Light& light = m_lights[i];
+		glm::vec3 offset = glm::vec3(unit(random), unit(random), unit(random)) * 2.f - 1.f;
+
+		//every fourth light is a spot aimed at the model
+		light.type = i % 4 == 3 ? LightType::Spot : LightType::Point;
+		light.position = m_lightCenter + extent * offset;
+		light.direction = glm::length(offset) > 0.f ? -glm::normalize(offset) : glm::vec3(0.f, -1.f, 0.f);
+		light.color = glm::vec3(0.2f) + 0.8f * glm::vec3(unit(random), unit(random), unit(random));
+		light.intensity = 2.f;
+		light.range = size * (0.05f + 0.1f * unit(random));
+		light.outerAngle = glm::radians(20.f + 25.f * unit(random));
+	}
+}
+
+void VulkanEngine::update_lights() {
+	//the whole set turns around the model, so the clusters see the lights move
+	glm::mat3 rotation = glm::mat3(glm::rotate(LIGHT_ORBIT_SPEED, glm::vec3(0.f, 1.f, 0.f)));
+	for (Light& light : m_lights) {
+		light.position = m_lightCenter + rotation * (light.position - m_lightCenter);
+		light.direction = rotation * light.direction;
+	}
+}
+
+void VulkanEngine::draw_objects(VkCommandBuffer cmd, RenderObject* first, int count) {
+	FrameData& frame = get_current_frame();
+
+	uint32_t globalOffsets[] = { frame.cameraOffset, frame.sceneOffset };
 
+	//mesh spheres scaled by the largest axis of the transform, which keeps them conservative
+	m_objectBounds.resize(count);
 	for (int i = 0; i < count; i++) {
 		RenderObject& object = first[i];
-		objectSSBO[i].modelMatrix = object.transformMatrix;
+		glm::mat4& transform = object.transformMatrix;
+
+		glm::vec3 center = glm::vec3(transform * glm::vec4(object.mesh->m_boundsOrigin, 1.f));
+		float scale = std::max(glm::length(glm::vec3(transform[0])),
+			std::max(glm::length(glm::vec3(transform[1])), glm::length(glm::vec3(transform[2]))));
+		m_objectBounds.set(i, center, object.mesh->m_boundsRadius * scale);
+	}
+
+	m_culler.cull(m_frustum, m_objectBounds, m_threadPool, m_visible);
+
+	m_visible.erase(std::remove_if(m_visible.begin(), m_visible.end(),
+		[first](uint32_t i) { return !first[i].mesh->m_resident; }), m_visible.end());
+
+	if (m_visible.empty()) return;
+
+	//objects sharing a mesh and a material end up next to each other and become one instanced draw,
+	//inside a run opaque objects go near to far
+	const float* centerX = m_objectBounds.x();
+	const float* centerY = m_objectBounds.y();
+	const float* centerZ = m_objectBounds.z();
+
+	m_renderQueue.clear();
+	for (uint32_t i : m_visible) {
+		RenderObject& object = first[i];
+		float depth = glm::distance(m_camera.position, glm::vec3(centerX[i], centerY[i], centerZ[i]));
+
+		uint64_t key = object.material->transparent
+			? RenderQueue::transparent_key(object.material->pipelineId, object.material->sortId, object.mesh->m_sortId, depth)
+			: RenderQueue::opaque_key(object.material->pipelineId, object.material->sortId, object.mesh->m_sortId, depth);
+		m_renderQueue.push(key, i);
 	}
 
-	vmaUnmapMemory(m_allocator, get_current_frame().objectBuffer.m_allocation);
+	m_renderQueue.sort(m_threadPool);
+
+	const std::vector<RenderItem>& items = m_renderQueue.items();
+	for (size_t i = 0; i < items.size(); i++) {
+		m_visible[i] = items[i].index;
+	}
+
+	//the transforms are written in batch order, so the instances of a batch read a contiguous range
+	uint32_t objectOffset;
+	GPUObjectData* objectSSBO = frame.dynamicData.allocate<GPUObjectData>(objectOffset, m_visible.size());
+	if (!objectSSBO) return;
+
+	for (size_t i = 0; i < m_visible.size(); i++) {
+		objectSSBO[i].modelMatrix = first[m_visible[i]].transformMatrix;
+	}
+
+	m_geometry.bind(cmd);
+	set_viewport(cmd);
 
-	Mesh* lastMesh = nullptr;
 	Material* lastMaterial = nullptr;
-	for (int i = 0; i < count; i++)
+	uint32_t batchStart = 0;
+	while (batchStart < m_visible.size())
 	{
-		RenderObject& object = first[i];
+		RenderObject& object = first[m_visible[batchStart]];
+
+		uint32_t batchEnd = batchStart + 1;
+		while (batchEnd < m_visible.size() && first[m_visible[batchEnd]].mesh == object.mesh
+			&& first[m_visible[batchEnd]].material == object.material) {
+			batchEnd++;
+		}
+
+		//materials still compiling skip their draws, their layouts don't match any fallback
+		VkPipeline pipeline = object.material->pipeline;
+		if (object.material->pipelineHandle != INVALID_PIPELINE_HANDLE) {
+			pipeline = m_pipelineCompiler.get(object.material->pipelineHandle);
+		}
+		if (pipeline == VK_NULL_HANDLE) {
+			batchStart = batchEnd;
+			continue;
+		}
 
 		//only bind the pipeline if it doesn't match with the already bound one
 		if (object.material != lastMaterial) {
 
-			vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, object.material->pipeline);
+			vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
 			lastMaterial = object.material;
 
-			uint32_t uniform_offset = pad_uniform_buffer_size(sizeof(GPUSceneData)) * frameIndex;
-
 			vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, object.material->pipelineLayout,
-				0, 1, &get_current_frame().m_globalDescriptor, 1, &uniform_offset);
+				0, 1, &frame.m_globalDescriptor, 2, globalOffsets);
 
 			vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, object.material->pipelineLayout,
-				1, 1, &get_current_frame().objectDescriptor, 0, nullptr);
+				1, 1, &frame.objectDescriptor, 1, &objectOffset);
 
 			if (object.material->textureSet != VK_NULL_HANDLE) {
 				vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS,
@@ -723,29 +1532,15 @@ void VulkanEngine::draw_objects(VkCommandBuffer cmd, RenderObject* first, int co
 		}
 
 
-		glm::mat4 model = object.transformMatrix;
-		//final render matrix, that we are calculating on the cpu
-		glm::mat4 mesh_matrix = projection * view * model;
-
-		MeshPushConstants constants;
-		constants.render_matrix = model;
+		//the mesh is a range of the already bound arena, the instance index picks the object data
+		vkCmdDrawIndexed(cmd, object.mesh->m_indexCount, batchEnd - batchStart,
+			object.mesh->m_firstIndex, object.mesh->m_vertexOffset, batchStart);
 
-		//upload the mesh to the GPU via push constants
-		vkCmdPushConstants(cmd, object.material->pipelineLayout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(MeshPushConstants), &constants);
-
-		//only bind the mesh if it's a different one from last bind
-		if (object.mesh != lastMesh) {
-			//bind the mesh vertex buffer with offset 0
-			VkDeviceSize offset = 0;
-			vkCmdBindVertexBuffers(cmd, 0, 1, &object.mesh->m_vertexBuffer.m_buffer, &offset);
-			lastMesh = object.mesh;
-		}
-		//we can now draw
-		vkCmdDraw(cmd, object.mesh->m_vertices.size(), 1, 0, i);
+		batchStart = batchEnd;
 	}
 }
 
-bool VulkanEngine::load_shader_module(const char* filePath, VkShaderModule* output) {
+bool VulkanEngine::load_shader_module(const char* filePath, VkShaderModule* output, uint64_t* outHash) {
 	std::ifstream file(filePath, std::ios::ate | std::ios::binary);
 
 	if (!file.is_open()) return false;
@@ -764,6 +1559,8 @@ bool VulkanEngine::load_shader_module(const char* filePath, VkShaderModule* outp
 	createInfo.codeSize = buffer.size() * sizeof(uint32_t);
 	createInfo.pCode = buffer.data();
 
+	if (outHash) *outHash = XXH64(buffer.data(), createInfo.codeSize, 0);
+
 	VkShaderModule shaderModule;
 	if (vkCreateShaderModule(m_device, &createInfo, nullptr, &shaderModule) != VK_SUCCESS) 
 		return false;
@@ -780,6 +1577,38 @@ void VulkanEngine::draw()
 	VK_CHECK(vkWaitForFences(m_device, 1, &get_current_frame().m_renderFence, true, 10000000));
 	VK_CHECK(vkResetFences(m_device, 1, &get_current_frame().m_renderFence));
 
+	//the gpu is done with this frame, so its dynamic data and command buffers can be handed out again
+	get_current_frame().dynamicData.reset();
+	get_current_frame().secondaryCommands.reset();
+	update_frame_data();
+
+	//the statistics of the frame that used these buffers last are available by now
+	FrameData& statisticsFrame = get_current_frame();
+	if (statisticsFrame.statisticsPending) {
+		uint64_t invocations = 0;
+		if (vkGetQueryPoolResults(m_device, statisticsFrame.statisticsQuery, 0, 1, sizeof(invocations), &invocations,
+			sizeof(invocations), VK_QUERY_RESULT_64_BIT) == VK_SUCCESS) {
+			m_fragmentInvocations = invocations;
+		}
+		statisticsFrame.statisticsPending = false;
+	}
+
+	//evictions go first, so the streamer doesn't upgrade into memory that is about to be reclaimed
+	m_residency.update((uint64_t)_frameNumber);
+
+	//meshes the workers finished reading back start uploading, they are drawn once the transfer is done
+	update_mesh_reloads();
+
+	//frames older than the overlap finished, so the streamer can swap and release images
+	m_textureStreamer.update((uint64_t)_frameNumber);
+
+	//pipelines compiled since the last save reach the disk even if the app never shuts down cleanly
+	m_pipelineCache.update((uint64_t)_frameNumber);
+
+	//shaders edited on disk get their pipelines rebuilt on the workers, the ones that finished are swapped in
+	m_shaderReloader.update();
+	update_pipeline_reloads();
+
 	VK_CHECK(vkResetCommandBuffer(get_current_frame().m_mainCommandBuffer, 0));
 
 	uint32_t swapchainImageIndex;
@@ -792,6 +1621,78 @@ void VulkanEngine::draw()
 
 	VK_CHECK(vkBeginCommandBuffer(cmd, &cmdBeginInfo));
 
+	//take ownership of finished uploads before anything in this frame reads them
+	uint64_t transferWaitValue = m_transfer.acquire_completed(cmd);
+
+	//moved allocations are copied before the render pass, so this frame already draws with them
+	m_defragmenter.update(cmd, (uint64_t)_frameNumber);
+
+	//the main pass reads the light lists, so they are built before any render pass begins
+	update_lights();
+	m_lighting.record_update(cmd, _frameNumber % FRAME_OVERLAP, m_lights, (uint32_t)m_activeLights,
+		m_view, m_projection, CAMERA_NEAR, CAMERA_FAR, m_gpuLightBinning, m_threadPool);
+
+	//with the prepass the main pass shades each pixel about once, instead of once per overlapping surface
+	bool prepass = depth_prepass_active();
+	//the depth pyramid is built from the prepass, so occlusion culling can't run without it
+	bool occlusion = m_gpuCulling && m_occlusionCulling && prepass;
+
+	//compute work can't run inside the render pass, so the draw commands are written up front
+	if (m_gpuCulling) m_gpuCuller.record_culling(cmd, _frameNumber % FRAME_OVERLAP, m_frustum, m_viewproj, occlusion);
+
+	cull_model();
+
+	SecondaryCommands& secondaryCommands = get_current_frame().secondaryCommands;
+
+	if (prepass) {
+		VkClearValue prepassClear;
+		prepassClear.depthStencil.depth = 1.f;
+
+		VkRenderPassBeginInfo prepassInfo = {};
+		prepassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+		prepassInfo.pNext = nullptr;
+
+		prepassInfo.renderPass = m_depthPrepassRenderPass;
+		prepassInfo.renderArea.offset.x = 0;
+		prepassInfo.renderArea.offset.y = 0;
+		prepassInfo.renderArea.extent = _windowExtent;
+		prepassInfo.framebuffer = m_depthFramebuffer;
+		prepassInfo.clearValueCount = 1;
+		prepassInfo.pClearValues = &prepassClear;
+
+		vkCmdBeginRenderPass(cmd, &prepassInfo, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+		secondaryCommands.begin_pass(m_depthPrepassRenderPass, 0, m_depthFramebuffer);
+
+		draw_depth_prepass(CullPhase::Early);
+
+		secondaryCommands.execute(cmd);
+		vkCmdEndRenderPass(cmd);
+
+		//what was visible last frame is in the depth now, the rest gets tested against it
+		if (occlusion) {
+			m_depthPyramid.record_build(cmd, m_depthImage.m_image);
+			m_gpuCuller.record_late_culling(cmd, _frameNumber % FRAME_OVERLAP);
+
+			prepassInfo.renderPass = m_depthPrepassLoadRenderPass;
+			vkCmdBeginRenderPass(cmd, &prepassInfo, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+			secondaryCommands.begin_pass(m_depthPrepassLoadRenderPass, 0, m_depthFramebuffer);
+
+			draw_depth_prepass(CullPhase::Late);
+
+			secondaryCommands.execute(cmd);
+			vkCmdEndRenderPass(cmd);
+		}
+	}
+
+	//counts the fragments the main pass shades, the prepass has no fragment shader
+	VkQueryPool statisticsQuery = get_current_frame().statisticsQuery;
+	VkQueryPipelineStatisticFlags statistics = 0;
+	if (m_pipelineStatistics) {
+		statistics = VK_QUERY_PIPELINE_STATISTIC_FRAGMENT_SHADER_INVOCATIONS_BIT;
+		vkCmdResetQueryPool(cmd, statisticsQuery, 0, 1);
+		vkCmdBeginQuery(cmd, statisticsQuery, 0, 0);
+	}
+
 	VkClearValue clearValue;
 	float flash = abs(sin(_frameNumber / 120.f));
 	clearValue.color = { { 0.0f, 0.0f, flash, 1.0f } };
@@ -803,7 +1704,7 @@ void VulkanEngine::draw()
 	rpInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
 	rpInfo.pNext = nullptr;
 
-	rpInfo.renderPass = m_renderPass;
+	rpInfo.renderPass = prepass ? m_depthLoadRenderPass : m_renderPass;
 	rpInfo.renderArea.offset.x = 0;
 	rpInfo.renderArea.offset.y = 0;
 	rpInfo.renderArea.extent = _windowExtent;
@@ -814,25 +1715,49 @@ void VulkanEngine::draw()
 	rpInfo.clearValueCount = 2;
 	rpInfo.pClearValues = &clearValues[0];
 
-	vkCmdBeginRenderPass(cmd, &rpInfo, VK_SUBPASS_CONTENTS_INLINE);
+	//the whole pass is recorded into secondaries, the main buffer only executes them
+	vkCmdBeginRenderPass(cmd, &rpInfo, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
 
-	draw_model(cmd); 
+	secondaryCommands.begin_pass(rpInfo.renderPass, 0, m_framebuffers[swapchainImageIndex], statistics);
 
-	ImGui_ImplVulkan_RenderDrawData(ImGui::GetDrawData(), cmd);
+	draw_model();
+
+	secondaryCommands.record(m_threadPool, 1, 1, [](VkCommandBuffer secondary, size_t, size_t) {
+		ImGui_ImplVulkan_RenderDrawData(ImGui::GetDrawData(), secondary);
+	});
+
+	secondaryCommands.execute(cmd);
 
 	vkCmdEndRenderPass(cmd);
+
+	if (m_pipelineStatistics) {
+		vkCmdEndQuery(cmd, statisticsQuery, 0);
+		get_current_frame().statisticsPending = true;
+	}
+
 	VK_CHECK(vkEndCommandBuffer(cmd));
 
 	VkSubmitInfo submit = {};
 	submit.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
 	submit.pNext = nullptr;
 
-	VkPipelineStageFlags waitStage = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+	VkPipelineStageFlags waitStages[] = { VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT };
+	VkSemaphore waitSemaphores[] = { get_current_frame().m_presentSemaphore, m_transfer.timeline() };
+	//the binary present semaphore ignores its value
+	uint64_t waitValues[] = { 0, transferWaitValue };
+
+	VkTimelineSemaphoreSubmitInfo timelineInfo = {};
+	timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+	timelineInfo.pNext = nullptr;
+	timelineInfo.waitSemaphoreValueCount = 2;
+	timelineInfo.pWaitSemaphoreValues = waitValues;
 
-	submit.pWaitDstStageMask = &waitStage;
+	submit.pWaitDstStageMask = waitStages;
 
-	submit.waitSemaphoreCount = 1;
-	submit.pWaitSemaphores = &get_current_frame().m_presentSemaphore;
+	//the acquire barriers recorded above must happen after the release on the transfer queue
+	submit.waitSemaphoreCount = transferWaitValue > 0 ? 2 : 1;
+	submit.pWaitSemaphores = waitSemaphores;
+	if (transferWaitValue > 0) submit.pNext = &timelineInfo;
 
 	submit.signalSemaphoreCount = 1;
 	submit.pSignalSemaphores = &get_current_frame().m_renderSemaphore;
@@ -840,6 +1765,8 @@ void VulkanEngine::draw()
 	submit.commandBufferCount = 1;
 	submit.pCommandBuffers = &cmd;
 
+	std::lock_guard<std::mutex> queueLock(m_graphicsQueueMutex);
+
 	VK_CHECK(vkQueueSubmit(m_graphicsQueue, 1, &submit, get_current_frame().m_renderFence));
 
 	VkPresentInfoKHR presentInfo = {};
@@ -888,6 +1815,15 @@ Material* VulkanEngine::create_material(VkPipeline pipeline, VkPipelineLayout la
 	Material mat;
 	mat.pipeline = pipeline;
 	mat.pipelineLayout = layout;
+
+	auto pipelineId = m_pipelineIds.find(pipeline);
+	if (pipelineId == m_pipelineIds.end()) {
+		pipelineId = m_pipelineIds.emplace(pipeline, (uint32_t)m_pipelineIds.size()).first;
+	}
+	mat.pipelineId = pipelineId->second;
+
+	auto existing = m_materials.find(name);
+	mat.sortId = existing != m_materials.end() ? existing->second.sortId : (uint32_t)m_materials.size();
 	m_materials[name] = mat;
 
 	return &m_materials[name];
@@ -914,88 +1850,209 @@ Mesh* VulkanEngine::get_mesh(const std::string& name)
 
 void VulkanEngine::load_model() {
 	std::string objectPath = "../../assets/backpack/";
-	m_importedModel = Model(objectPath + "backpack.obj");
+	m_importedModel = Model(objectPath + "backpack.obj", ASSET_CACHE_DIRECTORY);
 
+	//only the mip tails are uploaded here, higher levels stream in once the meshes show up on screen
+	std::vector<std::string> texturePaths;
 	for (Texture& texture : m_importedModel.m_textures_loaded) {
-		std::string filePath = objectPath + texture.path;
-		bool result = vkutil::load_image_from_file((*this), filePath.c_str(), texture.image);
-
-		VkImageViewCreateInfo imageInfo = vkinit::imageview_create_info(VK_FORMAT_R8G8B8A8_SRGB,
-			texture.image.m_image, VK_IMAGE_ASPECT_COLOR_BIT);
-		vkCreateImageView(m_device, &imageInfo, nullptr, &texture.image.m_defaultView);
+		texturePaths.push_back(objectPath + texture.path);
 	}
 
-	VkDescriptorSetAllocateInfo allocInfo = {};
-	allocInfo.pNext = nullptr;
-	allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
-	allocInfo.descriptorPool = m_descriptorPool;
-	allocInfo.descriptorSetCount = 1;
-	allocInfo.pSetLayouts = &m_textureSetLayout;
-
-	vkAllocateDescriptorSets(m_device, &allocInfo, &m_textureDescriptorSet);
+	std::vector<uint32_t> streamIds = m_textureStreamer.load_textures(texturePaths);
 
-	VkSamplerCreateInfo samplerInfo = vkinit::sampler_create_info(VK_FILTER_NEAREST);
+	for (size_t i = 0; i < streamIds.size(); i++) {
+		Texture& texture = m_importedModel.m_textures_loaded[i];
+		texture.streamId = streamIds[i];
+		texture.isLoaded = streamIds[i] != INVALID_STREAMED_TEXTURE;
+		if (i < m_bindlessTextureCount) texture.bindlessIndex = (uint32_t)i;
 
-	VkSampler blockySampler;
-	vkCreateSampler(m_device, &samplerInfo, nullptr, &blockySampler);
+		//under VRAM pressure textures nobody sampled lately drop back to their mip tails
+		if (texture.isLoaded) {
+			uint32_t streamId = texture.streamId;
+			texture.residencyId = m_residency.add_resource(ResidencyPool::DeviceHeap,
+				[this, streamId]() { return m_textureStreamer.evict(streamId); }, nullptr);
+		}
 
-	VkDescriptorImageInfo textureImageInfo[2];
-	textureImageInfo[0] = {};
-	textureImageInfo[0].sampler = nullptr;
-	textureImageInfo[0].imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-	textureImageInfo[0].imageView = m_importedModel.m_textures_loaded[0].image.m_defaultView;
+		for (Mesh& mesh : m_importedModel.m_meshes) {
+			for (Texture& meshTexture : mesh.m_textures) {
+				if (meshTexture.path == texture.path) {
+					meshTexture.streamId = texture.streamId;
+					meshTexture.residencyId = texture.residencyId;
+					meshTexture.bindlessIndex = texture.bindlessIndex;
+				}
+			}
+		}
+	}
 
-	textureImageInfo[1] = {};
-	textureImageInfo[1].sampler = nullptr;
-	textureImageInfo[1].imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-	textureImageInfo[1].imageView = m_importedModel.m_textures_loaded[1].image.m_defaultView;
+	VkSamplerCreateInfo samplerInfo = vkinit::sampler_create_info(VK_FILTER_NEAREST);
+	vkCreateSampler(m_device, &samplerInfo, nullptr, &m_modelSampler);
 
-	VkDescriptorImageInfo imageInfo = {};
-	imageInfo.sampler = blockySampler;
+	m_deletionQueue.push_function([=]() {
+		vkDestroySampler(m_device, m_modelSampler, nullptr);
+	});
 
-	VkWriteDescriptorSet setWrites[2];
+	VkDescriptorImageInfo samplerImageInfo = {};
+	samplerImageInfo.sampler = m_modelSampler;
 
-	setWrites[0] = vkinit::write_descriptor_image(
-		VK_DESCRIPTOR_TYPE_SAMPLER,
-		m_textureDescriptorSet,
-		&imageInfo, 0
-	);
+	//the materials never change, textures the array couldn't take are left out
+	std::vector<GPUMaterial> materials(m_importedModel.m_meshes.size());
+	for (size_t i = 0; i < materials.size(); i++) {
+		materials[i] = { ~0u, ~0u, { 0, 0 } };
+		for (Texture& texture : m_importedModel.m_meshes[i].m_textures) {
+			if (texture.type == "diffuse" && materials[i].diffuse == ~0u) materials[i].diffuse = texture.bindlessIndex;
+			if (texture.type == "specular" && materials[i].specular == ~0u) materials[i].specular = texture.bindlessIndex;
+		}
+	}
 
-	setWrites[1] = vkinit::write_descriptor_image(
-		VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE,
-		m_textureDescriptorSet,
-		textureImageInfo,
-		1
-	);
-	setWrites[1].descriptorCount = 2;
+	size_t materialBufferSize = std::max<size_t>(materials.size(), 1) * sizeof(GPUMaterial);
+	m_materialBuffer = create_buffer(materialBufferSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU);
 
-	vkUpdateDescriptorSets(m_device, 2, setWrites, 0, nullptr);
+	void* materialData;
+	vmaMapMemory(m_allocator, m_materialBuffer.m_allocation, &materialData);
+	memcpy(materialData, materials.data(), materials.size() * sizeof(GPUMaterial));
+	vmaUnmapMemory(m_allocator, m_materialBuffer.m_allocation);
 
 	m_deletionQueue.push_function([=]() {
-		vkDestroySampler(m_device, blockySampler, nullptr);
+		vmaDestroyBuffer(m_allocator, m_materialBuffer.m_buffer, m_materialBuffer.m_allocation);
 	});
 
+	VkDescriptorBufferInfo materialInfo = { m_materialBuffer.m_buffer, 0, materialBufferSize };
+
+	//one set per frame, so the views can be swapped while the other frame is still in flight
+	for (int i = 0; i < FRAME_OVERLAP; i++) {
+		VkDescriptorSetAllocateInfo allocInfo = {};
+		allocInfo.pNext = nullptr;
+		allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+		allocInfo.descriptorPool = m_bindlessPool;
+		allocInfo.descriptorSetCount = 1;
+		allocInfo.pSetLayouts = &m_textureSetLayout;
+
+		vkAllocateDescriptorSets(m_device, &allocInfo, &m_frames[i].textureDescriptor);
+
+		VkWriteDescriptorSet samplerWrite = vkinit::write_descriptor_image(
+			VK_DESCRIPTOR_TYPE_SAMPLER,
+			m_frames[i].textureDescriptor,
+			&samplerImageInfo, 0
+		);
+		VkWriteDescriptorSet materialWrite = vkinit::write_descriptor_buffer(
+			VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+			m_frames[i].textureDescriptor,
+			&materialInfo, 2
+		);
+
+		VkWriteDescriptorSet setWrites[] = { samplerWrite, materialWrite };
+		vkUpdateDescriptorSets(m_device, 2, setWrites, 0, nullptr);
+
+		//the views are written on the first frame the textures are resident
+		m_frames[i].textureGeneration = ~0ull;
+	}
+
+	//meshes that weren't drawn lately give their arena ranges to the ones that need them
+	//the bounds never change, so the culling input is built once
+	m_modelBounds.resize(m_importedModel.m_meshes.size());
+	m_gpuCuller.set_object_count((uint32_t)m_importedModel.m_meshes.size());
+
+	//the big meshes hide most of the others, the small ones are left to the main pass by default
+	float largestRadius = 0.f;
+	for (Mesh& mesh : m_importedModel.m_meshes) largestRadius = std::max(largestRadius, mesh.m_boundsRadius);
 	for (Mesh& mesh : m_importedModel.m_meshes) {
-		upload_mesh(mesh);
+		bool occluder = mesh.m_boundsRadius >= DEPTH_PREPASS_OCCLUDER_SHARE * largestRadius;
+		mesh.m_class = occluder ? MeshClass::Occluder : MeshClass::Detail;
+	}
+
+	for (size_t i = 0; i < m_importedModel.m_meshes.size(); i++) {
+		Mesh& mesh = m_importedModel.m_meshes[i];
+		Mesh* target = &mesh;
+
+		m_modelBounds.set(i, mesh.m_boundsOrigin, mesh.m_boundsRadius);
+
+		//the asset pipeline makes no simplified versions, so the occluder class is rasterized as it is
+		if (mesh.m_class == MeshClass::Occluder && mesh.has_cpu_data()) {
+			std::vector<glm::vec3> positions(mesh.m_vertices.size());
+			for (size_t v = 0; v < positions.size(); v++) {
+				positions[v] = mesh.m_vertices[v].position;
+			}
+			m_occlusionRasterizer.add_occluder(positions, mesh.m_indices, mesh.m_boundsOrigin, mesh.m_boundsRadius);
+			m_occluderMeshes.push_back((uint32_t)i);
+		}
+
+		//without a cached copy there is nothing to read the released data back from
+		mesh.m_cpuAccess = !m_importedModel.canReload();
+
+		mesh.m_residencyId = m_residency.add_resource(ResidencyPool::GeometryArena,
+			[this, target, i]() -> VkDeviceSize {
+				if (!target->m_resident) return 0;
+
+				m_geometry.free(*target);
+				m_gpuCuller.set_object((uint32_t)i, *target);
+				return target->m_vertexCount * (sizeof(Vertex) + sizeof(glm::vec3)) + target->m_indexCount * sizeof(uint32_t);
+			},
+			[this, i]() { restore_model_mesh(i); });
+
+		upload_model_mesh(i);
 	}
 }
 
-void VulkanEngine::load_images() {
-	Texture lostEmpire;
-	
-	vkutil::load_image_from_file(*this, "../../assets/lost_empire-RGBA.png", lostEmpire.image);
+void VulkanEngine::upload_model_mesh(size_t index) {
+	Mesh* target = &m_importedModel.m_meshes[index];
+	bool queued = upload_mesh(*target, [this, target, index]() {
+		m_gpuCuller.set_object((uint32_t)index, *target);
+		m_residency.restored(target->m_residencyId);
+	});
 
-	VkImageViewCreateInfo imageInfo = vkinit::imageview_create_info(VK_FORMAT_R8G8B8A8_SRGB,
-		lostEmpire.image.m_image, VK_IMAGE_ASPECT_COLOR_BIT);
-	vkCreateImageView(m_device, &imageInfo, nullptr, &lostEmpire.imageView);
+	//the next time the mesh is used it tries again
+	if (!queued) m_residency.restore_failed(target->m_residencyId);
+}
 
-	m_textures["empire_diffuse"] = lostEmpire;
+void VulkanEngine::restore_model_mesh(size_t index) {
+	if (m_importedModel.m_meshes[index].has_cpu_data()) {
+		upload_model_mesh(index);
+		return;
+	}
 
-	m_deletionQueue.push_function([=]() {
-		vkDestroyImageView(m_device, lostEmpire.imageView, nullptr);
+	//reading and unpacking runs on a worker, so meshes coming back don't stall the frame recording them
+	m_threadPool.submit([this, index]() {
+		MeshReload reload;
+		reload.index = index;
+		reload.loaded = m_importedModel.reloadMesh(index, reload.mesh);
+
+		std::lock_guard<std::mutex> lock(m_meshReloadMutex);
+		m_meshReloads.push_back(std::move(reload));
 	});
 }
 
+void VulkanEngine::update_mesh_reloads() {
+	std::vector<MeshReload> reloads;
+	{
+		std::lock_guard<std::mutex> lock(m_meshReloadMutex);
+		reloads.swap(m_meshReloads);
+	}
+
+	//the arena and the transfer requests belong to the main thread, so the uploads start here
+	for (MeshReload& reload : reloads) {
+		if (!reload.loaded) {
+			std::cout << "Failed to reload mesh " << reload.index << " from the baked model" << std::endl;
+			m_residency.restore_failed(m_importedModel.m_meshes[reload.index].m_residencyId);
+			continue;
+		}
+
+		Mesh& mesh = m_importedModel.m_meshes[reload.index];
+		mesh.m_vertices = std::move(reload.mesh.m_vertices);
+		mesh.m_indices = std::move(reload.mesh.m_indices);
+		upload_model_mesh(reload.index);
+	}
+}
+
+void VulkanEngine::load_images() {
+	//the map keeps the texture address stable until its upload finishes
+	Texture& lostEmpire = m_textures["empire_diffuse"];
+	Texture* target = &lostEmpire;
+
+	lostEmpire.isLoaded = vkutil::load_image_from_file(*this, "../../assets/lost_empire-RGBA.png", lostEmpire.image,
+		[target]() { target->isResident = true; });
+	lostEmpire.imageView = lostEmpire.image.m_defaultView;
+}
+
 void VulkanEngine::load_meshes() {
 	m_triangleMesh.m_vertices.resize(3);
 
@@ -1007,116 +2064,127 @@ void VulkanEngine::load_meshes() {
 	m_triangleMesh.m_vertices[1].color = { 0.f, 1.f, 0.0f };
 	m_triangleMesh.m_vertices[2].color = { 0.f, 1.f, 0.0f };
 
+	m_triangleMesh.m_indices = { 0, 1, 2 };
+
 	m_monkeyMesh.load_from_obj("../../assets/monkey_smooth.obj");
 
 	Mesh lostEmpire{};
 	lostEmpire.load_from_obj("../../assets/lost_empire.obj");
 
-	upload_mesh(m_triangleMesh);
-	upload_mesh(m_monkeyMesh);
-	upload_mesh(lostEmpire);
-
 	m_meshes["monkey"] = m_monkeyMesh;
 	m_meshes["triangle"] = m_triangleMesh;
 	m_meshes["empire"] = lostEmpire;
+
+	//uploads finish asynchronously, so they have to target the meshes owned by the map
+	upload_mesh(m_meshes["monkey"]);
+	upload_mesh(m_meshes["triangle"]);
+	upload_mesh(m_meshes["empire"]);
 }
 
-void VulkanEngine::upload_mesh(Mesh &mesh) {
-	const size_t bufferSize = mesh.m_vertices.size() * sizeof(Vertex);
+bool VulkanEngine::upload_mesh(Mesh &mesh, std::function<void()>&& onResident) {
+	mesh.m_resident = false;
+	if (mesh.m_sortId == ~0u) mesh.m_sortId = m_nextMeshId++;
 
-	VkBufferCreateInfo stagingBufferInfo = {};
-	stagingBufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-	stagingBufferInfo.pNext = nullptr;
-	stagingBufferInfo.size = bufferSize;
-	stagingBufferInfo.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+	//released meshes keep their counts, their data has to be reloaded before uploading again
+	if (!mesh.has_cpu_data()) {
+		std::cout << "Mesh of " << mesh.m_vertexCount << " vertices has no data to upload" << std::endl;
+		return false;
+	}
+	mesh.m_vertexCount = (uint32_t)mesh.m_vertices.size();
+	mesh.m_indexCount = (uint32_t)mesh.m_indices.size();
 
-	VmaAllocationCreateInfo vmaallocInfo = {};
-	vmaallocInfo.usage = VMA_MEMORY_USAGE_CPU_ONLY;
+	const size_t vertexBufferSize = mesh.m_vertexCount * sizeof(Vertex);
+	const size_t positionBufferSize = mesh.m_vertexCount * sizeof(glm::vec3);
+	const size_t indexBufferSize = mesh.m_indexCount * sizeof(uint32_t);
 
-	AllocatedBuffer stagingBuffer;
+	while (!m_geometry.allocate(mesh)) {
+		if (!m_residency.make_room(ResidencyPool::GeometryArena, vertexBufferSize + positionBufferSize + indexBufferSize)) {
+			std::cout << "Geometry arena is out of space for a mesh of " << mesh.m_vertexCount << " vertices" << std::endl;
+			return false;
+		}
+	}
 
-	VK_CHECK(vmaCreateBuffer(m_allocator, &stagingBufferInfo, &vmaallocInfo,
-		&stagingBuffer.m_buffer,
-		&stagingBuffer.m_allocation,
-		nullptr));
+	//a single staging buffer holds the vertices, their positions alone and the indices
+	AllocatedBuffer stagingBuffer = create_buffer(vertexBufferSize + positionBufferSize + indexBufferSize,
+		VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VMA_MEMORY_USAGE_CPU_ONLY);
 
-	void* data;
-	vmaMapMemory(m_allocator, stagingBuffer.m_allocation, &data);
-	memcpy(data, mesh.m_vertices.data(), mesh.m_vertices.size() * sizeof(Vertex));
+	char* data;
+	vmaMapMemory(m_allocator, stagingBuffer.m_allocation, (void**)&data);
+	memcpy(data, mesh.m_vertices.data(), vertexBufferSize);
+	glm::vec3* positions = reinterpret_cast<glm::vec3*>(data + vertexBufferSize);
+	for (size_t i = 0; i < mesh.m_vertices.size(); i++) {
+		positions[i] = mesh.m_vertices[i].position;
+	}
+	memcpy(data + vertexBufferSize + positionBufferSize, mesh.m_indices.data(), indexBufferSize);
 	vmaUnmapMemory(m_allocator, stagingBuffer.m_allocation);
 
-	VkBufferCreateInfo vertexBufferInfo = {};
-	vertexBufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-	vertexBufferInfo.pNext = nullptr;
-	vertexBufferInfo.size = bufferSize;
-	vertexBufferInfo.usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
-
-	vmaallocInfo.usage = VMA_MEMORY_USAGE_GPU_ONLY;
-
-	VK_CHECK(vmaCreateBuffer(m_allocator, &vertexBufferInfo, &vmaallocInfo,
-		&mesh.m_vertexBuffer.m_buffer,
-		&mesh.m_vertexBuffer.m_allocation,
-		nullptr));
-
-	immediate_submit([=](VkCommandBuffer cmd) {
-		VkBufferCopy copy;
-		copy.dstOffset = 0;
-		copy.srcOffset = 0;
-		copy.size = bufferSize;
-		vkCmdCopyBuffer(cmd, stagingBuffer.m_buffer, mesh.m_vertexBuffer.m_buffer, 1, &copy);
-	});
-
-	VkDeviceSize indexBufferSize = sizeof(unsigned int) * mesh.m_indices.size();
-
-	stagingBufferInfo = {};
-	stagingBufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-	stagingBufferInfo.pNext = nullptr;
-	stagingBufferInfo.size = indexBufferSize;
-	stagingBufferInfo.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
-
-	vmaallocInfo.usage = VMA_MEMORY_USAGE_CPU_ONLY;
-
-	AllocatedBuffer indexStagingBuffer;
-	VK_CHECK(vmaCreateBuffer(m_allocator, &stagingBufferInfo, &vmaallocInfo,
-		&indexStagingBuffer.m_buffer,
-		&indexStagingBuffer.m_allocation,
-		nullptr));
-
-	void* indexData;
-	vmaMapMemory(m_allocator, indexStagingBuffer.m_allocation, &indexData);
-	memcpy(indexData, mesh.m_indices.data(), mesh.m_indices.size() * sizeof(unsigned int));
-	vmaUnmapMemory(m_allocator, indexStagingBuffer.m_allocation);
-
-	vertexBufferInfo = {};
-	vertexBufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-	vertexBufferInfo.pNext = nullptr;
-	vertexBufferInfo.size = bufferSize;
-	vertexBufferInfo.usage = VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
-
-	vmaallocInfo.usage = VMA_MEMORY_USAGE_GPU_ONLY;
-
-	VK_CHECK(vmaCreateBuffer(m_allocator, &vertexBufferInfo, &vmaallocInfo,
-		&mesh.m_indicesBuffer.m_buffer,
-		&mesh.m_indicesBuffer.m_allocation,
-		nullptr));
-
-	immediate_submit([=](VkCommandBuffer cmd) {
-		VkBufferCopy copy;
-		copy.dstOffset = 0;
-		copy.srcOffset = 0;
-		copy.size = indexBufferSize;
-		vkCmdCopyBuffer(cmd, indexStagingBuffer.m_buffer, mesh.m_indicesBuffer.m_buffer, 1, &copy);
-	});
+	VkBufferCopy vertexCopy;
+	vertexCopy.srcOffset = 0;
+	vertexCopy.dstOffset = mesh.m_vertexOffset * sizeof(Vertex);
+	vertexCopy.size = vertexBufferSize;
+
+	VkBufferCopy positionCopy;
+	positionCopy.srcOffset = vertexBufferSize;
+	positionCopy.dstOffset = mesh.m_vertexOffset * sizeof(glm::vec3);
+	positionCopy.size = positionBufferSize;
+
+	VkBufferCopy indexCopy;
+	indexCopy.srcOffset = vertexBufferSize + positionBufferSize;
+	indexCopy.dstOffset = mesh.m_firstIndex * sizeof(uint32_t);
+	indexCopy.size = indexBufferSize;
+
+	VkBuffer vertexBuffer = m_geometry.vertex_buffer();
+	VkBuffer positionBuffer = m_geometry.position_buffer();
+	VkBuffer indexBuffer = m_geometry.index_buffer();
+
+	TransferRequest request;
+	request.record = [=](VkCommandBuffer cmd) {
+		vkCmdCopyBuffer(cmd, stagingBuffer.m_buffer, vertexBuffer, 1, &vertexCopy);
+		vkCmdCopyBuffer(cmd, stagingBuffer.m_buffer, positionBuffer, 1, &positionCopy);
+		vkCmdCopyBuffer(cmd, stagingBuffer.m_buffer, indexBuffer, 1, &indexCopy);
+	};
 
-	m_deletionQueue.push_function([=]() {
-		vmaDestroyBuffer(m_allocator, mesh.m_vertexBuffer.m_buffer, mesh.m_vertexBuffer.m_allocation);
-	});
+	//only the ranges of this mesh change hands, the rest of the arena stays with the graphics queue
+	VkBufferMemoryBarrier vertexBarrier = vkinit::buffer_barrier(vertexBuffer,
+		VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT);
+	vertexBarrier.offset = vertexCopy.dstOffset;
+	vertexBarrier.size = vertexCopy.size;
+
+	VkBufferMemoryBarrier indexBarrier = vkinit::buffer_barrier(indexBuffer,
+		VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_INDEX_READ_BIT);
+	indexBarrier.offset = indexCopy.dstOffset;
+	indexBarrier.size = indexCopy.size;
+
+	VkBufferMemoryBarrier positionBarrier = vkinit::buffer_barrier(positionBuffer,
+		VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT);
+	positionBarrier.offset = positionCopy.dstOffset;
+	positionBarrier.size = positionCopy.size;
+
+	request.bufferBarriers.push_back(vertexBarrier);
+	request.bufferBarriers.push_back(positionBarrier);
+	request.bufferBarriers.push_back(indexBarrier);
+	request.dstStageMask = VK_PIPELINE_STAGE_VERTEX_INPUT_BIT;
+
+	Mesh* target = &mesh;
+	request.onComplete = [=]() {
+		vmaDestroyBuffer(m_allocator, stagingBuffer.m_buffer, stagingBuffer.m_allocation);
+		target->m_resident = true;
+
+		//the device copy is confirmed, so the host one only stays for meshes read on the cpu
+		if (!target->m_cpuAccess) target->release_cpu_data();
+		if (onResident) onResident();
+	};
 
-	vmaDestroyBuffer(m_allocator, stagingBuffer.m_buffer, stagingBuffer.m_allocation);
+	m_transfer.enqueue(std::move(request));
+	return true;
 }
 
 void VulkanEngine::run()
 {
+	if (!_isInitialized) {
+		return;
+	}
+
 	auto& io = ImGui::GetIO();
 	SDL_Event e;
 	bool bQuit = false;
@@ -1168,6 +2236,63 @@ void VulkanEngine::run()
 		ImGui_ImplSDL2_NewFrame(_window);
 		ImGui::NewFrame();
 
+		const ResidencyStats& residency = m_residency.stats();
+		ImGui::Begin("Memory");
+		ImGui::Text("VRAM %llu / %llu MB (%.0f%%)", (unsigned long long)(residency.deviceUsage >> 20),
+			(unsigned long long)(residency.deviceBudget >> 20), residency.pressure * 100.f);
+		ImGui::Text("Streamed textures %llu / %llu MB", (unsigned long long)(m_textureStreamer.resident_bytes() >> 20),
+			(unsigned long long)(m_textureStreamer.budget() >> 20));
+		ImGui::Text("Frames over budget %llu", (unsigned long long)residency.overBudgetFrames);
+		ImGui::Text("Evictions %llu (%llu MB), restores %llu", (unsigned long long)residency.evictions,
+			(unsigned long long)(residency.evictedBytes >> 20), (unsigned long long)residency.restores);
+		ImGui::Text("Failed evictions %llu, failed restores %llu", (unsigned long long)residency.failedEvictions,
+			(unsigned long long)residency.failedRestores);
+
+		const DefragmentationStats& defragmentation = m_defragmenter.stats();
+		ImGui::Separator();
+		ImGui::Text("Fragmentation %.0f%% over %u free ranges (%llu MB)", defragmentation.fragmentation * 100.f,
+			defragmentation.unusedRanges, (unsigned long long)(defragmentation.unusedBytes >> 20));
+		ImGui::Text("Defragmentation runs %llu, moved %llu (%llu MB)", (unsigned long long)defragmentation.runs,
+			(unsigned long long)defragmentation.allocationsMoved, (unsigned long long)(defragmentation.bytesMoved >> 20));
+		ImGui::Text("Freed %llu blocks (%llu MB)", (unsigned long long)defragmentation.blocksFreed,
+			(unsigned long long)(defragmentation.bytesFreed >> 20));
+		ImGui::End();
+
+		ImGui::Begin("Rendering");
+		ImGui::Checkbox("GPU culling", &m_gpuCulling);
+		ImGui::Checkbox("Occlusion culling", &m_occlusionCulling);
+		ImGui::Checkbox("CPU occlusion culling", &m_cpuOcclusionCulling);
+		if (!m_gpuCulling && m_cpuOcclusionCulling) {
+			ImGui::Text("CPU occluders: %u triangles, %u meshes hidden", m_occlusionRasterizer.triangle_count(),
+				m_occlusionRasterizer.occluded_count());
+		}
+		ImGui::Text("Pipelines compiling %u", m_pipelineCompiler.pending());
+
+		const std::vector<std::string>& modelFeatures = m_modelPermutations.features();
+		for (size_t i = 0; i < modelFeatures.size(); i++) {
+			ImGui::CheckboxFlags(modelFeatures[i].c_str(), &m_modelFeatures, 1u << i);
+		}
+		ImGui::Text("Model permutations %zu", m_modelPermutations.permutation_count());
+
+		ImGui::SliderInt("Lights", &m_activeLights, 0, (int)MAX_LIGHTS);
+		ImGui::Checkbox("GPU light binning", &m_gpuLightBinning);
+		if (!m_gpuLightBinning && m_lighting.dropped_indices() > 0) {
+			ImGui::Text("Light indices dropped %u", m_lighting.dropped_indices());
+		}
+
+		ImGui::Checkbox("Depth prepass", &m_depthPrepass);
+		ImGui::Checkbox("Prepass occluders", &m_prepassClasses[(size_t)MeshClass::Occluder]);
+		ImGui::Checkbox("Prepass details", &m_prepassClasses[(size_t)MeshClass::Detail]);
+		if (m_pipelineStatistics) {
+			//1 means every pixel got shaded once, the rest is overdraw
+			double pixels = (double)_windowExtent.width * _windowExtent.height;
+			ImGui::Text("Shaded fragments per pixel %.2f", m_fragmentInvocations / pixels);
+		}
+		ImGui::Text("Pipelines %u, shared %llu times", m_pipelineCache.pipeline_count(),
+			(unsigned long long)m_pipelineCache.shared_hits());
+		ImGui::Text("Indirect path: %s", m_drawIndirectCount ? "draw count" : (m_multiDrawIndirect ? "multi draw" : "single draws"));
+		ImGui::End();
+
 		draw();
 	}
 }
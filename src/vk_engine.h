@@ -6,17 +6,43 @@
 #include "vk_mesh.h"
 #include "vk_model.h"
 #include "utils/camera.h"
+#include "utils/thread_pool.h"
 #include "vk_types.h"
+#include "vk_transfer.h"
+#include "vk_geometry.h"
+#include "vk_frame_allocator.h"
+#include "vk_texture_streamer.h"
+#include "vk_residency.h"
+#include "vk_defragmenter.h"
+#include "vk_culling.h"
+#include "vk_gpu_culling.h"
+#include "vk_depth_pyramid.h"
+#include "vk_occlusion.h"
+#include "vk_clustered_lighting.h"
+#include "vk_render_queue.h"
+#include "vk_secondary_commands.h"
+#include "vk_pipeline_cache.h"
+#include "vk_pipeline_compiler.h"
+#include "vk_shader_permutations.h"
+#include "vk_shader_reloader.h"
 
 #include <glm/glm.hpp>
 #include <vector>
 #include <functional>
 #include <deque>
+#include <mutex>
 
 struct Material {
 	VkPipeline pipeline;
 	VkPipelineLayout pipelineLayout;
 	VkDescriptorSet textureSet{VK_NULL_HANDLE};
+	//set for materials compiled on the workers, pipeline stays null and their draws wait for it
+	PipelineHandle pipelineHandle{ INVALID_PIPELINE_HANDLE };
+
+	//small ids packed into the render queue keys
+	uint32_t pipelineId{ 0 };
+	uint32_t sortId{ 0 };
+	bool transparent{ false };
 };
 
 struct RenderObject {
@@ -57,7 +83,10 @@ struct GPUSceneData {
 	glm::vec4 fogDistances;
 	glm::vec4 ambientColor;
 	glm::vec4 sunlightDirection;
+	//w is the intensity
 	glm::vec4 sunlightColor;
+	//turns a fragment into its light cluster, see ClusteredLighting::cluster_scale
+	glm::vec4 clusterScale;
 };
 
 struct FrameData {
@@ -67,17 +96,56 @@ struct FrameData {
 	VkCommandPool m_commandPool;
 	VkCommandBuffer m_mainCommandBuffer;
 
-	AllocatedBuffer cameraBuffer;
+	//the render pass contents, recorded by the workers and executed from the main buffer
+	SecondaryCommands secondaryCommands;
+
+	//per frame uniform and storage data, reset once the render fence signaled
+	FrameAllocator dynamicData;
+
+	//camera and scene data, bound with the dynamic offsets below
 	VkDescriptorSet m_globalDescriptor;
+	uint32_t cameraOffset;
+	uint32_t sceneOffset;
 
-	AllocatedBuffer objectBuffer;
 	VkDescriptorSet objectDescriptor;
+
+	//indirect commands of the visible model meshes in the order of m_visible, so a chunk of the list is one draw call
+	uint32_t modelDrawOffset;
+	bool modelDrawsWritten{ false };
+
+	//model textures, written again whenever the streamer swapped a view
+	VkDescriptorSet textureDescriptor;
+	uint64_t textureGeneration;
+
+	//fragment shader invocations of the main pass, read back once the render fence signaled
+	VkQueryPool statisticsQuery{ VK_NULL_HANDLE };
+	bool statisticsPending{ false };
 };
 
 struct GPUObjectData {
 	glm::mat4 modelMatrix;
 };
 
+//matches Material in model_lighting.frag, indices into the bindless texture array
+struct GPUMaterial {
+	uint32_t diffuse;
+	uint32_t specular;
+	uint32_t padding[2];
+};
+
+//a model mesh read back from the baked model on a worker, waiting for the main thread to upload it
+struct MeshReload {
+	size_t index;
+	Mesh mesh;
+	bool loaded;
+};
+
+//a pipeline rebuilt on a worker after its shader changed, swap puts it in place on the main thread
+struct PipelineReload {
+	PipelineHandle handle;
+	std::function<void(VkPipeline)> swap;
+};
+
 struct UploadContext {
 	VkFence uploadFence;
 	VkCommandPool commandPool;
@@ -86,6 +154,52 @@ struct UploadContext {
 
 constexpr unsigned int FRAME_OVERLAP = 2;
 
+constexpr VkDeviceSize FRAME_ALLOCATOR_SIZE = 8 * 1024 * 1024;
+
+constexpr uint32_t GEOMETRY_ARENA_VERTICES = 1 << 20;
+constexpr uint32_t GEOMETRY_ARENA_INDICES = 1 << 22;
+
+//source assets are baked in here on their first load, entries are keyed by source hash and baker version
+constexpr const char* ASSET_CACHE_DIRECTORY = "../../assets/.cache";
+
+//driver pipeline cache, validated against the device before it gets used
+constexpr const char* PIPELINE_CACHE_PATH = "../../assets/.cache/pipelines.bin";
+
+//edited shaders get recompiled from here while the app runs
+constexpr const char* SHADER_DIRECTORY = "../../shaders";
+
+#ifndef GLSL_VALIDATOR_PATH
+#define GLSL_VALIDATOR_PATH "glslangValidator"
+#endif
+
+//VRAM the streamed textures may take, the mip tails are always resident on top of their share
+constexpr VkDeviceSize TEXTURE_STREAMING_BUDGET = 256 * 1024 * 1024;
+
+//share of the device local budget at which least recently used resources start getting evicted
+constexpr float RESIDENCY_PRESSURE_THRESHOLD = 0.9f;
+
+//fewest draws a recording worker gets, smaller lists stay on one thread
+constexpr size_t SECONDARY_RECORD_CHUNK = 256;
+
+//most draws the compute culling pass handles
+constexpr uint32_t GPU_CULL_MAX_OBJECTS = 4096;
+
+//size of the bindless texture array, clamped to the update after bind limits of the device
+constexpr uint32_t MAX_BINDLESS_TEXTURES = 4096;
+
+//model meshes with a bounding radius of at least this share of the largest one are occluders
+constexpr float DEPTH_PREPASS_OCCLUDER_SHARE = 0.1f;
+
+//clip planes of the camera, the light clusters are sliced between them
+constexpr float CAMERA_NEAR = 0.1f;
+constexpr float CAMERA_FAR = 200.f;
+
+//lights scattered around the model at startup, up to MAX_LIGHTS can be turned on
+constexpr int DEFAULT_LIGHT_COUNT = 256;
+
+//radians the lights orbit the model by every frame
+constexpr float LIGHT_ORBIT_SPEED = 0.002f;
+
 class VulkanEngine {
 public:
 
@@ -102,6 +216,12 @@ public:
 
 	VkQueue m_graphicsQueue;
 	uint32_t m_graphicsQueueFamily;
+	//guards the graphics queue when uploads are submitted to it from the transfer thread
+	std::mutex m_graphicsQueueMutex;
+
+	VkQueue m_transferQueue;
+	uint32_t m_transferQueueFamily;
+	TransferQueue m_transfer;
 
 	FrameData m_frames[FRAME_OVERLAP];
 	FrameData& get_current_frame();
@@ -109,25 +229,114 @@ public:
 	UploadContext m_uploadContext;
 
 	VkDescriptorPool m_descriptorPool;
+	//holds the update after bind texture sets, which can't share a pool with the other sets
+	VkDescriptorPool m_bindlessPool;
+	uint32_t m_bindlessTextureCount{ 0 };
 
 	VkDescriptorSetLayout m_sceneSetLayout;
+	VkDescriptorSetLayout m_objectSetLayout;
 	VkDescriptorSetLayout m_textureSetLayout;
 
-	VkDescriptorSet m_textureDescriptorSet;
+	VkSampler m_modelSampler;
+	//one material per model mesh, the draws pick theirs through the first instance
+	AllocatedBuffer m_materialBuffer;
 
 	GPUSceneData m_sceneParameters;
-	AllocatedBuffer m_sceneParameterBuffer;
 
 	VkRenderPass m_renderPass;
 	std::vector<VkFramebuffer> m_framebuffers;
 
+	//the depth prepass fills the depth image alone, the main pass then loads it instead of clearing.
+	//Both main passes are compatible, so they share the framebuffers and pipelines
+	VkRenderPass m_depthPrepassRenderPass;
+	//the late occlusion phase adds its draws to the depth of the early one
+	VkRenderPass m_depthPrepassLoadRenderPass;
+	VkRenderPass m_depthLoadRenderPass;
+	VkFramebuffer m_depthFramebuffer;
+
 	VkPipelineLayout m_pipelineLayout;
-	VkPipeline m_pipeline;
+	//the model pipeline compiles on the workers, the flat fallback draws the model until it is ready
+	PipelineHandle m_modelPipeline{ INVALID_PIPELINE_HANDLE };
+	//permutations of model_lighting.frag, the last ready one keeps drawing while a new one compiles
+	ShaderPermutations m_modelPermutations;
+	uint32_t m_modelFeatures{ 0 };
+	VkPipeline m_fallbackPipeline;
+
+	//the same permutations with an equal depth test and no depth writes, for meshes already in the prepass
+	ShaderPermutations m_modelPrepassPermutations;
+	PipelineHandle m_modelPrepassPipeline{ INVALID_PIPELINE_HANDLE };
+	VkPipeline m_depthPipeline{ VK_NULL_HANDLE };
+	bool m_depthPrepass{ true };
+	bool m_prepassClasses[(size_t)MeshClass::Count]{ true, false };
+	//the visible meshes the prepass draws are the first ones of m_visible
+	size_t m_prepassCount{ 0 };
+
+	bool m_pipelineStatistics{ false };
+	uint64_t m_fragmentInvocations{ 0 };
+	PipelineCompiler m_pipelineCompiler;
+
+	//every pipeline is created through it, so later runs skip the driver compiles
+	PipelineCache m_pipelineCache;
+
+	//pipelines a reload replaced are released to the pipeline cache, which destroys them
+	//once no frame in flight can use them anymore
+	ShaderReloader m_shaderReloader;
+	std::vector<PipelineReload> m_pipelineReloads;
+	//permutations dropped by a reload, released once they compiled and no draw uses them
+	std::vector<PipelineHandle> m_stalePipelines;
 
 	DeletionQueue m_deletionQueue;
 
 	VmaAllocator m_allocator;
 
+	GeometryArena m_geometry;
+
+	ThreadPool m_threadPool;
+
+	TextureStreamer m_textureStreamer;
+
+	ResidencyManager m_residency;
+
+	Defragmenter m_defragmenter;
+
+	//frustum of the frame being recorded, and the matrix it came from
+	vkutil::Frustum m_frustum;
+	glm::mat4 m_viewproj{ 1.f };
+	glm::mat4 m_view{ 1.f };
+	glm::mat4 m_projection{ 1.f };
+	FrustumCuller m_culler;
+	//world space bounds of the model meshes, and of the renderables rebuilt every draw
+	vkutil::CullingBounds m_modelBounds;
+	vkutil::CullingBounds m_objectBounds;
+	std::vector<uint32_t> m_visible;
+
+	//when the cpu records every draw, the occluder meshes are rasterized on the cpu to drop the meshes they hide
+	OcclusionRasterizer m_occlusionRasterizer;
+	//mesh index of every occluder id
+	std::vector<uint32_t> m_occluderMeshes;
+	bool m_cpuOcclusionCulling{ true };
+
+	//the model is lit by the first m_activeLights of these, through the light lists of its clusters
+	ClusteredLighting m_lighting;
+	std::vector<Light> m_lights;
+	glm::vec3 m_lightCenter{ 0.f };
+	int m_activeLights{ DEFAULT_LIGHT_COUNT };
+	bool m_gpuLightBinning{ true };
+
+	//visible model meshes and renderables, ordered by state and depth before they get drawn
+	RenderQueue m_renderQueue;
+	std::unordered_map<VkPipeline, uint32_t> m_pipelineIds;
+	uint32_t m_nextMeshId{ 0 };
+
+	//the model draws from commands the compute culling pass wrote, the cpu cull above still feeds the streaming
+	GPUCuller m_gpuCuller;
+	bool m_gpuCulling{ true };
+	//built from the early prepass draws, the late culling phase tests the rest of the objects against it
+	DepthPyramid m_depthPyramid;
+	bool m_occlusionCulling{ true };
+	bool m_drawIndirectCount{ false };
+	bool m_multiDrawIndirect{ false };
+
 	VkPipeline m_meshPipeline;
 	Mesh m_triangleMesh;
 
@@ -149,6 +358,10 @@ public:
 
 	Model m_importedModel;
 
+	//the workers hand back the meshes they reloaded here, update_mesh_reloads uploads them
+	std::mutex m_meshReloadMutex;
+	std::vector<MeshReload> m_meshReloads;
+
 	Camera m_camera;
 	CameraInfo m_cameraInfo;
 
@@ -174,32 +387,69 @@ public:
 
 	AllocatedBuffer create_buffer(size_t allocSize, VkBufferUsageFlags usage, VmaMemoryUsage memoryUsage);
 
+	//outHash receives a hash of the SPIR-V, for pipelines shared through the pipeline cache
+	bool load_shader_module(const char* filePath, VkShaderModule* output, uint64_t* outHash = nullptr);
+
 private:
-	void init_vulkan();
+	//false when no device can run the engine, nothing is left to clean up then
+	bool init_vulkan();
+	bool supports_device_extension(const char* name);
 	void init_swapchain();
 	void init_commands();
 	void init_default_renderpass();
 	void init_framebuffers();
 	void init_sync_structures();
 	void init_pipelines();
+	//safe to call from the workers, everything it reads is set before the pipelines get requested
+	VkPipeline build_model_pipeline(const char* vertexPath, const char* fragmentPath,
+		SpecializationConstants fragmentConstants = {}, bool afterPrepass = false);
+	PipelineHandle request_model_pipeline(uint32_t features, bool afterPrepass = false);
+	VkPipeline build_depth_pipeline();
 	void init_scene();
 	void init_descriptors();
 	void init_imgui();
 
-	bool load_shader_module(const char* filePath, VkShaderModule* output);
-
 	Material* create_material(VkPipeline pipeline, VkPipelineLayout layout, const std::string& name);
 	Material* get_material(const std::string& name);
 	Mesh* get_mesh(const std::string& name);
 
+	void update_frame_data();
+
+	void init_lights();
+	void update_lights();
 	void draw_objects(VkCommandBuffer cmd, RenderObject* first, int count);
-	void draw_model(VkCommandBuffer cmd);
+	//visibility and streaming feedback of the model meshes, both passes draw from its list
+	void cull_model();
+	bool model_textures_resident();
+	bool mesh_textures_resident(const Mesh& mesh);
+	bool depth_prepass_active();
+	void draw_depth_prepass(CullPhase phase);
+	void draw_model();
+	//the visible meshes in [begin, end), from the indirect commands when the frame has them
+	void draw_visible_meshes(VkCommandBuffer cmd, size_t begin, size_t end);
+	//pipelines take their viewport and scissor from the dynamic state
+	void set_viewport(VkCommandBuffer cmd);
+	void write_texture_descriptors(FrameData& frame);
+
+	//rough diameter in pixels the bounds cover on screen
+	float screen_size(const glm::vec3& center, float radius);
 
 	void load_images();
 	void load_model();
 
 	void load_meshes();
-	void upload_mesh(Mesh& mesh);
+	//onResident runs on the main thread once the mesh can be drawn
+	//returns false when the mesh couldn't be queued, onResident never runs then
+	bool upload_mesh(Mesh& mesh, std::function<void()>&& onResident = nullptr);
+	//uploads a mesh of the model, the compute culling picks up its ranges once it is resident
+	void upload_model_mesh(size_t index);
+	//brings an evicted model mesh back, reading its released data from disk on a worker first
+	void restore_model_mesh(size_t index);
+	void update_mesh_reloads();
+
+	//compiles the pipeline on a worker, swap runs on the main thread once it is ready
+	void reload_pipeline(std::function<VkPipeline()>&& build, std::function<void(VkPipeline)>&& swap);
+	void update_pipeline_reloads();
 
 	size_t pad_uniform_buffer_size(size_t originalSize);
 };
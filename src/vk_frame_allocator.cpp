@@ -0,0 +1,44 @@
+#include "vk_frame_allocator.h"
+
+void FrameAllocator::init(VmaAllocator allocator, VkDeviceSize size, VkDeviceSize alignment, VkBufferUsageFlags usage) {
+	m_allocator = allocator;
+	m_size = size;
+	m_alignment = alignment > 0 ? alignment : 1;
+	m_head = 0;
+
+	VkBufferCreateInfo bufferInfo = {};
+	bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+	bufferInfo.pNext = nullptr;
+	bufferInfo.size = size;
+	bufferInfo.usage = usage;
+
+	//coherent memory so the writes never need a flush
+	VmaAllocationCreateInfo vmaallocInfo = {};
+	vmaallocInfo.usage = VMA_MEMORY_USAGE_CPU_TO_GPU;
+	vmaallocInfo.flags = VMA_ALLOCATION_CREATE_MAPPED_BIT;
+	vmaallocInfo.requiredFlags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+
+	VmaAllocationInfo allocationInfo;
+	VK_CHECK(vmaCreateBuffer(m_allocator, &bufferInfo, &vmaallocInfo,
+		&m_buffer.m_buffer, &m_buffer.m_allocation, &allocationInfo));
+
+	m_mapped = static_cast<char*>(allocationInfo.pMappedData);
+}
+
+void FrameAllocator::cleanup() {
+	vmaDestroyBuffer(m_allocator, m_buffer.m_buffer, m_buffer.m_allocation);
+	m_mapped = nullptr;
+}
+
+void* FrameAllocator::allocate(VkDeviceSize size, uint32_t& outOffset) {
+	VkDeviceSize offset = (m_head + m_alignment - 1) & ~(m_alignment - 1);
+
+	if (offset + size > m_size) {
+		std::cout << "Frame allocator is out of space, " << size << " bytes requested" << std::endl;
+		return nullptr;
+	}
+
+	m_head = offset + size;
+	outOffset = (uint32_t)offset;
+	return m_mapped + offset;
+}
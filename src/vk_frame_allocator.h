@@ -0,0 +1,35 @@
+#pragma once
+
+#include "vk_types.h"
+
+//linear allocator over a persistently mapped, host coherent buffer owned by one frame in flight.
+//Slices are bound through dynamic offsets, and everything is released at once by reset()
+//after the frame fence signaled, so writing per frame data is a plain store
+class FrameAllocator {
+public:
+	void init(VmaAllocator allocator, VkDeviceSize size, VkDeviceSize alignment, VkBufferUsageFlags usage);
+	void cleanup();
+
+	//returns nullptr when the frame ran out of space
+	void* allocate(VkDeviceSize size, uint32_t& outOffset);
+
+	template<typename T>
+	T* allocate(uint32_t& outOffset, size_t count = 1) {
+		return static_cast<T*>(allocate(sizeof(T) * count, outOffset));
+	}
+
+	void reset() { m_head = 0; }
+
+	VkBuffer buffer() const { return m_buffer.m_buffer; }
+	VkDeviceSize used() const { return m_head; }
+	VkDeviceSize size() const { return m_size; }
+
+private:
+	VmaAllocator m_allocator{ VK_NULL_HANDLE };
+	AllocatedBuffer m_buffer{};
+	char* m_mapped{ nullptr };
+
+	VkDeviceSize m_size{ 0 };
+	VkDeviceSize m_alignment{ 1 };
+	VkDeviceSize m_head{ 0 };
+};
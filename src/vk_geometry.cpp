@@ -0,0 +1,130 @@
+#include "vk_geometry.h"
+#include "vk_mesh.h"
+
+void vkutil::FreeListAllocator::init(uint64_t capacity) {
+	m_capacity = capacity;
+	m_freeSpace = capacity;
+	m_freeBlocks.clear();
+	if (capacity > 0) m_freeBlocks[0] = capacity;
+}
+
+bool vkutil::FreeListAllocator::allocate(uint64_t size, uint64_t& outOffset) {
+	if (size == 0) {
+		outOffset = 0;
+		return true;
+	}
+
+	for (auto it = m_freeBlocks.begin(); it != m_freeBlocks.end(); ++it) {
+		if (it->second < size) continue;
+
+		outOffset = it->first;
+		uint64_t remaining = it->second - size;
+		m_freeBlocks.erase(it);
+
+		if (remaining > 0) m_freeBlocks[outOffset + size] = remaining;
+
+		m_freeSpace -= size;
+		return true;
+	}
+	return false;
+}
+
+void vkutil::FreeListAllocator::free(uint64_t offset, uint64_t size) {
+	if (size == 0) return;
+	m_freeSpace += size;
+
+	auto next = m_freeBlocks.lower_bound(offset);
+
+	//merge with the block right before
+	if (next != m_freeBlocks.begin()) {
+		auto prev = std::prev(next);
+		if (prev->first + prev->second == offset) {
+			offset = prev->first;
+			size += prev->second;
+			m_freeBlocks.erase(prev);
+		}
+	}
+
+	//merge with the block right after
+	if (next != m_freeBlocks.end() && offset + size == next->first) {
+		size += next->second;
+		m_freeBlocks.erase(next);
+	}
+
+	m_freeBlocks[offset] = size;
+}
+
+uint64_t vkutil::FreeListAllocator::largest_free_block() const {
+	uint64_t largest = 0;
+	for (auto& block : m_freeBlocks) {
+		if (block.second > largest) largest = block.second;
+	}
+	return largest;
+}
+
+void GeometryArena::init(VmaAllocator allocator, uint32_t vertexCapacity, uint32_t indexCapacity) {
+	m_allocator = allocator;
+
+	VkBufferCreateInfo bufferInfo = {};
+	bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+	bufferInfo.pNext = nullptr;
+
+	VmaAllocationCreateInfo vmaallocInfo = {};
+	vmaallocInfo.usage = VMA_MEMORY_USAGE_GPU_ONLY;
+
+	bufferInfo.size = (VkDeviceSize)vertexCapacity * sizeof(Vertex);
+	bufferInfo.usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+	VK_CHECK(vmaCreateBuffer(m_allocator, &bufferInfo, &vmaallocInfo,
+		&m_vertexBuffer.m_buffer, &m_vertexBuffer.m_allocation, nullptr));
+
+	bufferInfo.size = (VkDeviceSize)vertexCapacity * sizeof(glm::vec3);
+	VK_CHECK(vmaCreateBuffer(m_allocator, &bufferInfo, &vmaallocInfo,
+		&m_positionBuffer.m_buffer, &m_positionBuffer.m_allocation, nullptr));
+
+	bufferInfo.size = (VkDeviceSize)indexCapacity * sizeof(uint32_t);
+	bufferInfo.usage = VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+	VK_CHECK(vmaCreateBuffer(m_allocator, &bufferInfo, &vmaallocInfo,
+		&m_indexBuffer.m_buffer, &m_indexBuffer.m_allocation, nullptr));
+
+	m_vertexRanges.init(vertexCapacity);
+	m_indexRanges.init(indexCapacity);
+}
+
+void GeometryArena::cleanup() {
+	vmaDestroyBuffer(m_allocator, m_vertexBuffer.m_buffer, m_vertexBuffer.m_allocation);
+	vmaDestroyBuffer(m_allocator, m_positionBuffer.m_buffer, m_positionBuffer.m_allocation);
+	vmaDestroyBuffer(m_allocator, m_indexBuffer.m_buffer, m_indexBuffer.m_allocation);
+}
+
+bool GeometryArena::allocate(Mesh& mesh) {
+	uint64_t vertexOffset, firstIndex;
+
+	if (!m_vertexRanges.allocate(mesh.m_vertexCount, vertexOffset)) return false;
+
+	if (!m_indexRanges.allocate(mesh.m_indexCount, firstIndex)) {
+		m_vertexRanges.free(vertexOffset, mesh.m_vertexCount);
+		return false;
+	}
+
+	mesh.m_vertexOffset = (uint32_t)vertexOffset;
+	mesh.m_firstIndex = (uint32_t)firstIndex;
+	return true;
+}
+
+void GeometryArena::free(Mesh& mesh) {
+	m_vertexRanges.free(mesh.m_vertexOffset, mesh.m_vertexCount);
+	m_indexRanges.free(mesh.m_firstIndex, mesh.m_indexCount);
+	mesh.m_resident = false;
+}
+
+void GeometryArena::bind(VkCommandBuffer cmd) const {
+	VkDeviceSize offset = 0;
+	vkCmdBindVertexBuffers(cmd, 0, 1, &m_vertexBuffer.m_buffer, &offset);
+	vkCmdBindIndexBuffer(cmd, m_indexBuffer.m_buffer, 0, VK_INDEX_TYPE_UINT32);
+}
+
+void GeometryArena::bind_positions(VkCommandBuffer cmd) const {
+	VkDeviceSize offset = 0;
+	vkCmdBindVertexBuffers(cmd, 0, 1, &m_positionBuffer.m_buffer, &offset);
+	vkCmdBindIndexBuffer(cmd, m_indexBuffer.m_buffer, 0, VK_INDEX_TYPE_UINT32);
+}
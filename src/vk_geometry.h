@@ -0,0 +1,62 @@
+#pragma once
+
+#include "vk_types.h"
+
+#include <map>
+
+struct Mesh;
+
+namespace vkutil {
+	//first-fit free list over an abstract range, neighbouring free blocks are merged back on free
+	class FreeListAllocator {
+	public:
+		void init(uint64_t capacity);
+
+		bool allocate(uint64_t size, uint64_t& outOffset);
+		void free(uint64_t offset, uint64_t size);
+
+		uint64_t capacity() const { return m_capacity; }
+		uint64_t free_space() const { return m_freeSpace; }
+		uint64_t largest_free_block() const;
+
+	private:
+		//offset -> size of every free block
+		std::map<uint64_t, uint64_t> m_freeBlocks;
+		uint64_t m_capacity{ 0 };
+		uint64_t m_freeSpace{ 0 };
+	};
+}
+
+//one device local vertex buffer and one index buffer shared by every mesh.
+//Meshes only own ranges inside them, so draws never rebind geometry.
+//The positions are also kept apart in a compact stream at the same vertex offsets, for depth only draws
+class GeometryArena {
+public:
+	void init(VmaAllocator allocator, uint32_t vertexCapacity, uint32_t indexCapacity);
+	void cleanup();
+
+	//reserves the ranges for the mesh vertices and indices and fills its offsets
+	bool allocate(Mesh& mesh);
+	void free(Mesh& mesh);
+
+	VkBuffer vertex_buffer() const { return m_vertexBuffer.m_buffer; }
+	VkBuffer position_buffer() const { return m_positionBuffer.m_buffer; }
+	VkBuffer index_buffer() const { return m_indexBuffer.m_buffer; }
+
+	void bind(VkCommandBuffer cmd) const;
+	void bind_positions(VkCommandBuffer cmd) const;
+
+	const vkutil::FreeListAllocator& vertex_ranges() const { return m_vertexRanges; }
+	const vkutil::FreeListAllocator& index_ranges() const { return m_indexRanges; }
+
+private:
+	VmaAllocator m_allocator{ VK_NULL_HANDLE };
+
+	AllocatedBuffer m_vertexBuffer{};
+	AllocatedBuffer m_positionBuffer{};
+	AllocatedBuffer m_indexBuffer{};
+
+	//both are counted in elements, not bytes
+	vkutil::FreeListAllocator m_vertexRanges;
+	vkutil::FreeListAllocator m_indexRanges;
+};
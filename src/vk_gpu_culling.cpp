@@ -0,0 +1,311 @@
+#include "vk_gpu_culling.h"
+#include "vk_engine.h"
+#include "vk_initializers.h"
+
+#include <algorithm>
+
+//vkCmdUpdateBuffer takes at most this many bytes per call
+constexpr VkDeviceSize UPDATE_BUFFER_LIMIT = 65536;
+
+void GPUCuller::init(VulkanEngine* engine, uint32_t capacity, uint32_t framesInFlight,
+	bool drawIndirectCount, bool multiDrawIndirect, const DepthPyramid& pyramid)
+{
+	m_engine = engine;
+	m_capacity = capacity;
+	m_drawIndirectCount = drawIndirectCount;
+	m_multiDrawIndirect = multiDrawIndirect;
+	m_pyramidExtent = pyramid.extent();
+	m_pyramidLevels = pyramid.level_count();
+
+	m_objectBuffer = m_engine->create_buffer(capacity * sizeof(GPUDrawObject),
+		VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_ONLY);
+	m_visibilityBuffer = m_engine->create_buffer(capacity * sizeof(uint32_t),
+		VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_ONLY);
+
+	init_pipeline();
+
+	VkDescriptorBufferInfo objectInfo = { m_objectBuffer.m_buffer, 0, VK_WHOLE_SIZE };
+	VkDescriptorBufferInfo visibilityInfo = { m_visibilityBuffer.m_buffer, 0, VK_WHOLE_SIZE };
+
+	VkDescriptorImageInfo pyramidInfo = {};
+	pyramidInfo.sampler = pyramid.sampler();
+	pyramidInfo.imageView = pyramid.view();
+	pyramidInfo.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+
+	//the commands of a frame are read while the next one is culled, so every frame writes its own
+	m_frames.resize(framesInFlight);
+	for (FrameBuffers& frame : m_frames) {
+		frame.constants = m_engine->create_buffer(sizeof(GPUCullConstants),
+			VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_ONLY);
+		VkDescriptorBufferInfo constantsInfo = { frame.constants.m_buffer, 0, sizeof(GPUCullConstants) };
+
+		for (PhaseBuffers& phase : frame.phases) {
+			phase.draws = m_engine->create_buffer(capacity * sizeof(VkDrawIndexedIndirectCommand),
+				VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT, VMA_MEMORY_USAGE_GPU_ONLY);
+			phase.count = m_engine->create_buffer(sizeof(uint32_t),
+				VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+				VMA_MEMORY_USAGE_GPU_ONLY);
+
+			VkDescriptorSetAllocateInfo allocInfo = {};
+			allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+			allocInfo.pNext = nullptr;
+			allocInfo.descriptorPool = m_engine->m_descriptorPool;
+			allocInfo.descriptorSetCount = 1;
+			allocInfo.pSetLayouts = &m_setLayout;
+
+			VK_CHECK(vkAllocateDescriptorSets(m_engine->m_device, &allocInfo, &phase.descriptor));
+
+			VkDescriptorBufferInfo drawInfo = { phase.draws.m_buffer, 0, VK_WHOLE_SIZE };
+			VkDescriptorBufferInfo countInfo = { phase.count.m_buffer, 0, VK_WHOLE_SIZE };
+
+			VkWriteDescriptorSet writes[] = {
+				vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, phase.descriptor, &objectInfo, 0),
+				vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, phase.descriptor, &drawInfo, 1),
+				vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, phase.descriptor, &countInfo, 2),
+				vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, phase.descriptor, &visibilityInfo, 3),
+				vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, phase.descriptor, &constantsInfo, 4),
+				vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, phase.descriptor, &pyramidInfo, 5)
+			};
+			vkUpdateDescriptorSets(m_engine->m_device, 6, writes, 0, nullptr);
+		}
+	}
+}
+
+void GPUCuller::cleanup() {
+	VmaAllocator allocator = m_engine->m_allocator;
+
+	for (FrameBuffers& frame : m_frames) {
+		for (PhaseBuffers& phase : frame.phases) {
+			vmaDestroyBuffer(allocator, phase.draws.m_buffer, phase.draws.m_allocation);
+			vmaDestroyBuffer(allocator, phase.count.m_buffer, phase.count.m_allocation);
+		}
+		vmaDestroyBuffer(allocator, frame.constants.m_buffer, frame.constants.m_allocation);
+	}
+	m_frames.clear();
+
+	vmaDestroyBuffer(allocator, m_objectBuffer.m_buffer, m_objectBuffer.m_allocation);
+	vmaDestroyBuffer(allocator, m_visibilityBuffer.m_buffer, m_visibilityBuffer.m_allocation);
+
+	vkDestroyPipeline(m_engine->m_device, m_pipeline, nullptr);
+	vkDestroyPipelineLayout(m_engine->m_device, m_pipelineLayout, nullptr);
+	vkDestroyDescriptorSetLayout(m_engine->m_device, m_setLayout, nullptr);
+}
+
+void GPUCuller::init_pipeline() {
+	VkDescriptorSetLayoutBinding bindings[] = {
+		vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 0),
+		vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 1),
+		vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 2),
+		vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 3),
+		vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 4),
+		vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_COMPUTE_BIT, 5)
+	};
+
+	VkDescriptorSetLayoutCreateInfo setLayoutInfo = vkinit::descriptorset_layout_create_info(bindings, 6);
+	VK_CHECK(vkCreateDescriptorSetLayout(m_engine->m_device, &setLayoutInfo, nullptr, &m_setLayout));
+
+	//the view projection matrix doesn't fit next to the planes, so only the phase is pushed
+	VkPushConstantRange pushConstant;
+	pushConstant.offset = 0;
+	pushConstant.size = sizeof(uint32_t);
+	pushConstant.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+
+	VkPipelineLayoutCreateInfo layoutInfo = vkinit::pipeline_layout_create_info();
+	layoutInfo.setLayoutCount = 1;
+	layoutInfo.pSetLayouts = &m_setLayout;
+	layoutInfo.pushConstantRangeCount = 1;
+	layoutInfo.pPushConstantRanges = &pushConstant;
+
+	VK_CHECK(vkCreatePipelineLayout(m_engine->m_device, &layoutInfo, nullptr, &m_pipelineLayout));
+
+	m_pipeline = build_pipeline();
+}
+
+VkPipeline GPUCuller::build_pipeline() const {
+	VkShaderModule cullShader;
+	if (!m_engine->load_shader_module("../../shaders/indirect_cull.comp.spv", &cullShader)) {
+		std::cout << "Error when building the indirect cull compute shader" << std::endl;
+		return VK_NULL_HANDLE;
+	}
+
+	VkComputePipelineCreateInfo pipelineInfo = {};
+	pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+	pipelineInfo.pNext = nullptr;
+	pipelineInfo.stage = vkinit::pipeline_shader_stage_create_info(VK_SHADER_STAGE_COMPUTE_BIT, cullShader);
+	pipelineInfo.layout = m_pipelineLayout;
+
+	//a reloaded shader may not link, the previous pipeline then keeps running
+	VkPipeline pipeline;
+	if (vkCreateComputePipelines(m_engine->m_device, m_engine->m_pipelineCache.handle(), 1, &pipelineInfo, nullptr, &pipeline) != VK_SUCCESS) {
+		std::cout << "failed to create compute pipeline\n";
+		pipeline = VK_NULL_HANDLE;
+	}
+
+	vkDestroyShaderModule(m_engine->m_device, cullShader, nullptr);
+
+	return pipeline;
+}
+
+VkPipeline GPUCuller::swap_pipeline(VkPipeline pipeline) {
+	VkPipeline previous = m_pipeline;
+	m_pipeline = pipeline;
+	return previous;
+}
+
+void GPUCuller::set_object_count(uint32_t count) {
+	count = std::min(count, m_capacity);
+	m_objects.resize(count, GPUDrawObject{});
+	m_dirty = true;
+	m_resetVisibility = true;
+}
+
+void GPUCuller::set_object(uint32_t index, const Mesh& mesh) {
+	if (index >= m_objects.size()) return;
+
+	GPUDrawObject& object = m_objects[index];
+	object.sphere = glm::vec4(mesh.m_boundsOrigin, mesh.m_boundsRadius);
+	object.indexCount = mesh.m_indexCount;
+	object.firstIndex = mesh.m_firstIndex;
+	object.vertexOffset = (int32_t)mesh.m_vertexOffset;
+	object.resident = mesh.m_resident ? 1 : 0;
+	m_dirty = true;
+}
+
+void GPUCuller::upload_objects(VkCommandBuffer cmd) {
+	VkBufferMemoryBarrier toTransfer = vkinit::buffer_barrier(m_objectBuffer.m_buffer,
+		VK_ACCESS_SHADER_READ_BIT, VK_ACCESS_TRANSFER_WRITE_BIT);
+
+	//earlier frames on this queue may still be culling with the old objects
+	vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0,
+		0, nullptr, 1, &toTransfer, 0, nullptr);
+
+	//changes are rare and small, so they go inline with the frame instead of through a staging buffer
+	const char* data = reinterpret_cast<const char*>(m_objects.data());
+	VkDeviceSize size = m_objects.size() * sizeof(GPUDrawObject);
+	for (VkDeviceSize offset = 0; offset < size; offset += UPDATE_BUFFER_LIMIT) {
+		VkDeviceSize chunk = std::min(UPDATE_BUFFER_LIMIT, size - offset);
+		vkCmdUpdateBuffer(cmd, m_objectBuffer.m_buffer, offset, chunk, data + offset);
+	}
+
+	VkBufferMemoryBarrier toCompute = vkinit::buffer_barrier(m_objectBuffer.m_buffer,
+		VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT);
+
+	vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,
+		0, nullptr, 1, &toCompute, 0, nullptr);
+
+	m_dirty = false;
+}
+
+void GPUCuller::record_culling(VkCommandBuffer cmd, uint32_t frameIndex, const vkutil::Frustum& frustum,
+	const glm::mat4& viewproj, bool occlusion)
+{
+	if (m_objects.empty() || m_pipeline == VK_NULL_HANDLE) return;
+
+	if (m_dirty) upload_objects(cmd);
+
+	FrameBuffers& frame = m_frames[frameIndex];
+	frame.occlusion = occlusion;
+
+	GPUCullConstants constants = {};
+	constants.viewproj = viewproj;
+	for (int i = 0; i < 6; i++) {
+		constants.planes[i] = frustum.planes[i];
+	}
+	constants.pyramidSize = glm::vec2(m_pyramidExtent.width, m_pyramidExtent.height);
+	constants.objectCount = (uint32_t)m_objects.size();
+	constants.compact = m_drawIndirectCount ? 1 : 0;
+	constants.occlusion = occlusion ? 1 : 0;
+	constants.pyramidLevels = m_pyramidLevels;
+
+	//the frame fence already covered the last reads of these, so they are written right away
+	vkCmdUpdateBuffer(cmd, frame.constants.m_buffer, 0, sizeof(GPUCullConstants), &constants);
+	vkCmdFillBuffer(cmd, frame.phases[0].count.m_buffer, 0, sizeof(uint32_t), 0);
+	vkCmdFillBuffer(cmd, frame.phases[1].count.m_buffer, 0, sizeof(uint32_t), 0);
+
+	std::vector<VkBufferMemoryBarrier> barriers = {
+		vkinit::buffer_barrier(frame.constants.m_buffer, VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_UNIFORM_READ_BIT),
+		vkinit::buffer_barrier(frame.phases[0].count.m_buffer, VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT),
+		vkinit::buffer_barrier(frame.phases[1].count.m_buffer, VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT)
+	};
+
+	VkPipelineStageFlags srcStages = VK_PIPELINE_STAGE_TRANSFER_BIT;
+	if (m_resetVisibility) {
+		//the late phase of an earlier frame may still be writing the old flags
+		VkBufferMemoryBarrier visibilityReset = vkinit::buffer_barrier(m_visibilityBuffer.m_buffer,
+			VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_TRANSFER_WRITE_BIT);
+		vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0,
+			0, nullptr, 1, &visibilityReset, 0, nullptr);
+
+		vkCmdFillBuffer(cmd, m_visibilityBuffer.m_buffer, 0, VK_WHOLE_SIZE, 0);
+		barriers.push_back(vkinit::buffer_barrier(m_visibilityBuffer.m_buffer,
+			VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT));
+		m_resetVisibility = false;
+	} else {
+		//flags written by the late phase of the last frame
+		barriers.push_back(vkinit::buffer_barrier(m_visibilityBuffer.m_buffer,
+			VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT));
+		srcStages |= VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+	}
+
+	vkCmdPipelineBarrier(cmd, srcStages, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,
+		0, nullptr, (uint32_t)barriers.size(), barriers.data(), 0, nullptr);
+
+	dispatch(cmd, frame, CullPhase::Early);
+}
+
+void GPUCuller::record_late_culling(VkCommandBuffer cmd, uint32_t frameIndex) {
+	if (m_objects.empty() || m_pipeline == VK_NULL_HANDLE) return;
+
+	FrameBuffers& frame = m_frames[frameIndex];
+	if (!frame.occlusion) return;
+
+	//the early phase read the flags this one rewrites
+	VkBufferMemoryBarrier visibilityBarrier = vkinit::buffer_barrier(m_visibilityBuffer.m_buffer,
+		VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT);
+
+	vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,
+		0, nullptr, 1, &visibilityBarrier, 0, nullptr);
+
+	dispatch(cmd, frame, CullPhase::Late);
+}
+
+void GPUCuller::dispatch(VkCommandBuffer cmd, FrameBuffers& frame, CullPhase phase) {
+	PhaseBuffers& buffers = frame.phases[(uint32_t)phase];
+	uint32_t phaseIndex = (uint32_t)phase;
+
+	vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, m_pipeline);
+	vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, m_pipelineLayout, 0, 1, &buffers.descriptor, 0, nullptr);
+	vkCmdPushConstants(cmd, m_pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(uint32_t), &phaseIndex);
+
+	vkCmdDispatch(cmd, ((uint32_t)m_objects.size() + 63) / 64, 1, 1);
+
+	VkBufferMemoryBarrier drawBarriers[] = {
+		vkinit::buffer_barrier(buffers.draws.m_buffer, VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_INDIRECT_COMMAND_READ_BIT),
+		vkinit::buffer_barrier(buffers.count.m_buffer, VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_INDIRECT_COMMAND_READ_BIT)
+	};
+
+	vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT, 0,
+		0, nullptr, 2, drawBarriers, 0, nullptr);
+}
+
+void GPUCuller::record_draws(VkCommandBuffer cmd, uint32_t frameIndex, CullPhase phase) {
+	if (m_objects.empty() || m_pipeline == VK_NULL_HANDLE) return;
+
+	FrameBuffers& frame = m_frames[frameIndex];
+	if (phase == CullPhase::Late && !frame.occlusion) return;
+
+	PhaseBuffers& buffers = frame.phases[(uint32_t)phase];
+	uint32_t maxDraws = (uint32_t)m_objects.size();
+	uint32_t stride = sizeof(VkDrawIndexedIndirectCommand);
+
+	if (m_drawIndirectCount) {
+		vkCmdDrawIndexedIndirectCount(cmd, buffers.draws.m_buffer, 0, buffers.count.m_buffer, 0, maxDraws, stride);
+	} else if (m_multiDrawIndirect) {
+		vkCmdDrawIndexedIndirect(cmd, buffers.draws.m_buffer, 0, maxDraws, stride);
+	} else {
+		//one command per call, culled ones draw no instances
+		for (uint32_t i = 0; i < maxDraws; i++) {
+			vkCmdDrawIndexedIndirect(cmd, buffers.draws.m_buffer, i * stride, 1, stride);
+		}
+	}
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include "vk_types.h"
+#include "vk_culling.h"
+#include "vk_depth_pyramid.h"
+
+#include <vector>
+
+class VulkanEngine;
+struct Mesh;
+
+//matches DrawObject in indirect_cull.comp
+struct GPUDrawObject {
+	glm::vec4 sphere;
+	uint32_t indexCount;
+	uint32_t firstIndex;
+	int32_t vertexOffset;
+	uint32_t resident;
+};
+
+//matches CullData in indirect_cull.comp, written once per frame
+struct GPUCullConstants {
+	glm::mat4 viewproj;
+	glm::vec4 planes[6];
+	glm::vec2 pyramidSize;
+	uint32_t objectCount;
+	uint32_t compact;
+	uint32_t occlusion;
+	uint32_t pyramidLevels;
+	uint32_t padding[2];
+};
+
+//with occlusion culling the early phase draws what was visible last frame. The late one tests
+//everything else against the depth pyramid of the early draws and draws what shows up
+enum class CullPhase : uint32_t {
+	Early,
+	Late
+};
+
+//culls a fixed set of draws in a compute shader and draws the survivors with indirect commands.
+//The objects live on the gpu, so a frame only costs the cpu a dispatch and one indirect draw
+//no matter how many of them there are
+class GPUCuller {
+public:
+	//drawIndirectCount compacts the commands, multiDrawIndirect issues them in a single call.
+	//The pyramid is only read by the late phase
+	void init(VulkanEngine* engine, uint32_t capacity, uint32_t framesInFlight,
+		bool drawIndirectCount, bool multiDrawIndirect, const DepthPyramid& pyramid);
+	void cleanup();
+
+	void set_object_count(uint32_t count);
+	//refreshes the bounds and ranges of an object, needed whenever its mesh is uploaded or evicted
+	void set_object(uint32_t index, const Mesh& mesh);
+
+	//outside of the render pass: uploads the changed objects and writes the draw commands of the early phase.
+	//Without occlusion it writes every object in the frustum and the late phase draws nothing
+	void record_culling(VkCommandBuffer cmd, uint32_t frameIndex, const vkutil::Frustum& frustum,
+		const glm::mat4& viewproj, bool occlusion);
+
+	//outside of the render pass, once the pyramid was built from the depth of the early draws
+	void record_late_culling(VkCommandBuffer cmd, uint32_t frameIndex);
+
+	//inside the render pass, with the pipeline, descriptors and geometry already bound
+	void record_draws(VkCommandBuffer cmd, uint32_t frameIndex, CullPhase phase);
+
+	//compiles the compute shader again, safe from a worker. VK_NULL_HANDLE when it failed
+	VkPipeline build_pipeline() const;
+	//puts a rebuilt pipeline in place and returns the previous one, frames in flight may still use it
+	VkPipeline swap_pipeline(VkPipeline pipeline);
+
+	uint32_t object_count() const { return (uint32_t)m_objects.size(); }
+
+private:
+	struct PhaseBuffers {
+		AllocatedBuffer draws;
+		AllocatedBuffer count;
+		VkDescriptorSet descriptor;
+	};
+
+	struct FrameBuffers {
+		PhaseBuffers phases[2];
+		AllocatedBuffer constants;
+		bool occlusion{ false };
+	};
+
+	void init_pipeline();
+	void upload_objects(VkCommandBuffer cmd);
+	void dispatch(VkCommandBuffer cmd, FrameBuffers& frame, CullPhase phase);
+
+	VulkanEngine* m_engine{ nullptr };
+	uint32_t m_capacity{ 0 };
+	bool m_drawIndirectCount{ false };
+	bool m_multiDrawIndirect{ false };
+
+	std::vector<GPUDrawObject> m_objects;
+	bool m_dirty{ false };
+	//cleared whenever the object count changes, stale entries would skip objects in the early phase
+	bool m_resetVisibility{ true };
+
+	AllocatedBuffer m_objectBuffer{};
+	//one flag per object, written by the late phase and read by the early one of the next frame
+	AllocatedBuffer m_visibilityBuffer{};
+	VkExtent2D m_pyramidExtent{};
+	uint32_t m_pyramidLevels{ 0 };
+	std::vector<FrameBuffers> m_frames;
+
+	VkDescriptorSetLayout m_setLayout{ VK_NULL_HANDLE };
+	VkPipelineLayout m_pipelineLayout{ VK_NULL_HANDLE };
+	VkPipeline m_pipeline{ VK_NULL_HANDLE };
+};
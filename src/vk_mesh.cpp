@@ -1,6 +1,8 @@
 #include "vk_mesh.h"
 #include <tiny_obj_loader.h>
 #include <iostream>
+#include <algorithm>
+#include <glm/glm.hpp>
 
 VertexInputDescription Vertex::get_vertex_description() {
 	VertexInputDescription description;
@@ -45,6 +47,27 @@ VertexInputDescription Vertex::get_vertex_description() {
 	return description;
 }
 
+VertexInputDescription Vertex::get_position_description() {
+	VertexInputDescription description;
+
+	VkVertexInputBindingDescription positionBinding{};
+	positionBinding.binding = 0;
+	positionBinding.stride = sizeof(glm::vec3);
+	positionBinding.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+
+	description.bindings.push_back(positionBinding);
+
+	VkVertexInputAttributeDescription positionAttribute{};
+	positionAttribute.binding = 0;
+	positionAttribute.location = 0;
+	positionAttribute.format = VK_FORMAT_R32G32B32_SFLOAT;
+	positionAttribute.offset = 0;
+
+	description.attributes.push_back(positionAttribute);
+
+	return description;
+}
+
 bool Mesh::load_from_obj(const char* filename) {
 	tinyobj::attrib_t attrib;
 	std::vector<tinyobj::shape_t> shapes;
@@ -100,10 +123,41 @@ bool Mesh::load_from_obj(const char* filename) {
 				new_vert.uv.x = ux;
 				new_vert.uv.y = 1-uy;
 
+				m_indices.push_back((unsigned int)m_vertices.size());
 				m_vertices.push_back(new_vert);
 			}
 			index_offset += fv;
 		}
 	}
+
+	m_vertexCount = (uint32_t)m_vertices.size();
+	m_indexCount = (uint32_t)m_indices.size();
+	compute_bounds();
 	return true;
+}
+
+void Mesh::release_cpu_data() {
+	//swapping with empty vectors gives the memory back, clear() would keep the capacity
+	std::vector<Vertex>().swap(m_vertices);
+	std::vector<unsigned int>().swap(m_indices);
+}
+
+void Mesh::compute_bounds() {
+	if (m_vertices.empty()) return;
+
+	glm::vec3 min = m_vertices[0].position;
+	glm::vec3 max = m_vertices[0].position;
+	for (Vertex& vertex : m_vertices) {
+		min = glm::min(min, vertex.position);
+		max = glm::max(max, vertex.position);
+	}
+
+	m_boundsOrigin = (min + max) / 2.f;
+
+	float radiusSquared = 0.f;
+	for (Vertex& vertex : m_vertices) {
+		glm::vec3 offset = vertex.position - m_boundsOrigin;
+		radiusSquared = std::max(radiusSquared, glm::dot(offset, offset));
+	}
+	m_boundsRadius = std::sqrt(radiusSquared);
 }
\ No newline at end of file
@@ -22,6 +22,15 @@ struct Vertex {
 	alignas(16) glm::vec2 uv;
 
 	static VertexInputDescription get_vertex_description();
+	//positions alone, read from the compact stream of the geometry arena by the depth prepass
+	static VertexInputDescription get_position_description();
+};
+
+//the depth prepass takes meshes by class, small details cost more vertex work there than they save in shading
+enum class MeshClass : uint8_t {
+	Occluder,
+	Detail,
+	Count
 };
 
 struct Mesh {
@@ -29,8 +38,31 @@ struct Mesh {
 	std::vector<Texture> m_textures;
 	std::vector<unsigned int> m_indices;
 
-	AllocatedBuffer m_vertexBuffer;
-	AllocatedBuffer m_indicesBuffer;
+	//ranges inside the engine geometry arena, counted in elements
+	uint32_t m_vertexOffset{ 0 };
+	uint32_t m_vertexCount{ 0 };
+	uint32_t m_firstIndex{ 0 };
+	uint32_t m_indexCount{ 0 };
+
+	//set once the upload finished and the graphics queue owns the ranges
+	bool m_resident{ false };
+	uint32_t m_residencyId{ ~0u };
+	//assigned on the first upload, orders draws of the same material in the render queue
+	uint32_t m_sortId{ ~0u };
+
+	//keeps the vertices and indices in memory after the upload, for collision or picking.
+	//Other meshes release them once the upload finished, the counts and bounds stay
+	bool m_cpuAccess{ false };
+
+	//bounding sphere in model space
+	glm::vec3 m_boundsOrigin{ 0.f };
+	float m_boundsRadius{ 0.f };
+
+	MeshClass m_class{ MeshClass::Occluder };
 
 	bool load_from_obj(const char* filename);
+	void compute_bounds();
+
+	bool has_cpu_data() const { return !m_vertices.empty(); }
+	void release_cpu_data();
 };
\ No newline at end of file
@@ -1,13 +1,175 @@
 #include "vk_model.h"
 
+#include <cstring>
+
+#include "asset_cache.h"
+
 Model::Model() = default;
 
+//copies one mesh of an unpacked model blob, the data starts at its first vertex
+static void readBakedMesh(const char* data, const assets::MeshInfo& meshInfo, Mesh& mesh) {
+    mesh.m_vertices.resize(meshInfo.vertexCount);
+
+    for (uint32_t i = 0; i < meshInfo.vertexCount; i++) {
+        assets::Vertex_f32_PNCV bakedVertex;
+        memcpy(&bakedVertex, data, sizeof(bakedVertex));
+        data += sizeof(bakedVertex);
+
+        Vertex& vertex = mesh.m_vertices[i];
+        vertex.position = glm::vec3(bakedVertex.position[0], bakedVertex.position[1], bakedVertex.position[2]);
+        vertex.normal = glm::vec3(bakedVertex.normal[0], bakedVertex.normal[1], bakedVertex.normal[2]);
+        vertex.color = glm::vec3(bakedVertex.color[0], bakedVertex.color[1], bakedVertex.color[2]);
+        vertex.uv = glm::vec2(bakedVertex.uv[0], bakedVertex.uv[1]);
+    }
+
+    mesh.m_indices.resize(meshInfo.indexCount);
+    memcpy(mesh.m_indices.data(), data, meshInfo.indexCount * sizeof(uint32_t));
+
+    mesh.m_vertexCount = meshInfo.vertexCount;
+    mesh.m_indexCount = meshInfo.indexCount;
+}
+
 Model::Model(std::string path) {
     std::cout << "Starting model loading" << std::endl;
     loadModel(path);
     std::cout << "Ended model loading" << std::endl;
 }
 
+Model::Model(std::string path, const std::string& cacheDirectory) {
+    std::cout << "Starting model loading" << std::endl;
+    m_directory = path.substr(0, path.find_last_of('/'));
+
+    std::string bakedPath = assets::derived_data_path(cacheDirectory.c_str(), path.c_str(), ".mdl");
+
+    if (loadBaked(bakedPath)) {
+        std::cout << "Loaded baked model " << bakedPath << std::endl;
+        m_bakedPath = bakedPath;
+    } else {
+        loadModel(path);
+        if (!bakedPath.empty() && !m_meshes.empty() && bakeModel(bakedPath, path)) m_bakedPath = bakedPath;
+    }
+    std::cout << "Ended model loading" << std::endl;
+}
+
+bool Model::loadBaked(const std::string& bakedPath) {
+    assets::AssetFile file;
+    if (!assets::load_derived_data(bakedPath, "MODL", file)) return false;
+
+    //a stale or corrupt entry falls back to the source, which bakes it again
+    assets::ModelInfo info;
+    if (!assets::read_model_info(&file, info)) return false;
+
+    std::vector<char> meshData(info.blobSize);
+    if (!assets::unpack_model(&info, file.binaryBlob.data(), file.binaryBlob.size(), meshData.data())) {
+        std::cout << "Failed to unpack baked model " << bakedPath << std::endl;
+        return false;
+    }
+
+    for (assets::ModelTexture& bakedTexture : info.textures) {
+        Texture texture;
+        texture.path = bakedTexture.path;
+        texture.type = bakedTexture.type;
+        m_textures_loaded.push_back(texture);
+    }
+
+    const char* cursor = meshData.data();
+    for (assets::MeshInfo& meshInfo : info.meshes) {
+        Mesh mesh;
+        readBakedMesh(cursor, meshInfo, mesh);
+        cursor += meshInfo.dataSize;
+
+        mesh.m_boundsOrigin = glm::vec3(meshInfo.bounds.origin[0], meshInfo.bounds.origin[1], meshInfo.bounds.origin[2]);
+        mesh.m_boundsRadius = meshInfo.bounds.radius;
+
+        for (uint32_t textureIndex : meshInfo.textures) {
+            mesh.m_textures.push_back(m_textures_loaded[textureIndex]);
+        }
+        m_meshes.push_back(std::move(mesh));
+    }
+
+    m_bakedInfo = std::move(info);
+    return true;
+}
+
+bool Model::reloadMesh(size_t index, Mesh& destination) const {
+    if (m_bakedPath.empty() || index >= m_bakedInfo.meshes.size()) return false;
+
+    const assets::MeshInfo& meshInfo = m_bakedInfo.meshes[index];
+
+    std::vector<char> compressed(meshInfo.compressedSize);
+    if (!assets::load_binaryfile_range(m_bakedPath.c_str(), meshInfo.compressedOffset, meshInfo.compressedSize, compressed.data())) {
+        std::cout << "Failed to reload mesh " << index << " from " << m_bakedPath << std::endl;
+        return false;
+    }
+
+    std::vector<char> meshData(meshInfo.dataSize);
+    if (!assets::unpack_model_mesh(&m_bakedInfo, (uint32_t)index, compressed.data(), meshData.data())) {
+        std::cout << "Failed to unpack mesh " << index << " of " << m_bakedPath << std::endl;
+        return false;
+    }
+
+    readBakedMesh(meshData.data(), meshInfo, destination);
+    return true;
+}
+
+bool Model::bakeModel(const std::string& bakedPath, const std::string& sourcePath) {
+    assets::ModelInfo info;
+    info.originalFile = sourcePath;
+    info.blobSize = 0;
+
+    for (Texture& texture : m_textures_loaded) {
+        info.textures.push_back({ texture.path, texture.type });
+    }
+
+    std::vector<char> meshData;
+    for (Mesh& mesh : m_meshes) {
+        std::vector<assets::Vertex_f32_PNCV> bakedVertices(mesh.m_vertices.size());
+        for (size_t i = 0; i < mesh.m_vertices.size(); i++) {
+            Vertex& vertex = mesh.m_vertices[i];
+            bakedVertices[i] = {
+                { vertex.position.x, vertex.position.y, vertex.position.z },
+                { vertex.normal.x, vertex.normal.y, vertex.normal.z },
+                { vertex.color.x, vertex.color.y, vertex.color.z },
+                { vertex.uv.x, vertex.uv.y }
+            };
+        }
+
+        assets::MeshInfo meshInfo;
+        meshInfo.vertexCount = (uint32_t)mesh.m_vertices.size();
+        meshInfo.indexCount = (uint32_t)mesh.m_indices.size();
+        meshInfo.bounds = assets::calculate_bounds(bakedVertices.data(), bakedVertices.size());
+
+        for (Texture& texture : mesh.m_textures) {
+            for (uint32_t j = 0; j < m_textures_loaded.size(); j++) {
+                if (m_textures_loaded[j].path == texture.path) {
+                    meshInfo.textures.push_back(j);
+                    break;
+                }
+            }
+        }
+        info.meshes.push_back(meshInfo);
+
+        size_t vertexBytes = bakedVertices.size() * sizeof(assets::Vertex_f32_PNCV);
+        size_t indexBytes = mesh.m_indices.size() * sizeof(uint32_t);
+        meshData.resize(info.blobSize + vertexBytes + indexBytes);
+
+        memcpy(meshData.data() + info.blobSize, bakedVertices.data(), vertexBytes);
+        memcpy(meshData.data() + info.blobSize + vertexBytes, mesh.m_indices.data(), indexBytes);
+        info.blobSize += vertexBytes + indexBytes;
+    }
+
+    assets::AssetFile file = assets::pack_model(&info, meshData.data());
+
+    if (!assets::save_derived_data(bakedPath, file)) {
+        std::cout << "Failed to cache model " << sourcePath << std::endl;
+        return false;
+    }
+
+    //packing filled in where every mesh went
+    m_bakedInfo = std::move(info);
+    return true;
+}
+
 void Model::loadModel(std::string& path) {
     Assimp::Importer importer;
     const aiScene* scene = importer.ReadFile(path, aiProcess_Triangulate);
@@ -37,7 +199,7 @@ Mesh Model::processMesh(aiMesh* mesh, const aiScene* scene) {
     std::vector<Texture> textures;
     
     for (unsigned int i = 0; i < mesh->mNumVertices; i++) {
-        Vertex vertex;
+        Vertex vertex = {};
         vertex.position = glm::vec3(
             mesh->mVertices[i].x,
             mesh->mVertices[i].y,
@@ -85,6 +247,9 @@ Mesh Model::processMesh(aiMesh* mesh, const aiScene* scene) {
     newMesh.m_indices = indices;
     newMesh.m_textures = textures;
     newMesh.m_vertices = vertices;
+    newMesh.m_vertexCount = (uint32_t)vertices.size();
+    newMesh.m_indexCount = (uint32_t)indices.size();
+    newMesh.compute_bounds();
 
     return newMesh;
 }
@@ -109,7 +274,7 @@ std::vector<Texture> Model::loadMaterialTextures(aiMaterial* material, aiTexture
         if (!skip) {
             Texture texture;
             std::string path = std::string(str.C_Str());
-            texture.type = type;
+            texture.type = typeName;
             texture.path = str.C_Str();
             textures.push_back(texture);
             m_textures_loaded.push_back(texture);
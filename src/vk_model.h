@@ -9,21 +9,35 @@
 #include <assimp/postprocess.h>
 
 #include "vk_mesh.h"
+#include "model_asset.h"
 
 class Model {
     public:
         Model();
         Model(std::string path);
+        //loads the baked form from the cache directory, baking it there first when it's missing
+        Model(std::string path, const std::string& cacheDirectory);
 
         void draw();
 
+        //reads the vertices and indices of a mesh back from the baked model into destination, after they were released.
+        //Only the range of that mesh is read and unpacked, and nothing of the model changes, so workers can call it
+        bool reloadMesh(size_t index, Mesh& destination) const;
+        bool canReload() const { return !m_bakedPath.empty(); }
+
         std::vector<Texture> m_textures_loaded;
         std::vector<Mesh> m_meshes;
     
     private:
         std::string m_directory;
+        //empty when the model couldn't be cached
+        std::string m_bakedPath;
+        //where every mesh sits inside the baked blob
+        assets::ModelInfo m_bakedInfo;
 
         void loadModel(std::string& path);
+        bool loadBaked(const std::string& bakedPath);
+        bool bakeModel(const std::string& bakedPath, const std::string& sourcePath);
         void processNode(aiNode* node, const aiScene* scene);
         Mesh processMesh(aiMesh* mesh, const aiScene* scene);
 
@@ -0,0 +1,336 @@
+#include "vk_occlusion.h"
+#include "utils/thread_pool.h"
+#include "utils/cpu_features.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+#if defined(CPU_AVX2)
+#include <immintrin.h>
+#endif
+
+constexpr uint32_t OCCLUSION_TILES_X = OCCLUSION_WIDTH / OCCLUSION_TILE_SIZE;
+constexpr uint32_t OCCLUSION_TILES_Y = OCCLUSION_HEIGHT / OCCLUSION_TILE_SIZE;
+static_assert(OCCLUSION_WIDTH % OCCLUSION_TILE_SIZE == 0 && OCCLUSION_HEIGHT % OCCLUSION_TILE_SIZE == 0,
+	"the depth buffer must be made of whole tiles");
+static_assert(OCCLUSION_TILE_SIZE == 8, "a tile row is one 8 wide register");
+
+//triangles and bounds closer to the camera plane than this aren't projected
+constexpr float OCCLUSION_NEAR_W = 1e-3f;
+
+//triangles smaller than this in pixels have no usable depth plane
+constexpr float OCCLUSION_MIN_AREA = 1e-6f;
+
+//bounds per job when culling the visible list
+constexpr size_t OCCLUSION_TEST_CHUNK = 64;
+
+static glm::vec3 to_screen(const glm::vec4& clip) {
+	return glm::vec3((clip.x / clip.w * 0.5f + 0.5f) * OCCLUSION_WIDTH,
+		(clip.y / clip.w * 0.5f + 0.5f) * OCCLUSION_HEIGHT, clip.z / clip.w);
+}
+
+#if defined(CPU_AVX2)
+//a whole tile row per register, rows firstRow to lastRow of the tile at originX, originY
+static CPU_AVX2_FUNCTION void rasterize_rows_avx2(const glm::vec3* edges, const glm::vec3& plane, float triangleMaxDepth,
+	int32_t originX, int32_t originY, int32_t firstRow, int32_t lastRow, float* tileDepth, uint64_t& coverage)
+{
+	//the pixel centers of a tile row
+	__m256 px = _mm256_add_ps(_mm256_set1_ps(originX + 0.5f), _mm256_setr_ps(0.f, 1.f, 2.f, 3.f, 4.f, 5.f, 6.f, 7.f));
+	__m256 maxDepth = _mm256_set1_ps(triangleMaxDepth);
+
+	for (int32_t row = firstRow; row <= lastRow; row++) {
+		float py = originY + row + 0.5f;
+
+		__m256 inside = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+		for (int k = 0; k < 3; k++) {
+			const glm::vec3& edge = edges[k];
+			__m256 distance = _mm256_add_ps(_mm256_mul_ps(px, _mm256_set1_ps(edge.x)), _mm256_set1_ps(edge.y * py + edge.z));
+			inside = _mm256_and_ps(inside, _mm256_cmp_ps(distance, _mm256_setzero_ps(), _CMP_GE_OQ));
+		}
+
+		uint32_t rowMask = (uint32_t)_mm256_movemask_ps(inside);
+		if (rowMask == 0) continue;
+
+		__m256 depth = _mm256_add_ps(_mm256_mul_ps(px, _mm256_set1_ps(plane.x)), _mm256_set1_ps(plane.y * py + plane.z));
+		depth = _mm256_min_ps(depth, maxDepth);
+
+		//only the covered lanes take the nearer depth
+		float* rowDepth = tileDepth + row * OCCLUSION_TILE_SIZE;
+		__m256 previous = _mm256_loadu_ps(rowDepth);
+		_mm256_storeu_ps(rowDepth, _mm256_blendv_ps(previous, _mm256_min_ps(previous, depth), inside));
+
+		coverage |= (uint64_t)rowMask << (row * OCCLUSION_TILE_SIZE);
+	}
+}
+
+//pixels of a tile row whose depth doesn't hide something at nearest
+static CPU_AVX2_FUNCTION uint32_t row_shows_avx2(const float* rowDepth, float nearest) {
+	__m256 shows = _mm256_cmp_ps(_mm256_loadu_ps(rowDepth), _mm256_set1_ps(nearest), _CMP_GE_OQ);
+	return (uint32_t)_mm256_movemask_ps(shows);
+}
+#endif
+
+uint32_t OcclusionRasterizer::add_occluder(const std::vector<glm::vec3>& positions, const std::vector<uint32_t>& indices,
+	const glm::vec3& boundsOrigin, float boundsRadius)
+{
+	Occluder occluder;
+	occluder.positions = positions;
+	occluder.indices = indices;
+	occluder.boundsOrigin = boundsOrigin;
+	occluder.boundsRadius = boundsRadius;
+
+	m_occluders.push_back(std::move(occluder));
+	return (uint32_t)m_occluders.size() - 1;
+}
+
+void OcclusionRasterizer::clear() {
+	m_occluders.clear();
+	m_triangles.clear();
+	m_triangleCount = 0;
+	m_occludedCount = 0;
+}
+
+void OcclusionRasterizer::set_enabled(uint32_t id, bool enabled) {
+	m_occluders[id].enabled = enabled;
+}
+
+void OcclusionRasterizer::render(const glm::mat4& viewproj, ThreadPool& pool) {
+	m_viewproj = viewproj;
+	m_tiles.resize(OCCLUSION_TILES_X * OCCLUSION_TILES_Y);
+	m_triangles.resize(m_occluders.size());
+
+	vkutil::Frustum frustum = vkutil::extract_frustum(viewproj);
+
+	pool.parallel_for(m_occluders.size(), 1, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++) {
+			const Occluder& occluder = m_occluders[i];
+			m_triangles[i].clear();
+			if (!occluder.enabled) continue;
+
+			bool inside = true;
+			for (const glm::vec4& plane : frustum.planes) {
+				inside = inside && glm::dot(glm::vec3(plane), occluder.boundsOrigin) + plane.w >= -occluder.boundsRadius;
+			}
+			if (inside) setup_triangles(occluder, m_triangles[i]);
+		}
+	});
+
+	m_triangleCount = 0;
+	for (const std::vector<ScreenTriangle>& triangles : m_triangles) {
+		m_triangleCount += (uint32_t)triangles.size();
+	}
+
+	//tile rows don't share any pixels, so each one is rasterized without locks
+	pool.parallel_for(OCCLUSION_TILES_Y, 1, [&](size_t begin, size_t end) {
+		for (size_t row = begin; row < end; row++) {
+			rasterize_tile_row((uint32_t)row);
+		}
+	});
+}
+
+void OcclusionRasterizer::setup_triangles(const Occluder& occluder, std::vector<ScreenTriangle>& triangles) const {
+	for (size_t i = 0; i + 2 < occluder.indices.size(); i += 3) {
+		glm::vec3 screen[3];
+		bool behind = false;
+		for (int k = 0; k < 3; k++) {
+			glm::vec4 clip = m_viewproj * glm::vec4(occluder.positions[occluder.indices[i + k]], 1.f);
+			behind = behind || clip.w < OCCLUSION_NEAR_W;
+			if (!behind) screen[k] = to_screen(clip);
+		}
+		//there is no clipping, and leaving an occluder triangle out never hides too much
+		if (behind) continue;
+
+		glm::vec3 d1 = screen[1] - screen[0];
+		glm::vec3 d2 = screen[2] - screen[0];
+		float area = d1.x * d2.y - d2.x * d1.y;
+		if (std::abs(area) < OCCLUSION_MIN_AREA) continue;
+
+		//pixels whose centers fall inside the bounds
+		ScreenTriangle triangle;
+		float minX = std::min({ screen[0].x, screen[1].x, screen[2].x });
+		float maxX = std::max({ screen[0].x, screen[1].x, screen[2].x });
+		float minY = std::min({ screen[0].y, screen[1].y, screen[2].y });
+		float maxY = std::max({ screen[0].y, screen[1].y, screen[2].y });
+		triangle.minX = std::max((int32_t)std::ceil(minX - 0.5f), 0);
+		triangle.maxX = std::min((int32_t)std::floor(maxX - 0.5f), (int32_t)OCCLUSION_WIDTH - 1);
+		triangle.minY = std::max((int32_t)std::ceil(minY - 0.5f), 0);
+		triangle.maxY = std::min((int32_t)std::floor(maxY - 0.5f), (int32_t)OCCLUSION_HEIGHT - 1);
+		if (triangle.minX > triangle.maxX || triangle.minY > triangle.maxY) continue;
+
+		//both windings are kept, so the edges are flipped to be positive inside.
+		//Centers right on an edge count as inside, or the pixels along shared edges would be left open
+		float winding = area > 0.f ? 1.f : -1.f;
+		for (int k = 0; k < 3; k++) {
+			const glm::vec3& a = screen[k];
+			const glm::vec3& b = screen[(k + 1) % 3];
+			triangle.edges[k] = winding * glm::vec3(a.y - b.y, b.x - a.x, a.x * b.y - a.y * b.x);
+		}
+
+		//depth is linear in screen space. Moving the plane by half a pixel on both axes gives the farthest
+		//depth over each pixel, so a bound only counts as hidden when no part of the pixel could show it
+		float depthX = (d1.z * d2.y - d2.z * d1.y) / area;
+		float depthY = (d2.z * d1.x - d1.z * d2.x) / area;
+		float depthC = screen[0].z - depthX * screen[0].x - depthY * screen[0].y;
+		triangle.depthPlane = glm::vec3(depthX, depthY, depthC + 0.5f * (std::abs(depthX) + std::abs(depthY)));
+		triangle.maxDepth = std::max({ screen[0].z, screen[1].z, screen[2].z });
+
+		triangles.push_back(triangle);
+	}
+}
+
+void OcclusionRasterizer::rasterize_tile_row(uint32_t tileRow) {
+	Tile* tiles = &m_tiles[tileRow * OCCLUSION_TILES_X];
+	for (uint32_t x = 0; x < OCCLUSION_TILES_X; x++) {
+		tiles[x].coverage = 0;
+		std::fill(std::begin(tiles[x].depth), std::end(tiles[x].depth), 1.f);
+	}
+
+	int32_t rowMinY = (int32_t)(tileRow * OCCLUSION_TILE_SIZE);
+	int32_t rowMaxY = rowMinY + (int32_t)OCCLUSION_TILE_SIZE - 1;
+
+	for (const std::vector<ScreenTriangle>& triangles : m_triangles) {
+		for (const ScreenTriangle& triangle : triangles) {
+			if (triangle.maxY < rowMinY || triangle.minY > rowMaxY) continue;
+
+			int32_t firstTile = triangle.minX / (int32_t)OCCLUSION_TILE_SIZE;
+			int32_t lastTile = triangle.maxX / (int32_t)OCCLUSION_TILE_SIZE;
+			for (int32_t x = firstTile; x <= lastTile; x++) {
+				rasterize(triangle, tiles[x], x, (int32_t)tileRow);
+			}
+		}
+	}
+
+	for (uint32_t x = 0; x < OCCLUSION_TILES_X; x++) {
+		tiles[x].maxDepth = *std::max_element(std::begin(tiles[x].depth), std::end(tiles[x].depth));
+	}
+}
+
+void OcclusionRasterizer::rasterize(const ScreenTriangle& triangle, Tile& tile, int32_t tileX, int32_t tileY) const {
+	int32_t originX = tileX * (int32_t)OCCLUSION_TILE_SIZE;
+	int32_t originY = tileY * (int32_t)OCCLUSION_TILE_SIZE;
+	int32_t firstRow = std::max(triangle.minY - originY, 0);
+	int32_t lastRow = std::min(triangle.maxY - originY, (int32_t)OCCLUSION_TILE_SIZE - 1);
+
+#if defined(CPU_AVX2)
+	if (cpu_supports_avx2()) {
+		rasterize_rows_avx2(triangle.edges, triangle.depthPlane, triangle.maxDepth,
+			originX, originY, firstRow, lastRow, tile.depth, tile.coverage);
+		return;
+	}
+#endif
+
+	for (int32_t row = firstRow; row <= lastRow; row++) {
+		float py = originY + row + 0.5f;
+
+		for (int32_t column = 0; column < (int32_t)OCCLUSION_TILE_SIZE; column++) {
+			float px = originX + column + 0.5f;
+
+			bool inside = true;
+			for (const glm::vec3& edge : triangle.edges) {
+				inside = inside && edge.x * px + edge.y * py + edge.z >= 0.f;
+			}
+			if (!inside) continue;
+
+			const glm::vec3& plane = triangle.depthPlane;
+			float depth = std::min(plane.x * px + plane.y * py + plane.z, triangle.maxDepth);
+
+			float& pixel = tile.depth[row * OCCLUSION_TILE_SIZE + column];
+			pixel = std::min(pixel, depth);
+			tile.coverage |= 1ull << (row * OCCLUSION_TILE_SIZE + column);
+		}
+	}
+}
+
+bool OcclusionRasterizer::test_sphere(const glm::vec3& center, float radius) const {
+	if (m_triangleCount == 0) return true;
+
+	//the corners of the box around the sphere give a conservative screen rectangle and nearest depth
+	glm::vec2 screenMin{ FLT_MAX };
+	glm::vec2 screenMax{ -FLT_MAX };
+	float nearest = FLT_MAX;
+	for (int i = 0; i < 8; i++) {
+		glm::vec3 corner = center + radius * glm::vec3((i & 1) ? 1.f : -1.f, (i & 2) ? 1.f : -1.f, (i & 4) ? 1.f : -1.f);
+		glm::vec4 clip = m_viewproj * glm::vec4(corner, 1.f);
+
+		//bounds reaching behind the camera cover most of the screen anyway
+		if (clip.w < OCCLUSION_NEAR_W) return true;
+
+		glm::vec3 screen = to_screen(clip);
+		screenMin = glm::min(screenMin, glm::vec2(screen));
+		screenMax = glm::max(screenMax, glm::vec2(screen));
+		nearest = std::min(nearest, screen.z);
+	}
+
+	//every pixel the rectangle touches, not only the ones whose centers it covers
+	int32_t minX = std::max((int32_t)std::floor(screenMin.x), 0);
+	int32_t maxX = std::min((int32_t)std::floor(screenMax.x), (int32_t)OCCLUSION_WIDTH - 1);
+	int32_t minY = std::max((int32_t)std::floor(screenMin.y), 0);
+	int32_t maxY = std::min((int32_t)std::floor(screenMax.y), (int32_t)OCCLUSION_HEIGHT - 1);
+	if (minX > maxX || minY > maxY) return true;
+
+#if defined(CPU_AVX2)
+	bool avx2 = cpu_supports_avx2();
+#endif
+	int32_t tileSize = (int32_t)OCCLUSION_TILE_SIZE;
+	for (int32_t tileY = minY / tileSize; tileY <= maxY / tileSize; tileY++) {
+		for (int32_t tileX = minX / tileSize; tileX <= maxX / tileSize; tileX++) {
+			const Tile& tile = m_tiles[tileY * OCCLUSION_TILES_X + tileX];
+
+			//the whole tile is in front of the bound
+			if (nearest > tile.maxDepth) continue;
+
+			int32_t firstColumn = std::max(minX - tileX * tileSize, 0);
+			int32_t lastColumn = std::min(maxX - tileX * tileSize, tileSize - 1);
+			int32_t firstRow = std::max(minY - tileY * tileSize, 0);
+			int32_t lastRow = std::min(maxY - tileY * tileSize, tileSize - 1);
+			uint32_t columnMask = ((1u << (lastColumn + 1)) - 1) & ~((1u << firstColumn) - 1);
+
+			for (int32_t row = firstRow; row <= lastRow; row++) {
+				//pixels no occluder reached show whatever is behind them
+				uint32_t rowCoverage = (uint32_t)(tile.coverage >> (row * tileSize)) & 0xff;
+				if (columnMask & ~rowCoverage) return true;
+
+				const float* rowDepth = tile.depth + row * tileSize;
+#if defined(CPU_AVX2)
+				if (avx2) {
+					if (row_shows_avx2(rowDepth, nearest) & columnMask) return true;
+					continue;
+				}
+#endif
+				for (int32_t column = firstColumn; column <= lastColumn; column++) {
+					if (rowDepth[column] >= nearest) return true;
+				}
+			}
+		}
+	}
+	return false;
+}
+
+void OcclusionRasterizer::cull(const vkutil::CullingBounds& bounds, ThreadPool& pool, std::vector<uint32_t>& visible) {
+	m_occludedCount = 0;
+	if (m_triangleCount == 0 || visible.empty()) return;
+
+	m_hidden.assign(visible.size(), 0);
+	pool.parallel_for(visible.size(), OCCLUSION_TEST_CHUNK, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++) {
+			uint32_t index = visible[i];
+			glm::vec3 center{ bounds.x()[index], bounds.y()[index], bounds.z()[index] };
+			m_hidden[i] = test_sphere(center, bounds.radius()[index]) ? 0 : 1;
+		}
+	});
+
+	size_t count = 0;
+	for (size_t i = 0; i < visible.size(); i++) {
+		if (!m_hidden[i]) visible[count++] = visible[i];
+	}
+	m_occludedCount = (uint32_t)(visible.size() - count);
+	visible.resize(count);
+}
+
+float OcclusionRasterizer::depth(uint32_t x, uint32_t y) const {
+	if (m_tiles.empty()) return 1.f;
+
+	const Tile& tile = m_tiles[(y / OCCLUSION_TILE_SIZE) * OCCLUSION_TILES_X + x / OCCLUSION_TILE_SIZE];
+	return tile.depth[(y % OCCLUSION_TILE_SIZE) * OCCLUSION_TILE_SIZE + x % OCCLUSION_TILE_SIZE];
+}
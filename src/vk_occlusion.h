@@ -0,0 +1,87 @@
+#pragma once
+
+#include "vk_culling.h"
+
+#include <glm/glm.hpp>
+
+#include <vector>
+#include <cstdint>
+
+class ThreadPool;
+
+//resolution of the cpu depth buffer, coarse enough to rasterize the occluders well under a millisecond
+constexpr uint32_t OCCLUSION_WIDTH = 320;
+constexpr uint32_t OCCLUSION_HEIGHT = 192;
+
+//a tile row is one 8 wide avx2 register, and 8 rows keep the coverage of a tile in a 64 bit mask
+constexpr uint32_t OCCLUSION_TILE_SIZE = 8;
+
+//rasterizes a few designated occluders into a small depth buffer on the cpu and drops the bounds
+//they hide from the visible list, before those cost any command recording or gpu time.
+//Every tile row is rasterized on its own worker, the triangles are set up once for all of them
+class OcclusionRasterizer {
+public:
+	//positions in world space, indices as a triangle list. Returns the id that enables it
+	uint32_t add_occluder(const std::vector<glm::vec3>& positions, const std::vector<uint32_t>& indices,
+		const glm::vec3& boundsOrigin, float boundsRadius);
+	void clear();
+
+	//occluders that aren't drawn this frame must not hide anything either
+	void set_enabled(uint32_t id, bool enabled);
+
+	//clears the depth and rasterizes the enabled occluders as seen through viewproj
+	void render(const glm::mat4& viewproj, ThreadPool& pool);
+
+	//removes the indices whose bounds are hidden by the last render, keeping the order of the rest
+	void cull(const vkutil::CullingBounds& bounds, ThreadPool& pool, std::vector<uint32_t>& visible);
+
+	//false only when the whole sphere is behind what was rendered
+	bool test_sphere(const glm::vec3& center, float radius) const;
+
+	//farthest depth the occluders left in the pixel, 1 where they left nothing
+	float depth(uint32_t x, uint32_t y) const;
+
+	uint32_t triangle_count() const { return m_triangleCount; }
+	uint32_t occluded_count() const { return m_occludedCount; }
+
+private:
+	struct Occluder {
+		std::vector<glm::vec3> positions;
+		std::vector<uint32_t> indices;
+		glm::vec3 boundsOrigin;
+		float boundsRadius;
+		bool enabled{ true };
+	};
+
+	//edges are positive inside, the depth plane is already moved to the far corner of every pixel
+	struct ScreenTriangle {
+		glm::vec3 edges[3];
+		glm::vec3 depthPlane;
+		float maxDepth;
+		//covered pixels, inclusive
+		int32_t minX, minY, maxX, maxY;
+	};
+
+	struct Tile {
+		//pixels an occluder was rasterized into, bit y * 8 + x
+		uint64_t coverage;
+		//farthest depth of the tile, so a bound in front of it skips the pixels
+		float maxDepth;
+		float depth[OCCLUSION_TILE_SIZE * OCCLUSION_TILE_SIZE];
+	};
+
+	void setup_triangles(const Occluder& occluder, std::vector<ScreenTriangle>& triangles) const;
+	void rasterize_tile_row(uint32_t tileRow);
+	void rasterize(const ScreenTriangle& triangle, Tile& tile, int32_t tileX, int32_t tileY) const;
+
+	std::vector<Occluder> m_occluders;
+	//one list per occluder, kept between frames so they don't reallocate
+	std::vector<std::vector<ScreenTriangle>> m_triangles;
+	std::vector<Tile> m_tiles;
+	//one flag per entry of the visible list being culled
+	std::vector<uint8_t> m_hidden;
+
+	glm::mat4 m_viewproj{ 1.f };
+	uint32_t m_triangleCount{ 0 };
+	uint32_t m_occludedCount{ 0 };
+};
@@ -1,15 +1,26 @@
 #include "vk_pipeline.h"
 #include <iostream>
+#include <cstring>
 
-VkPipeline PipelineBuilder::build_pipeline(VkDevice device, VkRenderPass pass) {
+VkPipeline PipelineBuilder::build_pipeline(VkDevice device, VkRenderPass pass, VkPipelineCache cache) const {
 	VkPipelineViewportStateCreateInfo viewportState{};
 	viewportState.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
 	viewportState.pNext = nullptr;
 
+	//both come from the dynamic state, so resizing the window keeps every pipeline valid
 	viewportState.viewportCount = 1;
-	viewportState.pViewports = &m_viewport;
+	viewportState.pViewports = nullptr;
 	viewportState.scissorCount = 1;
-	viewportState.pScissors = &m_scissor;
+	viewportState.pScissors = nullptr;
+
+	VkDynamicState dynamicStates[] = { VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR };
+
+	VkPipelineDynamicStateCreateInfo dynamicState{};
+	dynamicState.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+	dynamicState.pNext = nullptr;
+
+	dynamicState.dynamicStateCount = 2;
+	dynamicState.pDynamicStates = dynamicStates;
 
 	VkPipelineColorBlendStateCreateInfo colorBlending{};
 	colorBlending.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
@@ -17,7 +28,7 @@ VkPipeline PipelineBuilder::build_pipeline(VkDevice device, VkRenderPass pass) {
 
 	colorBlending.logicOpEnable = VK_FALSE;
 	colorBlending.logicOp = VK_LOGIC_OP_COPY;
-	colorBlending.attachmentCount = 1;
+	colorBlending.attachmentCount = m_colorAttachmentCount;
 	colorBlending.pAttachments = &m_colorBlendAttachment;
 
 	VkGraphicsPipelineCreateInfo pipelineInfo{};
@@ -37,11 +48,122 @@ VkPipeline PipelineBuilder::build_pipeline(VkDevice device, VkRenderPass pass) {
 	pipelineInfo.subpass = 0;
 	pipelineInfo.basePipelineHandle = VK_NULL_HANDLE;
 	pipelineInfo.pDepthStencilState = &m_depthStencil;
+	pipelineInfo.pDynamicState = &dynamicState;
 
 	VkPipeline newPipeline;
-	if (vkCreateGraphicsPipelines(device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &newPipeline) != VK_SUCCESS) {
+	if (vkCreateGraphicsPipelines(device, cache, 1, &pipelineInfo, nullptr, &newPipeline) != VK_SUCCESS) {
 		std::cout << "failed to create pipeline\n";
 		return VK_NULL_HANDLE;
 	}
 	else return newPipeline;
-}
\ No newline at end of file
+}
+namespace {
+	//appends the individual fields, copying whole structs would pick up their pointers and padding
+	struct StateWriter {
+		std::vector<unsigned char>& bytes;
+
+		template<typename T>
+		void add(const T& field) {
+			size_t offset = bytes.size();
+			bytes.resize(offset + sizeof(T));
+			memcpy(bytes.data() + offset, &field, sizeof(T));
+		}
+	};
+}
+
+PipelineKey PipelineBuilder::key(VkRenderPass pass) const {
+	PipelineKey key;
+	if (m_shaderHashes.size() != m_shaderStages.size()) return key;
+
+	StateWriter writer{ key.state };
+
+	//counts go in ahead of every list, so two different states never write the same bytes
+	writer.add(m_shaderStages.size());
+	for (size_t i = 0; i < m_shaderStages.size(); i++) {
+		writer.add(m_shaderStages[i].stage);
+		writer.add(m_shaderHashes[i]);
+		for (const char* name = m_shaderStages[i].pName; name && *name; name++) writer.add(*name);
+		writer.add('\0');
+
+		//every permutation of a shader is a pipeline of its own
+		const VkSpecializationInfo* specialization = m_shaderStages[i].pSpecializationInfo;
+		writer.add(specialization != nullptr);
+		if (specialization) {
+			writer.add(specialization->mapEntryCount);
+			for (uint32_t entry = 0; entry < specialization->mapEntryCount; entry++) {
+				writer.add(specialization->pMapEntries[entry].constantID);
+				writer.add(specialization->pMapEntries[entry].offset);
+				writer.add(specialization->pMapEntries[entry].size);
+			}
+			writer.add(specialization->dataSize);
+			const unsigned char* data = static_cast<const unsigned char*>(specialization->pData);
+			for (size_t byte = 0; byte < specialization->dataSize; byte++) writer.add(data[byte]);
+		}
+	}
+
+	writer.add(m_vertexInputInfo.vertexBindingDescriptionCount);
+	for (uint32_t i = 0; i < m_vertexInputInfo.vertexBindingDescriptionCount; i++) {
+		const VkVertexInputBindingDescription& binding = m_vertexInputInfo.pVertexBindingDescriptions[i];
+		writer.add(binding.binding);
+		writer.add(binding.stride);
+		writer.add(binding.inputRate);
+	}
+	writer.add(m_vertexInputInfo.vertexAttributeDescriptionCount);
+	for (uint32_t i = 0; i < m_vertexInputInfo.vertexAttributeDescriptionCount; i++) {
+		const VkVertexInputAttributeDescription& attribute = m_vertexInputInfo.pVertexAttributeDescriptions[i];
+		writer.add(attribute.location);
+		writer.add(attribute.binding);
+		writer.add(attribute.format);
+		writer.add(attribute.offset);
+	}
+
+	writer.add(m_inputAssembly.topology);
+	writer.add(m_inputAssembly.primitiveRestartEnable);
+
+	writer.add(m_rasterizer.depthClampEnable);
+	writer.add(m_rasterizer.rasterizerDiscardEnable);
+	writer.add(m_rasterizer.polygonMode);
+	writer.add(m_rasterizer.cullMode);
+	writer.add(m_rasterizer.frontFace);
+	writer.add(m_rasterizer.depthBiasEnable);
+	writer.add(m_rasterizer.depthBiasConstantFactor);
+	writer.add(m_rasterizer.depthBiasClamp);
+	writer.add(m_rasterizer.depthBiasSlopeFactor);
+	writer.add(m_rasterizer.lineWidth);
+
+	writer.add(m_colorAttachmentCount);
+	writer.add(m_colorBlendAttachment.blendEnable);
+	writer.add(m_colorBlendAttachment.srcColorBlendFactor);
+	writer.add(m_colorBlendAttachment.dstColorBlendFactor);
+	writer.add(m_colorBlendAttachment.colorBlendOp);
+	writer.add(m_colorBlendAttachment.srcAlphaBlendFactor);
+	writer.add(m_colorBlendAttachment.dstAlphaBlendFactor);
+	writer.add(m_colorBlendAttachment.alphaBlendOp);
+	writer.add(m_colorBlendAttachment.colorWriteMask);
+
+	writer.add(m_multisampling.rasterizationSamples);
+	writer.add(m_multisampling.sampleShadingEnable);
+	writer.add(m_multisampling.minSampleShading);
+	writer.add(m_multisampling.alphaToCoverageEnable);
+	writer.add(m_multisampling.alphaToOneEnable);
+
+	writer.add(m_depthStencil.depthTestEnable);
+	writer.add(m_depthStencil.depthWriteEnable);
+	writer.add(m_depthStencil.depthCompareOp);
+	writer.add(m_depthStencil.depthBoundsTestEnable);
+	writer.add(m_depthStencil.stencilTestEnable);
+	writer.add(m_depthStencil.minDepthBounds);
+	writer.add(m_depthStencil.maxDepthBounds);
+
+	//layouts and render passes live as long as the engine, so their handles stand for their contents
+	writer.add(m_pipelineLayout);
+	writer.add(pass);
+
+	//FNV-1a over the state, it only picks the bucket, lookups compare the state itself
+	key.hash = 14695981039346656037ull;
+	for (unsigned char byte : key.state) {
+		key.hash ^= byte;
+		key.hash *= 1099511628211ull;
+	}
+	return key;
+}
@@ -2,18 +2,32 @@
 #include <vk_types.h>
 #include <vector>
 
+//the state of a builder written out field by field, builders with equal keys build the same pipeline
+struct PipelineKey {
+	std::vector<unsigned char> state;
+	uint64_t hash{ 0 };
+
+	bool operator==(const PipelineKey& other) const { return hash == other.hash && state == other.state; }
+};
+
 class PipelineBuilder {
 public:
 	std::vector<VkPipelineShaderStageCreateInfo> m_shaderStages;
+	//content hash of the SPIR-V behind every stage, pipelines without them are never shared
+	std::vector<uint64_t> m_shaderHashes;
 	VkPipelineVertexInputStateCreateInfo m_vertexInputInfo;
 	VkPipelineInputAssemblyStateCreateInfo m_inputAssembly;
-	VkViewport m_viewport;
-	VkRect2D m_scissor;
 	VkPipelineRasterizationStateCreateInfo m_rasterizer;
 	VkPipelineColorBlendAttachmentState m_colorBlendAttachment;
 	VkPipelineMultisampleStateCreateInfo m_multisampling;
 	VkPipelineLayout m_pipelineLayout;
 	VkPipelineDepthStencilStateCreateInfo m_depthStencil;
+	//depth only passes have no color attachment to blend into
+	uint32_t m_colorAttachmentCount{ 1 };
+
+	//viewport and scissor are dynamic, draws set them before drawing
+	VkPipeline build_pipeline(VkDevice device, VkRenderPass pass, VkPipelineCache cache = VK_NULL_HANDLE) const;
 
-	VkPipeline build_pipeline(VkDevice device, VkRenderPass pass);
-};
\ No newline at end of file
+	//all the state that ends up in the pipeline, empty when a stage has no content hash
+	PipelineKey key(VkRenderPass pass) const;
+};
@@ -0,0 +1,191 @@
+#include "vk_pipeline_cache.h"
+
+#include <filesystem>
+#include <fstream>
+#include <cstring>
+#include <algorithm>
+
+void PipelineCache::init(VkDevice device, const VkPhysicalDeviceProperties& properties, const std::string& path, uint32_t framesInFlight) {
+	m_device = device;
+	m_properties = properties;
+	m_path = path;
+	m_framesInFlight = framesInFlight;
+
+	std::vector<char> data;
+	std::ifstream file(m_path, std::ios::binary | std::ios::ate);
+	if (file.is_open()) {
+		data.resize((size_t)file.tellg());
+		file.seekg(0);
+		file.read(data.data(), data.size());
+	}
+
+	//a blob from another gpu or driver version is at best ignored by the driver, so it never gets there
+	if (!data.empty() && !is_compatible(data)) {
+		std::cout << "Pipeline cache " << m_path << " was written by another device or driver, starting empty" << std::endl;
+		data.clear();
+	}
+
+	VkPipelineCacheCreateInfo cacheInfo = {};
+	cacheInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+	cacheInfo.pNext = nullptr;
+	cacheInfo.initialDataSize = data.size();
+	cacheInfo.pInitialData = data.empty() ? nullptr : data.data();
+
+	VK_CHECK(vkCreatePipelineCache(m_device, &cacheInfo, nullptr, &m_cache));
+
+	m_savedSize = data.size();
+}
+
+void PipelineCache::cleanup() {
+	save();
+
+	for (auto& [key, shared] : m_pipelines) {
+		vkDestroyPipeline(m_device, shared.pipeline, nullptr);
+	}
+	for (VkPipeline pipeline : m_unsharedPipelines) {
+		vkDestroyPipeline(m_device, pipeline, nullptr);
+	}
+	for (RetiredPipeline& retired : m_retired) {
+		vkDestroyPipeline(m_device, retired.pipeline, nullptr);
+	}
+	m_pipelines.clear();
+	m_unsharedPipelines.clear();
+	m_retired.clear();
+
+	vkDestroyPipelineCache(m_device, m_cache, nullptr);
+	m_cache = VK_NULL_HANDLE;
+}
+
+bool PipelineCache::is_compatible(const std::vector<char>& data) const {
+	VkPipelineCacheHeaderVersionOne header;
+	if (data.size() < sizeof(header)) return false;
+
+	memcpy(&header, data.data(), sizeof(header));
+
+	return header.headerSize >= sizeof(header)
+		&& header.headerVersion == VK_PIPELINE_CACHE_HEADER_VERSION_ONE
+		&& header.vendorID == m_properties.vendorID
+		&& header.deviceID == m_properties.deviceID
+		&& memcmp(header.pipelineCacheUUID, m_properties.pipelineCacheUUID, VK_UUID_SIZE) == 0;
+}
+
+void PipelineCache::update(uint64_t frameNumber) {
+	{
+		std::lock_guard<std::mutex> lock(m_pipelineMutex);
+		m_frameNumber = frameNumber;
+
+		//the fence of this frame signaled, so frames older than the overlap are done with the retired pipelines
+		auto destroyed = std::remove_if(m_retired.begin(), m_retired.end(), [&](RetiredPipeline& retired) {
+			if (frameNumber < retired.frameNumber + m_framesInFlight) return false;
+
+			vkDestroyPipeline(m_device, retired.pipeline, nullptr);
+			return true;
+		});
+		m_retired.erase(destroyed, m_retired.end());
+	}
+
+	if (frameNumber == 0 || frameNumber % PIPELINE_CACHE_SAVE_INTERVAL != 0) return;
+
+	save();
+}
+
+bool PipelineCache::save() {
+	if (m_cache == VK_NULL_HANDLE) return false;
+
+	size_t size = 0;
+	VK_CHECK(vkGetPipelineCacheData(m_device, m_cache, &size, nullptr));
+
+	//caches only grow, so an unchanged size means nothing new was compiled
+	if (size == 0 || size == m_savedSize) return true;
+
+	std::vector<char> data(size);
+	VK_CHECK(vkGetPipelineCacheData(m_device, m_cache, &size, data.data()));
+
+	std::error_code error;
+	std::filesystem::path target(m_path);
+	std::filesystem::create_directories(target.parent_path(), error);
+
+	//written next to the cache and renamed, so a crash while saving never leaves a truncated file
+	std::string tempPath = m_path + ".tmp";
+	{
+		std::ofstream file(tempPath, std::ios::binary | std::ios::trunc);
+		if (!file.is_open()) return false;
+		file.write(data.data(), size);
+		if (!file) return false;
+	}
+
+	std::filesystem::rename(tempPath, target, error);
+	if (error) return false;
+
+	m_savedSize = size;
+	return true;
+}
+
+VkPipeline PipelineCache::get_pipeline(const PipelineBuilder& builder, VkRenderPass pass) {
+	//a matching hash alone could be a collision, the map compares the whole state
+	PipelineKey key = builder.key(pass);
+	bool shared = !key.state.empty();
+
+	if (shared) {
+		std::lock_guard<std::mutex> lock(m_pipelineMutex);
+		auto found = m_pipelines.find(key);
+		if (found != m_pipelines.end()) {
+			m_sharedHits++;
+			found->second.users++;
+			return found->second.pipeline;
+		}
+	}
+
+	VkPipeline pipeline = builder.build_pipeline(m_device, pass, m_cache);
+	if (pipeline == VK_NULL_HANDLE) return VK_NULL_HANDLE;
+
+	std::lock_guard<std::mutex> lock(m_pipelineMutex);
+	if (!shared) {
+		m_unsharedPipelines.push_back(pipeline);
+		return pipeline;
+	}
+
+	//two threads compiled the same state at once, the first one to finish is kept
+	auto [entry, inserted] = m_pipelines.emplace(std::move(key), SharedPipeline{ pipeline, 0 });
+	if (!inserted) {
+		vkDestroyPipeline(m_device, pipeline, nullptr);
+		m_sharedHits++;
+	}
+	entry->second.users++;
+	return entry->second.pipeline;
+}
+
+void PipelineCache::release(VkPipeline pipeline) {
+	if (pipeline == VK_NULL_HANDLE) return;
+
+	std::lock_guard<std::mutex> lock(m_pipelineMutex);
+
+	//only shader reloads release pipelines, so walking the map is fine
+	for (auto entry = m_pipelines.begin(); entry != m_pipelines.end(); ++entry) {
+		if (entry->second.pipeline != pipeline) continue;
+
+		if (--entry->second.users == 0) {
+			m_retired.push_back({ pipeline, m_frameNumber });
+			m_pipelines.erase(entry);
+		}
+		return;
+	}
+
+	auto unshared = std::find(m_unsharedPipelines.begin(), m_unsharedPipelines.end(), pipeline);
+	if (unshared != m_unsharedPipelines.end()) {
+		m_unsharedPipelines.erase(unshared);
+		m_retired.push_back({ pipeline, m_frameNumber });
+	}
+}
+
+void PipelineCache::retire(VkPipeline pipeline) {
+	if (pipeline == VK_NULL_HANDLE) return;
+
+	std::lock_guard<std::mutex> lock(m_pipelineMutex);
+	m_retired.push_back({ pipeline, m_frameNumber });
+}
+
+uint32_t PipelineCache::pipeline_count() {
+	std::lock_guard<std::mutex> lock(m_pipelineMutex);
+	return (uint32_t)(m_pipelines.size() + m_unsharedPipelines.size());
+}
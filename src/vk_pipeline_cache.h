@@ -0,0 +1,79 @@
+#pragma once
+
+#include "vk_types.h"
+#include "vk_pipeline.h"
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <unordered_map>
+
+//frames between two checks whether the cache grew and has to be written back
+constexpr uint64_t PIPELINE_CACHE_SAVE_INTERVAL = 3600;
+
+//driver pipeline cache kept on disk between runs. The file is only used when its header
+//matches the current device and driver, anything else starts an empty cache.
+//On top of it builders with the same state share one pipeline, which the cache owns
+//until every user released it
+class PipelineCache {
+public:
+	//released pipelines are destroyed once framesInFlight frames passed
+	void init(VkDevice device, const VkPhysicalDeviceProperties& properties, const std::string& path, uint32_t framesInFlight);
+	//saves the cache a last time, then destroys it with every pipeline it built
+	void cleanup();
+
+	//returns the pipeline built from the same state before, or builds it. Safe from any thread
+	VkPipeline get_pipeline(const PipelineBuilder& builder, VkRenderPass pass);
+
+	//gives up one use of a pipeline get_pipeline returned, the last one destroys it
+	void release(VkPipeline pipeline);
+	//destroys a pipeline built elsewhere once the frames recorded with it finished
+	void retire(VkPipeline pipeline);
+
+	uint32_t pipeline_count();
+	uint64_t shared_hits() const { return m_sharedHits; }
+
+	//destroys the released pipelines no frame uses anymore and writes the cache back
+	//every PIPELINE_CACHE_SAVE_INTERVAL frames, if it changed. Called once per frame
+	void update(uint64_t frameNumber);
+	bool save();
+
+	VkPipelineCache handle() const { return m_cache; }
+
+private:
+	struct SharedPipeline {
+		VkPipeline pipeline;
+		uint32_t users;
+	};
+
+	struct RetiredPipeline {
+		VkPipeline pipeline;
+		uint64_t frameNumber;
+	};
+
+	bool is_compatible(const std::vector<char>& data) const;
+
+	VkDevice m_device{ VK_NULL_HANDLE };
+	VkPhysicalDeviceProperties m_properties{};
+	std::string m_path;
+
+	VkPipelineCache m_cache{ VK_NULL_HANDLE };
+	size_t m_savedSize{ 0 };
+
+	struct PipelineKeyHash {
+		size_t operator()(const PipelineKey& key) const {
+			return (size_t)key.hash;
+		}
+	};
+
+	//guards the pipelines, compiles run outside of it
+	std::mutex m_pipelineMutex;
+	std::unordered_map<PipelineKey, SharedPipeline, PipelineKeyHash> m_pipelines;
+	//built from builders without shader hashes, owned but never shared
+	std::vector<VkPipeline> m_unsharedPipelines;
+	std::vector<RetiredPipeline> m_retired;
+	uint32_t m_framesInFlight{ 0 };
+	uint64_t m_frameNumber{ 0 };
+	std::atomic<uint64_t> m_sharedHits{ 0 };
+};
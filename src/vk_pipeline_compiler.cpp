@@ -0,0 +1,41 @@
+#include "vk_pipeline_compiler.h"
+
+void PipelineCompiler::init(VkDevice device, ThreadPool* pool) {
+	m_device = device;
+	m_pool = pool;
+}
+
+void PipelineCompiler::cleanup() {
+	for (CompiledPipeline& compiled : m_pipelines) {
+		if (compiled.job.valid()) compiled.job.wait();
+	}
+	m_pipelines.clear();
+}
+
+PipelineHandle PipelineCompiler::submit(std::function<VkPipeline()>&& build) {
+	PipelineHandle handle = (PipelineHandle)m_pipelines.size();
+	CompiledPipeline* compiled = &m_pipelines.emplace_back();
+
+	m_pending++;
+	compiled->job = m_pool->submit([this, compiled, handle, build = std::move(build)]() {
+		VkPipeline pipeline = build();
+		if (pipeline == VK_NULL_HANDLE) {
+			std::cout << "Pipeline " << handle << " failed to compile" << std::endl;
+			compiled->failed = true;
+		}
+
+		compiled->pipeline = pipeline;
+		m_pending--;
+	});
+
+	return handle;
+}
+
+VkPipeline PipelineCompiler::get(PipelineHandle handle) const {
+	if (handle >= m_pipelines.size()) return VK_NULL_HANDLE;
+	return m_pipelines[handle].pipeline.load();
+}
+
+bool PipelineCompiler::failed(PipelineHandle handle) const {
+	return handle < m_pipelines.size() && m_pipelines[handle].failed.load();
+}
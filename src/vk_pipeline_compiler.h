@@ -0,0 +1,45 @@
+#pragma once
+
+#include "vk_types.h"
+#include "utils/thread_pool.h"
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <future>
+
+using PipelineHandle = uint32_t;
+constexpr PipelineHandle INVALID_PIPELINE_HANDLE = ~0u;
+
+//builds pipelines on the worker threads. Requests hand out a handle right away, which resolves
+//to the pipeline once its compile finished, so the frame never waits on the driver
+class PipelineCompiler {
+public:
+	void init(VkDevice device, ThreadPool* pool);
+	//waits for the compiles still running. The pipelines belong to whatever built them
+	void cleanup();
+
+	//build runs on a worker, returns VK_NULL_HANDLE when it failed. It must only touch
+	//state that stays untouched until the handle resolved
+	PipelineHandle submit(std::function<VkPipeline()>&& build);
+
+	//VK_NULL_HANDLE while the pipeline compiles, or when it failed to
+	VkPipeline get(PipelineHandle handle) const;
+	bool failed(PipelineHandle handle) const;
+
+	uint32_t pending() const { return m_pending.load(); }
+
+private:
+	struct CompiledPipeline {
+		std::atomic<VkPipeline> pipeline{ VK_NULL_HANDLE };
+		std::atomic<bool> failed{ false };
+		std::future<void> job;
+	};
+
+	VkDevice m_device{ VK_NULL_HANDLE };
+	ThreadPool* m_pool{ nullptr };
+
+	//workers write through element pointers, which a deque keeps stable while it grows
+	std::deque<CompiledPipeline> m_pipelines;
+	std::atomic<uint32_t> m_pending{ 0 };
+};
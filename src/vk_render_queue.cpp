@@ -0,0 +1,109 @@
+#include "vk_render_queue.h"
+
+#include <algorithm>
+#include <cstring>
+#include <utility>
+
+//items per histogram, small queues end up as a single chunk on the calling thread
+constexpr size_t RADIX_SORT_CHUNK = 4096;
+constexpr uint32_t RADIX_BUCKETS = 256;
+
+constexpr uint64_t PASS_BITS = 2;
+constexpr uint64_t PIPELINE_BITS = 10;
+constexpr uint64_t MATERIAL_BITS = 12;
+constexpr uint64_t MESH_BITS = 16;
+constexpr uint64_t DEPTH_BITS = 24;
+static_assert(PASS_BITS + PIPELINE_BITS + MATERIAL_BITS + MESH_BITS + DEPTH_BITS == 64, "sort keys use all 64 bits");
+
+static uint64_t field(uint32_t value, uint64_t bits) {
+	return value & ((1ull << bits) - 1);
+}
+
+//positive floats order the same as their bit patterns, the top bits below the sign are the bucket
+static uint64_t depth_bucket(float depth) {
+	if (!(depth > 0.f)) return 0;
+
+	uint32_t bits;
+	memcpy(&bits, &depth, sizeof(bits));
+	return bits >> (31 - DEPTH_BITS);
+}
+
+uint64_t RenderQueue::opaque_key(uint32_t pipeline, uint32_t material, uint32_t mesh, float depth) {
+	uint64_t key = (uint64_t)DrawPass::Opaque;
+	key = (key << PIPELINE_BITS) | field(pipeline, PIPELINE_BITS);
+	key = (key << MATERIAL_BITS) | field(material, MATERIAL_BITS);
+	key = (key << MESH_BITS) | field(mesh, MESH_BITS);
+	key = (key << DEPTH_BITS) | depth_bucket(depth);
+	return key;
+}
+
+uint64_t RenderQueue::transparent_key(uint32_t pipeline, uint32_t material, uint32_t mesh, float depth) {
+	uint64_t key = (uint64_t)DrawPass::Transparent;
+	key = (key << DEPTH_BITS) | (~depth_bucket(depth) & ((1ull << DEPTH_BITS) - 1));
+	key = (key << PIPELINE_BITS) | field(pipeline, PIPELINE_BITS);
+	key = (key << MATERIAL_BITS) | field(material, MATERIAL_BITS);
+	key = (key << MESH_BITS) | field(mesh, MESH_BITS);
+	return key;
+}
+
+
+void RenderQueue::sort(ThreadPool& pool) {
+	size_t count = m_items.size();
+	if (count < 2) return;
+
+	size_t chunkCount = (count + RADIX_SORT_CHUNK - 1) / RADIX_SORT_CHUNK;
+	m_scratch.resize(count);
+	m_histograms.resize(chunkCount * RADIX_BUCKETS);
+
+	RenderItem* src = m_items.data();
+	RenderItem* dst = m_scratch.data();
+	uint32_t* histograms = m_histograms.data();
+
+	for (uint32_t shift = 0; shift < 64; shift += 8) {
+		pool.parallel_for(chunkCount, 1, [&](size_t begin, size_t end) {
+			for (size_t chunk = begin; chunk < end; chunk++) {
+				uint32_t* histogram = histograms + chunk * RADIX_BUCKETS;
+				memset(histogram, 0, RADIX_BUCKETS * sizeof(uint32_t));
+
+				size_t last = std::min(count, (chunk + 1) * RADIX_SORT_CHUNK);
+				for (size_t i = chunk * RADIX_SORT_CHUNK; i < last; i++) {
+					histogram[(src[i].key >> shift) & 0xFF]++;
+				}
+			}
+		});
+
+		//the chunk histograms turn into the first slot every chunk writes each digit to,
+		//chunks keep their order inside a digit so the sort stays stable
+		uint32_t sharedDigit = (src[0].key >> shift) & 0xFF;
+		size_t sharedCount = 0;
+		uint32_t offset = 0;
+		for (uint32_t digit = 0; digit < RADIX_BUCKETS; digit++) {
+			for (size_t chunk = 0; chunk < chunkCount; chunk++) {
+				uint32_t& bucket = histograms[chunk * RADIX_BUCKETS + digit];
+				if (digit == sharedDigit) sharedCount += bucket;
+
+				uint32_t bucketCount = bucket;
+				bucket = offset;
+				offset += bucketCount;
+			}
+		}
+
+		//pipeline and pass digits are the same for most of the frame
+		if (sharedCount == count) continue;
+
+		pool.parallel_for(chunkCount, 1, [&](size_t begin, size_t end) {
+			for (size_t chunk = begin; chunk < end; chunk++) {
+				uint32_t* slots = histograms + chunk * RADIX_BUCKETS;
+
+				size_t last = std::min(count, (chunk + 1) * RADIX_SORT_CHUNK);
+				for (size_t i = chunk * RADIX_SORT_CHUNK; i < last; i++) {
+					dst[slots[(src[i].key >> shift) & 0xFF]++] = src[i];
+				}
+			}
+		});
+
+		std::swap(src, dst);
+	}
+
+	if (src != m_items.data()) m_items.swap(m_scratch);
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include "utils/thread_pool.h"
+
+#include <cstdint>
+#include <vector>
+
+//opaque draws sort before transparent ones
+enum class DrawPass : uint8_t {
+	Opaque = 0,
+	Transparent = 1
+};
+
+struct RenderItem {
+	uint64_t key;
+	//index of the draw in the list the queue was built from
+	uint32_t index;
+};
+
+//orders the draws of a frame by a packed key, so state changes only happen between runs
+//of equal pipelines, materials and meshes
+class RenderQueue {
+public:
+	//opaque keys go pipeline, material, mesh, then near to far for early depth rejection.
+	//Transparent ones put the depth first and invert it, so they blend far to near
+	static uint64_t opaque_key(uint32_t pipeline, uint32_t material, uint32_t mesh, float depth);
+	static uint64_t transparent_key(uint32_t pipeline, uint32_t material, uint32_t mesh, float depth);
+
+	void clear() { m_items.clear(); }
+	void push(uint64_t key, uint32_t index) { m_items.push_back({ key, index }); }
+
+	//stable LSD radix sort over 8 bit digits, the histograms and scatters of every digit
+	//run on the pool. Digits every key shares are skipped
+	void sort(ThreadPool& pool);
+
+	const std::vector<RenderItem>& items() const { return m_items; }
+
+private:
+	std::vector<RenderItem> m_items;
+	std::vector<RenderItem> m_scratch;
+	std::vector<uint32_t> m_histograms;
+};
@@ -0,0 +1,145 @@
+#include "vk_residency.h"
+
+#include <algorithm>
+
+void ResidencyManager::init(VmaAllocator allocator, uint32_t framesInFlight, float pressureThreshold) {
+	m_allocator = allocator;
+	m_framesInFlight = framesInFlight;
+	m_pressureThreshold = pressureThreshold;
+
+	const VkPhysicalDeviceMemoryProperties* memoryProperties;
+	vmaGetMemoryProperties(m_allocator, &memoryProperties);
+
+	m_deviceHeapMask = 0;
+	for (uint32_t heap = 0; heap < memoryProperties->memoryHeapCount; heap++) {
+		if (memoryProperties->memoryHeaps[heap].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT) {
+			m_deviceHeapMask |= 1u << heap;
+		}
+	}
+}
+
+uint32_t ResidencyManager::add_resource(ResidencyPool pool, std::function<VkDeviceSize()>&& evict, std::function<void()>&& restore) {
+	Resource resource;
+	resource.pool = pool;
+	resource.lastUsedFrame = m_frameNumber;
+	resource.evict = std::move(evict);
+	resource.restore = std::move(restore);
+
+	m_resources.push_back(std::move(resource));
+	return (uint32_t)m_resources.size() - 1;
+}
+
+void ResidencyManager::touch(uint32_t id) {
+	if (id >= m_resources.size()) return;
+
+	Resource& resource = m_resources[id];
+	resource.lastUsedFrame = m_frameNumber;
+
+	if (resource.resident || resource.restoring) return;
+
+	m_stats.restores++;
+	if (!resource.restore) {
+		resource.resident = true;
+		return;
+	}
+
+	resource.restoring = true;
+	resource.restore();
+}
+
+void ResidencyManager::restored(uint32_t id) {
+	if (id >= m_resources.size()) return;
+
+	Resource& resource = m_resources[id];
+	resource.restoring = false;
+	resource.resident = true;
+}
+
+void ResidencyManager::restore_failed(uint32_t id) {
+	if (id >= m_resources.size()) return;
+
+	Resource& resource = m_resources[id];
+	resource.restoring = false;
+	resource.resident = false;
+	m_stats.failedRestores++;
+}
+
+void ResidencyManager::update(uint64_t frameNumber) {
+	m_frameNumber = frameNumber;
+
+	//the budget is refreshed from VK_EXT_memory_budget once per frame index
+	vmaSetCurrentFrameIndex(m_allocator, (uint32_t)frameNumber);
+
+	VmaBudget budgets[VK_MAX_MEMORY_HEAPS];
+	vmaGetBudget(m_allocator, budgets);
+
+	m_stats.deviceBudget = 0;
+	m_stats.deviceUsage = 0;
+	for (uint32_t heap = 0; heap < VK_MAX_MEMORY_HEAPS; heap++) {
+		if (!(m_deviceHeapMask & (1u << heap))) continue;
+
+		m_stats.deviceBudget += budgets[heap].budget;
+		m_stats.deviceUsage += budgets[heap].usage;
+	}
+
+	if (m_stats.deviceBudget == 0) return;
+	m_stats.pressure = (float)m_stats.deviceUsage / (float)m_stats.deviceBudget;
+
+	if (m_stats.pressure <= m_pressureThreshold) return;
+	m_stats.overBudgetFrames++;
+
+	if (frameNumber < m_cooldownFrame) return;
+
+	VkDeviceSize target = (VkDeviceSize)(m_stats.deviceBudget * m_pressureThreshold);
+	VkDeviceSize excess = m_stats.deviceUsage - target;
+
+	VkDeviceSize released = evict_lru(ResidencyPool::DeviceHeap, excess);
+	if (released < excess) m_stats.failedEvictions++;
+
+	if (released > 0) {
+		std::cout << "Over the VRAM budget (" << m_stats.deviceUsage / (1024 * 1024) << " of "
+			<< m_stats.deviceBudget / (1024 * 1024) << " MB), evicted " << released / (1024 * 1024) << " MB" << std::endl;
+	}
+
+	m_cooldownFrame = frameNumber + m_framesInFlight + 1;
+}
+
+bool ResidencyManager::make_room(ResidencyPool pool, VkDeviceSize bytes) {
+	if (evict_lru(pool, bytes) >= bytes) return true;
+
+	m_stats.failedEvictions++;
+	return false;
+}
+
+VkDeviceSize ResidencyManager::evict_lru(ResidencyPool pool, VkDeviceSize bytes) {
+	//resources used by frames that may still be in flight can't go yet
+	std::vector<uint32_t> candidates;
+	for (uint32_t id = 0; id < m_resources.size(); id++) {
+		Resource& resource = m_resources[id];
+		if (resource.pool != pool || !resource.resident) continue;
+		if (resource.lastUsedFrame + m_framesInFlight > m_frameNumber) continue;
+
+		candidates.push_back(id);
+	}
+
+	std::sort(candidates.begin(), candidates.end(), [&](uint32_t a, uint32_t b) {
+		return m_resources[a].lastUsedFrame < m_resources[b].lastUsedFrame;
+	});
+
+	VkDeviceSize released = 0;
+	for (uint32_t id : candidates) {
+		if (released >= bytes) break;
+
+		Resource& resource = m_resources[id];
+		VkDeviceSize freed = resource.evict();
+		if (freed == 0) continue;
+
+		resource.resident = false;
+		released += freed;
+
+		m_stats.evictions++;
+		m_stats.evictedBytes += freed;
+	}
+
+	return released;
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include "vk_types.h"
+
+#include <vector>
+#include <functional>
+
+enum class ResidencyPool : uint32_t {
+	//memory allocated through VMA, evicting gives it back to the device heaps
+	DeviceHeap,
+	//ranges of the shared geometry buffers, evicting makes room for other meshes
+	GeometryArena
+};
+
+struct ResidencyStats {
+	//summed over the device local heaps
+	VkDeviceSize deviceBudget{ 0 };
+	VkDeviceSize deviceUsage{ 0 };
+	float pressure{ 0.f };
+
+	uint64_t overBudgetFrames{ 0 };
+	uint64_t evictions{ 0 };
+	VkDeviceSize evictedBytes{ 0 };
+	uint64_t restores{ 0 };
+	//restores that reported back without bringing the resource back, the next use retries them
+	uint64_t failedRestores{ 0 };
+	//times not enough could be evicted to get back under the budget or fit an allocation
+	uint64_t failedEvictions{ 0 };
+};
+
+//tracks when streamable resources were last used and evicts the least recently used ones
+//back to their assets when the device heaps get over budget or a pool runs out of space.
+//Evicted resources are restored the next time they are used
+class ResidencyManager {
+public:
+	//resources are only evicted once framesInFlight frames passed since their last use
+	void init(VmaAllocator allocator, uint32_t framesInFlight, float pressureThreshold);
+
+	//evict releases the GPU copy and returns the bytes it gave back, 0 when nothing could be released.
+	//restore starts bringing the resource back from its asset and reports the outcome through
+	//restored or restore_failed. Resources without one count as resident again right away
+	uint32_t add_resource(ResidencyPool pool, std::function<VkDeviceSize()>&& evict, std::function<void()>&& restore);
+
+	//marks the resource as used by the frame being recorded, restoring it if it was evicted
+	void touch(uint32_t id);
+
+	//the restore finished, the resource can be evicted again
+	void restored(uint32_t id);
+	//the restore gave up, the resource counts as evicted so the next touch retries it
+	void restore_failed(uint32_t id);
+
+	//queries the heap budgets, called once per frame after its fence signaled
+	void update(uint64_t frameNumber);
+
+	//evicts least recently used resources of the pool until bytes were released
+	bool make_room(ResidencyPool pool, VkDeviceSize bytes);
+
+	const ResidencyStats& stats() const { return m_stats; }
+
+private:
+	struct Resource {
+		ResidencyPool pool;
+		uint64_t lastUsedFrame{ 0 };
+		bool resident{ true };
+		//a restore was started and didn't report back yet
+		bool restoring{ false };
+
+		std::function<VkDeviceSize()> evict;
+		std::function<void()> restore;
+	};
+
+	VkDeviceSize evict_lru(ResidencyPool pool, VkDeviceSize bytes);
+
+	VmaAllocator m_allocator{ VK_NULL_HANDLE };
+	uint32_t m_framesInFlight{ 0 };
+	float m_pressureThreshold{ 1.f };
+
+	uint32_t m_deviceHeapMask{ 0 };
+	uint64_t m_frameNumber{ 0 };
+	//evicted memory only goes back once the uploads replacing it finished, so the
+	//heaps get some frames to reflect it before evicting again
+	uint64_t m_cooldownFrame{ 0 };
+
+	std::vector<Resource> m_resources;
+	ResidencyStats m_stats;
+};
@@ -0,0 +1,91 @@
+#include "vk_secondary_commands.h"
+#include "vk_initializers.h"
+
+#include <algorithm>
+
+void SecondaryCommands::init(VkDevice device, uint32_t queueFamily, uint32_t workerCount) {
+	m_device = device;
+
+	//no per buffer reset flag, the pools are only ever reset as a whole
+	VkCommandPoolCreateInfo poolInfo = vkinit::command_pool_create_info(queueFamily,
+		VK_COMMAND_POOL_CREATE_TRANSIENT_BIT);
+
+	m_workers.resize(std::max(workerCount, 1u));
+	for (WorkerCommands& worker : m_workers) {
+		VK_CHECK(vkCreateCommandPool(m_device, &poolInfo, nullptr, &worker.pool));
+	}
+}
+
+void SecondaryCommands::cleanup() {
+	for (WorkerCommands& worker : m_workers) {
+		vkDestroyCommandPool(m_device, worker.pool, nullptr);
+	}
+	m_workers.clear();
+}
+
+void SecondaryCommands::reset() {
+	for (WorkerCommands& worker : m_workers) {
+		VK_CHECK(vkResetCommandPool(m_device, worker.pool, 0));
+		worker.used = 0;
+	}
+	m_recorded.clear();
+}
+
+void SecondaryCommands::begin_pass(VkRenderPass renderPass, uint32_t subpass, VkFramebuffer framebuffer,
+	VkQueryPipelineStatisticFlags statistics)
+{
+	m_inheritance = vkinit::command_buffer_inheritance_info(renderPass, subpass, framebuffer);
+	m_inheritance.pipelineStatistics = statistics;
+}
+
+VkCommandBuffer SecondaryCommands::acquire(WorkerCommands& worker) {
+	//buffers stay allocated across frames, the pool reset puts them back to the initial state
+	if (worker.used == worker.buffers.size()) {
+		VkCommandBufferAllocateInfo allocInfo = vkinit::command_buffer_allocate_info(worker.pool, 1,
+			VK_COMMAND_BUFFER_LEVEL_SECONDARY);
+
+		VkCommandBuffer cmd;
+		VK_CHECK(vkAllocateCommandBuffers(m_device, &allocInfo, &cmd));
+		worker.buffers.push_back(cmd);
+	}
+
+	return worker.buffers[worker.used++];
+}
+
+void SecondaryCommands::record(ThreadPool& pool, size_t count, size_t minChunk,
+	const std::function<void(VkCommandBuffer cmd, size_t begin, size_t end)>& body)
+{
+	if (count == 0) return;
+
+	//one chunk per worker slot at most, chunk i always records through slot i so no pool is shared
+	size_t chunkCount = std::min(m_workers.size(), (count + minChunk - 1) / std::max<size_t>(minChunk, 1));
+	chunkCount = std::max<size_t>(chunkCount, 1);
+	size_t chunkSize = (count + chunkCount - 1) / chunkCount;
+	chunkCount = (count + chunkSize - 1) / chunkSize;
+
+	size_t first = m_recorded.size();
+	m_recorded.resize(first + chunkCount, VK_NULL_HANDLE);
+
+	VkCommandBufferBeginInfo beginInfo = vkinit::command_buffer_begin_info(
+		VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT | VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT);
+	beginInfo.pInheritanceInfo = &m_inheritance;
+
+	pool.parallel_for(chunkCount, 1, [&](size_t chunkBegin, size_t chunkEnd) {
+		for (size_t chunk = chunkBegin; chunk < chunkEnd; chunk++) {
+			VkCommandBuffer cmd = acquire(m_workers[chunk]);
+
+			VK_CHECK(vkBeginCommandBuffer(cmd, &beginInfo));
+			body(cmd, chunk * chunkSize, std::min(count, (chunk + 1) * chunkSize));
+			VK_CHECK(vkEndCommandBuffer(cmd));
+
+			m_recorded[first + chunk] = cmd;
+		}
+	});
+}
+
+void SecondaryCommands::execute(VkCommandBuffer primary) {
+	if (m_recorded.empty()) return;
+
+	vkCmdExecuteCommands(primary, (uint32_t)m_recorded.size(), m_recorded.data());
+	m_recorded.clear();
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include "vk_types.h"
+#include "utils/thread_pool.h"
+
+#include <vector>
+#include <functional>
+
+//secondary command buffers of one frame in flight. Every worker slot owns a command pool,
+//so chunks of a draw list get recorded on several threads and the primary only executes them
+class SecondaryCommands {
+public:
+	void init(VkDevice device, uint32_t queueFamily, uint32_t workerCount);
+	void cleanup();
+
+	//recycles every buffer of the frame at once, called after the frame fence signaled
+	void reset();
+
+	//the render pass the following recordings continue. statistics are the pipeline statistics
+	//of a query the primary keeps active around the pass
+	void begin_pass(VkRenderPass renderPass, uint32_t subpass, VkFramebuffer framebuffer,
+		VkQueryPipelineStatisticFlags statistics = 0);
+
+	//splits [0, count) in chunks of at least minChunk and records each into its own secondary.
+	//The body only sees its command buffer, nothing is inherited from the primary but the pass
+	void record(ThreadPool& pool, size_t count, size_t minChunk,
+		const std::function<void(VkCommandBuffer cmd, size_t begin, size_t end)>& body);
+
+	//executes everything recorded since begin_pass, in recording order
+	void execute(VkCommandBuffer primary);
+
+private:
+	struct WorkerCommands {
+		VkCommandPool pool;
+		std::vector<VkCommandBuffer> buffers;
+		uint32_t used{ 0 };
+	};
+
+	VkCommandBuffer acquire(WorkerCommands& worker);
+
+	VkDevice m_device{ VK_NULL_HANDLE };
+	std::vector<WorkerCommands> m_workers;
+	VkCommandBufferInheritanceInfo m_inheritance{};
+	std::vector<VkCommandBuffer> m_recorded;
+};
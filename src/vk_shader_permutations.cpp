@@ -0,0 +1,67 @@
+#include "vk_shader_permutations.h"
+
+void SpecializationConstants::set(uint32_t constantId, uint32_t value) {
+	for (VkSpecializationMapEntry& entry : m_entries) {
+		if (entry.constantID == constantId) {
+			m_data[entry.offset / sizeof(uint32_t)] = value;
+			return;
+		}
+	}
+
+	VkSpecializationMapEntry entry;
+	entry.constantID = constantId;
+	entry.offset = (uint32_t)(m_data.size() * sizeof(uint32_t));
+	entry.size = sizeof(uint32_t);
+
+	m_entries.push_back(entry);
+	m_data.push_back(value);
+}
+
+const VkSpecializationInfo* SpecializationConstants::info() {
+	if (m_entries.empty()) return nullptr;
+
+	m_info.mapEntryCount = (uint32_t)m_entries.size();
+	m_info.pMapEntries = m_entries.data();
+	m_info.dataSize = m_data.size() * sizeof(uint32_t);
+	m_info.pData = m_data.data();
+	return &m_info;
+}
+
+void ShaderPermutations::init(std::vector<std::string> features) {
+	m_features = std::move(features);
+	m_permutations.clear();
+}
+
+uint32_t ShaderPermutations::feature_bit(const std::string& name) const {
+	for (size_t i = 0; i < m_features.size(); i++) {
+		if (m_features[i] == name) return 1u << i;
+	}
+	return 0;
+}
+
+SpecializationConstants ShaderPermutations::specialization(uint32_t features) const {
+	//bool constants are 32 bit, every feature gets an explicit value so none falls back to the shader default
+	SpecializationConstants constants;
+	for (uint32_t i = 0; i < m_features.size(); i++) {
+		constants.set(i, (features >> i) & 1 ? VK_TRUE : VK_FALSE);
+	}
+	return constants;
+}
+
+PipelineHandle ShaderPermutations::get(uint32_t features, const std::function<PipelineHandle(uint32_t features)>& build) {
+	auto found = m_permutations.find(features);
+	if (found != m_permutations.end()) return found->second;
+
+	PipelineHandle handle = build(features);
+	m_permutations.emplace(features, handle);
+	return handle;
+}
+
+std::vector<PipelineHandle> ShaderPermutations::invalidate() {
+	std::vector<PipelineHandle> handles;
+	for (auto& [features, handle] : m_permutations) {
+		handles.push_back(handle);
+	}
+	m_permutations.clear();
+	return handles;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include "vk_types.h"
+#include "vk_pipeline_compiler.h"
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <unordered_map>
+
+//values of the specialization constants of one shader stage, by constant id
+class SpecializationConstants {
+public:
+	void set(uint32_t constantId, uint32_t value);
+
+	//points into this object, which has to outlive the pipeline build
+	const VkSpecializationInfo* info();
+
+	bool empty() const { return m_entries.empty(); }
+
+private:
+	std::vector<VkSpecializationMapEntry> m_entries;
+	std::vector<uint32_t> m_data;
+	VkSpecializationInfo m_info{};
+};
+
+//variants of a shader as named feature bits, feature i drives the bool specialization constant i.
+//Each combination is compiled the first time it is asked for, so the driver folds the branches
+//of disabled features away without a copy of the shader per variant
+class ShaderPermutations {
+public:
+	void init(std::vector<std::string> features);
+
+	//0 for names the shader doesn't know
+	uint32_t feature_bit(const std::string& name) const;
+	const std::vector<std::string>& features() const { return m_features; }
+
+	SpecializationConstants specialization(uint32_t features) const;
+
+	//handle of the permutation, requesting its compile through build the first time
+	PipelineHandle get(uint32_t features, const std::function<PipelineHandle(uint32_t features)>& build);
+
+	//forgets every permutation, so the next get compiles them again. Handles already handed out stay valid,
+	//the forgotten ones are returned so their pipelines can be released once nothing draws with them
+	std::vector<PipelineHandle> invalidate();
+
+	size_t permutation_count() const { return m_permutations.size(); }
+
+private:
+	std::vector<std::string> m_features;
+	std::unordered_map<uint32_t, PipelineHandle> m_permutations;
+};
@@ -0,0 +1,146 @@
+#include "vk_shader_reloader.h"
+
+#include <iostream>
+#include <chrono>
+#include <cstdlib>
+#include <algorithm>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+//seconds between two modification time checks where inotify isn't available
+constexpr double SHADER_POLL_INTERVAL = 0.5;
+
+void ShaderReloader::init(const std::string& shaderDirectory, const std::string& validatorPath, ThreadPool* pool) {
+	m_directory = shaderDirectory;
+	m_validator = validatorPath;
+	m_pool = pool;
+
+#ifdef __linux__
+	//editors either write the file in place or move a new one over it
+	m_inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (m_inotify >= 0 && inotify_add_watch(m_inotify, m_directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+		close(m_inotify);
+		m_inotify = -1;
+	}
+	if (m_inotify < 0) {
+		std::cout << "Could not watch " << m_directory << " with inotify, polling it instead" << std::endl;
+	}
+#endif
+}
+
+void ShaderReloader::cleanup() {
+	for (std::future<void>& job : m_jobs) {
+		if (job.valid()) job.wait();
+	}
+	m_jobs.clear();
+
+#ifdef __linux__
+	if (m_inotify >= 0) close(m_inotify);
+	m_inotify = -1;
+#endif
+}
+
+void ShaderReloader::watch(const std::string& sourceName, std::function<void()>&& onReloaded) {
+	WatchedShader& shader = m_shaders[sourceName];
+
+	std::error_code error;
+	shader.lastWrite = std::filesystem::last_write_time(std::filesystem::path(m_directory) / sourceName, error);
+	shader.callbacks.push_back(std::move(onReloaded));
+}
+
+void ShaderReloader::collect_changes(std::vector<std::string>& changed) {
+#ifdef __linux__
+	if (m_inotify >= 0) {
+		alignas(inotify_event) char buffer[4096];
+		ssize_t length;
+		while ((length = read(m_inotify, buffer, sizeof(buffer))) > 0) {
+			for (char* event = buffer; event < buffer + length; ) {
+				inotify_event* info = reinterpret_cast<inotify_event*>(event);
+				if (info->len > 0 && m_shaders.count(info->name)) changed.push_back(info->name);
+				event += sizeof(inotify_event) + info->len;
+			}
+		}
+		return;
+	}
+#endif
+
+	double now = std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	if (now - m_lastPoll < SHADER_POLL_INTERVAL) return;
+	m_lastPoll = now;
+
+	for (auto& [name, shader] : m_shaders) {
+		std::error_code error;
+		auto lastWrite = std::filesystem::last_write_time(std::filesystem::path(m_directory) / name, error);
+		if (error || lastWrite == shader.lastWrite) continue;
+
+		shader.lastWrite = lastWrite;
+		changed.push_back(name);
+	}
+}
+
+void ShaderReloader::compile(const std::string& sourceName) {
+	WatchedShader& shader = m_shaders[sourceName];
+	shader.compiling = true;
+	shader.dirty = false;
+
+	std::filesystem::path source = std::filesystem::path(m_directory) / sourceName;
+	std::string output = source.string() + ".spv";
+	std::string command = "\"" + m_validator + "\" -V \"" + source.string() + "\" -o \"" + output + ".tmp\"";
+
+	m_jobs.push_back(m_pool->submit([this, sourceName, command, output]() {
+		//compiled next to the module and renamed, so a failed compile never replaces a working one
+		bool compiled = std::system(command.c_str()) == 0;
+		std::error_code error;
+		if (compiled) {
+			std::filesystem::rename(output + ".tmp", output, error);
+			compiled = !error;
+		}
+		if (!compiled) std::filesystem::remove(output + ".tmp", error);
+
+		std::lock_guard<std::mutex> lock(m_finishedMutex);
+		m_finished.emplace_back(sourceName, compiled);
+	}));
+}
+
+void ShaderReloader::update() {
+	std::vector<std::string> changed;
+	collect_changes(changed);
+
+	for (const std::string& name : changed) {
+		WatchedShader& shader = m_shaders[name];
+		if (shader.compiling) {
+			shader.dirty = true;
+		} else {
+			std::cout << "Recompiling " << name << std::endl;
+			compile(name);
+		}
+	}
+
+	std::vector<std::pair<std::string, bool>> finished;
+	{
+		std::lock_guard<std::mutex> lock(m_finishedMutex);
+		finished.swap(m_finished);
+	}
+
+	for (auto& [name, compiled] : finished) {
+		WatchedShader& shader = m_shaders[name];
+		shader.compiling = false;
+
+		if (compiled) {
+			std::cout << "Reloading " << name << std::endl;
+			for (std::function<void()>& callback : shader.callbacks) callback();
+		} else {
+			std::cout << "Compiling " << name << " failed, keeping the previous version" << std::endl;
+		}
+
+		if (shader.dirty) compile(name);
+	}
+
+	//finished jobs already reported back, only the running ones have to be kept
+	m_jobs.erase(std::remove_if(m_jobs.begin(), m_jobs.end(), [](std::future<void>& job) {
+		return job.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+	}), m_jobs.end());
+}
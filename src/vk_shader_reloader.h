@@ -0,0 +1,52 @@
+#pragma once
+
+#include "utils/thread_pool.h"
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <filesystem>
+
+//watches the GLSL sources of the shader directory and recompiles the ones that changed with
+//glslangValidator on the workers. Callbacks of a rebuilt shader run on the main thread from
+//update(), they start the pipeline rebuilds, which are swapped in between two frames once compiled
+class ShaderReloader {
+public:
+	void init(const std::string& shaderDirectory, const std::string& validatorPath, ThreadPool* pool);
+	//waits for the compiles still running
+	void cleanup();
+
+	//sourceName is the file name inside the shader directory, such as model_lighting.frag
+	void watch(const std::string& sourceName, std::function<void()>&& onReloaded);
+
+	//picks up the changed sources, starts their compiles and runs the callbacks of finished ones
+	void update();
+
+private:
+	struct WatchedShader {
+		std::vector<std::function<void()>> callbacks;
+		std::filesystem::file_time_type lastWrite;
+		bool compiling{ false };
+		//changed again while compiling, compiled once more when the current one is done
+		bool dirty{ false };
+	};
+
+	void collect_changes(std::vector<std::string>& changed);
+	void compile(const std::string& sourceName);
+
+	std::string m_directory;
+	std::string m_validator;
+	ThreadPool* m_pool{ nullptr };
+
+	std::unordered_map<std::string, WatchedShader> m_shaders;
+
+	std::mutex m_finishedMutex;
+	std::vector<std::pair<std::string, bool>> m_finished;
+	std::vector<std::future<void>> m_jobs;
+
+	int m_inotify{ -1 };
+	double m_lastPoll{ 0.0 };
+};
@@ -0,0 +1,386 @@
+#include "vk_texture_streamer.h"
+#include "vk_engine.h"
+#include "vk_textures.h"
+#include "vk_initializers.h"
+
+#include "asset_cache.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+void TextureStreamer::init(VulkanEngine* engine, VkDeviceSize budget) {
+	m_engine = engine;
+	m_budget = budget;
+}
+
+void TextureStreamer::cleanup() {
+	for (RetiredImage& retired : m_retired) {
+		destroy_image(retired.image);
+	}
+	m_retired.clear();
+
+	for (StreamedTexture& texture : m_textures) {
+		if (texture.resident) destroy_image(texture.image);
+	}
+	m_textures.clear();
+}
+
+std::vector<uint32_t> TextureStreamer::load_textures(const std::vector<std::string>& paths) {
+	std::vector<assets::AssetFile> files(paths.size());
+	std::vector<std::string> bakedPaths(paths.size());
+	std::vector<char> loaded(paths.size(), 0);
+
+	//hashing, reading the cache and baking the missing entries is independent per texture
+	m_engine->m_threadPool.parallel_for(paths.size(), 1, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++) {
+			std::string& bakedPath = bakedPaths[i];
+			bakedPath = assets::derived_data_path(ASSET_CACHE_DIRECTORY, paths[i].c_str(), ".tx");
+
+			if (assets::load_derived_data(bakedPath, "TEXI", files[i])) {
+				assets::TextureInfo info = assets::read_texture_info(&files[i]);
+				VkExtent3D extent = { info.pixelSize[0], info.pixelSize[1], 1 };
+
+				loaded[i] = info.textureFormat == assets::TextureFormat::RGBA8 &&
+					info.mips.size() == vkutil::mip_level_count(extent);
+			}
+
+			if (!loaded[i]) loaded[i] = vkutil::bake_texture(paths[i], bakedPath, files[i]);
+		}
+	});
+
+	std::vector<uint32_t> ids;
+	for (size_t i = 0; i < paths.size(); i++) {
+		if (!loaded[i]) {
+			std::cout << "Failed to load texture file " << paths[i] << std::endl;
+			ids.push_back(INVALID_STREAMED_TEXTURE);
+			continue;
+		}
+
+		StreamedTexture texture;
+		texture.bakedPath = bakedPaths[i];
+
+		//the header of a cache entry was checked on the worker, its data only shows up as corrupt when unpacking
+		bool unpacked = read_tail(texture, files[i]);
+		if (!unpacked && vkutil::bake_texture(paths[i], bakedPaths[i], files[i])) {
+			unpacked = read_tail(texture, files[i]);
+		}
+		files[i].binaryBlob.clear();
+		files[i].binaryBlob.shrink_to_fit();
+
+		if (!unpacked) {
+			std::cout << "Failed to unpack texture file " << paths[i] << std::endl;
+			ids.push_back(INVALID_STREAMED_TEXTURE);
+			continue;
+		}
+
+		m_textures.push_back(std::move(texture));
+
+		uint32_t id = (uint32_t)m_textures.size() - 1;
+		stream_levels(id, m_textures[id].tailLevel);
+		ids.push_back(id);
+	}
+
+	return ids;
+}
+
+bool TextureStreamer::read_tail(StreamedTexture& texture, assets::AssetFile& file) {
+	texture.info = assets::read_texture_info(&file);
+	if (texture.info.textureFormat != assets::TextureFormat::RGBA8) return false;
+
+	uint32_t mipCount = (uint32_t)texture.info.mips.size();
+	texture.tailLevel = mipCount - 1;
+	for (uint32_t level = 0; level < mipCount; level++) {
+		assets::MipInfo& mip = texture.info.mips[level];
+		if (std::max(mip.width, mip.height) <= TEXTURE_MIP_TAIL_SIZE) {
+			texture.tailLevel = level;
+			break;
+		}
+	}
+
+	texture.residentLevel = mipCount;
+	texture.targetLevel = mipCount;
+	texture.wantedLevel = texture.tailLevel;
+
+	//only the tail stays in memory, higher levels are read back from the baked file when they stream in
+	texture.tailData.resize(level_bytes(texture, texture.tailLevel));
+	char* tail = texture.tailData.data();
+	for (uint32_t level = texture.tailLevel; level < mipCount; level++) {
+		if (!assets::unpack_texture_mip(&texture.info, file.binaryBlob.data(), file.binaryBlob.size(), level, tail)) return false;
+		tail += texture.info.mips[level].dataSize;
+	}
+	return true;
+}
+
+void TextureStreamer::request(uint32_t id, float screenSize) {
+	if (id >= m_textures.size()) return;
+
+	StreamedTexture& texture = m_textures[id];
+	texture.screenSize = std::max(texture.screenSize, screenSize);
+}
+
+void TextureStreamer::update(uint64_t frameNumber) {
+	m_frameNumber = frameNumber;
+
+	//the fence of this frame signaled, so frames older than the overlap are done with the retired images
+	auto released = std::remove_if(m_retired.begin(), m_retired.end(), [&](RetiredImage& retired) {
+		if (frameNumber < retired.frameNumber + FRAME_OVERLAP) return false;
+
+		destroy_image(retired.image);
+		return true;
+	});
+	m_retired.erase(released, m_retired.end());
+
+	std::vector<uint32_t> upgrades;
+	for (uint32_t id = 0; id < m_textures.size(); id++) {
+		StreamedTexture& texture = m_textures[id];
+
+		if (texture.screenSize > 0.f) {
+			texture.lastUsedFrame = frameNumber;
+			texture.wantedLevel = wanted_level(texture, texture.screenSize);
+
+			//screen pixels per texel of the resident top level, the most magnified textures go first
+			if (texture.resident) {
+				assets::MipInfo& top = texture.info.mips[texture.residentLevel];
+				texture.priority = texture.screenSize / (float)std::max(top.width, top.height);
+			}
+		}
+		texture.screenSize = 0.f;
+
+		if (texture.resident && !texture.uploading && !texture.moving && texture.wantedLevel < texture.residentLevel) {
+			upgrades.push_back(id);
+		}
+	}
+
+	std::sort(upgrades.begin(), upgrades.end(), [&](uint32_t a, uint32_t b) {
+		return m_textures[a].priority > m_textures[b].priority;
+	});
+
+	for (uint32_t id : upgrades) {
+		if (m_uploadsInFlight >= TEXTURE_STREAM_UPLOADS) break;
+
+		StreamedTexture& texture = m_textures[id];
+
+		//settle for fewer levels when the budget can't fit the wanted ones
+		uint32_t level = texture.wantedLevel;
+		while (level < texture.residentLevel &&
+			!make_room(level_bytes(texture, level) - level_bytes(texture, texture.residentLevel), id)) {
+			level++;
+		}
+
+		if (level < texture.residentLevel) stream_levels(id, level);
+	}
+}
+
+bool TextureStreamer::is_resident(uint32_t id) const {
+	return id < m_textures.size() && m_textures[id].resident;
+}
+
+VkImageView TextureStreamer::view(uint32_t id) const {
+	return is_resident(id) ? m_textures[id].image.m_defaultView : VK_NULL_HANDLE;
+}
+
+VkDeviceSize TextureStreamer::evict(uint32_t id) {
+	if (id >= m_textures.size()) return 0;
+
+	StreamedTexture& texture = m_textures[id];
+	if (!texture.resident || texture.uploading || texture.moving) return 0;
+	if (texture.residentLevel >= texture.tailLevel) return 0;
+
+	VkDeviceSize freed = level_bytes(texture, texture.residentLevel) - level_bytes(texture, texture.tailLevel);
+	texture.wantedLevel = texture.tailLevel;
+	stream_levels(id, texture.tailLevel);
+
+	return freed;
+}
+
+void TextureStreamer::stream_levels(uint32_t id, uint32_t firstLevel) {
+	StreamedTexture& texture = m_textures[id];
+
+	uint32_t mipCount = (uint32_t)texture.info.mips.size();
+	uint32_t levels = mipCount - firstLevel;
+
+	VkImageCreateInfo dimg_info = image_info(texture, firstLevel);
+	VkExtent3D extent = dimg_info.extent;
+
+	VmaAllocationCreateInfo dimg_allocinfo = {};
+	dimg_allocinfo.usage = VMA_MEMORY_USAGE_GPU_ONLY;
+
+	AllocatedImage image;
+	VK_CHECK(vmaCreateImage(m_engine->m_allocator, &dimg_info, &dimg_allocinfo, &image.m_image, &image.m_allocation, nullptr));
+
+	VkImageViewCreateInfo view_info = vkinit::imageview_create_info(dimg_info.format, image.m_image, VK_IMAGE_ASPECT_COLOR_BIT, levels);
+	VK_CHECK(vkCreateImageView(m_engine->m_device, &view_info, nullptr, &image.m_defaultView));
+	image.mipLevels = (int)levels;
+
+	VkDeviceSize stagingSize = level_bytes(texture, firstLevel);
+	AllocatedBuffer staging = m_engine->create_buffer(stagingSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VMA_MEMORY_USAGE_CPU_ONLY);
+
+	char* data;
+	vmaMapMemory(m_engine->m_allocator, staging.m_allocation, (void**)&data);
+
+	m_committedBytes += stagingSize;
+	m_committedBytes -= level_bytes(texture, texture.targetLevel);
+	texture.targetLevel = firstLevel;
+	texture.uploading = true;
+	m_uploadsInFlight++;
+
+	TransferRequest request;
+	request.record = [=](VkCommandBuffer cmd) {
+		vkutil::record_image_copy(cmd, staging.m_buffer, 0, image.m_image, extent, levels);
+	};
+	request.imageBarriers.push_back(vkinit::image_barrier(image.m_image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+		VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT));
+	request.dstStageMask = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+
+	request.onComplete = [this, id, firstLevel, image, staging]() {
+		vmaUnmapMemory(m_engine->m_allocator, staging.m_allocation);
+		vmaDestroyBuffer(m_engine->m_allocator, staging.m_buffer, staging.m_allocation);
+		m_uploadsInFlight--;
+
+		//frames still in flight may sample the previous image
+		StreamedTexture& texture = m_textures[id];
+		if (texture.resident) m_retired.push_back({ texture.image, m_frameNumber });
+
+		texture.image = image;
+		texture.residentLevel = firstLevel;
+		texture.resident = true;
+		texture.uploading = false;
+		m_generation++;
+	};
+
+	//the levels are unpacked on a worker, which hands the upload to the transfer queue once they are in
+	StreamedTexture* source = &texture;
+	m_engine->m_threadPool.submit([this, source, firstLevel, data, request]() {
+		char* destination = data;
+		if (firstLevel < source->tailLevel) {
+			assets::AssetFile file;
+			bool loaded = assets::load_binaryfile(source->bakedPath.c_str(), file);
+
+			//the cache entry changed under the streamer, the levels stay black rather than showing garbage
+			for (uint32_t level = firstLevel; level < source->tailLevel; level++) {
+				uint32_t size = source->info.mips[level].dataSize;
+				if (loaded) {
+					loaded = assets::unpack_texture_mip(&source->info, file.binaryBlob.data(), file.binaryBlob.size(), level, destination);
+				}
+				if (!loaded) memset(destination, 0, size);
+				destination += size;
+			}
+			if (!loaded) std::cout << "Failed to read back texture levels from " << source->bakedPath << std::endl;
+		}
+		memcpy(destination, source->tailData.data(), source->tailData.size());
+
+		TransferRequest transfer = request;
+		m_engine->m_transfer.enqueue(std::move(transfer));
+	});
+}
+
+void TextureStreamer::collect_movable(std::vector<MovableAllocation>& movables) {
+	for (uint32_t id = 0; id < m_textures.size(); id++) {
+		StreamedTexture& texture = m_textures[id];
+		if (!texture.resident || texture.uploading) continue;
+
+		texture.moving = true;
+
+		MovableAllocation movable;
+		movable.allocation = texture.image.m_allocation;
+		movable.move = [this, id](VkCommandBuffer cmd, VkDeviceMemory memory, VkDeviceSize offset) {
+			move_image(id, cmd, memory, offset);
+		};
+		movable.release = [this, id](bool moved) {
+			StreamedTexture& texture = m_textures[id];
+			texture.moving = false;
+
+			//the allocation itself went along with the move, only the handles bound to the old place go
+			if (moved) {
+				vkDestroyImageView(m_engine->m_device, texture.previousImage.m_defaultView, nullptr);
+				vkDestroyImage(m_engine->m_device, texture.previousImage.m_image, nullptr);
+				texture.previousImage = {};
+			}
+		};
+		movables.push_back(std::move(movable));
+	}
+}
+
+void TextureStreamer::move_image(uint32_t id, VkCommandBuffer cmd, VkDeviceMemory memory, VkDeviceSize offset) {
+	StreamedTexture& texture = m_textures[id];
+
+	VkImageCreateInfo dimg_info = image_info(texture, texture.residentLevel);
+
+	AllocatedImage image = texture.image;
+	VK_CHECK(vkCreateImage(m_engine->m_device, &dimg_info, nullptr, &image.m_image));
+	VK_CHECK(vkBindImageMemory(m_engine->m_device, image.m_image, memory, offset));
+
+	VkImageViewCreateInfo view_info = vkinit::imageview_create_info(dimg_info.format, image.m_image,
+		VK_IMAGE_ASPECT_COLOR_BIT, dimg_info.mipLevels);
+	VK_CHECK(vkCreateImageView(m_engine->m_device, &view_info, nullptr, &image.m_defaultView));
+
+	vkutil::record_image_move(cmd, texture.image.m_image, image.m_image, dimg_info.extent, dimg_info.mipLevels);
+
+	//the copy comes first in the frame, so its draws can already sample the new image
+	texture.previousImage = texture.image;
+	texture.image = image;
+	m_generation++;
+}
+
+bool TextureStreamer::make_room(VkDeviceSize bytes, uint32_t keepId) {
+	if (m_committedBytes + bytes <= m_budget) return true;
+
+	//textures the last frame didn't need lose their high levels first, least recently used ones before the others
+	std::vector<uint32_t> candidates;
+	for (uint32_t id = 0; id < m_textures.size(); id++) {
+		StreamedTexture& texture = m_textures[id];
+		if (id == keepId || !texture.resident || texture.uploading || texture.moving) continue;
+		if (texture.residentLevel >= texture.tailLevel) continue;
+
+		bool unused = texture.lastUsedFrame < m_frameNumber;
+		if (unused || texture.wantedLevel > texture.residentLevel) candidates.push_back(id);
+	}
+
+	std::sort(candidates.begin(), candidates.end(), [&](uint32_t a, uint32_t b) {
+		return m_textures[a].lastUsedFrame < m_textures[b].lastUsedFrame;
+	});
+
+	for (uint32_t id : candidates) {
+		StreamedTexture& texture = m_textures[id];
+
+		uint32_t level = texture.lastUsedFrame < m_frameNumber ? texture.tailLevel : texture.wantedLevel;
+		stream_levels(id, level);
+
+		if (m_committedBytes + bytes <= m_budget) return true;
+	}
+	return false;
+}
+
+VkDeviceSize TextureStreamer::level_bytes(const StreamedTexture& texture, uint32_t firstLevel) const {
+	VkDeviceSize size = 0;
+	for (uint32_t level = firstLevel; level < texture.info.mips.size(); level++) {
+		size += texture.info.mips[level].dataSize;
+	}
+	return size;
+}
+
+VkImageCreateInfo TextureStreamer::image_info(const StreamedTexture& texture, uint32_t firstLevel) const {
+	VkExtent3D extent;
+	extent.width = texture.info.mips[firstLevel].width;
+	extent.height = texture.info.mips[firstLevel].height;
+	extent.depth = 1;
+
+	//transfer source so the defragmenter can copy the image to a new place
+	return vkinit::image_create_info(VK_FORMAT_R8G8B8A8_SRGB,
+		VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
+		extent, (uint32_t)texture.info.mips.size() - firstLevel);
+}
+
+uint32_t TextureStreamer::wanted_level(const StreamedTexture& texture, float screenSize) const {
+	float textureSize = (float)std::max(texture.info.mips[0].width, texture.info.mips[0].height);
+
+	//one texel per covered pixel, higher levels would only alias
+	float level = std::floor(std::log2(std::max(textureSize / screenSize, 1.f)));
+	return std::min((uint32_t)level, texture.tailLevel);
+}
+
+void TextureStreamer::destroy_image(AllocatedImage& image) {
+	vkDestroyImageView(m_engine->m_device, image.m_defaultView, nullptr);
+	vmaDestroyImage(m_engine->m_allocator, image.m_image, image.m_allocation);
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include "vk_types.h"
+#include "texture_asset.h"
+#include "vk_defragmenter.h"
+
+#include <vector>
+#include <deque>
+#include <string>
+
+class VulkanEngine;
+
+//levels up to this size form the mip tail, which stays resident from the first frame on
+constexpr uint32_t TEXTURE_MIP_TAIL_SIZE = 128;
+
+//at most this many higher level uploads are in flight at once
+constexpr uint32_t TEXTURE_STREAM_UPLOADS = 2;
+
+constexpr uint32_t INVALID_STREAMED_TEXTURE = ~0u;
+
+//keeps the mip tails of its textures in memory and only makes the levels the screen
+//needs resident, reading the higher ones back from the asset cache. Growing or shrinking a texture swaps in a new image holding the levels
+//from the wanted one to the end, the old image is released once no frame can use it
+class TextureStreamer {
+public:
+	void init(VulkanEngine* engine, VkDeviceSize budget);
+	void cleanup();
+
+	//bakes the sources missing from the asset cache and uploads the mip tail of every texture.
+	//Returns one id per path, INVALID_STREAMED_TEXTURE for the ones that failed
+	std::vector<uint32_t> load_textures(const std::vector<std::string>& paths);
+
+	//the texture covers screenSize pixels on the screen this frame, the biggest request wins
+	void request(uint32_t id, float screenSize);
+
+	//starts the uploads and evictions for the requests of the last frame, by priority.
+	//Called once per frame, after its fence signaled
+	void update(uint64_t frameNumber);
+
+	bool is_resident(uint32_t id) const;
+	VkImageView view(uint32_t id) const;
+
+	//drops the texture back to its mip tail, returns the bytes that will be released
+	VkDeviceSize evict(uint32_t id);
+
+	//hands the resident images to the defragmenter, they stay as they are until released
+	void collect_movable(std::vector<MovableAllocation>& movables);
+
+	//bumped every time a view changes, descriptors using them have to be written again
+	uint64_t generation() const { return m_generation; }
+
+	VkDeviceSize resident_bytes() const { return m_committedBytes; }
+	VkDeviceSize budget() const { return m_budget; }
+
+private:
+	struct StreamedTexture {
+		assets::TextureInfo info;
+		std::string bakedPath;
+		//unpacked levels of the mip tail
+		std::vector<char> tailData;
+
+		//first level of the mip tail, and of the image currently resident.
+		//The level count stands for nothing resident
+		uint32_t tailLevel{ 0 };
+		uint32_t residentLevel{ 0 };
+		//level the current upload brings in, equal to residentLevel when idle
+		uint32_t targetLevel{ 0 };
+		uint32_t wantedLevel{ 0 };
+
+		float screenSize{ 0.f };
+		float priority{ 0.f };
+		uint64_t lastUsedFrame{ 0 };
+
+		AllocatedImage image{};
+		bool resident{ false };
+		bool uploading{ false };
+
+		//pinned by a defragmentation run, previousImage holds the handles bound to the old place
+		bool moving{ false };
+		AllocatedImage previousImage{};
+	};
+
+	struct RetiredImage {
+		AllocatedImage image;
+		uint64_t frameNumber;
+	};
+
+	//reads the info of a baked texture and unpacks its mip tail, false when the file is corrupt
+	bool read_tail(StreamedTexture& texture, assets::AssetFile& file);
+	void stream_levels(uint32_t id, uint32_t firstLevel);
+	void move_image(uint32_t id, VkCommandBuffer cmd, VkDeviceMemory memory, VkDeviceSize offset);
+	VkImageCreateInfo image_info(const StreamedTexture& texture, uint32_t firstLevel) const;
+	bool make_room(VkDeviceSize bytes, uint32_t keepId);
+
+	VkDeviceSize level_bytes(const StreamedTexture& texture, uint32_t firstLevel) const;
+	uint32_t wanted_level(const StreamedTexture& texture, float screenSize) const;
+
+	void destroy_image(AllocatedImage& image);
+
+	VulkanEngine* m_engine{ nullptr };
+	VkDeviceSize m_budget{ 0 };
+	VkDeviceSize m_committedBytes{ 0 };
+	uint64_t m_generation{ 0 };
+	uint64_t m_frameNumber{ 0 };
+	uint32_t m_uploadsInFlight{ 0 };
+
+	//workers read the tails while more textures get loaded, so their addresses must stay stable
+	std::deque<StreamedTexture> m_textures;
+	std::vector<RetiredImage> m_retired;
+};
@@ -1,5 +1,7 @@
 #include <vk_textures.h>
 #include <iostream>
+#include <algorithm>
+#include <cmath>
 
 #include <vk_initializers.h>
 
@@ -7,110 +9,24 @@
 #include <stb_image.h>
 
 #include "asset_loader.h"
+#include "asset_cache.h"
 #include "texture_asset.h"
 
-bool vkutil::load_image_from_file(VulkanEngine& engine, const char* file, AllocatedImage& outImage) {
-    int texWidth, texHeight, texChannels;
+bool vkutil::load_image_from_file(VulkanEngine& engine, const char* file, AllocatedImage& outImage,
+    std::function<void()>&& onResident) {
+    //a batch of one, so single images go through the derived-data cache as well
+    std::vector<ImageLoadRequest> requests(1);
+    requests[0].path = file;
+    requests[0].outImage = &outImage;
+    requests[0].onResident = std::move(onResident);
 
-    stbi_uc* pixels = stbi_load(file, &texWidth, &texHeight, &texChannels, STBI_rgb_alpha);
+    load_images_from_files(engine, requests);
 
-    if (!pixels) {
-        std::cout << "Failed to load texture file " << file << std::endl;
-        return false;
-    }
-
-    void* pixel_ptr = pixels;
-    VkDeviceSize imageSize = texWidth * texHeight * 4;
-
-    VkFormat image_format = VK_FORMAT_R8G8B8A8_SRGB;
-
-    AllocatedBuffer stagingBuffer = engine.create_buffer(imageSize, 
-    VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VMA_MEMORY_USAGE_CPU_ONLY);
-
-    void* data;
-    vmaMapMemory(engine.m_allocator, stagingBuffer.m_allocation, &data);
-
-    memcpy(data, pixel_ptr, static_cast<size_t>(imageSize));
-
-    vmaUnmapMemory(engine.m_allocator, stagingBuffer.m_allocation);
-    stbi_image_free(pixels);
-
-    VkExtent3D imageExtent;
-    imageExtent.width = static_cast<uint32_t>(texWidth);
-    imageExtent.height = static_cast<uint32_t>(texHeight);
-    imageExtent.depth = 1;
-
-    VkImageCreateInfo dimg_info = vkinit::image_create_info(image_format,
-        VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT, imageExtent);
-
-    AllocatedImage newImage;
-
-    VmaAllocationCreateInfo dimg_allocinfo = {};
-    dimg_allocinfo.usage = VMA_MEMORY_USAGE_GPU_ONLY;
-
-    vmaCreateImage(engine.m_allocator, &dimg_info, &dimg_allocinfo, &newImage.m_image, &newImage.m_allocation, nullptr);
-
-    engine.immediate_submit([&](VkCommandBuffer cmd) {
-        VkImageSubresourceRange range;
-        range.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-        range.baseMipLevel = 0;
-        range.levelCount = 1;
-        range.baseArrayLayer = 0;
-        range.layerCount = 1;
-
-        VkImageMemoryBarrier imageBarrier_toTransfer = {};
-        imageBarrier_toTransfer.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-
-        imageBarrier_toTransfer.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-        imageBarrier_toTransfer.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-        imageBarrier_toTransfer.image = newImage.m_image;
-        imageBarrier_toTransfer.subresourceRange = range;
-
-        imageBarrier_toTransfer.srcAccessMask = 0;
-        imageBarrier_toTransfer.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-
-        vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
-            0, 0, nullptr, 0, nullptr, 1, &imageBarrier_toTransfer);
-
-        VkBufferImageCopy copyRegion = {};
-        copyRegion.bufferOffset = 0;
-        copyRegion.bufferRowLength = 0;
-        copyRegion.bufferImageHeight = 0;
-
-        copyRegion.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-        copyRegion.imageSubresource.mipLevel = 0;
-        copyRegion.imageSubresource.baseArrayLayer = 0;
-        copyRegion.imageSubresource.layerCount = 1;
-        copyRegion.imageExtent = imageExtent;
-
-        vkCmdCopyBufferToImage(cmd, stagingBuffer.m_buffer, newImage.m_image, 
-            VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &copyRegion);
-
-        VkImageMemoryBarrier toReadable = imageBarrier_toTransfer;
-
-        toReadable.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-        toReadable.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-
-        toReadable.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-        toReadable.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
-
-        vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 
-            0, 0, nullptr, 0, nullptr, 1, &toReadable);
-    });
-
-    engine.m_deletionQueue.push_function([=]() {
-        vmaDestroyImage(engine.m_allocator, newImage.m_image, newImage.m_allocation);
-    });
-
-    vmaDestroyBuffer(engine.m_allocator, stagingBuffer.m_buffer, stagingBuffer.m_allocation);
-
-    std::cout << "Texture loaded successfully" << file << std::endl;
-
-    outImage = newImage;
-    return true;
+    return requests[0].loaded;
 }
 
-bool vkutil::load_image_from_asset(VulkanEngine& engine, const char* filename, AllocatedImage& outImage) {
+bool vkutil::load_image_from_asset(VulkanEngine& engine, const char* filename, AllocatedImage& outImage,
+    std::function<void()>&& onResident) {
     assets::AssetFile file;
     bool loaded = assets::load_binaryfile(filename, file);
 
@@ -138,23 +54,104 @@ bool vkutil::load_image_from_asset(VulkanEngine& engine, const char* filename, A
     void* data;
     vmaMapMemory(engine.m_allocator, stagingBuffer.m_allocation, &data);
 
-    assets::unpack_texture(&textureInfo, file.binaryBlob.data(), file.binaryBlob.size(), (char*) data);
+    bool unpacked = assets::unpack_texture(&textureInfo, file.binaryBlob.data(), file.binaryBlob.size(), (char*) data);
 
     vmaUnmapMemory(engine.m_allocator, stagingBuffer.m_allocation);
 
-    outImage = upload_image(textureInfo.pixelSize[0], textureInfo.pixelSize[1], image_format, engine, stagingBuffer);
+    if (!unpacked) {
+        std::cout << "Error when unpacking image" << std::endl;
+        vmaDestroyBuffer(engine.m_allocator, stagingBuffer.m_buffer, stagingBuffer.m_allocation);
+        return false;
+    }
+
+    outImage = upload_image(textureInfo.pixelSize[0], textureInfo.pixelSize[1], image_format, engine, stagingBuffer,
+        std::move(onResident));
 
-    vmaDestroyBuffer(engine.m_allocator, stagingBuffer.m_buffer, stagingBuffer.m_allocation);
+    return true;
 }
 
-AllocatedImage vkutil::upload_image(int texWidth, int texHeight, VkFormat image_format, VulkanEngine& engine, AllocatedBuffer& stagingBuffer)
+uint32_t vkutil::mip_level_count(VkExtent3D extent)
 {
-	VkExtent3D imageExtent;
-	imageExtent.width = static_cast<uint32_t>(texWidth);
-	imageExtent.height = static_cast<uint32_t>(texHeight);
-	imageExtent.depth = 1;
+	return static_cast<uint32_t>(std::floor(std::log2(std::max(extent.width, extent.height)))) + 1;
+}
+
+VkExtent3D vkutil::mip_extent(VkExtent3D extent, uint32_t level)
+{
+	return { std::max(extent.width >> level, 1u), std::max(extent.height >> level, 1u), 1 };
+}
+
+VkDeviceSize vkutil::mip_chain_size(VkExtent3D extent, uint32_t mipLevels)
+{
+	VkDeviceSize size = 0;
+	for (uint32_t level = 0; level < mipLevels; level++) {
+		VkExtent3D levelExtent = mip_extent(extent, level);
+		size += (VkDeviceSize)levelExtent.width * levelExtent.height * 4;
+	}
+	return size;
+}
 
-	VkImageCreateInfo dimg_info = vkinit::image_create_info(image_format, VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT, imageExtent);
+//the blit chain needs the format to be a linear filterable blit source and destination
+static bool supports_blit_mips(VulkanEngine& engine, VkFormat format)
+{
+	VkFormatProperties properties;
+	vkGetPhysicalDeviceFormatProperties(engine.m_chosenGPU, format, &properties);
+
+	VkFormatFeatureFlags required = VK_FORMAT_FEATURE_BLIT_SRC_BIT | VK_FORMAT_FEATURE_BLIT_DST_BIT |
+		VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT;
+	return (properties.optimalTilingFeatures & required) == required;
+}
+
+void vkutil::generate_mips_cpu(char* chain, VkExtent3D extent, uint32_t mipLevels, bool srgb)
+{
+	float toLinear[256];
+	for (int i = 0; i < 256; i++) {
+		float c = i / 255.f;
+		toLinear[i] = srgb ? (c <= 0.04045f ? c / 12.92f : std::pow((c + 0.055f) / 1.055f, 2.4f)) : c;
+	}
+
+	auto from_linear = [srgb](float c) {
+		if (srgb) c = c <= 0.0031308f ? c * 12.92f : 1.055f * std::pow(c, 1.f / 2.4f) - 0.055f;
+		return static_cast<uint8_t>(std::clamp(c * 255.f + 0.5f, 0.f, 255.f));
+	};
+
+	uint8_t* source = reinterpret_cast<uint8_t*>(chain);
+	for (uint32_t level = 1; level < mipLevels; level++) {
+		VkExtent3D sourceExtent = mip_extent(extent, level - 1);
+		VkExtent3D levelExtent = mip_extent(extent, level);
+		uint8_t* destination = source + (size_t)sourceExtent.width * sourceExtent.height * 4;
+
+		for (uint32_t y = 0; y < levelExtent.height; y++) {
+			uint32_t y0 = std::min(y * 2, sourceExtent.height - 1);
+			uint32_t y1 = std::min(y * 2 + 1, sourceExtent.height - 1);
+
+			for (uint32_t x = 0; x < levelExtent.width; x++) {
+				uint32_t x0 = std::min(x * 2, sourceExtent.width - 1);
+				uint32_t x1 = std::min(x * 2 + 1, sourceExtent.width - 1);
+
+				const uint8_t* texels[4] = {
+					source + ((size_t)y0 * sourceExtent.width + x0) * 4,
+					source + ((size_t)y0 * sourceExtent.width + x1) * 4,
+					source + ((size_t)y1 * sourceExtent.width + x0) * 4,
+					source + ((size_t)y1 * sourceExtent.width + x1) * 4
+				};
+
+				uint8_t* out = destination + ((size_t)y * levelExtent.width + x) * 4;
+				for (int c = 0; c < 3; c++) {
+					float sum = toLinear[texels[0][c]] + toLinear[texels[1][c]] + toLinear[texels[2][c]] + toLinear[texels[3][c]];
+					out[c] = from_linear(sum / 4.f);
+				}
+				out[3] = static_cast<uint8_t>((texels[0][3] + texels[1][3] + texels[2][3] + texels[3][3] + 2) / 4);
+			}
+		}
+		source = destination;
+	}
+}
+
+//creates a sampled image with its default view over every level, destroyed with the engine
+static AllocatedImage create_texture_image(VulkanEngine& engine, VkExtent3D imageExtent, VkFormat image_format, uint32_t mipLevels)
+{
+	VkImageCreateInfo dimg_info = vkinit::image_create_info(image_format,
+		VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT, imageExtent, mipLevels);
 
 	AllocatedImage newImage;
 
@@ -164,67 +161,430 @@ AllocatedImage vkutil::upload_image(int texWidth, int texHeight, VkFormat image_
 	//allocate and create the image
 	vmaCreateImage(engine.m_allocator, &dimg_info, &dimg_allocinfo, &newImage.m_image, &newImage.m_allocation, nullptr);
 
-	//transition image to transfer-receiver	
-	engine.immediate_submit([&](VkCommandBuffer cmd) {
-		VkImageSubresourceRange range;
-		range.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-		range.baseMipLevel = 0;
-		range.levelCount = 1;
-		range.baseArrayLayer = 0;
-		range.layerCount = 1;
+	//build a default imageview
+	VkImageViewCreateInfo view_info = vkinit::imageview_create_info(image_format, newImage.m_image, VK_IMAGE_ASPECT_COLOR_BIT, mipLevels);
 
-		VkImageMemoryBarrier imageBarrier_toTransfer = {};
-		imageBarrier_toTransfer.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+	vkCreateImageView(engine.m_device, &view_info, nullptr, &newImage.m_defaultView);
 
-		imageBarrier_toTransfer.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-		imageBarrier_toTransfer.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-		imageBarrier_toTransfer.image = newImage.m_image;
-		imageBarrier_toTransfer.subresourceRange = range;
+	engine.m_deletionQueue.push_function([=, &engine]() {
+		vkDestroyImageView(engine.m_device, newImage.m_defaultView, nullptr);
+		vmaDestroyImage(engine.m_allocator, newImage.m_image, newImage.m_allocation);
+	});
 
-		imageBarrier_toTransfer.srcAccessMask = 0;
-		imageBarrier_toTransfer.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	newImage.mipLevels = static_cast<int>(mipLevels);
+	return newImage;
+}
 
-		//barrier the image into the transfer-receive layout
-		vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1, &imageBarrier_toTransfer);
+void vkutil::record_image_copy(VkCommandBuffer cmd, VkBuffer stagingBuffer, VkDeviceSize stagingOffset,
+	VkImage image, VkExtent3D imageExtent, uint32_t copyLevels)
+{
+	VkImageMemoryBarrier imageBarrier_toTransfer = vkinit::image_barrier(image,
+		VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 0, VK_ACCESS_TRANSFER_WRITE_BIT);
+
+	//barrier the image into the transfer-receive layout
+	vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1, &imageBarrier_toTransfer);
 
-		VkBufferImageCopy copyRegion = {};
-		copyRegion.bufferOffset = 0;
+	std::vector<VkBufferImageCopy> copyRegions(copyLevels);
+	for (uint32_t level = 0; level < copyLevels; level++) {
+		VkBufferImageCopy& copyRegion = copyRegions[level];
+		copyRegion = {};
+		copyRegion.bufferOffset = stagingOffset;
 		copyRegion.bufferRowLength = 0;
 		copyRegion.bufferImageHeight = 0;
 
 		copyRegion.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-		copyRegion.imageSubresource.mipLevel = 0;
+		copyRegion.imageSubresource.mipLevel = level;
 		copyRegion.imageSubresource.baseArrayLayer = 0;
 		copyRegion.imageSubresource.layerCount = 1;
-		copyRegion.imageExtent = imageExtent;
+		copyRegion.imageExtent = mip_extent(imageExtent, level);
 
-		//copy the buffer into the image
-		vkCmdCopyBufferToImage(cmd, stagingBuffer.m_buffer, newImage.m_image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &copyRegion);
+		stagingOffset += (VkDeviceSize)copyRegion.imageExtent.width * copyRegion.imageExtent.height * 4;
+	}
 
-		VkImageMemoryBarrier imageBarrier_toReadable = imageBarrier_toTransfer;
+	//copy the buffer into the image
+	vkCmdCopyBufferToImage(cmd, stagingBuffer, image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, copyLevels, copyRegions.data());
+}
 
-		imageBarrier_toReadable.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-		imageBarrier_toReadable.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+void vkutil::record_image_move(VkCommandBuffer cmd, VkImage source, VkImage destination,
+	VkExtent3D imageExtent, uint32_t mipLevels)
+{
+	VkImageMemoryBarrier toTransfer[2];
+	toTransfer[0] = vkinit::image_barrier(source, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+		VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, VK_ACCESS_SHADER_READ_BIT, VK_ACCESS_TRANSFER_READ_BIT);
+	toTransfer[1] = vkinit::image_barrier(destination, VK_IMAGE_LAYOUT_UNDEFINED,
+		VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 0, VK_ACCESS_TRANSFER_WRITE_BIT);
+
+	//earlier frames on this queue may still be sampling the source
+	vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0,
+		0, nullptr, 0, nullptr, 2, toTransfer);
+
+	std::vector<VkImageCopy> copyRegions(mipLevels);
+	for (uint32_t level = 0; level < mipLevels; level++) {
+		VkImageCopy& copyRegion = copyRegions[level];
+		copyRegion = {};
+		copyRegion.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+		copyRegion.srcSubresource.mipLevel = level;
+		copyRegion.srcSubresource.layerCount = 1;
+		copyRegion.dstSubresource = copyRegion.srcSubresource;
+		copyRegion.extent = mip_extent(imageExtent, level);
+	}
+
+	vkCmdCopyImage(cmd, source, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, destination, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+		mipLevels, copyRegions.data());
+
+	VkImageMemoryBarrier toReadable = vkinit::image_barrier(destination, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+		VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT);
+
+	vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0,
+		0, nullptr, 0, nullptr, 1, &toReadable);
+}
 
-		imageBarrier_toReadable.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-		imageBarrier_toReadable.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+//fills every level below the first by blitting from the one above. Needs a graphics queue,
+//so it's recorded in the frame command buffer once the transfer queue handed the image over
+static void record_blit_mips(VkCommandBuffer cmd, VkImage image, VkExtent3D imageExtent, uint32_t mipLevels)
+{
+	for (uint32_t level = 1; level < mipLevels; level++) {
+		VkImageMemoryBarrier toSource = vkinit::image_barrier(image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+			VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_TRANSFER_READ_BIT);
+		toSource.subresourceRange.baseMipLevel = level - 1;
+		toSource.subresourceRange.levelCount = 1;
+
+		vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1, &toSource);
+
+		VkExtent3D sourceExtent = vkutil::mip_extent(imageExtent, level - 1);
+		VkExtent3D levelExtent = vkutil::mip_extent(imageExtent, level);
+
+		VkImageBlit blit = {};
+		blit.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+		blit.srcSubresource.mipLevel = level - 1;
+		blit.srcSubresource.baseArrayLayer = 0;
+		blit.srcSubresource.layerCount = 1;
+		blit.srcOffsets[1] = { (int32_t)sourceExtent.width, (int32_t)sourceExtent.height, 1 };
+
+		blit.dstSubresource = blit.srcSubresource;
+		blit.dstSubresource.mipLevel = level;
+		blit.dstOffsets[1] = { (int32_t)levelExtent.width, (int32_t)levelExtent.height, 1 };
+
+		vkCmdBlitImage(cmd, image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+			1, &blit, VK_FILTER_LINEAR);
+
+		//the source level is done, it can go to the shaders
+		VkImageMemoryBarrier toReadable = vkinit::image_barrier(image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+			VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_ACCESS_TRANSFER_READ_BIT, VK_ACCESS_SHADER_READ_BIT);
+		toReadable.subresourceRange.baseMipLevel = level - 1;
+		toReadable.subresourceRange.levelCount = 1;
+
+		vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0, nullptr, 0, nullptr, 1, &toReadable);
+	}
+
+	//the last level was only ever written
+	VkImageMemoryBarrier lastLevel = vkinit::image_barrier(image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+		VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT);
+	lastLevel.subresourceRange.baseMipLevel = mipLevels - 1;
+	lastLevel.subresourceRange.levelCount = 1;
+
+	vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0, nullptr, 0, nullptr, 1, &lastLevel);
+}
 
-		//barrier the image into the shader readable layout
-		vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0, nullptr, 0, nullptr, 1, &imageBarrier_toReadable);
-		});
+//the transfer queue moves the image into the shader readable layout
+static VkImageMemoryBarrier readable_barrier(VkImage image)
+{
+	return vkinit::image_barrier(image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+		VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT);
+}
 
+//hands the image over still in the transfer-receive layout, for the blits on the graphics queue
+static VkImageMemoryBarrier blit_source_barrier(VkImage image)
+{
+	return vkinit::image_barrier(image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+		VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_ACCESS_TRANSFER_WRITE_BIT,
+		VK_ACCESS_TRANSFER_READ_BIT | VK_ACCESS_TRANSFER_WRITE_BIT);
+}
 
-	//build a default imageview
-	VkImageViewCreateInfo view_info = vkinit::imageview_create_info(image_format, newImage.m_image, VK_IMAGE_ASPECT_COLOR_BIT);
+AllocatedImage vkutil::upload_image(int texWidth, int texHeight, VkFormat image_format, VulkanEngine& engine,
+	AllocatedBuffer& stagingBuffer, std::function<void()>&& onResident)
+{
+	VkExtent3D imageExtent;
+	imageExtent.width = static_cast<uint32_t>(texWidth);
+	imageExtent.height = static_cast<uint32_t>(texHeight);
+	imageExtent.depth = 1;
 
-	vkCreateImageView(engine.m_device, &view_info, nullptr, &newImage.m_defaultView);
+	uint32_t mipLevels = mip_level_count(imageExtent);
+	bool blitMips = supports_blit_mips(engine, image_format);
+
+	AllocatedBuffer staging = stagingBuffer;
+	if (!blitMips && mipLevels > 1) {
+		//the staging buffer only holds the first level, the chain is built in a bigger one
+		AllocatedBuffer chainBuffer = engine.create_buffer(mip_chain_size(imageExtent, mipLevels),
+			VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VMA_MEMORY_USAGE_CPU_ONLY);
+
+		char* source;
+		char* chain;
+		vmaMapMemory(engine.m_allocator, staging.m_allocation, (void**)&source);
+		vmaMapMemory(engine.m_allocator, chainBuffer.m_allocation, (void**)&chain);
+
+		memcpy(chain, source, (size_t)texWidth * texHeight * 4);
+		generate_mips_cpu(chain, imageExtent, mipLevels, image_format == VK_FORMAT_R8G8B8A8_SRGB);
+
+		vmaUnmapMemory(engine.m_allocator, chainBuffer.m_allocation);
+		vmaUnmapMemory(engine.m_allocator, staging.m_allocation);
+		vmaDestroyBuffer(engine.m_allocator, staging.m_buffer, staging.m_allocation);
+
+		staging = chainBuffer;
+	}
+
+	AllocatedImage newImage = create_texture_image(engine, imageExtent, image_format, mipLevels);
+	VkImage image = newImage.m_image;
+
+	TransferRequest request;
+	request.record = [=](VkCommandBuffer cmd) {
+		record_image_copy(cmd, staging.m_buffer, 0, image, imageExtent, blitMips ? 1 : mipLevels);
+	};
+
+	if (blitMips) {
+		request.imageBarriers.push_back(blit_source_barrier(image));
+		request.dstStageMask = VK_PIPELINE_STAGE_TRANSFER_BIT;
+		request.recordGraphics = [=](VkCommandBuffer cmd) {
+			record_blit_mips(cmd, image, imageExtent, mipLevels);
+		};
+	}
+	else {
+		request.imageBarriers.push_back(readable_barrier(image));
+		request.dstStageMask = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+	}
+
+	VmaAllocator allocator = engine.m_allocator;
+	std::function<void()> residentCallback = std::move(onResident);
+	request.onComplete = [=]() {
+		vmaDestroyBuffer(allocator, staging.m_buffer, staging.m_allocation);
+		if (residentCallback) residentCallback();
+	};
+
+	engine.m_transfer.enqueue(std::move(request));
 
+	return newImage;
+}
 
-	engine.m_deletionQueue.push_function([=, &engine]() {
+bool vkutil::bake_texture(const std::string& path, const std::string& bakedPath, assets::AssetFile& outFile)
+{
+	int texWidth, texHeight, texChannels;
+	stbi_uc* pixels = stbi_load(path.c_str(), &texWidth, &texHeight, &texChannels, STBI_rgb_alpha);
 
-		vmaDestroyImage(engine.m_allocator, newImage.m_image, newImage.m_allocation);
+	if (!pixels) return false;
+
+	VkExtent3D extent = { (uint32_t)texWidth, (uint32_t)texHeight, 1 };
+	uint32_t mipLevels = mip_level_count(extent);
+
+	std::vector<char> chain(mip_chain_size(extent, mipLevels));
+	memcpy(chain.data(), pixels, (size_t)texWidth * texHeight * 4);
+	stbi_image_free(pixels);
+
+	generate_mips_cpu(chain.data(), extent, mipLevels, true);
+
+	assets::TextureInfo textureInfo;
+	textureInfo.textureSize = chain.size();
+	textureInfo.textureFormat = assets::TextureFormat::RGBA8;
+	textureInfo.pixelSize[0] = texWidth;
+	textureInfo.pixelSize[1] = texHeight;
+	textureInfo.pixelSize[2] = 1;
+	textureInfo.originalFile = path;
+
+	for (uint32_t level = 0; level < mipLevels; level++) {
+		VkExtent3D levelExtent = mip_extent(extent, level);
+		textureInfo.mips.push_back({ levelExtent.width, levelExtent.height, (uint64_t)levelExtent.width * levelExtent.height * 4, 0, 0 });
+	}
+
+	outFile = assets::pack_texture(&textureInfo, chain.data());
+
+	if (bakedPath.empty() || !assets::save_derived_data(bakedPath, outFile)) {
+		std::cout << "Failed to cache texture " << path << std::endl;
+	}
+	return true;
+}
+
+void vkutil::load_images_from_files(VulkanEngine& engine, std::vector<ImageLoadRequest>& requests)
+{
+	struct DecodedImage {
+		int width = 0;
+		int height = 0;
+		uint32_t mipLevels = 1;
+		VkDeviceSize stagingOffset = 0;
+
+		std::string bakedPath;
+		assets::AssetFile baked;
+		assets::TextureInfo bakedInfo;
+		bool cached = false;
+	};
+	std::vector<DecodedImage> decoded(requests.size());
+
+	//hashing the sources and reading the cache entries is independent per image as well
+	engine.m_threadPool.parallel_for(requests.size(), 1, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++) {
+			DecodedImage& image = decoded[i];
+			image.bakedPath = assets::derived_data_path(ASSET_CACHE_DIRECTORY, requests[i].path.c_str(), ".tx");
+
+			if (assets::load_derived_data(image.bakedPath, "TEXI", image.baked)) {
+				image.bakedInfo = assets::read_texture_info(&image.baked);
+				image.cached = image.bakedInfo.textureFormat == assets::TextureFormat::RGBA8;
+			}
+
+			if (image.cached) {
+				image.width = (int)image.bakedInfo.pixelSize[0];
+				image.height = (int)image.bakedInfo.pixelSize[1];
+				requests[i].loaded = true;
+			}
+			else {
+				//the headers are enough to lay out every image in one staging buffer before decoding
+				int channels;
+				requests[i].loaded = stbi_info(requests[i].path.c_str(), &image.width, &image.height, &channels) == 1;
+			}
+		}
 	});
 
-	newImage.mipLevels = 1;// mips.size();
-	return newImage;
-}
\ No newline at end of file
+	//the chains are blitted on the GPU when the format allows it, the staging buffer then only
+	//needs the first level. Otherwise they are built on the CPU next to it
+	VkFormat image_format = VK_FORMAT_R8G8B8A8_SRGB;
+	bool blitMips = supports_blit_mips(engine, image_format);
+
+	VkDeviceSize stagingSize = 0;
+	for (size_t i = 0; i < requests.size(); i++) {
+		if (!requests[i].loaded) {
+			std::cout << "Failed to load texture file " << requests[i].path << std::endl;
+			continue;
+		}
+
+		VkExtent3D imageExtent = { (uint32_t)decoded[i].width, (uint32_t)decoded[i].height, 1 };
+		decoded[i].mipLevels = mip_level_count(imageExtent);
+
+		decoded[i].stagingOffset = stagingSize;
+		stagingSize += mip_chain_size(imageExtent, blitMips ? 1 : decoded[i].mipLevels);
+	}
+
+	if (stagingSize == 0) return;
+
+	AllocatedBuffer stagingBuffer = engine.create_buffer(stagingSize,
+		VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VMA_MEMORY_USAGE_CPU_ONLY);
+
+	char* staging;
+	vmaMapMemory(engine.m_allocator, stagingBuffer.m_allocation, (void**)&staging);
+
+	//the region of an image holds its first level, or its whole chain when the levels can't be blitted.
+	//The info was checked against the blob, so its levels add up to the size the region was laid out with
+	auto unpack_baked = [&](DecodedImage& image) {
+		char* destination = staging + image.stagingOffset;
+		const char* blob = image.baked.binaryBlob.data();
+		size_t blobSize = image.baked.binaryBlob.size();
+
+		if (!blitMips && image.bakedInfo.mips.size() == image.mipLevels) {
+			return assets::unpack_texture(&image.bakedInfo, blob, blobSize, destination);
+		}
+
+		if (!assets::unpack_texture_mip(&image.bakedInfo, blob, blobSize, 0, destination)) return false;
+
+		if (!blitMips) {
+			VkExtent3D imageExtent = { (uint32_t)image.width, (uint32_t)image.height, 1 };
+			generate_mips_cpu(destination, imageExtent, image.mipLevels, true);
+		}
+		return true;
+	};
+
+	//decoding is independent per image, every worker writes its own region of the staging buffer
+	engine.m_threadPool.parallel_for(requests.size(), 1, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++) {
+			if (!requests[i].loaded) continue;
+
+			DecodedImage& image = decoded[i];
+
+			//a cache entry whose levels don't unpack is baked again like a missing one
+			bool unpacked = image.cached && unpack_baked(image);
+			if (!unpacked) {
+				image.cached = false;
+
+				//first load of this source, bake it so the next launches skip the decode
+				if (!bake_texture(requests[i].path, image.bakedPath, image.baked)) {
+					requests[i].loaded = false;
+					continue;
+				}
+				image.bakedInfo = assets::read_texture_info(&image.baked);
+
+				if (image.bakedInfo.textureFormat != assets::TextureFormat::RGBA8 ||
+					image.bakedInfo.pixelSize[0] != (uint32_t)image.width || image.bakedInfo.pixelSize[1] != (uint32_t)image.height) {
+					requests[i].loaded = false;
+					continue;
+				}
+
+				unpacked = unpack_baked(image);
+			}
+
+			if (!unpacked) {
+				requests[i].loaded = false;
+				continue;
+			}
+			image.baked.binaryBlob = std::vector<char>();
+		}
+	});
+
+	vmaUnmapMemory(engine.m_allocator, stagingBuffer.m_allocation);
+
+	struct ImageCopy {
+		VkImage image;
+		VkExtent3D extent;
+		VkDeviceSize stagingOffset;
+		uint32_t mipLevels;
+	};
+	std::vector<ImageCopy> copies;
+	std::vector<std::function<void()>> residentCallbacks;
+
+	TransferRequest transfer;
+	for (size_t i = 0; i < requests.size(); i++) {
+		if (!requests[i].loaded) continue;
+
+		VkExtent3D imageExtent;
+		imageExtent.width = static_cast<uint32_t>(decoded[i].width);
+		imageExtent.height = static_cast<uint32_t>(decoded[i].height);
+		imageExtent.depth = 1;
+
+		AllocatedImage newImage = create_texture_image(engine, imageExtent, image_format, decoded[i].mipLevels);
+		if (requests[i].outImage) *requests[i].outImage = newImage;
+
+		copies.push_back({ newImage.m_image, imageExtent, decoded[i].stagingOffset, decoded[i].mipLevels });
+		transfer.imageBarriers.push_back(blitMips ? blit_source_barrier(newImage.m_image) : readable_barrier(newImage.m_image));
+		if (requests[i].onResident) residentCallbacks.push_back(std::move(requests[i].onResident));
+	}
+
+	//everything goes out in a single submit
+	transfer.record = [=](VkCommandBuffer cmd) {
+		for (const ImageCopy& copy : copies) {
+			record_image_copy(cmd, stagingBuffer.m_buffer, copy.stagingOffset, copy.image, copy.extent,
+				blitMips ? 1 : copy.mipLevels);
+		}
+	};
+
+	if (blitMips) {
+		transfer.dstStageMask = VK_PIPELINE_STAGE_TRANSFER_BIT;
+		transfer.recordGraphics = [=](VkCommandBuffer cmd) {
+			for (const ImageCopy& copy : copies) {
+				record_blit_mips(cmd, copy.image, copy.extent, copy.mipLevels);
+			}
+		};
+	}
+	else {
+		transfer.dstStageMask = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+	}
+
+	VmaAllocator allocator = engine.m_allocator;
+	transfer.onComplete = [=]() {
+		vmaDestroyBuffer(allocator, stagingBuffer.m_buffer, stagingBuffer.m_allocation);
+		for (const std::function<void()>& callback : residentCallbacks) callback();
+	};
+
+	engine.m_transfer.enqueue(std::move(transfer));
+
+	size_t cachedCount = 0;
+	for (const DecodedImage& image : decoded) {
+		if (image.cached) cachedCount++;
+	}
+
+	std::cout << "Loaded " << copies.size() << " textures, " << cachedCount << " from the asset cache, on "
+		<< engine.m_threadPool.thread_count() + 1 << " threads" << std::endl;
+}
@@ -2,14 +2,56 @@
 
 #include "vk_types.h"
 #include "vk_engine.h"
+#include "asset_loader.h"
 
 class VulkanEngine;
 
 namespace vkutil {
-    bool load_image_from_file(VulkanEngine& engine, const char* file, AllocatedImage& outImage);
+    struct ImageLoadRequest {
+        std::string path;
+        AllocatedImage* outImage = nullptr;
+        std::function<void()> onResident;
+        bool loaded = false;
+    };
 
-    bool load_image_from_asset(VulkanEngine& engine, const char* filename, AllocatedImage& outImage);
+    //the upload happens asynchronously on the transfer queue, onResident is called
+    //on the main thread once the image can be sampled
+    bool load_image_from_file(VulkanEngine& engine, const char* file, AllocatedImage& outImage,
+        std::function<void()>&& onResident = nullptr);
 
-    AllocatedImage upload_image(int texWidth, int texHeight, VkFormat image_format, VulkanEngine& engine, AllocatedBuffer& stagingBuffer);
+    //decodes every file in parallel on the engine thread pool into one staging buffer,
+    //then uploads all of them with a single transfer submit. Sources are baked into the
+    //asset cache on their first load and read back from there afterwards
+    void load_images_from_files(VulkanEngine& engine, std::vector<ImageLoadRequest>& requests);
+
+    bool load_image_from_asset(VulkanEngine& engine, const char* filename, AllocatedImage& outImage,
+        std::function<void()>&& onResident = nullptr);
+
+    //decodes a source image, builds its whole mip chain and bakes it into bakedPath
+    bool bake_texture(const std::string& path, const std::string& bakedPath, assets::AssetFile& outFile);
+
+    uint32_t mip_level_count(VkExtent3D extent);
+    VkExtent3D mip_extent(VkExtent3D extent, uint32_t level);
+
+    //bytes of a RGBA8 chain with the levels stored one after another
+    VkDeviceSize mip_chain_size(VkExtent3D extent, uint32_t mipLevels);
+
+    //box filters level 0 of a RGBA8 chain down the other levels in place.
+    //sRGB texels are averaged in linear space like a blit would
+    void generate_mips_cpu(char* chain, VkExtent3D extent, uint32_t mipLevels, bool srgb);
+
+    //transitions the image to transfer-receiver and copies the first copyLevels levels,
+    //stored one after another from stagingOffset
+    void record_image_copy(VkCommandBuffer cmd, VkBuffer stagingBuffer, VkDeviceSize stagingOffset,
+        VkImage image, VkExtent3D imageExtent, uint32_t copyLevels);
+
+    //copies every level of a sampled image into a fresh one, which is left ready for sampling.
+    //The source stays in the transfer-source layout, it is only kept around to be destroyed
+    void record_image_move(VkCommandBuffer cmd, VkImage source, VkImage destination,
+        VkExtent3D imageExtent, uint32_t mipLevels);
+
+    //takes ownership of the staging buffer, which is freed once the upload finished
+    AllocatedImage upload_image(int texWidth, int texHeight, VkFormat image_format, VulkanEngine& engine,
+        AllocatedBuffer& stagingBuffer, std::function<void()>&& onResident = nullptr);
 };
 
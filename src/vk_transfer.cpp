@@ -0,0 +1,259 @@
+#include "vk_transfer.h"
+#include "vk_initializers.h"
+
+void TransferQueue::init(VkDevice device, VkQueue queue, uint32_t queueFamily, uint32_t graphicsQueueFamily,
+	std::mutex* queueMutex) {
+	m_device = device;
+	m_queue = queue;
+	m_queueFamily = queueFamily;
+	m_graphicsQueueFamily = graphicsQueueFamily;
+	m_queueMutex = queueMutex;
+
+	VkSemaphoreTypeCreateInfo typeInfo = {};
+	typeInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+	typeInfo.pNext = nullptr;
+	typeInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+	typeInfo.initialValue = 0;
+
+	VkSemaphoreCreateInfo semaphoreInfo = vkinit::semaphore_create_info();
+	semaphoreInfo.pNext = &typeInfo;
+	VK_CHECK(vkCreateSemaphore(m_device, &semaphoreInfo, nullptr, &m_timeline));
+
+	VkCommandPoolCreateInfo poolInfo = vkinit::command_pool_create_info(m_queueFamily);
+	for (Batch& batch : m_batches) {
+		VK_CHECK(vkCreateCommandPool(m_device, &poolInfo, nullptr, &batch.commandPool));
+
+		VkCommandBufferAllocateInfo cmdAllocInfo = vkinit::command_buffer_allocate_info(batch.commandPool, 1);
+		VK_CHECK(vkAllocateCommandBuffers(m_device, &cmdAllocInfo, &batch.commandBuffer));
+	}
+
+	m_worker = std::thread([this]() { worker_loop(); });
+
+	std::cout << (is_dedicated() ? "Uploading through a dedicated transfer queue family " :
+		"Uploading through the graphics queue family ") << m_queueFamily << std::endl;
+}
+
+void TransferQueue::cleanup() {
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop = true;
+	}
+	m_condition.notify_all();
+	if (m_worker.joinable()) m_worker.join();
+
+	flush();
+
+	for (Batch& batch : m_batches) {
+		vkDestroyCommandPool(m_device, batch.commandPool, nullptr);
+	}
+	vkDestroySemaphore(m_device, m_timeline, nullptr);
+}
+
+void TransferQueue::enqueue(TransferRequest&& request) {
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_pending.push_back(std::move(request));
+	}
+	m_condition.notify_one();
+}
+
+uint64_t TransferQueue::completed_value() {
+	uint64_t value = 0;
+	VK_CHECK(vkGetSemaphoreCounterValue(m_device, m_timeline, &value));
+	return value;
+}
+
+uint64_t TransferQueue::acquire_completed(VkCommandBuffer cmd) {
+	uint64_t completed = completed_value();
+
+	std::vector<InFlight> finished;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		while (!m_inFlight.empty() && m_inFlight.front().signalValue <= completed) {
+			finished.push_back(std::move(m_inFlight.front()));
+			m_inFlight.pop_front();
+		}
+	}
+
+	if (finished.empty()) return 0;
+
+	if (is_dedicated()) {
+		//the acquire half of the ownership transfer, matching the release done on the transfer queue
+		std::vector<VkBufferMemoryBarrier> bufferAcquires;
+		std::vector<VkImageMemoryBarrier> imageAcquires;
+		VkPipelineStageFlags dstStages = 0;
+
+		for (InFlight& batch : finished) {
+			for (TransferRequest& request : batch.requests) {
+				for (VkBufferMemoryBarrier barrier : request.bufferBarriers) {
+					barrier.srcAccessMask = 0;
+					bufferAcquires.push_back(barrier);
+				}
+				for (VkImageMemoryBarrier barrier : request.imageBarriers) {
+					barrier.srcAccessMask = 0;
+					imageAcquires.push_back(barrier);
+				}
+				dstStages |= request.dstStageMask;
+			}
+		}
+
+		if (!bufferAcquires.empty() || !imageAcquires.empty()) {
+			vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, dstStages, 0, 0, nullptr,
+				(uint32_t)bufferAcquires.size(), bufferAcquires.data(),
+				(uint32_t)imageAcquires.size(), imageAcquires.data());
+		}
+	}
+
+	for (InFlight& batch : finished) {
+		for (TransferRequest& request : batch.requests) {
+			if (request.recordGraphics) request.recordGraphics(cmd);
+			if (request.onComplete) request.onComplete();
+		}
+	}
+
+	return is_dedicated() ? finished.back().signalValue : 0;
+}
+
+void TransferQueue::flush() {
+	uint64_t waitValue;
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_idleCondition.wait(lock, [this]() { return m_pending.empty() && !m_busy; });
+		waitValue = m_submittedValue;
+	}
+
+	VkSemaphoreWaitInfo waitInfo = {};
+	waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+	waitInfo.pNext = nullptr;
+	waitInfo.semaphoreCount = 1;
+	waitInfo.pSemaphores = &m_timeline;
+	waitInfo.pValues = &waitValue;
+	VK_CHECK(vkWaitSemaphores(m_device, &waitInfo, UINT64_MAX));
+
+	std::deque<InFlight> finished;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		finished.swap(m_inFlight);
+	}
+
+	for (InFlight& batch : finished) {
+		for (TransferRequest& request : batch.requests) {
+			if (request.onComplete) request.onComplete();
+		}
+	}
+}
+
+void TransferQueue::worker_loop() {
+	while (true) {
+		std::vector<TransferRequest> requests;
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_condition.wait(lock, [this]() { return m_stop || !m_pending.empty(); });
+			if (m_pending.empty()) return;
+
+			requests.swap(m_pending);
+			m_busy = true;
+		}
+
+		submit_batch(requests);
+
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_busy = false;
+		}
+		m_idleCondition.notify_all();
+	}
+}
+
+TransferQueue::Batch& TransferQueue::grab_batch() {
+	Batch& batch = m_batches[m_nextBatch];
+	m_nextBatch = (m_nextBatch + 1) % BATCH_COUNT;
+
+	//the command buffer can only be reused once the gpu is done with its previous submit
+	if (batch.signalValue > 0) {
+		VkSemaphoreWaitInfo waitInfo = {};
+		waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+		waitInfo.pNext = nullptr;
+		waitInfo.semaphoreCount = 1;
+		waitInfo.pSemaphores = &m_timeline;
+		waitInfo.pValues = &batch.signalValue;
+		VK_CHECK(vkWaitSemaphores(m_device, &waitInfo, UINT64_MAX));
+	}
+
+	VK_CHECK(vkResetCommandPool(m_device, batch.commandPool, 0));
+	return batch;
+}
+
+void TransferQueue::submit_batch(std::vector<TransferRequest>& requests) {
+	Batch& batch = grab_batch();
+	VkCommandBuffer cmd = batch.commandBuffer;
+
+	VkCommandBufferBeginInfo cmdBeginInfo = vkinit::command_buffer_begin_info(VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
+	VK_CHECK(vkBeginCommandBuffer(cmd, &cmdBeginInfo));
+
+	for (TransferRequest& request : requests) {
+		request.record(cmd);
+	}
+
+	//on a dedicated family this is the release half of the ownership transfer,
+	//otherwise a plain barrier into the final state
+	uint32_t srcFamily = is_dedicated() ? m_queueFamily : VK_QUEUE_FAMILY_IGNORED;
+	uint32_t dstFamily = is_dedicated() ? m_graphicsQueueFamily : VK_QUEUE_FAMILY_IGNORED;
+
+	std::vector<VkBufferMemoryBarrier> bufferReleases;
+	std::vector<VkImageMemoryBarrier> imageReleases;
+	VkPipelineStageFlags dstStages = 0;
+
+	for (TransferRequest& request : requests) {
+		for (VkBufferMemoryBarrier& barrier : request.bufferBarriers) {
+			barrier.srcQueueFamilyIndex = srcFamily;
+			barrier.dstQueueFamilyIndex = dstFamily;
+
+			VkBufferMemoryBarrier release = barrier;
+			if (is_dedicated()) release.dstAccessMask = 0;
+			bufferReleases.push_back(release);
+		}
+		for (VkImageMemoryBarrier& barrier : request.imageBarriers) {
+			barrier.srcQueueFamilyIndex = srcFamily;
+			barrier.dstQueueFamilyIndex = dstFamily;
+
+			VkImageMemoryBarrier release = barrier;
+			if (is_dedicated()) release.dstAccessMask = 0;
+			imageReleases.push_back(release);
+		}
+		dstStages |= request.dstStageMask;
+	}
+
+	if (!bufferReleases.empty() || !imageReleases.empty()) {
+		vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT,
+			is_dedicated() ? VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT : dstStages, 0, 0, nullptr,
+			(uint32_t)bufferReleases.size(), bufferReleases.data(),
+			(uint32_t)imageReleases.size(), imageReleases.data());
+	}
+
+	VK_CHECK(vkEndCommandBuffer(cmd));
+
+	uint64_t signalValue = batch.signalValue = m_submittedValue + 1;
+
+	VkTimelineSemaphoreSubmitInfo timelineInfo = {};
+	timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+	timelineInfo.pNext = nullptr;
+	timelineInfo.signalSemaphoreValueCount = 1;
+	timelineInfo.pSignalSemaphoreValues = &signalValue;
+
+	VkSubmitInfo submit = vkinit::submit_info(&cmd);
+	submit.pNext = &timelineInfo;
+	submit.signalSemaphoreCount = 1;
+	submit.pSignalSemaphores = &m_timeline;
+
+	if (m_queueMutex) {
+		std::lock_guard<std::mutex> queueLock(*m_queueMutex);
+		VK_CHECK(vkQueueSubmit(m_queue, 1, &submit, VK_NULL_HANDLE));
+	} else {
+		VK_CHECK(vkQueueSubmit(m_queue, 1, &submit, VK_NULL_HANDLE));
+	}
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_submittedValue = signalValue;
+	m_inFlight.push_back(InFlight{ signalValue, std::move(requests) });
+}
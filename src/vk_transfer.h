@@ -0,0 +1,90 @@
+#pragma once
+
+#include "vk_types.h"
+
+#include <vector>
+#include <deque>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+struct TransferRequest {
+	//records the copies, executed on the transfer queue
+	std::function<void(VkCommandBuffer cmd)> record;
+
+	//final state of the uploaded resources. The queue family indices are filled by the
+	//transfer queue, which releases them on its queue and acquires them on the graphics one
+	std::vector<VkBufferMemoryBarrier> bufferBarriers;
+	std::vector<VkImageMemoryBarrier> imageBarriers;
+	VkPipelineStageFlags dstStageMask = VK_PIPELINE_STAGE_VERTEX_INPUT_BIT;
+
+	//recorded into the graphics command buffer right after the acquire, for the work
+	//a transfer-only queue can't do such as blits
+	std::function<void(VkCommandBuffer cmd)> recordGraphics;
+
+	//called on the main thread once the resources can be used by the graphics queue
+	std::function<void()> onComplete;
+};
+
+class TransferQueue {
+public:
+	//queueMutex must be given when the transfer queue is the graphics queue itself,
+	//as the worker thread submits to it concurrently with the main thread
+	void init(VkDevice device, VkQueue queue, uint32_t queueFamily, uint32_t graphicsQueueFamily,
+		std::mutex* queueMutex);
+	void cleanup();
+
+	//queues a request for the worker thread, pending requests are submitted together
+	void enqueue(TransferRequest&& request);
+
+	//records the ownership acquires of every finished transfer into cmd and runs their callbacks.
+	//Returns the timeline value the graphics submit has to wait on, 0 if no wait is needed
+	uint64_t acquire_completed(VkCommandBuffer cmd);
+
+	//blocks until everything enqueued so far has been executed and runs the callbacks
+	//without acquiring anything, only meant for shutdown
+	void flush();
+
+	bool is_dedicated() const { return m_queueFamily != m_graphicsQueueFamily; }
+	VkSemaphore timeline() const { return m_timeline; }
+
+private:
+	struct Batch {
+		VkCommandPool commandPool{ VK_NULL_HANDLE };
+		VkCommandBuffer commandBuffer{ VK_NULL_HANDLE };
+		uint64_t signalValue{ 0 };
+	};
+
+	struct InFlight {
+		uint64_t signalValue;
+		std::vector<TransferRequest> requests;
+	};
+
+	void worker_loop();
+	void submit_batch(std::vector<TransferRequest>& requests);
+	Batch& grab_batch();
+	uint64_t completed_value();
+
+	VkDevice m_device{ VK_NULL_HANDLE };
+	VkQueue m_queue{ VK_NULL_HANDLE };
+	uint32_t m_queueFamily{ 0 };
+	uint32_t m_graphicsQueueFamily{ 0 };
+	std::mutex* m_queueMutex{ nullptr };
+
+	VkSemaphore m_timeline{ VK_NULL_HANDLE };
+	uint64_t m_submittedValue{ 0 };
+
+	static constexpr unsigned int BATCH_COUNT = 4;
+	Batch m_batches[BATCH_COUNT];
+	unsigned int m_nextBatch{ 0 };
+
+	std::thread m_worker;
+	std::mutex m_mutex;
+	std::condition_variable m_condition;
+	std::condition_variable m_idleCondition;
+	std::vector<TransferRequest> m_pending;
+	std::deque<InFlight> m_inFlight;
+	bool m_busy{ false };
+	bool m_stop{ false };
+};
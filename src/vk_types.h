@@ -6,6 +6,17 @@
 #include <vulkan/vulkan.h>
 #include <vk_mem_alloc.h>
 #include <string>
+#include <iostream>
+
+#define VK_CHECK(x) \
+	do { \
+		VkResult err = x; \
+		if (err) { \
+			std::cout << "Detected Vulkan error: " << err << std::endl; \
+			abort(); \
+		} \
+	} while(0) \
+
 
 //we will add our main reusable types here
 struct AllocatedBuffer {
@@ -34,4 +45,11 @@ struct Texture {
 	std::string type;
 	std::string path;
 	bool isLoaded = false;
+	//set once the upload finished and the image can be sampled
+	bool isResident = false;
+	//id in the texture streamer, for streamed textures
+	uint32_t streamId = ~0u;
+	uint32_t residencyId = ~0u;
+	//slot in the bindless texture array, for model textures
+	uint32_t bindlessIndex = ~0u;
 };
\ No newline at end of file